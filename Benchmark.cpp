@@ -0,0 +1,359 @@
+#define NOMINMAX
+#include <windows.h>
+#include <wil/resource.h>
+#include <wil/result.h>
+#include <algorithm>
+#include <clocale>
+#include <cstdio>
+#include <cstdlib>
+#include <optional>
+#include <regex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "Benchmark.h"
+#include <crtdbg.h>
+
+constexpr UINT64 MAXIMUM_BENCHMARK_ITERATIONS = 1000000000;
+constexpr double DEFAULT_BENCHMARK_MIN_TIME = 0.5;
+namespace
+{
+	struct BenchmarkDefinition
+	{
+		std::string name;
+		BenchmarkFunction function;
+		std::optional<UINT64> argument;
+	};
+	struct BenchmarkResult
+	{
+		std::string name;
+		UINT64 iterations;
+		// Nanoseconds per iteration.
+		double real_time;
+		double cpu_time;
+		double items_per_second;
+		double bytes_per_second;
+		std::string error_message;
+	};
+	std::vector<BenchmarkDefinition>& GetBenchmarks()
+	{
+		static std::vector<BenchmarkDefinition> benchmarks;
+		return benchmarks;
+	}
+	LONGLONG QueryCounter()
+	{
+		LARGE_INTEGER qpc;
+		QueryPerformanceCounter(&qpc);
+		return qpc.QuadPart;
+	}
+	double GetCounterFrequency()
+	{
+		LARGE_INTEGER qpf;
+		QueryPerformanceFrequency(&qpf);
+		return static_cast<double>(qpf.QuadPart);
+	}
+	// User and kernel time of this thread, in 100 ns units.
+	UINT64 QueryThreadTime()
+	{
+		FILETIME creation, exit, kernel, user;
+		FAIL_FAST_IF_WIN32_BOOL_FALSE(GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user));
+		return (static_cast<UINT64>(kernel.dwHighDateTime) << 32 | kernel.dwLowDateTime) + (static_cast<UINT64>(user.dwHighDateTime) << 32 | user.dwLowDateTime);
+	}
+	// Disk sizes read better with binary suffix, such as VHDX_ReadHeader/64T.
+	std::string FormatArgument(UINT64 argument)
+	{
+		constexpr char suffixes[] = "KMGT";
+		int unit = -1;
+		while (unit < 3 && argument != 0 && argument % 1024 == 0)
+		{
+			argument /= 1024;
+			unit++;
+		}
+		std::string text = std::to_string(argument);
+		if (unit >= 0)
+		{
+			text += suffixes[unit];
+		}
+		return text;
+	}
+	BenchmarkResult RunBenchmark(const BenchmarkDefinition& benchmark, double min_time)
+	{
+		UINT64 iterations = 1;
+		for (;;)
+		{
+			BenchmarkState state(iterations, benchmark.argument.value_or(0));
+			benchmark.function(state);
+			if (state.iterations_count() != iterations)
+			{
+				throw std::logic_error("Benchmark returned before all iterations.");
+			}
+			const double real_time = state.GetRealTime();
+			if (real_time >= min_time || iterations >= MAXIMUM_BENCHMARK_ITERATIONS)
+			{
+				return {
+					.name = benchmark.name,
+					.iterations = iterations,
+					.real_time = real_time * 1e9 / iterations,
+					.cpu_time = state.GetCpuTime() * 1e9 / iterations,
+					.items_per_second = real_time > 0 ? state.GetItemsProcessed() / real_time : 0,
+					.bytes_per_second = real_time > 0 ? state.GetBytesProcessed() / real_time : 0,
+				};
+			}
+			// Same growth as Google Benchmark. Aims 40% beyond minimum time, at most 10 times per round.
+			const double multiplier = real_time > 0 ? std::min(10.0, min_time * 1.4 / real_time) : 10.0;
+			iterations = std::clamp<UINT64>(static_cast<UINT64>(iterations * multiplier), iterations + 1, MAXIMUM_BENCHMARK_ITERATIONS);
+		}
+	}
+	void WriteJsonString(FILE* output, PCSTR string)
+	{
+		fputc('"', output);
+		for (PCSTR p = string; *p; p++)
+		{
+			if (*p == '"' || *p == '\\')
+			{
+				fprintf(output, "\\%c", *p);
+			}
+			else if (static_cast<BYTE>(*p) < 0x20 || static_cast<BYTE>(*p) > 0x7E)
+			{
+				fprintf(output, "\\u%04x", static_cast<BYTE>(*p));
+			}
+			else
+			{
+				fputc(*p, output);
+			}
+		}
+		fputc('"', output);
+	}
+	void WriteJson(FILE* output, const std::vector<BenchmarkResult>& results)
+	{
+		SYSTEMTIME now;
+		GetSystemTime(&now);
+		char host_name[MAX_COMPUTERNAME_LENGTH + 1] = {};
+		DWORD host_name_length = static_cast<DWORD>(std::size(host_name));
+		GetComputerNameA(host_name, &host_name_length);
+		char executable[MAX_PATH] = {};
+		GetModuleFileNameA(nullptr, executable, static_cast<DWORD>(std::size(executable)));
+		SYSTEM_INFO system_info;
+		GetSystemInfo(&system_info);
+		fprintf(
+			output,
+			"{\n"
+			"  \"context\": {\n"
+			"    \"date\": \"%04u-%02u-%02uT%02u:%02u:%02uZ\",\n"
+			"    \"host_name\": ",
+			now.wYear, now.wMonth, now.wDay, now.wHour, now.wMinute, now.wSecond);
+		WriteJsonString(output, host_name);
+		fputs(",\n    \"executable\": ", output);
+		WriteJsonString(output, executable);
+		fprintf(
+			output,
+			",\n"
+			"    \"num_cpus\": %lu,\n"
+			"    \"library_build_type\": \"%s\"\n"
+			"  },\n"
+			"  \"benchmarks\": [",
+			system_info.dwNumberOfProcessors,
+#ifdef _DEBUG
+			"debug"
+#else
+			"release"
+#endif
+		);
+		for (size_t i = 0; i < results.size(); i++)
+		{
+			const auto& result = results[i];
+			fputs(i ? ",\n    {\n      \"name\": " : "\n    {\n      \"name\": ", output);
+			WriteJsonString(output, result.name.c_str());
+			fputs(",\n      \"run_name\": ", output);
+			WriteJsonString(output, result.name.c_str());
+			fprintf(
+				output,
+				",\n"
+				"      \"run_type\": \"iteration\",\n"
+				"      \"repetitions\": 1,\n"
+				"      \"repetition_index\": 0,\n"
+				"      \"threads\": 1,\n"
+				"      \"iterations\": %llu,\n"
+				"      \"real_time\": %.6e,\n"
+				"      \"cpu_time\": %.6e,\n"
+				"      \"time_unit\": \"ns\"",
+				result.iterations,
+				result.real_time,
+				result.cpu_time);
+			if (result.items_per_second > 0)
+			{
+				fprintf(output, ",\n      \"items_per_second\": %.6e", result.items_per_second);
+			}
+			if (result.bytes_per_second > 0)
+			{
+				fprintf(output, ",\n      \"bytes_per_second\": %.6e", result.bytes_per_second);
+			}
+			if (!result.error_message.empty())
+			{
+				fputs(",\n      \"error_occurred\": true,\n      \"error_message\": ", output);
+				WriteJsonString(output, result.error_message.c_str());
+			}
+			fputs("\n    }", output);
+		}
+		fputs("\n  ]\n}\n", output);
+	}
+	[[noreturn]]
+	void usage()
+	{
+		fputs(
+			"Measure in-memory hot paths of image formats. No disk is involved.\n"
+			"\n"
+			"MakeVHDXBench [--benchmark_filter=<Regex>] [--benchmark_min_time=<Seconds>] [--benchmark_out=<File>] [--benchmark_list_tests]\n"
+			"\n"
+			"--benchmark_filter     Run only benchmarks whose name matches <Regex>.\n"
+			"--benchmark_min_time   Repeat each benchmark at least <Seconds>. (Default is 0.5)\n"
+			"--benchmark_out        Write JSON results to <File> instead of standard output.\n"
+			"--benchmark_list_tests List benchmark names and exit.\n",
+			stderr);
+		ExitProcess(EXIT_FAILURE);
+	}
+}
+bool BenchmarkState::KeepRunning()
+{
+	if (iterations == 0 && !running)
+	{
+		ResumeTiming();
+	}
+	if (iterations < max_iterations)
+	{
+		iterations++;
+		return true;
+	}
+	PauseTiming();
+	return false;
+}
+void BenchmarkState::PauseTiming()
+{
+	if (!running)
+	{
+		return;
+	}
+	real_ticks += QueryCounter() - real_started;
+	cpu_time += QueryThreadTime() - cpu_started;
+	running = false;
+}
+void BenchmarkState::ResumeTiming()
+{
+	if (running)
+	{
+		return;
+	}
+	running = true;
+	cpu_started = QueryThreadTime();
+	real_started = QueryCounter();
+}
+double BenchmarkState::GetRealTime() const
+{
+	static const double frequency = GetCounterFrequency();
+	return real_ticks / frequency;
+}
+double BenchmarkState::GetCpuTime() const
+{
+	return cpu_time / 1e7;
+}
+BenchmarkRegistration::BenchmarkRegistration(const char* name, BenchmarkFunction function, std::initializer_list<UINT64> arguments)
+{
+	if (arguments.size() == 0)
+	{
+		GetBenchmarks().push_back({ name, function, std::nullopt });
+	}
+	for (const auto argument : arguments)
+	{
+		GetBenchmarks().push_back({ std::string(name) + "/" + FormatArgument(argument), function, argument });
+	}
+}
+int wmain(int argc, PWSTR argv[])
+{
+	_CrtSetDbgFlag(_CrtSetDbgFlag(_CRTDBG_REPORT_FLAG) | _CRTDBG_LEAK_CHECK_DF);
+	setlocale(LC_CTYPE, "");
+
+	std::optional<std::regex> filter;
+	double min_time = DEFAULT_BENCHMARK_MIN_TIME;
+	PCWSTR output_file_name = nullptr;
+	bool list_tests = false;
+	for (int i = 1; i < argc; i++)
+	{
+		if (_wcsnicmp(argv[i], L"--benchmark_filter=", 19) == 0)
+		{
+			char pattern[1024];
+			if (WideCharToMultiByte(CP_ACP, 0, argv[i] + 19, -1, pattern, static_cast<int>(std::size(pattern)), nullptr, nullptr) == 0)
+			{
+				usage();
+			}
+			try
+			{
+				filter.emplace(pattern);
+			}
+			catch (const std::regex_error&)
+			{
+				usage();
+			}
+		}
+		else if (_wcsnicmp(argv[i], L"--benchmark_min_time=", 21) == 0)
+		{
+			PWSTR end;
+			min_time = wcstod(argv[i] + 21, &end);
+			// Google Benchmark accepts seconds with s suffix.
+			if (*end == L's')
+			{
+				end++;
+			}
+			if (*end != L'\0' || !(min_time > 0))
+			{
+				usage();
+			}
+		}
+		else if (_wcsnicmp(argv[i], L"--benchmark_out=", 16) == 0 && argv[i][16] != L'\0')
+		{
+			output_file_name = argv[i] + 16;
+		}
+		else if (_wcsicmp(argv[i], L"--benchmark_list_tests") == 0)
+		{
+			list_tests = true;
+		}
+		else
+		{
+			usage();
+		}
+	}
+	std::vector<BenchmarkResult> results;
+	for (const auto& benchmark : GetBenchmarks())
+	{
+		if (filter && !std::regex_search(benchmark.name, *filter))
+		{
+			continue;
+		}
+		if (list_tests)
+		{
+			puts(benchmark.name.c_str());
+			continue;
+		}
+		try
+		{
+			results.push_back(RunBenchmark(benchmark, min_time));
+			fprintf(stderr, "%-32s %14.0f ns %14.0f ns %12llu\n", results.back().name.c_str(), results.back().real_time, results.back().cpu_time, results.back().iterations);
+		}
+		catch (const std::exception& e)
+		{
+			results.push_back({ .name = benchmark.name, .error_message = e.what() });
+			fprintf(stderr, "%-32s \x1B[91m%s\x1B[0m\n", benchmark.name.c_str(), e.what());
+		}
+	}
+	if (list_tests)
+	{
+		return EXIT_SUCCESS;
+	}
+	wil::unique_file output_file;
+	if (output_file_name && _wfopen_s(&output_file, output_file_name, L"w") != 0)
+	{
+		fprintf(stderr, "\x1B[91mCan't open %ls.\x1B[0m\n", output_file_name);
+		return EXIT_FAILURE;
+	}
+	WriteJson(output_file ? output_file.get() : stdout, results);
+	return std::any_of(results.begin(), results.end(), [](const BenchmarkResult& r) { return !r.error_message.empty(); }) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
\ No newline at end of file
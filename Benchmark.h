@@ -0,0 +1,73 @@
+#pragma once
+#include <windows.h>
+#include <initializer_list>
+#include <intrin.h>
+#include <vector>
+
+// Minimal counterpart of Google Benchmark. Results are written as JSON of same schema, so runs compare with its tools/compare.py.
+struct BenchmarkState
+{
+private:
+	const UINT64 max_iterations;
+	const UINT64 argument;
+	UINT64 iterations = 0;
+	bool running = false;
+	LONGLONG real_started;
+	UINT64 cpu_started;
+	LONGLONG real_ticks = 0;
+	UINT64 cpu_time = 0;
+	UINT64 items_processed = 0;
+	UINT64 bytes_processed = 0;
+public:
+	BenchmarkState(UINT64 max_iterations, UINT64 argument) : max_iterations(max_iterations), argument(argument)
+	{
+	}
+	// Called before each iteration. Timing starts at first call and stops at last call.
+	bool KeepRunning();
+	// Excludes setup inside loop from timing.
+	void PauseTiming();
+	void ResumeTiming();
+	UINT64 range() const
+	{
+		return argument;
+	}
+	UINT64 iterations_count() const
+	{
+		return iterations;
+	}
+	void SetItemsProcessed(UINT64 items)
+	{
+		items_processed = items;
+	}
+	void SetBytesProcessed(UINT64 bytes)
+	{
+		bytes_processed = bytes;
+	}
+	// Seconds measured while timing.
+	double GetRealTime() const;
+	double GetCpuTime() const;
+	UINT64 GetItemsProcessed() const
+	{
+		return items_processed;
+	}
+	UINT64 GetBytesProcessed() const
+	{
+		return bytes_processed;
+	}
+};
+using BenchmarkFunction = void (*)(BenchmarkState& state);
+struct BenchmarkRegistration
+{
+	BenchmarkRegistration(const char* name, BenchmarkFunction function, std::initializer_list<UINT64> arguments);
+};
+// Registers function to run once for each argument, named <function>/<argument>.
+#define BENCHMARK_WITH_ARGUMENTS(function, ...) static const BenchmarkRegistration function##_registration(#function, function, { __VA_ARGS__ })
+#define BENCHMARK(function) static const BenchmarkRegistration function##_registration(#function, function, {})
+// Keeps value computed, without adding work to measured loop.
+template <typename Ty>
+inline void DoNotOptimize(const Ty& value)
+{
+	static const void* volatile sink;
+	sink = &value;
+	_ReadWriteBarrier();
+}
\ No newline at end of file
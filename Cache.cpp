@@ -0,0 +1,144 @@
+#define NOMINMAX
+#include <windows.h>
+#include <wil/filesystem.h>
+#include <wil/resource.h>
+#include <wil/result.h>
+#include <algorithm>
+#include <cwchar>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string_view>
+#include "Cache.h"
+#include "Dedup.h"
+#include "Image.h"
+#include "Planner.h"
+
+void ConversionCache::Initialize(PCWSTR cache_directory, HANDLE source_file, UINT64 options_hash, PCWSTR extension)
+{
+	FILE_ID_INFO id_info;
+	THROW_IF_WIN32_BOOL_FALSE(GetFileInformationByHandleEx(source_file, FileIdInfo, &id_info, sizeof id_info));
+	FILE_BASIC_INFO basic_info;
+	THROW_IF_WIN32_BOOL_FALSE(GetFileInformationByHandleEx(source_file, FileBasicInfo, &basic_info, sizeof basic_info));
+	LARGE_INTEGER fsize;
+	THROW_IF_WIN32_BOOL_FALSE(GetFileSizeEx(source_file, &fsize));
+	// Change time is updated by any change to file, even if last write time is set back.
+	const UINT64 source_state[] = {
+		static_cast<UINT64>(fsize.QuadPart),
+		static_cast<UINT64>(basic_info.LastWriteTime.QuadPart),
+		static_cast<UINT64>(basic_info.ChangeTime.QuadPart),
+	};
+	WCHAR name[0x80];
+	int length = swprintf_s(name, L"%016llX-", id_info.VolumeSerialNumber);
+	for (const BYTE b : id_info.FileId.Identifier)
+	{
+		length += swprintf_s(name + length, std::size(name) - length, L"%02X", b);
+	}
+	directory = cache_directory;
+	entry_prefix = directory + L"\\" + name + L"-";
+	swprintf_s(name, L"%016llX-", HashChunk(reinterpret_cast<const BYTE*>(source_state), sizeof source_state));
+	source_state_prefix = entry_prefix + name;
+	swprintf_s(name, L"%016llX", options_hash);
+	entry_file_name = source_state_prefix + name + extension;
+}
+wil::unique_hfile ConversionCache::Open(const FSCTL_GET_INTEGRITY_INFORMATION_BUFFER& integrity) const
+{
+	wil::unique_hfile entry_file(CreateFileW(entry_file_name.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr));
+	if (!entry_file)
+	{
+		THROW_LAST_ERROR_IF(GetLastError() != ERROR_FILE_NOT_FOUND && GetLastError() != ERROR_PATH_NOT_FOUND);
+		return entry_file;
+	}
+	// Block cloning requires same integrity setting on both files.
+	FSCTL_GET_INTEGRITY_INFORMATION_BUFFER entry_integrity;
+	ULONG _;
+	THROW_IF_WIN32_BOOL_FALSE(DeviceIoControl(entry_file.get(), FSCTL_GET_INTEGRITY_INFORMATION, nullptr, 0, &entry_integrity, sizeof entry_integrity, &_, nullptr));
+	if (entry_integrity.ChecksumAlgorithm != integrity.ChecksumAlgorithm || entry_integrity.ClusterSizeInBytes != integrity.ClusterSizeInBytes)
+	{
+		entry_file.reset();
+	}
+	return entry_file;
+}
+void ConversionCache::Store(HANDLE output_file, const FSCTL_GET_INTEGRITY_INFORMATION_BUFFER& integrity, IoScheduler* scheduler) const
+{
+	THROW_IF_WIN32_BOOL_FALSE(CreateDirectoryW(directory.c_str(), nullptr) || GetLastError() == ERROR_ALREADY_EXISTS);
+	// Entry appears complete or not at all.
+	const std::wstring partial_file_name = entry_file_name + L".partial";
+	{
+		wil::unique_hfile partial_file(CreateFileW(partial_file_name.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+		THROW_LAST_ERROR_IF(!partial_file);
+		auto delete_partial = wil::scope_exit([&] { partial_file.reset(); DeleteFileW(partial_file_name.c_str()); });
+		ULONG _;
+		FSCTL_SET_INTEGRITY_INFORMATION_BUFFER set_integrity = { integrity.ChecksumAlgorithm, 0, integrity.Flags };
+		THROW_IF_WIN32_BOOL_FALSE(DeviceIoControl(partial_file.get(), FSCTL_SET_INTEGRITY_INFORMATION, &set_integrity, sizeof set_integrity, nullptr, 0, nullptr, nullptr));
+		THROW_IF_WIN32_BOOL_FALSE(DeviceIoControl(partial_file.get(), FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &_, nullptr));
+		CloneWholeFile(output_file, partial_file.get(), integrity.ClusterSizeInBytes, scheduler);
+		partial_file.reset();
+		THROW_IF_WIN32_BOOL_FALSE(MoveFileExW(partial_file_name.c_str(), entry_file_name.c_str(), MOVEFILE_REPLACE_EXISTING));
+		delete_partial.release();
+	}
+	// Entries of same source made before it changed are never hit again.
+	WIN32_FIND_DATAW find_data;
+	wil::unique_hfind find(FindFirstFileW((entry_prefix + L"*").c_str(), &find_data));
+	if (!find)
+	{
+		return;
+	}
+	const std::wstring_view source_state_name = std::wstring_view(source_state_prefix).substr(directory.size() + 1);
+	do
+	{
+		if (!std::wstring_view(find_data.cFileName).starts_with(source_state_name))
+		{
+			DeleteFileW((directory + L"\\" + find_data.cFileName).c_str());
+		}
+	} while (FindNextFileW(find.get(), &find_data));
+}
+void CloneWholeFile(HANDLE source_file, HANDLE destination_file, ULONG cluster_size, IoScheduler* scheduler)
+{
+	LARGE_INTEGER fsize;
+	THROW_IF_WIN32_BOOL_FALSE(GetFileSizeEx(source_file, &fsize));
+	const UINT64 file_size = fsize.QuadPart;
+	FILE_END_OF_FILE_INFO eof_info = { {.QuadPart = static_cast<LONGLONG>(file_size) } };
+	THROW_IF_WIN32_BOOL_FALSE(SetFileInformationByHandle(destination_file, FileEndOfFileInfo, &eof_info, sizeof eof_info));
+	const UINT64 clone_size = file_size / cluster_size * cluster_size;
+	ULONG _;
+	std::unique_ptr<BYTE[]> copy_buffer;
+	for (UINT64 offset = 0; offset < clone_size;)
+	{
+		DUPLICATE_EXTENTS_DATA dup_extent = {
+			.FileHandle = source_file,
+			.SourceFileOffset = {.QuadPart = static_cast<LONGLONG>(offset) },
+			.TargetFileOffset = {.QuadPart = static_cast<LONGLONG>(offset) },
+			.ByteCount = {.QuadPart = std::min<LONGLONG>(clone_size - offset, MAXIMUM_CLONE_SIZE) },
+		};
+		if (!ScheduleIo(scheduler, IoKind::Clone, dup_extent.ByteCount.QuadPart, [&] { return DeviceIoControl(destination_file, FSCTL_DUPLICATE_EXTENTS_TO_FILE, &dup_extent, sizeof dup_extent, nullptr, 0, &_, nullptr); }))
+		{
+			// Entry cloned too many times reaches reference count limit. Copy this chunk instead.
+			THROW_LAST_ERROR_IF(GetLastError() != ERROR_BLOCK_TOO_MANY_REFERENCES);
+			if (!copy_buffer)
+			{
+				copy_buffer = std::make_unique_for_overwrite<BYTE[]>(COPY_BUFFER_SIZE);
+			}
+			for (UINT64 copy_offset = 0; copy_offset < static_cast<UINT64>(dup_extent.ByteCount.QuadPart);)
+			{
+				const ULONG copy_size = static_cast<ULONG>(std::min<UINT64>(dup_extent.ByteCount.QuadPart - copy_offset, COPY_BUFFER_SIZE));
+				ScheduleIo(scheduler, IoKind::Copy, copy_size, [&]
+				{
+					ReadFileWithOffset(source_file, copy_buffer.get(), copy_size, offset + copy_offset);
+					WriteFileWithOffset(destination_file, copy_buffer.get(), copy_size, offset + copy_offset);
+					return TRUE;
+				});
+				copy_offset += copy_size;
+			}
+		}
+		offset += dup_extent.ByteCount.QuadPart;
+	}
+	if (clone_size < file_size)
+	{
+		// Such as footer of fixed VHD.
+		const ULONG tail_size = static_cast<ULONG>(file_size - clone_size);
+		const auto tail = std::make_unique_for_overwrite<BYTE[]>(tail_size);
+		ReadFileWithOffset(source_file, tail.get(), tail_size, clone_size);
+		WriteFileWithOffset(destination_file, tail.get(), tail_size, clone_size);
+	}
+}
\ No newline at end of file
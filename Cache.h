@@ -0,0 +1,32 @@
+#pragma once
+#include <windows.h>
+#include <wil/resource.h>
+#include <string>
+#include "Scheduler.h"
+
+// Previous outputs kept in a directory on source volume.
+// Entry name is source file ID, hash of source size and write times, and hash of output options, so an entry
+// matches only unchanged source converted same way, and storing an entry removes ones made before source changed.
+struct ConversionCache
+{
+private:
+	std::wstring directory;
+	std::wstring entry_prefix;
+	std::wstring source_state_prefix;
+	std::wstring entry_file_name;
+public:
+	void Initialize(PCWSTR cache_directory, HANDLE source_file, UINT64 options_hash, PCWSTR extension);
+	bool IsEnabled() const
+	{
+		return !entry_file_name.empty();
+	}
+	const std::wstring& GetEntryFileName() const
+	{
+		return entry_file_name;
+	}
+	// Returns empty handle if there is no entry, or entry can't be cloned to file with this integrity.
+	wil::unique_hfile Open(const FSCTL_GET_INTEGRITY_INFORMATION_BUFFER& integrity) const;
+	void Store(HANDLE output_file, const FSCTL_GET_INTEGRITY_INFORMATION_BUFFER& integrity, IoScheduler* scheduler) const;
+};
+// Whole clusters are cloned and the partial last cluster is copied.
+void CloneWholeFile(HANDLE source_file, HANDLE destination_file, ULONG cluster_size, IoScheduler* scheduler);
\ No newline at end of file
@@ -0,0 +1,87 @@
+#define NOMINMAX
+#include <windows.h>
+#include <clocale>
+#include <cstdio>
+#include <cstdlib>
+#include <optional>
+#include <regex>
+#include <string>
+#include <vector>
+#include "Check.h"
+#include <crtdbg.h>
+
+namespace
+{
+	struct CheckDefinition
+	{
+		std::string name;
+		CheckFunction function;
+	};
+	std::vector<CheckDefinition>& GetChecks()
+	{
+		static std::vector<CheckDefinition> checks;
+		return checks;
+	}
+	[[noreturn]]
+	void usage()
+	{
+		fputs(
+			"Check image formats and conversion steps against in-memory files. No disk is involved.\n"
+			"\n"
+			"MakeVHDXCheck [<Regex>]\n"
+			"\n"
+			"<Regex>  Run only checks whose name matches.\n",
+			stderr);
+		ExitProcess(EXIT_FAILURE);
+	}
+}
+CheckRegistration::CheckRegistration(const char* name, CheckFunction function)
+{
+	GetChecks().push_back({ name, function });
+}
+int wmain(int argc, PWSTR argv[])
+{
+	_CrtSetDbgFlag(_CrtSetDbgFlag(_CRTDBG_REPORT_FLAG) | _CRTDBG_LEAK_CHECK_DF);
+	setlocale(LC_CTYPE, "");
+
+	std::optional<std::regex> filter;
+	if (argc > 2)
+	{
+		usage();
+	}
+	if (argc == 2)
+	{
+		char pattern[1024];
+		if (WideCharToMultiByte(CP_ACP, 0, argv[1], -1, pattern, static_cast<int>(std::size(pattern)), nullptr, nullptr) == 0)
+		{
+			usage();
+		}
+		try
+		{
+			filter.emplace(pattern);
+		}
+		catch (const std::regex_error&)
+		{
+			usage();
+		}
+	}
+	UINT32 failed = 0;
+	for (const auto& check : GetChecks())
+	{
+		if (filter && !std::regex_search(check.name, *filter))
+		{
+			continue;
+		}
+		try
+		{
+			check.function();
+			printf("Passed: %hs\n", check.name.c_str());
+		}
+		catch (const std::exception& e)
+		{
+			failed++;
+			printf("\x1B[91mFailed: %hs\n%hs\x1B[0m\n", check.name.c_str(), e.what());
+		}
+	}
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
\ No newline at end of file
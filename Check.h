@@ -0,0 +1,15 @@
+#pragma once
+#include <windows.h>
+#include <stdexcept>
+
+// Checks run against in-memory files, like benchmarks. A check fails by throwing.
+using CheckFunction = void (*)();
+struct CheckRegistration
+{
+	CheckRegistration(const char* name, CheckFunction function);
+};
+#define CHECK(function) static const CheckRegistration function##_registration(#function, function)
+// Fails current check with location and expression.
+#define REQUIRE(condition) ((condition) ? (void)0 : throw std::runtime_error(__FILE__ "(" _CRT_STRINGIZE(__LINE__) "): " #condition))
+// Fails current check unless statement throws std::exception.
+#define REQUIRE_THROWS(statement) do { bool thrown = false; try { statement; } catch (const std::exception&) { thrown = true; } REQUIRE(thrown); } while (false)
\ No newline at end of file
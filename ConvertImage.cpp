@@ -5,13 +5,24 @@
 #include <wil/filesystem.h>
 #include <wil/resource.h>
 #include <wil/result.h>
+#include <filesystem>
 #include <iterator>
+#include <vector>
 #include <stdexcept>
+#include "Cache.h"
 #include "ConvertImage.h"
+#include "Dedup.h"
 #include "Image.h"
+#include "Journal.h"
+#include "Kernel.h"
+#include "Partition.h"
+#include "Planner.h"
+#include "Stream.h"
 #include "RAW.h"
+#include "VDI.h"
 #include "VHD.h"
 #include "VHDX.h"
+#include "VMDK.h"
 #pragma comment(lib, "shlwapi")
 
 std::unique_ptr<Image> DetectImageFormatByData(HANDLE file)
@@ -19,6 +30,8 @@ std::unique_ptr<Image> DetectImageFormatByData(HANDLE file)
 	static const auto img_detect_funcs = {
 		VHDX::DetectImageFormatByData,
 		VHD::DetectImageFormatByData,
+		VMDK::DetectImageFormatByData,
+		VDI::DetectImageFormatByData,
 		RAW::DetectImageFormatByData,
 	};
 	for (auto img_detect_func : img_detect_funcs)
@@ -41,117 +54,728 @@ std::unique_ptr<Image> DetectImageFormatByExtension(PCWSTR file_name)
 	{
 		return std::unique_ptr<Image>(new VHD);
 	}
+	if (_wcsicmp(extension, L".vmdk") == 0)
+	{
+		return std::unique_ptr<Image>(new VMDK);
+	}
+	if (_wcsicmp(extension, L".vdi") == 0)
+	{
+		return std::unique_ptr<Image>(new VDI);
+	}
 	return std::unique_ptr<Image>(new RAW);
 }
-void ConvertImage(PCWSTR src_file_name, PCWSTR dst_file_name, const Option& options)
+std::unique_ptr<Image> CreateImageOfType(PCSTR image_type_name)
 {
-	printf(
-		"Source\n"
-		"Path:              %ls\n",
-		src_file_name
-	);
-	const auto src_file = wil::open_file(src_file_name);
+	if (strcmp(image_type_name, "VHDX") == 0)
+	{
+		return std::unique_ptr<Image>(new VHDX);
+	}
+	if (strcmp(image_type_name, "VHD") == 0)
+	{
+		return std::unique_ptr<Image>(new VHD);
+	}
+	if (strcmp(image_type_name, "VMDK") == 0)
+	{
+		return std::unique_ptr<Image>(new VMDK);
+	}
+	if (strcmp(image_type_name, "VDI") == 0)
+	{
+		return std::unique_ptr<Image>(new VDI);
+	}
+	if (strcmp(image_type_name, "RAW") == 0)
+	{
+		return std::unique_ptr<Image>(new RAW);
+	}
+	throw std::invalid_argument("Unknown image type.");
+}
+static void RenameFileByHandle(HANDLE file, const std::wstring& new_file_name, bool replace_if_exists)
+{
+	const size_t rename_info_size = sizeof(FILE_RENAME_INFO) + new_file_name.size() * sizeof(WCHAR);
+	const auto rename_info_buffer = std::make_unique<BYTE[]>(rename_info_size);
+	const auto rename_info = reinterpret_cast<FILE_RENAME_INFO*>(rename_info_buffer.get());
+	rename_info->ReplaceIfExists = replace_if_exists;
+	rename_info->RootDirectory = nullptr;
+	rename_info->FileNameLength = static_cast<DWORD>(new_file_name.size() * sizeof(WCHAR));
+	memcpy(rename_info->FileName, new_file_name.c_str(), (new_file_name.size() + 1) * sizeof(WCHAR));
+	THROW_IF_WIN32_BOOL_FALSE(SetFileInformationByHandle(file, FileRenameInfo, rename_info, static_cast<DWORD>(rename_info_size)));
+}
+// Everything besides source that decides output contents.
+static UINT64 HashOutputOptions(const Option& options, const Image& destination, UINT32 cluster_size)
+{
+	UINT64 image_type = 0;
+	strncpy_s(reinterpret_cast<char*>(&image_type), sizeof image_type, destination.GetImageTypeName(), _TRUNCATE);
+	const UINT64 values[] = {
+		image_type,
+		options.disk_size,
+		options.block_size,
+		options.alignment,
+		options.auto_block_size ? options.auto_block_weight : 0,
+		static_cast<UINT64>(options.layout),
+		options.punch_zero,
+		options.partition,
+		options.fixed ? 1ULL + *options.fixed : 0,
+		cluster_size,
+	};
+	return HashChunk(reinterpret_cast<const BYTE*>(values), sizeof values);
+}
+static ULONG GetClusterSize(PCWSTR file_name)
+{
+	WCHAR volume_path[MAX_PATH];
+	THROW_IF_WIN32_BOOL_FALSE(GetVolumePathNameW(file_name, volume_path, static_cast<ULONG>(std::size(volume_path))));
+	ULONG sectors_per_cluster, bytes_per_sector, _;
+	THROW_IF_WIN32_BOOL_FALSE(GetDiskFreeSpaceW(volume_path, &sectors_per_cluster, &bytes_per_sector, &_, &_));
+	return sectors_per_cluster * bytes_per_sector;
+}
+void Conversion::Open(PCWSTR source_file_name)
+{
+	src_file_name = source_file_name;
+	src_file.reset(wil::open_file(source_file_name).release(), CloseHandle);
 	ULONG fs_flags;
 	THROW_IF_WIN32_BOOL_FALSE(GetVolumeInformationByHandleW(src_file.get(), nullptr, 0, nullptr, nullptr, &fs_flags, nullptr, 0));
-	if (WI_IsFlagClear(fs_flags, FILE_SUPPORTS_BLOCK_REFCOUNTING))
+	// Checked by Plan(), as streaming reads source on any filesystem.
+	src_block_cloning = WI_IsFlagSet(fs_flags, FILE_SUPPORTS_BLOCK_REFCOUNTING);
+	THROW_IF_WIN32_BOOL_FALSE(GetFileInformationByHandle(src_file.get(), &src_file_info));
+	ULONG _;
+	if (!DeviceIoControl(src_file.get(), FSCTL_GET_INTEGRITY_INFORMATION, nullptr, 0, &src_integrity, sizeof src_integrity, &_, nullptr))
 	{
-		throw std::runtime_error("Filesystem doesn't support Block Cloning feature.");
+		THROW_LAST_ERROR_IF(src_block_cloning);
+		src_integrity = { .ClusterSizeInBytes = GetClusterSize(source_file_name) };
 	}
-	BY_HANDLE_FILE_INFORMATION file_info;
-	THROW_IF_WIN32_BOOL_FALSE(GetFileInformationByHandle(src_file.get(), &file_info));
-	ULONG _;
-	FSCTL_GET_INTEGRITY_INFORMATION_BUFFER get_integrity;
-	THROW_IF_WIN32_BOOL_FALSE(DeviceIoControl(src_file.get(), FSCTL_GET_INTEGRITY_INFORMATION, nullptr, 0, &get_integrity, sizeof get_integrity, &_, nullptr));
-	const auto src_img = DetectImageFormatByData(src_file.get());
+	src_img = DetectImageFormatByData(src_file.get());
 	if (!src_img)
 	{
 		throw std::runtime_error("No supported image types detected.");
 	}
-	src_img->Attach(src_file.get(), get_integrity.ClusterSizeInBytes);
+	src_img->Attach(src_file.get(), src_integrity.ClusterSizeInBytes);
 	src_img->ReadHeader();
-	char buf[0x20];
-	printf(
-		"Image format:      %hs\n"
-		"Allocation policy: %hs\n"
-		"Disk size:         %llu (%s)\n"
-		"Block size:        %u MB\n",
-		src_img->GetImageTypeName(),
-		src_img->IsFixed() ? "Fixed" : "Dynamic",
-		src_img->GetDiskSize(),
-		StrFormatByteSize64A(src_img->GetDiskSize(), buf, std::size(buf)),
-		src_img->GetBlockSize() / 1024 / 1024
-	);
 	src_img->CheckConvertible();
-
-	printf(
-		"\n"
-		"Destination\n"
-		"Path:              %ls\n",
-		dst_file_name
-	);
+}
+void Conversion::Open(const Conversion& planned_sibling)
+{
+	if (src_img || !planned_sibling.src_img || !planned_sibling.dst_img || planned_sibling.options.compact)
+	{
+		throw std::logic_error("Conversion is already opened, or sibling is not planned or is compaction.");
+	}
+	src_file_name = planned_sibling.src_file_name;
+	src_file = planned_sibling.src_file;
+	src_img = planned_sibling.src_img;
+	src_file_info = planned_sibling.src_file_info;
+	src_integrity = planned_sibling.src_integrity;
+	src_block_cloning = planned_sibling.src_block_cloning;
+	options = planned_sibling.options;
+	source_extents = planned_sibling.source_extents;
+	source_disk_size = planned_sibling.source_disk_size;
+	partition = planned_sibling.partition;
+	zero_size = planned_sibling.zero_size;
+}
+void Conversion::Plan(PCWSTR destination_file_name, const Option& conversion_options)
+{
+	if (!src_img || dst_img)
+	{
+		throw std::logic_error("Conversion is not opened or already planned.");
+	}
+	if (source_extents && (conversion_options.partition != options.partition || conversion_options.punch_zero != options.punch_zero || conversion_options.compact))
+	{
+		throw std::invalid_argument("Destinations sharing source must use same partition and punch options, and can't be compacted.");
+	}
+	options = conversion_options;
+	if (options.compact && (src_img->IsFixed() || (strcmp(src_img->GetImageTypeName(), "VHD") != 0 && strcmp(src_img->GetImageTypeName(), "VHDX") != 0)))
+	{
+		throw std::runtime_error("Compaction requires dynamic VHD or VHDX.");
+	}
+	if (options.journal && (options.dedup_index || options.stream_output))
+	{
+		throw std::invalid_argument("Journal can't be used with deduplication or streaming.");
+	}
+	if (options.partition && (options.dedup_index || options.compact))
+	{
+		throw std::invalid_argument("Partition can't be extracted with deduplication or compaction.");
+	}
+	if (options.cache_directory && (options.journal || options.dedup_index || options.stream_output || options.compact))
+	{
+		throw std::invalid_argument("Cache can't be used with journal, deduplication, streaming or compaction.");
+	}
+	if (options.stream_output && (options.dedup_index || options.compact))
+	{
+		throw std::invalid_argument("Streaming can't be used with deduplication or compaction.");
+	}
+	if (!src_block_cloning && !options.stream_output)
+	{
+		throw std::runtime_error("Filesystem doesn't support Block Cloning feature.");
+	}
+	dst_file_name = destination_file_name;
+	if (options.stream_output)
+	{
+		// Nothing is written until streaming. Data of image is read from source then.
+		std::filesystem::path image_file_name = PathFindFileNameW(options.stream_output);
+		const std::wstring format_extension = std::wstring(L".") + options.stream_format;
+		if (wcscmp(options.stream_output, L"-") == 0 || _wcsnicmp(options.stream_output, L"tcp:", 4) == 0 || wcsncmp(options.stream_output, LR"(\\.\)", 4) == 0)
+		{
+			image_file_name = std::filesystem::path(src_file_name).filename().replace_extension(format_extension);
+		}
+		stream_layout = std::make_unique<StreamLayout>(image_file_name.wstring());
+		dst_img = DetectImageFormatByExtension(format_extension.c_str());
+		dst_img->AttachSink(stream_layout.get(), std::max<ULONG>(src_integrity.ClusterSizeInBytes, options.alignment));
+	}
+	else
+	{
+		if (options.journal)
+		{
+			// Partial destination survives failure to be resumed, and is renamed to destination when completed.
+			const std::wstring partial_file_name = dst_file_name + L".partial";
+			if (options.resume)
+			{
+				dst_file = wil::open_file(partial_file_name.c_str(), GENERIC_READ | GENERIC_WRITE | DELETE, 0);
+			}
+			else
+			{
+				dst_file = wil::create_new_file(partial_file_name.c_str(), GENERIC_READ | GENERIC_WRITE | DELETE);
+			}
+		}
+		else
+		{
 #if _DEBUG
-	const auto dst_file = wil::open_or_truncate_existing_file(dst_file_name, GENERIC_READ | GENERIC_WRITE, 0, nullptr, FILE_FLAG_DELETE_ON_CLOSE);
+			dst_file = wil::open_or_truncate_existing_file(destination_file_name, GENERIC_READ | GENERIC_WRITE, 0, nullptr, FILE_FLAG_DELETE_ON_CLOSE);
 #elif NTDDI_VERSION < NTDDI_WIN10_RS3
-	const auto dst_file = wil::create_new_file(dst_file_name, GENERIC_READ | GENERIC_WRITE | DELETE);
-	FILE_DISPOSITION_INFO dispos = { TRUE };
-	THROW_IF_WIN32_BOOL_FALSE(SetFileInformationByHandle(dst_file.get(), FileDispositionInfo, &dispos, sizeof dispos));
+			dst_file = wil::create_new_file(destination_file_name, GENERIC_READ | GENERIC_WRITE | DELETE);
+			FILE_DISPOSITION_INFO dispos = { TRUE };
+			THROW_IF_WIN32_BOOL_FALSE(SetFileInformationByHandle(dst_file.get(), FileDispositionInfo, &dispos, sizeof dispos));
 #else
-	const auto dst_file = wil::create_new_file(dst_file_name, GENERIC_READ | GENERIC_WRITE, 0, nullptr, FILE_FLAG_DELETE_ON_CLOSE);
+			dst_file = wil::create_new_file(destination_file_name, GENERIC_READ | GENERIC_WRITE, 0, nullptr, FILE_FLAG_DELETE_ON_CLOSE);
 #endif
-	FSCTL_SET_INTEGRITY_INFORMATION_BUFFER set_integrity = { get_integrity.ChecksumAlgorithm, 0, get_integrity.Flags };
-	THROW_IF_WIN32_BOOL_FALSE(DeviceIoControl(dst_file.get(), FSCTL_SET_INTEGRITY_INFORMATION, &set_integrity, sizeof set_integrity, nullptr, 0, nullptr, nullptr));
-	THROW_IF_WIN32_BOOL_FALSE(DeviceIoControl(dst_file.get(), FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &_, nullptr));
-	const auto dst_img = DetectImageFormatByExtension(dst_file_name);
-	dst_img->Attach(dst_file.get(), get_integrity.ClusterSizeInBytes);
-	dst_img->ConstructHeader(src_img->GetDiskSize(), options.block_size, src_img->GetSectorSize(), options.fixed.value_or(src_img->IsFixed()));
+		}
+		ULONG _;
+		if (!options.resume)
+		{
+			// Integrity can be changed only while file is empty.
+			FSCTL_SET_INTEGRITY_INFORMATION_BUFFER set_integrity = { src_integrity.ChecksumAlgorithm, 0, src_integrity.Flags };
+			THROW_IF_WIN32_BOOL_FALSE(DeviceIoControl(dst_file.get(), FSCTL_SET_INTEGRITY_INFORMATION, &set_integrity, sizeof set_integrity, nullptr, 0, nullptr, nullptr));
+		}
+		THROW_IF_WIN32_BOOL_FALSE(DeviceIoControl(dst_file.get(), FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &_, nullptr));
+		// Compacted image replaces source, so it keeps format of source whatever its name is.
+		dst_img = options.compact ? CreateImageOfType(src_img->GetImageTypeName()) : DetectImageFormatByExtension(destination_file_name);
+		dst_img->Attach(dst_file.get(), std::max<ULONG>(src_integrity.ClusterSizeInBytes, options.alignment));
+		if (options.resume)
+		{
+			// Metadata is rebuilt over data cloned by interrupted conversion, which must not be truncated away.
+			LARGE_INTEGER fsize;
+			THROW_IF_WIN32_BOOL_FALSE(GetFileSizeEx(dst_file.get(), &fsize));
+			resume_file_size = fsize.QuadPart;
+			dst_img->RetainFileSize(resume_file_size);
+		}
+	}
+	io_scheduler = std::make_unique<IoScheduler>(options.io_budget);
+	io_scheduler->SetPriorityHint(src_img->GetDataFile());
+	if (dst_file)
+	{
+		io_scheduler->SetPriorityHint(dst_file.get());
+	}
+	// Source is only read, so only destination needs the scheduler for its metadata writes.
+	dst_img->SetScheduler(io_scheduler.get());
+	// Hot layout depends on contents of access profile, so it is never cached.
+	if (options.cache_directory && options.layout != LayoutPolicy::Hot)
+	{
+		cache.Initialize(options.cache_directory, src_file.get(), HashOutputOptions(options, *dst_img, src_integrity.ClusterSizeInBytes), PathFindExtensionW(destination_file_name));
+		cached_file = cache.Open(src_integrity);
+		if (cached_file)
+		{
+			// Source is not scanned. Destination is reported from cached output.
+			dst_img = DetectImageFormatByData(cached_file.get());
+			dst_img->Attach(cached_file.get(), std::max<ULONG>(src_integrity.ClusterSizeInBytes, options.alignment));
+			dst_img->ReadHeader();
+			layout = dst_img->IsFixed() ? LayoutPolicy::Virtual : options.layout;
+			block_size_estimates.clear();
+			runs.clear();
+			layout_metrics = {};
+			zero_size = 0;
+			LARGE_INTEGER fsize;
+			THROW_IF_WIN32_BOOL_FALSE(GetFileSizeEx(cached_file.get(), &fsize));
+			progress_total_bytes = fsize.QuadPart;
+			progress_done_bytes = 0;
+			return;
+		}
+	}
+	kernel = &SelectConversionKernel(*src_img, *dst_img);
+	if (!source_extents)
+	{
+		auto extents = kernel->collect_extents(*src_img, src_integrity.ClusterSizeInBytes);
+		source_disk_size = src_img->GetDiskSize();
+		if (options.partition)
+		{
+			partition = FindPartition(src_img->GetDataFile(), extents, src_img->GetSectorSize(), src_img->GetDiskSize(), options.partition);
+			extents = ExtractPartition(extents, partition);
+			source_disk_size = partition.length;
+		}
+		zero_size = 0;
+		if (options.punch_zero)
+		{
+			for (const auto& extent : extents)
+			{
+				zero_size += extent.length;
+			}
+			extents = DropZeroClusters(src_img->GetDataFile(), extents, src_integrity.ClusterSizeInBytes);
+			for (const auto& extent : extents)
+			{
+				zero_size -= extent.length;
+			}
+		}
+		source_extents = std::make_shared<const std::vector<Extent>>(std::move(extents));
+	}
+	const auto& extents = *source_extents;
+	const UINT64 disk_size = options.disk_size ? options.disk_size : source_disk_size;
+	if (!extents.empty() && extents.back().virtual_offset + extents.back().length > round_up(disk_size, static_cast<UINT64>(src_integrity.ClusterSizeInBytes)))
+	{
+		throw std::runtime_error("Source has allocated data beyond new disk size.");
+	}
+	UINT32 block_size = options.block_size;
+	if (options.compact && !block_size)
+	{
+		block_size = src_img->GetBlockSize();
+	}
+	block_size_estimates.clear();
+	if (options.auto_block_size)
+	{
+		block_size_estimates = EstimateBlockSizes(*dst_img, disk_size, extents, options.auto_block_weight);
+		if (!block_size_estimates.empty())
+		{
+			block_size = std::min_element(block_size_estimates.begin(), block_size_estimates.end(), [](const auto& l, const auto& r) { return l.cost < r.cost; })->block_size;
+		}
+	}
+	dst_img->ConstructHeader(disk_size, block_size, src_img->GetSectorSize(), options.fixed.value_or(src_img->IsFixed()));
+	if (options.compact)
+	{
+		dst_img->CopyIdentity(*src_img);
+	}
+
+	layout = dst_img->IsFixed() ? LayoutPolicy::Virtual : options.layout;
+	std::vector<UINT64> block_heat;
+	if (layout == LayoutPolicy::Hot)
+	{
+		block_heat = ReadAccessProfile(options.access_profile, dst_img->GetBlockSize(), dst_img->GetTableEntriesCount());
+	}
+	runs = PlanLayout(extents, dst_img->GetBlockSize(), layout, block_heat);
+	layout_metrics = MeasureLayout(runs, dst_img->GetBlockSize());
+	if (options.dedup_index)
+	{
+		options.dedup_index->Deduplicate(options.dedup_index->AddFile(src_img->GetDataFile()), dst_img->GetBlockSize(), runs);
+	}
+	if (!stream_layout)
+	{
+		// Source cloned many times, such as a template, has clusters whose clone calls would only be refused.
+		MarkReferenceLimitedRuns(runs, ReadPhysicalExtents(src_img->GetDataFile(), src_integrity.ClusterSizeInBytes));
+	}
+	UINT64 total_bytes = 0;
+	for (const auto& run : runs)
+	{
+		total_bytes += run.length;
+	}
+	progress_total_bytes = total_bytes;
+	progress_done_bytes = 0;
+}
+void Conversion::Execute(const std::function<void(UINT64 done_bytes, UINT64 total_bytes)>& progress)
+{
+	if (!dst_img)
+	{
+		throw std::logic_error("Conversion is not planned.");
+	}
+	ULONG _;
+	if (cached_file)
+	{
+		CloneWholeFile(cached_file.get(), dst_file.get(), src_integrity.ClusterSizeInBytes, io_scheduler.get());
+		// Cached output is a copy of earlier one. Give destination its own disk identity, as conversion without cache does.
+		dst_img->Attach(dst_file.get(), std::max<ULONG>(src_integrity.ClusterSizeInBytes, options.alignment));
+		dst_img->ReadHeader();
+		dst_img->RenewIdentity();
+		progress_done_bytes = progress_total_bytes.load();
+		if (progress)
+		{
+			progress(progress_done_bytes, progress_total_bytes);
+		}
+	}
+	else
+	{
+		CloneRuns(progress);
+		dst_img->WriteHeader();
+	}
+	if (stream_layout)
+	{
+		stream_layout->Stream(options.stream_output);
+		progress_done_bytes = progress_total_bytes.load();
+		if (progress)
+		{
+			progress(progress_done_bytes, progress_total_bytes);
+		}
+		return;
+	}
+	FILE_SET_SPARSE_BUFFER set_sparse = { options.sparse.value_or(WI_IsFlagSet(src_file_info.dwFileAttributes, FILE_ATTRIBUTE_SPARSE_FILE)) };
+	THROW_IF_WIN32_BOOL_FALSE(DeviceIoControl(dst_file.get(), FSCTL_SET_SPARSE, &set_sparse, sizeof set_sparse, nullptr, 0, &_, nullptr));
+	if (options.journal)
+	{
+		THROW_IF_WIN32_BOOL_FALSE(FlushFileBuffers(dst_file.get()));
+	}
+	else
+	{
+#if !_DEBUG && NTDDI_VERSION < NTDDI_WIN10_RS3
+		FILE_DISPOSITION_INFO dispos = { FALSE };
+		THROW_IF_WIN32_BOOL_FALSE(SetFileInformationByHandle(dst_file.get(), FileDispositionInfo, &dispos, sizeof dispos));
+#else
+		FILE_DISPOSITION_INFO_EX fdie = { FILE_DISPOSITION_FLAG_DO_NOT_DELETE | FILE_DISPOSITION_FLAG_ON_CLOSE };
+		THROW_IF_WIN32_BOOL_FALSE(SetFileInformationByHandle(dst_file.get(), FileDispositionInfoEx, &fdie, sizeof fdie));
+#endif
+	}
+	if (options.compact)
+	{
+		// Source must be closed before it can be replaced.
+		src_img.reset();
+		src_file.reset();
+		RenameFileByHandle(dst_file.get(), std::filesystem::absolute(src_file_name), true);
+	}
+	else if (options.journal)
+	{
+		RenameFileByHandle(dst_file.get(), std::filesystem::absolute(dst_file_name), false);
+	}
+	if (options.journal)
+	{
+		journal.Delete();
+	}
+	if (cache.IsEnabled() && !cached_file)
+	{
+		// Destination is already complete, so failing to store it only loses the entry.
+		try
+		{
+			cache.Store(dst_file.get(), src_integrity, io_scheduler.get());
+		}
+		CATCH_LOG();
+	}
+}
+void Conversion::CloneRuns(const std::function<void(UINT64 done_bytes, UINT64 total_bytes)>& progress)
+{
+	ULONG _;
+	UINT64 done_bytes = 0;
+	deduplicated_size = 0;
+	clone_metrics = {};
+	kernel->resolve_targets(*dst_img, runs);
+	if (stream_layout)
+	{
+		// Nothing is cloned. Runs are read from source while streaming.
+		for (const auto& run : runs)
+		{
+			stream_layout->AddData(run.target_offset, src_img->GetDataFile(), run.source_offset, run.length);
+		}
+		return;
+	}
+	// Allocation is deterministic, so resumed conversion rebuilds same metadata and skips recorded runs.
+	size_t first_run = 0;
+	if (options.journal)
+	{
+		const std::wstring journal_file_name = dst_file_name + L".journal";
+		const UINT64 plan_hash = HashPlan(*dst_img, runs);
+		if (options.resume)
+		{
+			journal.Open(journal_file_name.c_str(), src_file_info, plan_hash, runs.size(), resume_file_size);
+			first_run = static_cast<size_t>(journal.GetCompletedRuns());
+			done_bytes = journal.GetDoneBytes();
+			progress_done_bytes = done_bytes;
+		}
+		else
+		{
+			LARGE_INTEGER fsize;
+			THROW_IF_WIN32_BOOL_FALSE(GetFileSizeEx(dst_file.get(), &fsize));
+			journal.Create(journal_file_name.c_str(), src_file_info, plan_hash, runs.size(), fsize.QuadPart);
+		}
+	}
+	const LONGLONG maximum_clone_size = static_cast<LONGLONG>(io_scheduler->GetMaximumCloneSize(MAXIMUM_CLONE_SIZE, src_integrity.ClusterSizeInBytes));
+	CloneCostModel cost_model(options.copy_limit);
+	std::unique_ptr<BYTE[]> copy_buffer;
+	const auto copy = [&](UINT64 source_offset, UINT64 target_offset, UINT64 length)
+	{
+		if (!copy_buffer)
+		{
+			copy_buffer = std::make_unique_for_overwrite<BYTE[]>(COPY_BUFFER_SIZE);
+		}
+		for (UINT64 offset = 0; offset < length;)
+		{
+			const ULONG copy_size = static_cast<ULONG>(std::min<UINT64>(length - offset, COPY_BUFFER_SIZE));
+			io_scheduler->Run(IoKind::Copy, copy_size, [&]
+			{
+				const LONGLONG started = CloneCostModel::Now();
+				ReadFileWithOffset(src_img->GetDataFile(), copy_buffer.get(), copy_size, source_offset + offset);
+				WriteFileWithOffset(dst_file.get(), copy_buffer.get(), copy_size, target_offset + offset);
+				cost_model.RecordCopy(copy_size, started);
+				return TRUE;
+			});
+			offset += copy_size;
+		}
+		clone_metrics.copied_runs++;
+		clone_metrics.copied_bytes += length;
+	};
+	// Every path completing runs ends here, so progress is reported and cancel is honored however runs were completed.
+	// Runs before next_run must be completed, as checkpoint records them so.
+	const auto complete = [&](size_t next_run)
+	{
+		progress_done_bytes = done_bytes;
+		if (progress)
+		{
+			progress(done_bytes, progress_total_bytes);
+		}
+		if (cancelled)
+		{
+			throw ConversionCancelled();
+		}
+		if (options.journal && journal.IsCheckpointDue())
+		{
+			journal.Checkpoint(dst_file.get(), next_run, done_bytes);
+		}
+	};
+	DUPLICATE_EXTENTS_DATA dup_extent = { .FileHandle = src_img->GetDataFile() };
+	// Clones pending runs, which end before next_run.
+	const auto flush = [&](size_t next_run)
+	{
+		const UINT64 length = dup_extent.ByteCount.QuadPart;
+		if (length == 0)
+		{
+			return;
+		}
+		if (cost_model.PreferCopy(length))
+		{
+			copy(dup_extent.SourceFileOffset.QuadPart, dup_extent.TargetFileOffset.QuadPart, length);
+		}
+		else if (io_scheduler->Run(IoKind::Clone, length, [&]
+		{
+			const LONGLONG started = CloneCostModel::Now();
+			const BOOL cloned = DeviceIoControl(dst_file.get(), FSCTL_DUPLICATE_EXTENTS_TO_FILE, &dup_extent, sizeof dup_extent, nullptr, 0, &_, nullptr);
+			if (cloned)
+			{
+				cost_model.RecordClone(started);
+			}
+			return cloned;
+		}))
+		{
+			clone_metrics.cloned_runs++;
+			clone_metrics.cloned_bytes += length;
+		}
+		else
+		{
+			// Source clusters reached reference count limit. They are still readable, so copy instead of failing whole conversion.
+			THROW_LAST_ERROR_IF(GetLastError() != ERROR_BLOCK_TOO_MANY_REFERENCES);
+			copy(dup_extent.SourceFileOffset.QuadPart, dup_extent.TargetFileOffset.QuadPart, length);
+			clone_metrics.fallback_runs++;
+		}
+		done_bytes += length;
+		dup_extent.ByteCount.QuadPart = 0;
+		complete(next_run);
+	};
+	const UINT32 cluster_size = src_integrity.ClusterSizeInBytes;
+	for (size_t i = first_run; i < runs.size(); i++)
+	{
+		const auto& run = runs[i];
+		if (run.reference_limited && !run.dedup_file)
+		{
+			// Clusters at reference count limit refuse cloning. Copy them.
+			flush(i);
+			copy(run.source_offset, run.target_offset, run.length);
+			clone_metrics.reference_limited_runs++;
+			done_bytes += run.length;
+			complete(i + 1);
+			continue;
+		}
+		// Cloning requires cluster alignment, which edges of partition and partially present clusters may not have.
+		// Only unaligned head and tail are copied. If source and target are misaligned to each other, no cluster can be cloned.
+		UINT32 head = run.length;
+		UINT32 tail = 0;
+		if ((run.source_offset - run.target_offset) % cluster_size == 0)
+		{
+			head = static_cast<UINT32>(std::min<UINT64>((cluster_size - run.source_offset % cluster_size) % cluster_size, run.length));
+			tail = (run.length - head) % cluster_size;
+		}
+		const UINT64 source_offset = run.source_offset + head;
+		const UINT64 target_offset = run.target_offset + head;
+		const UINT32 length = run.length - head - tail;
+		if (head != 0)
+		{
+			copy(run.source_offset, run.target_offset, head);
+		}
+		if (tail != 0)
+		{
+			copy(source_offset + length, target_offset + length, tail);
+		}
+		done_bytes += head + tail;
+		if (length == 0)
+		{
+			// Pending clone ends before this run, so flushing it completes this run too.
+			if (dup_extent.ByteCount.QuadPart != 0)
+			{
+				flush(i + 1);
+			}
+			else
+			{
+				complete(i + 1);
+			}
+			continue;
+		}
+		if (run.dedup_file && head + tail == 0)
+		{
+			flush(i);
+			DUPLICATE_EXTENTS_DATA dedup_extent = {
+				.FileHandle = run.dedup_file,
+				.SourceFileOffset = {.QuadPart = static_cast<LONGLONG>(run.dedup_offset) },
+				.TargetFileOffset = {.QuadPart = static_cast<LONGLONG>(run.target_offset) },
+				.ByteCount = {.QuadPart = run.length },
+			};
+			if (io_scheduler->Run(IoKind::Clone, run.length, [&] { return DeviceIoControl(dst_file.get(), FSCTL_DUPLICATE_EXTENTS_TO_FILE, &dedup_extent, sizeof dedup_extent, nullptr, 0, &_, nullptr); }))
+			{
+				clone_metrics.cloned_runs++;
+				clone_metrics.cloned_bytes += run.length;
+				deduplicated_size += run.length;
+				done_bytes += run.length;
+				complete(i + 1);
+				continue;
+			}
+			// Canonical chunk reached reference count limit or is on other volume. Clone from own source.
+			THROW_LAST_ERROR_IF(GetLastError() != ERROR_BLOCK_TOO_MANY_REFERENCES && GetLastError() != ERROR_NOT_SAME_DEVICE);
+		}
+		else if (dup_extent.ByteCount.QuadPart != 0
+			&& dup_extent.SourceFileOffset.QuadPart + dup_extent.ByteCount.QuadPart == static_cast<LONGLONG>(source_offset)
+			&& dup_extent.TargetFileOffset.QuadPart + dup_extent.ByteCount.QuadPart == static_cast<LONGLONG>(target_offset)
+			&& dup_extent.ByteCount.QuadPart + length <= maximum_clone_size)
+		{
+			dup_extent.ByteCount.QuadPart += length;
+			continue;
+		}
+		flush(i);
+		dup_extent.SourceFileOffset.QuadPart = source_offset;
+		dup_extent.TargetFileOffset.QuadPart = target_offset;
+		dup_extent.ByteCount.QuadPart = length;
+	}
+	flush(runs.size());
+	if (options.dedup_index)
+	{
+		options.dedup_index->AddDeduplicatedBytes(deduplicated_size);
+	}
+}
+static void PrintImage(const Image& image)
+{
+	char buf[0x20];
 	printf(
 		"Image format:      %hs\n"
 		"Allocation policy: %hs\n"
 		"Disk size:         %llu (%s)\n"
 		"Block size:        %u MB\n",
-		dst_img->GetImageTypeName(),
-		dst_img->IsFixed() ? "Fixed" : "Dynamic",
-		dst_img->GetDiskSize(),
-		StrFormatByteSize64A(dst_img->GetDiskSize(), buf, std::size(buf)),
-		dst_img->GetBlockSize() / 1024 / 1024
+		image.GetImageTypeName(),
+		image.IsFixed() ? "Fixed" : "Dynamic",
+		image.GetDiskSize(),
+		StrFormatByteSize64A(image.GetDiskSize(), buf, std::size(buf)),
+		image.GetBlockSize() / 1024 / 1024
 	);
-
-	const UINT64 source_block_size = src_img->GetBlockSize();
-	const UINT64 destination_block_size = dst_img->GetBlockSize();
-	const UINT64 gcd_block_size = std::min(source_block_size, destination_block_size);
-	DUPLICATE_EXTENTS_DATA dup_extent = { .FileHandle = src_file.get() };
-	for (UINT32 source_block_index = 0; source_block_index < src_img->GetTableEntriesCount(); source_block_index++)
+}
+static void PrintPlan(const Conversion& conversion, const Option& options)
+{
+	if (conversion.IsCacheHit())
 	{
-		const auto source_block_address = src_img->ProbeBlock(source_block_index);
-		if (!source_block_address)
+		printf("Cache entry:       %ls\n", conversion.GetCacheEntryFileName().c_str());
+		PrintImage(conversion.GetDestination());
+		return;
+	}
+	char buf[0x20];
+	if (options.partition)
+	{
+		printf("Partition:         %u (Offset %llu, %s)\n", options.partition, conversion.GetPartition().offset, StrFormatByteSize64A(conversion.GetPartition().length, buf, std::size(buf)));
+		if (!options.stream_format && conversion.GetPartition().offset % conversion.GetClusterSize() != 0)
 		{
-			continue;
+			printf("\x1B[93mPartition doesn't start at cluster boundary. All data is copied instead of cloned.\x1B[0m\n");
 		}
-		const UINT64 source_virtual_address = source_block_size * source_block_index;
-		for (UINT32 i = 0; i < source_block_size / gcd_block_size; i++)
+	}
+	if (options.punch_zero)
+	{
+		printf("Zero clusters:     %s\n", StrFormatByteSize64A(conversion.GetZeroSize(), buf, std::size(buf)));
+	}
+	if (const auto& estimates = conversion.GetBlockSizeEstimates(); !estimates.empty())
+	{
+		printf(
+			"\n"
+			"Block size   Output size   Allocated blocks   Clone calls\n"
+		);
+		for (const auto& estimate : estimates)
 		{
-			const UINT64 source_block_offset = destination_block_size * i;
-			if (source_virtual_address + source_block_offset >= src_img->GetDiskSize())
+			printf(
+				"%c%8u KB  %12hs  %16llu  %12llu\n",
+				estimate.block_size == conversion.GetDestination().GetBlockSize() ? '*' : ' ',
+				estimate.block_size / 1024,
+				StrFormatByteSize64A(estimate.file_size, buf, std::size(buf)),
+				estimate.allocated_blocks,
+				estimate.clone_calls
+			);
+		}
+	}
+	PrintImage(conversion.GetDestination());
+	const auto& metrics = conversion.GetLayoutMetrics();
+	printf(
+		"Layout policy:     %hs\n"
+		"Allocated blocks:  %llu\n"
+		"Fragments:         %llu\n"
+		"Clone runs:        %llu\n",
+		conversion.GetLayoutPolicy() == LayoutPolicy::Source ? "Source order" : conversion.GetLayoutPolicy() == LayoutPolicy::Hot ? "Hot first" : "Virtual order",
+		metrics.allocated_blocks,
+		metrics.fragments,
+		metrics.clone_runs
+	);
+}
+void ConvertImage(PCWSTR src_file_name, PCWSTR dst_file_name, const Option& options)
+{
+	ConvertImage(src_file_name, std::vector<PCWSTR>{ dst_file_name }, options);
+}
+void ConvertImage(PCWSTR src_file_name, const std::vector<PCWSTR>& dst_file_names, const Option& options)
+{
+	printf(
+		"Source\n"
+		"Path:              %ls\n",
+		src_file_name
+	);
+	// Source header, allocation table and zero clusters are read once, and every destination is planned from them.
+	std::vector<std::unique_ptr<Conversion>> conversions;
+	for (const auto dst_file_name : dst_file_names)
+	{
+		auto conversion = std::make_unique<Conversion>();
+		if (conversions.empty())
+		{
+			conversion->Open(src_file_name);
+			PrintImage(conversion->GetSource());
+		}
+		else
+		{
+			conversion->Open(*conversions.front());
+		}
+
+		printf(
+			"\n"
+			"Destination\n"
+			"Path:              %ls\n",
+			dst_file_name
+		);
+		conversion->Plan(dst_file_name, options);
+		PrintPlan(*conversion, options);
+		conversions.push_back(std::move(conversion));
+	}
+	char buf[0x20];
+	for (size_t i = 0; i < conversions.size(); i++)
+	{
+		conversions[i]->Execute();
+		if (!conversions[i]->IsCacheHit())
+		{
+			const auto& metrics = conversions[i]->GetCloneMetrics();
+			printf("Cloned:            %llu calls (%s)\n", metrics.cloned_runs, StrFormatByteSize64A(metrics.cloned_bytes, buf, std::size(buf)));
+			if (metrics.copied_runs)
 			{
-				break;
+				printf("Copied:            %llu runs (%s), %llu at reference count limit, %llu after clone was refused\n", metrics.copied_runs, StrFormatByteSize64A(metrics.copied_bytes, buf, std::size(buf)), metrics.reference_limited_runs, metrics.fallback_runs);
 			}
-			dup_extent.SourceFileOffset.QuadPart = *source_block_address + source_block_offset;
-			const UINT32 destination_block_index = static_cast<UINT32>((source_virtual_address + source_block_offset) / destination_block_size);
-			const UINT32 destination_block_offset = static_cast<UINT32>(source_virtual_address % destination_block_size);
-			dup_extent.TargetFileOffset.QuadPart = dst_img->AllocateBlock(destination_block_index) + destination_block_offset;
-			dup_extent.ByteCount.QuadPart = gcd_block_size;
-			THROW_IF_WIN32_BOOL_FALSE(DeviceIoControl(dst_file.get(), FSCTL_DUPLICATE_EXTENTS_TO_FILE, &dup_extent, sizeof dup_extent, nullptr, 0, &_, nullptr));
+		}
+		if (options.dedup_index)
+		{
+			printf("Deduplicated:      %s\n", StrFormatByteSize64A(conversions[i]->GetDeduplicatedSize(), buf, std::size(buf)));
+		}
+		if (conversions.size() > 1)
+		{
+			printf("\nCompleted:         %ls (%s)\n", dst_file_names[i], StrFormatByteSize64A(conversions[i]->GetDoneBytes(), buf, std::size(buf)));
 		}
 	}
-
-	dst_img->WriteHeader();
-	FILE_SET_SPARSE_BUFFER set_sparse = { options.sparse.value_or(WI_IsFlagSet(file_info.dwFileAttributes, FILE_ATTRIBUTE_SPARSE_FILE)) };
-	THROW_IF_WIN32_BOOL_FALSE(DeviceIoControl(dst_file.get(), FSCTL_SET_SPARSE, &set_sparse, sizeof set_sparse, nullptr, 0, &_, nullptr));
-#if !_DEBUG && NTDDI_VERSION < NTDDI_WIN10_RS3
-	dispos = { FALSE };
-	THROW_IF_WIN32_BOOL_FALSE(SetFileInformationByHandle(dst_file.get(), FileDispositionInfo, &dispos, sizeof dispos));
-#else
-	FILE_DISPOSITION_INFO_EX fdie = { FILE_DISPOSITION_FLAG_DO_NOT_DELETE | FILE_DISPOSITION_FLAG_ON_CLOSE };
-	THROW_IF_WIN32_BOOL_FALSE(SetFileInformationByHandle(dst_file.get(), FileDispositionInfoEx, &fdie, sizeof fdie));
-#endif
 }
\ No newline at end of file
@@ -1,11 +1,177 @@
 #pragma once
 #include <windows.h>
+#include <wil/resource.h>
+#include <atomic>
+#include <functional>
+#include <memory>
 #include <optional>
+#include <stdexcept>
+#include <string>
+#include "Cache.h"
+#include "Dedup.h"
+#include "Journal.h"
+#include "Kernel.h"
+#include "Partition.h"
+#include "Planner.h"
+#include "Stream.h"
 
 struct Option
 {
+	UINT64 disk_size = 0;
 	UINT32 block_size = 0;
+	UINT32 alignment = 0;
+	bool auto_block_size = false;
+	UINT32 auto_block_weight = 256 * 1024;
+	LayoutPolicy layout = LayoutPolicy::Virtual;
+	PCWSTR access_profile = nullptr;
+	bool punch_zero = false;
+	bool compact = false;
+	bool journal = false;
+	bool resume = false;
+	// Extract only this partition of source, from 1. 0 is whole disk.
+	UINT32 partition = 0;
+	// Extents smaller than this are copied when measured clone call costs more. 0 always clones.
+	UINT32 copy_limit = 0;
+	IoBudget io_budget;
+	// Directory of previous outputs on source volume. Identical conversion clones whole output from it.
+	PCWSTR cache_directory = nullptr;
+	// Image of this format (vhd, vhdx, vmdk, vdi or raw) is laid out over source and streamed to output, instead of written to destination.
+	PCWSTR stream_format = nullptr;
+	PCWSTR stream_output = nullptr;
+	DedupIndex* dedup_index = nullptr;
 	std::optional<bool> fixed;
 	std::optional<bool> sparse;
 };
-void ConvertImage(PCWSTR src_file_name, PCWSTR dst_file_name, const Option& options);
\ No newline at end of file
+// Mix of clone calls and copies chosen during execution.
+struct CloneMetrics
+{
+	UINT64 cloned_runs;
+	UINT64 cloned_bytes;
+	UINT64 copied_runs;
+	UINT64 copied_bytes;
+	// Copied because cloning was refused, such as by reference count limit of source clusters.
+	UINT64 fallback_runs;
+	// Copied without trying to clone, as source clusters were at reference count limit when planned.
+	UINT64 reference_limited_runs;
+};
+struct ConversionCancelled : std::runtime_error
+{
+	ConversionCancelled() : std::runtime_error("Conversion was cancelled.")
+	{
+	}
+};
+struct Conversion
+{
+private:
+	std::wstring src_file_name;
+	std::wstring dst_file_name;
+	// Source is shared by conversions to multiple destinations.
+	std::shared_ptr<void> src_file;
+	wil::unique_hfile dst_file;
+	std::shared_ptr<Image> src_img;
+	std::unique_ptr<Image> dst_img;
+	std::unique_ptr<StreamLayout> stream_layout;
+	const ConversionKernel* kernel = nullptr;
+	BY_HANDLE_FILE_INFORMATION src_file_info;
+	FSCTL_GET_INTEGRITY_INFORMATION_BUFFER src_integrity;
+	// Only streaming reads source on filesystem without Block Cloning.
+	bool src_block_cloning;
+	Option options;
+	ConversionJournal journal;
+	std::unique_ptr<IoScheduler> io_scheduler;
+	ConversionCache cache;
+	wil::unique_hfile cached_file;
+	// Extents after partition extraction and zero punching, collected once per source.
+	std::shared_ptr<const std::vector<Extent>> source_extents;
+	UINT64 source_disk_size;
+	// Size of partial destination when it was reopened to be resumed.
+	UINT64 resume_file_size = 0;
+	std::vector<BlockSizeEstimate> block_size_estimates;
+	std::vector<CloneRun> runs;
+	LayoutPolicy layout;
+	PartitionRange partition = {};
+	LayoutMetrics layout_metrics;
+	UINT64 zero_size;
+	UINT64 deduplicated_size = 0;
+	CloneMetrics clone_metrics = {};
+	std::atomic<UINT64> progress_done_bytes = 0;
+	std::atomic<UINT64> progress_total_bytes = 0;
+	std::atomic<bool> cancelled = false;
+	void CloneRuns(const std::function<void(UINT64 done_bytes, UINT64 total_bytes)>& progress);
+public:
+	void Open(PCWSTR source_file_name);
+	// Shares opened source and collected extents of planned sibling, instead of reading them again.
+	// Plan() must use same partition and punch options as sibling.
+	void Open(const Conversion& planned_sibling);
+	void Plan(PCWSTR destination_file_name, const Option& conversion_options);
+	void Execute(const std::function<void(UINT64 done_bytes, UINT64 total_bytes)>& progress = nullptr);
+	// Thread safe. Execute() throws ConversionCancelled, and destination is deleted.
+	void Cancel()
+	{
+		cancelled = true;
+	}
+	UINT64 GetDoneBytes() const
+	{
+		return progress_done_bytes;
+	}
+	UINT64 GetTotalBytes() const
+	{
+		return progress_total_bytes;
+	}
+	const Image& GetSource() const
+	{
+		return *src_img;
+	}
+	const Image& GetDestination() const
+	{
+		return *dst_img;
+	}
+	const std::vector<BlockSizeEstimate>& GetBlockSizeEstimates() const
+	{
+		return block_size_estimates;
+	}
+	LayoutPolicy GetLayoutPolicy() const
+	{
+		return layout;
+	}
+	const LayoutMetrics& GetLayoutMetrics() const
+	{
+		return layout_metrics;
+	}
+	// Destination is cloned whole from cache entry. Plan details are not available.
+	bool IsCacheHit() const
+	{
+		return static_cast<bool>(cached_file);
+	}
+	const std::wstring& GetCacheEntryFileName() const
+	{
+		return cache.GetEntryFileName();
+	}
+	const PartitionRange& GetPartition() const
+	{
+		return partition;
+	}
+	// Of source volume. Data is cloned in units of it.
+	UINT32 GetClusterSize() const
+	{
+		return src_integrity.ClusterSizeInBytes;
+	}
+	UINT64 GetZeroSize() const
+	{
+		return zero_size;
+	}
+	UINT64 GetDeduplicatedSize() const
+	{
+		return deduplicated_size;
+	}
+	const CloneMetrics& GetCloneMetrics() const
+	{
+		return clone_metrics;
+	}
+};
+std::unique_ptr<Image> DetectImageFormatByData(HANDLE file);
+std::unique_ptr<Image> DetectImageFormatByExtension(PCWSTR file_name);
+// Empty image of format named by GetImageTypeName().
+std::unique_ptr<Image> CreateImageOfType(PCSTR image_type_name);
+void ConvertImage(PCWSTR src_file_name, PCWSTR dst_file_name, const Option& options);
+void ConvertImage(PCWSTR src_file_name, const std::vector<PCWSTR>& dst_file_names, const Option& options);
\ No newline at end of file
@@ -0,0 +1,507 @@
+#define NOMINMAX
+#include <windows.h>
+#include <wil/resource.h>
+#include <wil/result.h>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "ConvertImage.h"
+#include "Daemon.h"
+
+namespace
+{
+	struct DaemonJob
+	{
+		UINT64 sequence;
+		INT32 priority;
+		// Volume GUID path of source. Destinations are on same volume, as block cloning requires.
+		std::wstring volume;
+		wil::unique_hfile pipe;
+		std::wstring source;
+		std::wstring access_profile;
+		std::wstring cache_directory;
+		std::vector<std::wstring> destinations;
+		// Paths point into strings above, so job is not moved after parsing.
+		Option options;
+	};
+	struct DaemonVolume
+	{
+		// Queried once per volume while daemon runs.
+		bool supports_block_cloning;
+		UINT32 running_jobs = 0;
+	};
+	struct DaemonQueue
+	{
+		std::mutex lock;
+		std::condition_variable changed;
+		std::vector<std::unique_ptr<DaemonJob>> queued;
+		std::unordered_map<std::wstring, DaemonVolume> volumes;
+		UINT32 volume_jobs;
+		UINT64 next_sequence = 0;
+		// Highest priority job whose volume has a free slot, first submitted first. Caller holds lock.
+		std::unique_ptr<DaemonJob> TakeRunnable()
+		{
+			auto selected = queued.end();
+			for (auto i = queued.begin(); i != queued.end(); ++i)
+			{
+				if (volumes.at((*i)->volume).running_jobs >= volume_jobs)
+				{
+					continue;
+				}
+				if (selected == queued.end() || (*i)->priority > (*selected)->priority || ((*i)->priority == (*selected)->priority && (*i)->sequence < (*selected)->sequence))
+				{
+					selected = i;
+				}
+			}
+			if (selected == queued.end())
+			{
+				return nullptr;
+			}
+			auto job = std::move(*selected);
+			queued.erase(selected);
+			volumes.at(job->volume).running_jobs++;
+			return job;
+		}
+	};
+	// Fails if client has disconnected.
+	bool SendStatus(HANDLE pipe, const DAEMON_JOB_STATUS& status) noexcept
+	{
+		DWORD written;
+		return WriteFile(pipe, &status, sizeof status, &written, nullptr) && written == sizeof status;
+	}
+	void SendFailure(HANDLE pipe, PCSTR message) noexcept
+	{
+		DAEMON_JOB_STATUS status = { .State = DaemonJobState::Failed };
+		strncpy_s(status.Message, message, _TRUNCATE);
+		SendStatus(pipe, status);
+	}
+	void SendFailure(HANDLE pipe, const std::exception& e) noexcept
+	{
+		if (const auto result = dynamic_cast<const wil::ResultException*>(&e))
+		{
+			DAEMON_JOB_STATUS status = { .State = DaemonJobState::Failed };
+			if (FormatMessageA(FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS, nullptr, result->GetErrorCode(), 0, status.Message, static_cast<DWORD>(std::size(status.Message)), nullptr))
+			{
+				SendStatus(pipe, status);
+				return;
+			}
+		}
+		SendFailure(pipe, e.what());
+	}
+	std::wstring GetVolumeName(PCWSTR file_name)
+	{
+		WCHAR volume_path[MAX_PATH];
+		THROW_IF_WIN32_BOOL_FALSE(GetVolumePathNameW(file_name, volume_path, static_cast<DWORD>(std::size(volume_path))));
+		WCHAR volume_name[MAX_PATH];
+		THROW_IF_WIN32_BOOL_FALSE(GetVolumeNameForVolumeMountPointW(volume_path, volume_name, static_cast<DWORD>(std::size(volume_name))));
+		return volume_name;
+	}
+	std::unique_ptr<DaemonJob> ParseJobRequest(const std::vector<BYTE>& message)
+	{
+		DAEMON_JOB_REQUEST request;
+		if (message.size() < sizeof request)
+		{
+			throw std::invalid_argument("Job request is too short.");
+		}
+		memcpy(&request, message.data(), sizeof request);
+		if (request.Version != DAEMON_PROTOCOL_VERSION)
+		{
+			throw std::invalid_argument("Unsupported job request version.");
+		}
+		const size_t paths_size = message.size() - sizeof request;
+		if (paths_size % sizeof(WCHAR) != 0)
+		{
+			throw std::invalid_argument("Job request is malformed.");
+		}
+		std::vector<std::wstring> paths;
+		std::wstring path;
+		for (size_t i = sizeof request; i < message.size(); i += sizeof(WCHAR))
+		{
+			WCHAR c;
+			memcpy(&c, message.data() + i, sizeof c);
+			if (c == L'\0')
+			{
+				paths.push_back(std::move(path));
+				path.clear();
+			}
+			else
+			{
+				path.push_back(c);
+			}
+		}
+		if (!path.empty() || request.DestinationsCount == 0 || paths.size() != 3ULL + request.DestinationsCount || request.Layout > static_cast<UINT32>(LayoutPolicy::Hot))
+		{
+			throw std::invalid_argument("Job request is malformed.");
+		}
+		auto job = std::make_unique<DaemonJob>();
+		job->priority = request.Priority;
+		job->source = std::move(paths[0]);
+		job->access_profile = std::move(paths[1]);
+		job->cache_directory = std::move(paths[2]);
+		job->destinations.assign(std::make_move_iterator(paths.begin() + 3), std::make_move_iterator(paths.end()));
+		for (const auto& p : job->destinations)
+		{
+			if (p.empty() || !std::filesystem::path(p).is_absolute())
+			{
+				throw std::invalid_argument("Job paths must be absolute.");
+			}
+		}
+		if (job->source.empty() || !std::filesystem::path(job->source).is_absolute())
+		{
+			throw std::invalid_argument("Job paths must be absolute.");
+		}
+		auto& options = job->options;
+		options.disk_size = request.DiskSize;
+		options.block_size = request.BlockSize;
+		options.alignment = request.Alignment;
+		options.auto_block_size = request.AutoBlockWeight != 0;
+		if (options.auto_block_size)
+		{
+			options.auto_block_weight = request.AutoBlockWeight;
+		}
+		options.layout = static_cast<LayoutPolicy>(request.Layout);
+		options.access_profile = job->access_profile.empty() ? nullptr : job->access_profile.c_str();
+		options.punch_zero = WI_IsFlagSet(request.Flags, DAEMON_JOB_FLAG_PUNCH_ZERO);
+		options.compact = WI_IsFlagSet(request.Flags, DAEMON_JOB_FLAG_COMPACT);
+		options.journal = WI_IsFlagSet(request.Flags, DAEMON_JOB_FLAG_JOURNAL);
+		options.resume = WI_IsFlagSet(request.Flags, DAEMON_JOB_FLAG_RESUME);
+		options.partition = request.Partition;
+		options.copy_limit = request.CopyLimit;
+		options.io_budget.bytes_per_second = request.BytesPerSecond;
+		options.io_budget.clone_calls_per_second = request.CloneCallsPerSecond;
+		options.io_budget.metadata_operations_per_second = request.MetadataOperationsPerSecond;
+		options.io_budget.target_latency_milliseconds = request.TargetLatencyMilliseconds;
+		options.io_budget.low_priority = WI_IsFlagSet(request.Flags, DAEMON_JOB_FLAG_LOW_PRIORITY);
+		options.cache_directory = job->cache_directory.empty() ? nullptr : job->cache_directory.c_str();
+		if (WI_IsFlagSet(request.Flags, DAEMON_JOB_FLAG_FIXED))
+		{
+			options.fixed = true;
+		}
+		else if (WI_IsFlagSet(request.Flags, DAEMON_JOB_FLAG_DYNAMIC))
+		{
+			options.fixed = false;
+		}
+		if (WI_IsFlagSet(request.Flags, DAEMON_JOB_FLAG_SPARSE))
+		{
+			options.sparse = true;
+		}
+		else if (WI_IsFlagSet(request.Flags, DAEMON_JOB_FLAG_NOSPARSE))
+		{
+			options.sparse = false;
+		}
+		return job;
+	}
+	void RunJob(DaemonJob& job)
+	{
+		const ULONGLONG started = GetTickCount64();
+		if (!SendStatus(job.pipe.get(), { .State = DaemonJobState::Started }))
+		{
+			// Client gave up while queued.
+			return;
+		}
+		try
+		{
+			std::vector<std::unique_ptr<Conversion>> conversions;
+			for (const auto& destination : job.destinations)
+			{
+				auto conversion = std::make_unique<Conversion>();
+				if (conversions.empty())
+				{
+					conversion->Open(job.source.c_str());
+				}
+				else
+				{
+					conversion->Open(*conversions.front());
+				}
+				conversion->Plan(destination.c_str(), job.options);
+				conversions.push_back(std::move(conversion));
+			}
+			for (UINT32 i = 0; i < conversions.size(); i++)
+			{
+				auto& conversion = *conversions[i];
+				const ULONGLONG destination_started = GetTickCount64();
+				ULONGLONG last_progress = 0;
+				conversion.Execute([&](UINT64 done_bytes, UINT64 total_bytes)
+				{
+					const ULONGLONG now = GetTickCount64();
+					if (now - last_progress < DAEMON_PROGRESS_INTERVAL)
+					{
+						return;
+					}
+					last_progress = now;
+					// Nobody waits for result of disconnected client.
+					if (!SendStatus(job.pipe.get(), { .State = DaemonJobState::Progress, .Index = i, .DoneBytes = done_bytes, .TotalBytes = total_bytes }))
+					{
+						conversion.Cancel();
+					}
+				});
+				SendStatus(job.pipe.get(), {
+					.State = DaemonJobState::DestinationCompleted,
+					.Index = i,
+					.DoneBytes = conversion.GetDoneBytes(),
+					.TotalBytes = conversion.GetTotalBytes(),
+					.CloneRuns = conversion.GetCloneMetrics().cloned_runs,
+					.CopiedBytes = conversion.GetCloneMetrics().copied_bytes,
+					.ElapsedMilliseconds = GetTickCount64() - destination_started,
+				});
+			}
+			SendStatus(job.pipe.get(), { .State = DaemonJobState::Completed, .ElapsedMilliseconds = GetTickCount64() - started });
+		}
+		catch (const std::exception& e)
+		{
+			SendFailure(job.pipe.get(), e);
+		}
+	}
+	void RunWorker(DaemonQueue& queue)
+	{
+		for (;;)
+		{
+			std::unique_ptr<DaemonJob> job;
+			{
+				std::unique_lock lock(queue.lock);
+				queue.changed.wait(lock, [&] { return (job = queue.TakeRunnable()) != nullptr; });
+			}
+			RunJob(*job);
+			{
+				std::lock_guard lock(queue.lock);
+				queue.volumes.at(job->volume).running_jobs--;
+			}
+			// Any worker may be waiting for this volume.
+			queue.changed.notify_all();
+		}
+	}
+	void AcceptJob(DaemonQueue& queue, wil::unique_hfile&& pipe)
+	{
+		std::vector<BYTE> message(DAEMON_MESSAGE_SIZE);
+		DWORD read;
+		{
+			// Pipe is synchronous, so pending read of this thread is cancelled by timer.
+			wil::unique_handle thread;
+			THROW_IF_WIN32_BOOL_FALSE(DuplicateHandle(GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(), &thread, 0, FALSE, DUPLICATE_SAME_ACCESS));
+			wil::unique_threadpool_timer timer(CreateThreadpoolTimer([](PTP_CALLBACK_INSTANCE, PVOID context, PTP_TIMER)
+			{
+				CancelSynchronousIo(context);
+			}, thread.get(), nullptr));
+			THROW_LAST_ERROR_IF(!timer);
+			// Negative due time is relative, in 100 ns units.
+			const LONGLONG due = -static_cast<LONGLONG>(DAEMON_REQUEST_TIMEOUT * 10000);
+			FILETIME due_time = { .dwLowDateTime = static_cast<DWORD>(due), .dwHighDateTime = static_cast<DWORD>(due >> 32) };
+			SetThreadpoolTimer(timer.get(), &due_time, 0, 0);
+			const BOOL succeeded = ReadFile(pipe.get(), message.data(), static_cast<DWORD>(message.size()), &read, nullptr);
+			const DWORD error = GetLastError();
+			// Waits for callback, so it can't cancel later I/O of this thread.
+			timer.reset();
+			if (!succeeded)
+			{
+				if (error == ERROR_OPERATION_ABORTED)
+				{
+					throw std::runtime_error("Client didn't send request in time.");
+				}
+				THROW_WIN32(error);
+			}
+		}
+		message.resize(read);
+		auto job = ParseJobRequest(message);
+		job->volume = GetVolumeName(job->source.c_str());
+		{
+			std::lock_guard lock(queue.lock);
+			auto [volume, inserted] = queue.volumes.try_emplace(job->volume);
+			if (inserted)
+			{
+				DWORD fs_flags = 0;
+				volume->second.supports_block_cloning = GetVolumeInformationW(job->volume.c_str(), nullptr, 0, nullptr, nullptr, &fs_flags, nullptr, 0) && WI_IsFlagSet(fs_flags, FILE_SUPPORTS_BLOCK_REFCOUNTING);
+			}
+			if (!volume->second.supports_block_cloning)
+			{
+				throw std::runtime_error("Filesystem doesn't support Block Cloning feature.");
+			}
+			job->pipe = std::move(pipe);
+			job->sequence = queue.next_sequence++;
+			const UINT32 jobs_ahead = static_cast<UINT32>(std::count_if(queue.queued.begin(), queue.queued.end(), [&](const auto& j) { return j->priority >= job->priority; }));
+			SendStatus(job->pipe.get(), { .State = DaemonJobState::Queued, .Index = jobs_ahead });
+			queue.queued.push_back(std::move(job));
+		}
+		queue.changed.notify_all();
+	}
+}
+void RunDaemon(PCWSTR pipe_name, UINT32 volume_jobs)
+{
+	const std::wstring pipe_path = std::wstring(L"\\\\.\\pipe\\") + pipe_name;
+	// Workers are detached and never stop, so queue is never destroyed.
+	const auto queue = std::make_shared<DaemonQueue>();
+	queue->volume_jobs = volume_jobs;
+	bool first_instance = true;
+	wil::unique_hfile pipe;
+	const auto create_pipe = [&]
+	{
+		pipe.reset(CreateNamedPipeW(
+			pipe_path.c_str(),
+			PIPE_ACCESS_DUPLEX | (first_instance ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0),
+			PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+			PIPE_UNLIMITED_INSTANCES,
+			DAEMON_MESSAGE_SIZE,
+			DAEMON_MESSAGE_SIZE,
+			0,
+			nullptr));
+		THROW_LAST_ERROR_IF(!pipe);
+		first_instance = false;
+	};
+	// Fails here, before printing anything, if another daemon owns pipe.
+	create_pipe();
+	const UINT32 workers_count = std::max(1U, std::thread::hardware_concurrency());
+	for (UINT32 i = 0; i < workers_count; i++)
+	{
+		std::thread([queue] { RunWorker(*queue); }).detach();
+	}
+	printf(
+		"Listening:         %ls\n"
+		"Workers:           %u\n"
+		"Jobs per volume:   %u\n",
+		pipe_path.c_str(),
+		workers_count,
+		volume_jobs);
+	for (;;)
+	{
+		if (!ConnectNamedPipe(pipe.get(), nullptr))
+		{
+			THROW_LAST_ERROR_IF(GetLastError() != ERROR_PIPE_CONNECTED);
+		}
+		wil::unique_hfile client = std::move(pipe);
+		create_pipe();
+		// Request is read on its own thread, so client which doesn't send it doesn't hold up next connection.
+		std::thread([client = std::move(client), queue]() mutable
+		{
+			try
+			{
+				AcceptJob(*queue, std::move(client));
+			}
+			catch (const std::exception& e)
+			{
+				// Job was not queued, so client is still ours.
+				if (client)
+				{
+					SendFailure(client.get(), e);
+				}
+				fprintf(stderr, "\x1B[91m%s\x1B[0m\n", e.what());
+			}
+		}).detach();
+	}
+}
+void SubmitJob(PCWSTR pipe_name, INT32 priority, PCWSTR source, const std::vector<PCWSTR>& destinations, const Option& options)
+{
+	// Daemon has its own current directory.
+	std::vector<std::wstring> paths = {
+		std::filesystem::absolute(source).wstring(),
+		options.access_profile ? std::filesystem::absolute(options.access_profile).wstring() : std::wstring(),
+		options.cache_directory ? std::filesystem::absolute(options.cache_directory).wstring() : std::wstring(),
+	};
+	for (const auto destination : destinations)
+	{
+		paths.push_back(std::filesystem::absolute(destination).wstring());
+	}
+	DAEMON_JOB_REQUEST request = {
+		.Version = DAEMON_PROTOCOL_VERSION,
+		.Priority = priority,
+		.DiskSize = options.disk_size,
+		.BlockSize = options.block_size,
+		.Alignment = options.alignment,
+		.AutoBlockWeight = options.auto_block_size ? options.auto_block_weight : 0,
+		.Layout = static_cast<UINT32>(options.layout),
+		.Partition = options.partition,
+		.CopyLimit = options.copy_limit,
+		.BytesPerSecond = options.io_budget.bytes_per_second,
+		.CloneCallsPerSecond = options.io_budget.clone_calls_per_second,
+		.MetadataOperationsPerSecond = options.io_budget.metadata_operations_per_second,
+		.TargetLatencyMilliseconds = options.io_budget.target_latency_milliseconds,
+		.DestinationsCount = static_cast<UINT32>(destinations.size()),
+	};
+	WI_SetFlagIf(request.Flags, DAEMON_JOB_FLAG_PUNCH_ZERO, options.punch_zero);
+	WI_SetFlagIf(request.Flags, DAEMON_JOB_FLAG_COMPACT, options.compact);
+	WI_SetFlagIf(request.Flags, DAEMON_JOB_FLAG_JOURNAL, options.journal);
+	WI_SetFlagIf(request.Flags, DAEMON_JOB_FLAG_RESUME, options.resume);
+	WI_SetFlagIf(request.Flags, DAEMON_JOB_FLAG_FIXED, options.fixed == true);
+	WI_SetFlagIf(request.Flags, DAEMON_JOB_FLAG_DYNAMIC, options.fixed == false);
+	WI_SetFlagIf(request.Flags, DAEMON_JOB_FLAG_SPARSE, options.sparse == true);
+	WI_SetFlagIf(request.Flags, DAEMON_JOB_FLAG_NOSPARSE, options.sparse == false);
+	WI_SetFlagIf(request.Flags, DAEMON_JOB_FLAG_LOW_PRIORITY, options.io_budget.low_priority);
+	std::vector<BYTE> message(reinterpret_cast<const BYTE*>(&request), reinterpret_cast<const BYTE*>(&request + 1));
+	for (const auto& path : paths)
+	{
+		const auto p = reinterpret_cast<const BYTE*>(path.c_str());
+		message.insert(message.end(), p, p + (path.size() + 1) * sizeof(WCHAR));
+	}
+	if (message.size() > DAEMON_MESSAGE_SIZE)
+	{
+		throw std::invalid_argument("Job request is too long.");
+	}
+	const std::wstring pipe_path = std::wstring(L"\\\\.\\pipe\\") + pipe_name;
+	wil::unique_hfile pipe;
+	for (;;)
+	{
+		pipe.reset(CreateFileW(pipe_path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, 0, nullptr));
+		if (pipe)
+		{
+			break;
+		}
+		// Daemon is between accepting a client and creating next instance.
+		THROW_LAST_ERROR_IF(GetLastError() != ERROR_PIPE_BUSY);
+		THROW_IF_WIN32_BOOL_FALSE(WaitNamedPipeW(pipe_path.c_str(), NMPWAIT_WAIT_FOREVER));
+	}
+	DWORD mode = PIPE_READMODE_MESSAGE;
+	THROW_IF_WIN32_BOOL_FALSE(SetNamedPipeHandleState(pipe.get(), &mode, nullptr, nullptr));
+	DWORD written;
+	THROW_IF_WIN32_BOOL_FALSE(WriteFile(pipe.get(), message.data(), static_cast<DWORD>(message.size()), &written, nullptr));
+	for (;;)
+	{
+		DAEMON_JOB_STATUS status;
+		DWORD read;
+		if (!ReadFile(pipe.get(), &status, sizeof status, &read, nullptr))
+		{
+			if (GetLastError() == ERROR_BROKEN_PIPE)
+			{
+				throw std::runtime_error("Daemon closed connection.");
+			}
+			THROW_LAST_ERROR();
+		}
+		if (read != sizeof status || (status.State != DaemonJobState::Queued && status.Index >= destinations.size()))
+		{
+			throw std::runtime_error("Daemon sent malformed status.");
+		}
+		status.Message[std::size(status.Message) - 1] = '\0';
+		switch (status.State)
+		{
+		case DaemonJobState::Queued:
+			printf("Queued:            %u jobs ahead\n", status.Index);
+			break;
+		case DaemonJobState::Started:
+			printf("Started:           %ls\n", paths[0].c_str());
+			break;
+		case DaemonJobState::Progress:
+			printf("Progress:          %3llu%% %ls\r", status.TotalBytes ? status.DoneBytes * 100 / status.TotalBytes : 100, destinations[status.Index]);
+			break;
+		case DaemonJobState::DestinationCompleted:
+			printf(
+				"Completed:         %ls (%llu bytes, %llu clone calls, %llu bytes copied, %llu ms)\x1B[K\n",
+				destinations[status.Index],
+				status.DoneBytes,
+				status.CloneRuns,
+				status.CopiedBytes,
+				status.ElapsedMilliseconds);
+			break;
+		case DaemonJobState::Completed:
+			printf("Elapsed:           %llu ms\n", status.ElapsedMilliseconds);
+			return;
+		case DaemonJobState::Failed:
+			throw std::runtime_error(status.Message);
+		default:
+			throw std::runtime_error("Daemon sent malformed status.");
+		}
+	}
+}
\ No newline at end of file
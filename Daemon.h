@@ -0,0 +1,68 @@
+#pragma once
+#include <windows.h>
+#include <vector>
+#include "ConvertImage.h"
+
+constexpr WCHAR DAEMON_DEFAULT_PIPE_NAME[] = L"MakeVHDX";
+constexpr UINT32 DAEMON_PROTOCOL_VERSION = 2;
+constexpr DWORD DAEMON_MESSAGE_SIZE = 64 * 1024;
+constexpr ULONGLONG DAEMON_PROGRESS_INTERVAL = 500;
+// Client which connects but doesn't send request within this is disconnected.
+constexpr ULONGLONG DAEMON_REQUEST_TIMEOUT = 10 * 1000;
+constexpr UINT32 DAEMON_JOB_FLAG_PUNCH_ZERO = 1U << 0;
+constexpr UINT32 DAEMON_JOB_FLAG_COMPACT = 1U << 1;
+constexpr UINT32 DAEMON_JOB_FLAG_JOURNAL = 1U << 2;
+constexpr UINT32 DAEMON_JOB_FLAG_RESUME = 1U << 3;
+constexpr UINT32 DAEMON_JOB_FLAG_FIXED = 1U << 4;
+constexpr UINT32 DAEMON_JOB_FLAG_DYNAMIC = 1U << 5;
+constexpr UINT32 DAEMON_JOB_FLAG_SPARSE = 1U << 6;
+constexpr UINT32 DAEMON_JOB_FLAG_NOSPARSE = 1U << 7;
+constexpr UINT32 DAEMON_JOB_FLAG_LOW_PRIORITY = 1U << 8;
+// One pipe message. Followed by NUL terminated source, access profile, cache directory and each destination.
+// Empty access profile and cache directory are not specified. Paths are absolute.
+struct DAEMON_JOB_REQUEST
+{
+	UINT32 Version;
+	INT32  Priority;
+	UINT64 DiskSize;
+	UINT32 BlockSize;
+	UINT32 Alignment;
+	// Zero unless block size is selected automatically.
+	UINT32 AutoBlockWeight;
+	UINT32 Layout;
+	UINT32 Partition;
+	UINT32 CopyLimit;
+	UINT32 Flags;
+	UINT64 BytesPerSecond;
+	UINT32 CloneCallsPerSecond;
+	UINT32 MetadataOperationsPerSecond;
+	UINT32 TargetLatencyMilliseconds;
+	UINT32 DestinationsCount;
+};
+enum class DaemonJobState : UINT32
+{
+	Queued,
+	Started,
+	Progress,
+	DestinationCompleted,
+	Completed,
+	Failed,
+};
+// Pipe messages from daemon until job is completed or failed.
+struct DAEMON_JOB_STATUS
+{
+	DaemonJobState State;
+	// Jobs ahead while queued, otherwise index of destination.
+	UINT32 Index;
+	UINT64 DoneBytes;
+	UINT64 TotalBytes;
+	UINT64 CloneRuns;
+	UINT64 CopiedBytes;
+	UINT64 ElapsedMilliseconds;
+	char   Message[512];
+};
+// Runs submitted conversions with worker threads, until process is terminated.
+// Jobs run in priority order, at most volume_jobs at once on each volume.
+void RunDaemon(PCWSTR pipe_name, UINT32 volume_jobs);
+// Throws with daemon's message if job fails.
+void SubmitJob(PCWSTR pipe_name, INT32 priority, PCWSTR source, const std::vector<PCWSTR>& destinations, const Option& options);
\ No newline at end of file
@@ -0,0 +1,239 @@
+#define NOMINMAX
+#include <windows.h>
+#include <wil/result.h>
+#include <immintrin.h>
+#include <array>
+#include <cstring>
+#include <exception>
+#include <execution>
+#include <numeric>
+#include "Dedup.h"
+
+constexpr size_t HASH_LANES = 4;
+constexpr size_t HASH_STRIPE_SIZE = HASH_LANES * sizeof(UINT64);
+constexpr size_t HASH_STRIPES_PER_BLOCK = 16;
+constexpr UINT64 HASH_PRIME32 = 0x9E3779B1;
+constexpr UINT64 HASH_PRIME64_1 = 0x9E3779B185EBCA87;
+constexpr UINT64 HASH_PRIME64_2 = 0xC2B2AE3D27D4EB4F;
+constexpr UINT64 HASH_PRIME64_3 = 0x165667B19E3779F9;
+// Stripe n of block mixes lane l with key n + l, so reordered stripes hash differently. Last keys also scramble accumulators after each block.
+static constexpr auto hash_secret = []
+{
+	std::array<UINT64, HASH_STRIPES_PER_BLOCK + HASH_LANES - 1> secret = {};
+	UINT64 state = 0;
+	for (auto& key : secret)
+	{
+		UINT64 z = state += HASH_PRIME64_1;
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+		key = z ^ (z >> 31);
+	}
+	return secret;
+}();
+static const UINT64* const hash_scramble_key = hash_secret.data() + HASH_STRIPES_PER_BLOCK - 1;
+enum class HashLevel
+{
+	SSE2,
+	AVX2,
+};
+static HashLevel GetHashLevel()
+{
+	static const HashLevel level = IsProcessorFeaturePresent(PF_AVX2_INSTRUCTIONS_AVAILABLE) ? HashLevel::AVX2 : HashLevel::SSE2;
+	return level;
+}
+// XXH3 style accumulation. Each lane adds product of 32 bits halves of input mixed with key, and raw input of its neighbor lane.
+// Only 32 x 32 bits multiplies are used, so all lanes are processed by one vector instruction.
+static void AccumulateAVX2(UINT64* accumulators, const BYTE* buffer, size_t stripes)
+{
+	const __m256i prime = _mm256_set1_epi64x(HASH_PRIME32);
+	const __m256i scramble_key = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(hash_scramble_key));
+	__m256i acc = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(accumulators));
+	for (size_t i = 0; i < stripes; i++)
+	{
+		const size_t stripe_in_block = i % HASH_STRIPES_PER_BLOCK;
+		const __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(buffer + i * HASH_STRIPE_SIZE));
+		const __m256i data_key = _mm256_xor_si256(input, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(hash_secret.data() + stripe_in_block)));
+		const __m256i product = _mm256_mul_epu32(data_key, _mm256_srli_epi64(data_key, 32));
+		acc = _mm256_add_epi64(acc, _mm256_add_epi64(_mm256_shuffle_epi32(input, _MM_SHUFFLE(1, 0, 3, 2)), product));
+		if (stripe_in_block == HASH_STRIPES_PER_BLOCK - 1)
+		{
+			acc = _mm256_xor_si256(_mm256_xor_si256(acc, _mm256_srli_epi64(acc, 47)), scramble_key);
+			acc = _mm256_add_epi64(_mm256_mul_epu32(acc, prime), _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(acc, 32), prime), 32));
+		}
+	}
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(accumulators), acc);
+}
+static void AccumulateSSE2(UINT64* accumulators, const BYTE* buffer, size_t stripes)
+{
+	const __m128i prime = _mm_set1_epi64x(HASH_PRIME32);
+	for (size_t half = 0; half < HASH_LANES; half += 2)
+	{
+		const __m128i scramble_key = _mm_loadu_si128(reinterpret_cast<const __m128i*>(hash_scramble_key + half));
+		__m128i acc = _mm_loadu_si128(reinterpret_cast<const __m128i*>(accumulators + half));
+		for (size_t i = 0; i < stripes; i++)
+		{
+			const size_t stripe_in_block = i % HASH_STRIPES_PER_BLOCK;
+			const __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buffer + i * HASH_STRIPE_SIZE + half * sizeof(UINT64)));
+			const __m128i data_key = _mm_xor_si128(input, _mm_loadu_si128(reinterpret_cast<const __m128i*>(hash_secret.data() + stripe_in_block + half)));
+			const __m128i product = _mm_mul_epu32(data_key, _mm_srli_epi64(data_key, 32));
+			acc = _mm_add_epi64(acc, _mm_add_epi64(_mm_shuffle_epi32(input, _MM_SHUFFLE(1, 0, 3, 2)), product));
+			if (stripe_in_block == HASH_STRIPES_PER_BLOCK - 1)
+			{
+				acc = _mm_xor_si128(_mm_xor_si128(acc, _mm_srli_epi64(acc, 47)), scramble_key);
+				acc = _mm_add_epi64(_mm_mul_epu32(acc, prime), _mm_slli_epi64(_mm_mul_epu32(_mm_srli_epi64(acc, 32), prime), 32));
+			}
+		}
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(accumulators + half), acc);
+	}
+}
+UINT64 HashChunk(const BYTE* buffer, size_t size)
+{
+	alignas(32) UINT64 accumulators[HASH_LANES] = { HASH_PRIME32, HASH_PRIME64_1, HASH_PRIME64_2, HASH_PRIME64_3 };
+	const auto accumulate = [&](const BYTE* stripes_buffer, size_t stripes)
+	{
+		switch (GetHashLevel())
+		{
+		case HashLevel::AVX2:
+			AccumulateAVX2(accumulators, stripes_buffer, stripes);
+			break;
+		case HashLevel::SSE2:
+			AccumulateSSE2(accumulators, stripes_buffer, stripes);
+			break;
+		}
+	};
+	constexpr size_t block_size = HASH_STRIPES_PER_BLOCK * HASH_STRIPE_SIZE;
+	const size_t blocks_size = size / block_size * block_size;
+	accumulate(buffer, blocks_size / HASH_STRIPE_SIZE);
+	// Last partial block is zero padded to whole stripes. Size is mixed below, so padding doesn't hash same as zero data.
+	if (const size_t tail_size = size - blocks_size; tail_size != 0)
+	{
+		BYTE tail[block_size] = {};
+		memcpy(tail, buffer + blocks_size, tail_size);
+		accumulate(tail, (tail_size + HASH_STRIPE_SIZE - 1) / HASH_STRIPE_SIZE);
+	}
+	UINT64 hash = size * HASH_PRIME64_1;
+	for (size_t lane = 0; lane < HASH_LANES; lane += 2)
+	{
+		UINT64 high;
+		const UINT64 low = _umul128(accumulators[lane] ^ hash_secret[lane], accumulators[lane + 1] ^ hash_secret[lane + 1], &high);
+		hash += low ^ high;
+	}
+	hash ^= hash >> 37;
+	hash *= HASH_PRIME64_3;
+	hash ^= hash >> 32;
+	return hash;
+}
+HANDLE DedupIndex::AddFile(HANDLE file)
+{
+	HANDLE duplicated;
+	THROW_IF_WIN32_BOOL_FALSE(DuplicateHandle(GetCurrentProcess(), file, GetCurrentProcess(), &duplicated, 0, FALSE, DUPLICATE_SAME_ACCESS));
+	std::lock_guard lock(index_lock);
+	return index_files.emplace_back(duplicated).get();
+}
+void DedupIndex::Deduplicate(HANDLE file, UINT32 block_size, std::vector<CloneRun>& runs)
+{
+	// Split at chunk boundaries of guest address, so same data in same place of other images splits same way.
+	std::vector<CloneRun> chunks;
+	for (const auto& run : runs)
+	{
+		const UINT64 run_address = static_cast<UINT64>(run.block_index) * block_size + run.block_offset;
+		for (UINT32 run_offset = 0; run_offset < run.length;)
+		{
+			const UINT32 length = static_cast<UINT32>(std::min<UINT64>(run.length - run_offset, DEDUP_CHUNK_SIZE - (run_address + run_offset) % DEDUP_CHUNK_SIZE));
+			CloneRun chunk = run;
+			chunk.block_offset += run_offset;
+			chunk.length = length;
+			chunk.source_offset += run_offset;
+			chunks.push_back(chunk);
+			run_offset += length;
+		}
+	}
+	std::vector<UINT64> hashes(chunks.size());
+	std::vector<size_t> indexes(chunks.size());
+	std::iota(indexes.begin(), indexes.end(), size_t());
+	std::mutex error_lock;
+	std::exception_ptr error;
+	std::for_each(std::execution::par, indexes.begin(), indexes.end(), [&](size_t i)
+	{
+		try
+		{
+			const auto buffer = std::make_unique<BYTE[]>(chunks[i].length);
+			ReadFileWithOffset(file, buffer.get(), chunks[i].length, chunks[i].source_offset);
+			hashes[i] = HashChunk(buffer.get(), chunks[i].length);
+		}
+		catch (...)
+		{
+			std::lock_guard lock(error_lock);
+			error = std::current_exception();
+		}
+	});
+	if (error)
+	{
+		std::rethrow_exception(error);
+	}
+	const auto buffer = std::make_unique<BYTE[]>(DEDUP_CHUNK_SIZE);
+	const auto canonical_buffer = std::make_unique<BYTE[]>(DEDUP_CHUNK_SIZE);
+	std::vector<CanonicalChunk> candidates;
+	for (size_t i = 0; i < chunks.size(); i++)
+	{
+		auto& chunk = chunks[i];
+		{
+			std::lock_guard lock(index_lock);
+			candidates.clear();
+			for (auto [candidate, end] = index_chunks.equal_range(hashes[i]); candidate != end; ++candidate)
+			{
+				if (candidate->second.length == chunk.length && candidate->second.references < DEDUP_MAXIMUM_REFERENCES)
+				{
+					candidates.push_back(candidate->second);
+				}
+			}
+		}
+		// Data is read and compared without lock, so conversions sharing index aren't blocked by it.
+		bool found = false;
+		if (!candidates.empty())
+		{
+			ReadFileWithOffset(file, buffer.get(), chunk.length, chunk.source_offset);
+		}
+		for (const auto& canonical : candidates)
+		{
+			ReadFileWithOffset(canonical.file, canonical_buffer.get(), chunk.length, canonical.offset);
+			if (memcmp(buffer.get(), canonical_buffer.get(), chunk.length) != 0)
+			{
+				continue;
+			}
+			// Other conversions may have taken remaining references while comparing.
+			std::lock_guard lock(index_lock);
+			for (auto [current, end] = index_chunks.equal_range(hashes[i]); current != end; ++current)
+			{
+				if (current->second.file == canonical.file && current->second.offset == canonical.offset && current->second.references < DEDUP_MAXIMUM_REFERENCES)
+				{
+					current->second.references++;
+					found = true;
+					break;
+				}
+			}
+			if (found)
+			{
+				chunk.dedup_file = canonical.file;
+				chunk.dedup_offset = canonical.offset;
+				break;
+			}
+		}
+		if (!found)
+		{
+			std::lock_guard lock(index_lock);
+			index_chunks.emplace(hashes[i], CanonicalChunk{ file, chunk.source_offset, chunk.length, 1 });
+		}
+	}
+	runs = std::move(chunks);
+}
+void DedupIndex::AddDeduplicatedBytes(UINT64 bytes)
+{
+	std::lock_guard lock(index_lock);
+	deduplicated_bytes += bytes;
+}
+UINT64 DedupIndex::GetDeduplicatedBytes()
+{
+	std::lock_guard lock(index_lock);
+	return deduplicated_bytes;
+}
\ No newline at end of file
@@ -0,0 +1,31 @@
+#pragma once
+#include <wil/resource.h>
+#include <mutex>
+#include <unordered_map>
+#include "Planner.h"
+
+constexpr UINT32 DEDUP_CHUNK_SIZE = 1024 * 1024;
+// Below ReFS block reference count limit, so a canonical chunk is replaced before cloning fails.
+constexpr UINT32 DEDUP_MAXIMUM_REFERENCES = CLONE_REFERENCE_LIMIT;
+struct DedupIndex
+{
+private:
+	struct CanonicalChunk
+	{
+		HANDLE file;
+		UINT64 offset;
+		UINT32 length;
+		UINT32 references;
+	};
+	std::mutex index_lock;
+	std::vector<wil::unique_hfile> index_files;
+	std::unordered_multimap<UINT64, CanonicalChunk> index_chunks;
+	UINT64 deduplicated_bytes = 0;
+public:
+	HANDLE AddFile(HANDLE file);
+	void Deduplicate(HANDLE file, UINT32 block_size, std::vector<CloneRun>& runs);
+	void AddDeduplicatedBytes(UINT64 bytes);
+	UINT64 GetDeduplicatedBytes();
+};
+// Any size. Used for chunks, and for keys of journal and cache.
+UINT64 HashChunk(const BYTE* buffer, size_t size);
\ No newline at end of file
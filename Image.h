@@ -9,15 +9,68 @@
 #include <optional>
 #include <stdexcept>
 #include <type_traits>
+#include <utility>
+#include <vector>
 #include <crtdbg.h>
+#include "Scheduler.h"
 
 constexpr UINT32 MINIMUM_DISK_SIZE = 3 * 1024 * 1024;
+// Images only read, not cloned, are attached with this alignment, as their data needs none.
+constexpr UINT32 SECTOR_GRANULARITY = 512;
+struct SectorRun
+{
+	UINT32 offset;
+	UINT32 length;
+};
+// Receives writes of image built without file, such as one streamed out. Ranges it doesn't receive read as zero.
+struct ImageSink
+{
+	virtual ~ImageSink() = default;
+	virtual void Write(const void* data, ULONG size, UINT64 offset) = 0;
+	// Repeats received range at another offset, where image file would be block cloned within itself.
+	virtual void Duplicate(UINT64 source_offset, UINT64 target_offset, UINT64 length) = 0;
+	virtual void SetEnd(UINT64 file_size) = 0;
+	virtual UINT64 GetEnd() const = 0;
+	// Name image would have as file. Some formats record it.
+	virtual PCWSTR GetFileName() const = 0;
+};
+struct MetadataCommit;
 struct Image
 {
 protected:
 	HANDLE image_file;
+	ImageSink* image_sink = nullptr;
 	UINT32 require_alignment;
+	IoScheduler* io_scheduler = nullptr;
+	// Resumed destination already holds cloned data up to this size, so file end never moves below it.
+	UINT64 retained_file_size = 0;
 	Image() = default;
+	// Allocating blocks one by one extends file for each, so these are throttled as metadata operations.
+	void SetImageFileEnd(const FILE_END_OF_FILE_INFO& eof_info) const
+	{
+		if (std::cmp_less_equal(eof_info.EndOfFile.QuadPart, retained_file_size))
+		{
+			return;
+		}
+		if (image_sink)
+		{
+			image_sink->SetEnd(eof_info.EndOfFile.QuadPart);
+			return;
+		}
+		THROW_IF_WIN32_BOOL_FALSE(ScheduleIo(io_scheduler, IoKind::Metadata, 0, [&] { return SetFileInformationByHandle(image_file, FileEndOfFileInfo, const_cast<FILE_END_OF_FILE_INFO*>(&eof_info), sizeof eof_info); }));
+	}
+	// Write paths of images go through these, so image can be built on sink instead of file.
+	void WriteImage(const void* data, ULONG size, UINT64 offset) const;
+	template <typename Ty>
+	void WriteImage(const Ty& data, UINT64 offset) const
+	{
+		static_assert(!std::is_pointer_v<Ty>);
+		WriteImage(&data, sizeof(Ty), offset);
+	}
+	void WriteImage(MetadataCommit& commit) const;
+	void FlushImage() const;
+	UINT64 GetImageFileSize() const;
+	BOOL DuplicateImageRange(UINT64 source_offset, UINT64 target_offset, UINT64 length) const;
 public:
 	Image(const Image&) = delete;
 	Image& operator=(const Image&) = delete;
@@ -29,20 +82,80 @@ public:
 			throw std::invalid_argument("Require alignment is not power of 2.");
 		}
 		image_file = file;
+		image_sink = nullptr;
 		require_alignment = cluster_size;
 	}
+	// Constructs image on sink instead of file. Only ConstructHeader, allocation and WriteHeader are available.
+	void AttachSink(ImageSink* sink, ULONG cluster_size)
+	{
+		Attach(nullptr, cluster_size);
+		image_sink = sink;
+	}
+	void SetScheduler(IoScheduler* scheduler)
+	{
+		io_scheduler = scheduler;
+	}
+	// Call before ConstructHeader when rebuilding metadata over a file to be resumed. Header construction and allocation only extend it.
+	void RetainFileSize(UINT64 file_size)
+	{
+		retained_file_size = file_size;
+	}
 	virtual void ReadHeader() = 0;
 	virtual void ConstructHeader(UINT64 disk_size, UINT32 block_size, UINT32 sector_size, bool fixed) = 0;
 	virtual void WriteHeader() const = 0;
+	// Rejects images whose guest data can't be read, such as differencing ones.
+	virtual void CheckReadable() const = 0;
+	// Also rejects images whose data isn't aligned to be cloned.
 	virtual void CheckConvertible() const = 0;
+	// Takes disk identity, such as VHD UniqueId, of an image of same format. Image rebuilt in place keeps its differencing children linked.
+	virtual void CopyIdentity(const Image&)
+	{
+	}
+	// Gives image read by ReadHeader new disk identity, and writes it. Copy of another image must not share its disk IDs.
+	virtual void RenewIdentity()
+	{
+	}
 	virtual bool IsFixed() const = 0;
 	virtual PCSTR GetImageTypeName() const = 0;
 	virtual UINT64 GetDiskSize() const = 0;
 	virtual UINT32 GetSectorSize() const = 0;
 	virtual UINT32 GetBlockSize() const = 0;
 	virtual UINT32 GetTableEntriesCount() const = 0;
+	virtual UINT32 GetMinimumBlockSize() const
+	{
+		return 0;
+	}
+	virtual UINT32 GetMaximumBlockSize() const
+	{
+		return 0;
+	}
+	virtual UINT64 EstimateFileSize(UINT64 disk_size, UINT32 block_size, UINT64 allocated_blocks) const = 0;
+	virtual HANDLE GetDataFile() const
+	{
+		return image_file;
+	}
 	virtual std::optional<UINT64> ProbeBlock(UINT32 index) const = 0;
 	virtual UINT64 AllocateBlock(UINT32 index) = 0;
+	// Bit i is set when ProbeBlock(i) has a value.
+	virtual void ScanAllocatedBlocks(std::vector<UINT64>& allocated) const
+	{
+		allocated.assign((GetTableEntriesCount() + 63ULL) / 64, 0);
+		for (UINT32 i = 0; i < GetTableEntriesCount(); i++)
+		{
+			if (ProbeBlock(i))
+			{
+				allocated[i / 64] |= 1ULL << (i % 64);
+			}
+		}
+	}
+	virtual void ProbeSectorRuns(UINT32 index, std::vector<SectorRun>& runs) const
+	{
+		runs.assign(1, { 0, GetBlockSize() });
+	}
+	virtual UINT64 AllocateSectorRun(UINT32 index, SectorRun)
+	{
+		return AllocateBlock(index);
+	}
 	static std::unique_ptr<Image> DetectImageFormatByData(HANDLE file) = delete;
 };
 
@@ -88,4 +201,118 @@ void inline WriteFileWithOffset(HANDLE hFile, const Ty& lpBuffer, ULONGLONG Offs
 {
 	static_assert(!std::is_pointer_v<Ty>);
 	WriteFileWithOffset(hFile, &lpBuffer, sizeof(Ty), Offset);
+}
+
+constexpr UINT32 MAXIMUM_GATHER_WRITE_SIZE = 64 * 1024 * 1024;
+// Collects metadata regions, then writes each run of adjacent regions with one WriteFile.
+struct MetadataCommit
+{
+private:
+	struct Region
+	{
+		UINT64 offset;
+		const BYTE* data;
+		ULONG size;
+	};
+	std::vector<Region> regions;
+public:
+	void Add(const void* data, ULONG size, UINT64 offset)
+	{
+		regions.push_back({ offset, static_cast<const BYTE*>(data), size });
+	}
+	template <typename Ty>
+	void Add(const Ty& data, UINT64 offset)
+	{
+		static_assert(!std::is_pointer_v<Ty>);
+		Add(&data, sizeof(Ty), offset);
+	}
+	void Write(HANDLE file)
+	{
+		std::sort(regions.begin(), regions.end(), [](const Region& l, const Region& r) { return l.offset < r.offset; });
+		for (size_t begin = 0; begin < regions.size();)
+		{
+			size_t end = begin + 1;
+			UINT64 span_end = regions[begin].offset + regions[begin].size;
+			while (end < regions.size() && regions[end].offset == span_end && span_end + regions[end].size - regions[begin].offset <= MAXIMUM_GATHER_WRITE_SIZE)
+			{
+				span_end += regions[end].size;
+				end++;
+			}
+			if (end - begin == 1)
+			{
+				WriteFileWithOffset(file, regions[begin].data, regions[begin].size, regions[begin].offset);
+			}
+			else
+			{
+				const auto gather_buffer = std::make_unique<BYTE[]>(span_end - regions[begin].offset);
+				for (size_t i = begin; i < end; i++)
+				{
+					memcpy(gather_buffer.get() + (regions[i].offset - regions[begin].offset), regions[i].data, regions[i].size);
+				}
+				WriteFileWithOffset(file, gather_buffer.get(), static_cast<ULONG>(span_end - regions[begin].offset), regions[begin].offset);
+			}
+			begin = end;
+		}
+		regions.clear();
+	}
+	void Write(ImageSink& sink)
+	{
+		for (const auto& region : regions)
+		{
+			sink.Write(region.data, region.size, region.offset);
+		}
+		regions.clear();
+	}
+};
+
+inline void Image::WriteImage(const void* data, ULONG size, UINT64 offset) const
+{
+	if (image_sink)
+	{
+		image_sink->Write(data, size, offset);
+		return;
+	}
+	WriteFileWithOffset(image_file, data, size, offset);
+}
+inline void Image::WriteImage(MetadataCommit& commit) const
+{
+	if (image_sink)
+	{
+		commit.Write(*image_sink);
+		return;
+	}
+	commit.Write(image_file);
+}
+inline void Image::FlushImage() const
+{
+	if (!image_sink)
+	{
+		THROW_IF_WIN32_BOOL_FALSE(FlushFileBuffers(image_file));
+	}
+}
+inline UINT64 Image::GetImageFileSize() const
+{
+	if (image_sink)
+	{
+		return image_sink->GetEnd();
+	}
+	LARGE_INTEGER fsize;
+	THROW_IF_WIN32_BOOL_FALSE(GetFileSizeEx(image_file, &fsize));
+	return fsize.QuadPart;
+}
+inline BOOL Image::DuplicateImageRange(UINT64 source_offset, UINT64 target_offset, UINT64 length) const
+{
+	if (image_sink)
+	{
+		image_sink->Duplicate(source_offset, target_offset, length);
+		return TRUE;
+	}
+	DUPLICATE_EXTENTS_DATA dup_extent = {
+		.FileHandle = image_file,
+		.SourceFileOffset = {.QuadPart = static_cast<LONGLONG>(source_offset) },
+		.TargetFileOffset = {.QuadPart = static_cast<LONGLONG>(target_offset) },
+		.ByteCount = {.QuadPart = static_cast<LONGLONG>(length) }
+	};
+	ULONG _;
+	return DeviceIoControl(image_file, FSCTL_DUPLICATE_EXTENTS_TO_FILE, &dup_extent, sizeof dup_extent, nullptr, 0, &_, nullptr);
 }
\ No newline at end of file
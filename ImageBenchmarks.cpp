@@ -0,0 +1,264 @@
+#define NOMINMAX
+#include <windows.h>
+#include <wil/resource.h>
+#include <memory>
+#include <vector>
+#include "Benchmark.h"
+#include "Kernel.h"
+#include "MemoryImage.h"
+#include "Planner.h"
+#include "VHD.h"
+#include "VHDX.h"
+
+namespace
+{
+	constexpr UINT64 GB = 1024ULL * 1024 * 1024;
+	constexpr UINT64 TB = 1024 * GB;
+	// Allocation tables of about 64M entries, the largest conversion kernels walk.
+	constexpr UINT32 VHD_KERNEL_BLOCK_SIZE = 32 * 1024;
+	constexpr UINT32 VHDX_KERNEL_BLOCK_SIZE = 1024 * 1024;
+	constexpr UINT32 KERNEL_ALLOCATION_STRIDE = 64;
+	template <typename ImageType>
+	void ReadHeader(BenchmarkState& state)
+	{
+		const auto file = BuildImage<ImageType>(state.range());
+		UINT32 entries = 0;
+		while (state.KeepRunning())
+		{
+			ImageType image;
+			image.Attach(file.get(), MEMORY_IMAGE_CLUSTER_SIZE);
+			image.ReadHeader();
+			entries = image.GetTableEntriesCount();
+		}
+		state.SetItemsProcessed(state.iterations_count() * entries);
+	}
+	template <typename ImageType>
+	void ProbeBlock(BenchmarkState& state)
+	{
+		const auto file = BuildImage<ImageType>(state.range());
+		ImageType image;
+		image.Attach(file.get(), MEMORY_IMAGE_CLUSTER_SIZE);
+		image.ReadHeader();
+		while (state.KeepRunning())
+		{
+			for (UINT32 i = 0; i < image.GetTableEntriesCount(); i++)
+			{
+				DoNotOptimize(image.ProbeBlock(i));
+			}
+		}
+		state.SetItemsProcessed(state.iterations_count() * image.GetTableEntriesCount());
+	}
+	// Bulk counterpart of ProbeBlock, used to collect extents.
+	template <typename ImageType>
+	void ScanAllocatedBlocks(BenchmarkState& state)
+	{
+		const auto file = BuildImage<ImageType>(state.range());
+		ImageType image;
+		image.Attach(file.get(), MEMORY_IMAGE_CLUSTER_SIZE);
+		image.ReadHeader();
+		std::vector<UINT64> allocated;
+		while (state.KeepRunning())
+		{
+			image.ScanAllocatedBlocks(allocated);
+			DoNotOptimize(allocated.data());
+		}
+		state.SetItemsProcessed(state.iterations_count() * image.GetTableEntriesCount());
+	}
+	// Allocates every block of new image. File extension and table bookkeeping only, as data is cloned afterwards.
+	template <typename ImageType>
+	void AllocateBlock(BenchmarkState& state)
+	{
+		UINT32 entries = 0;
+		while (state.KeepRunning())
+		{
+			state.PauseTiming();
+			unique_memory_file file(CreateMemoryFile());
+			ImageType image;
+			image.Attach(file.get(), MEMORY_IMAGE_CLUSTER_SIZE);
+			image.ConstructHeader(state.range(), 0, 512, false);
+			entries = image.GetTableEntriesCount();
+			state.ResumeTiming();
+			for (UINT32 i = 0; i < entries; i++)
+			{
+				DoNotOptimize(image.AllocateBlock(i));
+			}
+			state.PauseTiming();
+			file.reset();
+			state.ResumeTiming();
+		}
+		state.SetItemsProcessed(state.iterations_count() * entries);
+	}
+	// Generic CollectExtentsOf, which probes each block through ProbeBlock.
+	template <typename ImageType>
+	void CollectExtentsGeneric(BenchmarkState& state, UINT32 block_size)
+	{
+		const auto file = BuildImage<ImageType>(state.range(), block_size, KERNEL_ALLOCATION_STRIDE);
+		ImageType image;
+		image.Attach(file.get(), MEMORY_IMAGE_CLUSTER_SIZE);
+		image.ReadHeader();
+		while (state.KeepRunning())
+		{
+			DoNotOptimize(CollectExtentsOf(image, MEMORY_IMAGE_CLUSTER_SIZE).size());
+		}
+		state.SetItemsProcessed(state.iterations_count() * image.GetTableEntriesCount());
+	}
+	// Same through conversion kernel, which is specialized for format and disk type.
+	template <typename ImageType>
+	void CollectExtents(BenchmarkState& state, UINT32 block_size)
+	{
+		const auto file = BuildImage<ImageType>(state.range(), block_size, KERNEL_ALLOCATION_STRIDE);
+		ImageType image;
+		image.Attach(file.get(), MEMORY_IMAGE_CLUSTER_SIZE);
+		image.ReadHeader();
+		const auto& kernel = SelectConversionKernel(image, image);
+		while (state.KeepRunning())
+		{
+			DoNotOptimize(kernel.collect_extents(image, MEMORY_IMAGE_CLUSTER_SIZE).size());
+		}
+		state.SetItemsProcessed(state.iterations_count() * image.GetTableEntriesCount());
+	}
+	// Allocates targets of runs planned from source into new image of same format.
+	template <typename ImageType>
+	void ResolveTargets(BenchmarkState& state, UINT32 block_size)
+	{
+		const auto file = BuildImage<ImageType>(state.range(), block_size, KERNEL_ALLOCATION_STRIDE);
+		ImageType source;
+		source.Attach(file.get(), MEMORY_IMAGE_CLUSTER_SIZE);
+		source.ReadHeader();
+		const auto& kernel = SelectConversionKernel(source, source);
+		const auto planned_runs = PlanLayout(kernel.collect_extents(source, MEMORY_IMAGE_CLUSTER_SIZE), block_size, LayoutPolicy::Virtual, {});
+		while (state.KeepRunning())
+		{
+			state.PauseTiming();
+			unique_memory_file destination_file(CreateMemoryFile());
+			ImageType destination;
+			destination.Attach(destination_file.get(), MEMORY_IMAGE_CLUSTER_SIZE);
+			destination.ConstructHeader(state.range(), block_size, 512, false);
+			auto runs = planned_runs;
+			state.ResumeTiming();
+			kernel.resolve_targets(destination, runs);
+			DoNotOptimize(runs.data());
+			state.PauseTiming();
+			runs.clear();
+			destination_file.reset();
+			state.ResumeTiming();
+		}
+		state.SetItemsProcessed(state.iterations_count() * planned_runs.size());
+	}
+	void VHD_ReadHeader(BenchmarkState& state)
+	{
+		ReadHeader<VHD>(state);
+	}
+	void VHDX_ReadHeader(BenchmarkState& state)
+	{
+		ReadHeader<VHDX>(state);
+	}
+	void VHD_ProbeBlock(BenchmarkState& state)
+	{
+		ProbeBlock<VHD>(state);
+	}
+	void VHDX_ProbeBlock(BenchmarkState& state)
+	{
+		ProbeBlock<VHDX>(state);
+	}
+	void VHD_ScanAllocatedBlocks(BenchmarkState& state)
+	{
+		ScanAllocatedBlocks<VHD>(state);
+	}
+	void VHDX_ScanAllocatedBlocks(BenchmarkState& state)
+	{
+		ScanAllocatedBlocks<VHDX>(state);
+	}
+	void VHD_AllocateBlock(BenchmarkState& state)
+	{
+		AllocateBlock<VHD>(state);
+	}
+	void VHDX_AllocateBlock(BenchmarkState& state)
+	{
+		AllocateBlock<VHDX>(state);
+	}
+	void VHD_CollectExtentsOf(BenchmarkState& state)
+	{
+		CollectExtentsGeneric<VHD>(state, VHD_KERNEL_BLOCK_SIZE);
+	}
+	void VHDX_CollectExtentsOf(BenchmarkState& state)
+	{
+		CollectExtentsGeneric<VHDX>(state, VHDX_KERNEL_BLOCK_SIZE);
+	}
+	void VHD_CollectExtents(BenchmarkState& state)
+	{
+		CollectExtents<VHD>(state, VHD_KERNEL_BLOCK_SIZE);
+	}
+	void VHDX_CollectExtents(BenchmarkState& state)
+	{
+		CollectExtents<VHDX>(state, VHDX_KERNEL_BLOCK_SIZE);
+	}
+	void VHD_ResolveTargets(BenchmarkState& state)
+	{
+		ResolveTargets<VHD>(state, VHD_KERNEL_BLOCK_SIZE);
+	}
+	void VHDX_ResolveTargets(BenchmarkState& state)
+	{
+		ResolveTargets<VHDX>(state, VHDX_KERNEL_BLOCK_SIZE);
+	}
+	void VHD_CHSCalculate(BenchmarkState& state)
+	{
+		// Read through volatile, so the call isn't folded to a constant.
+		volatile UINT64 disk_size = state.range();
+		while (state.KeepRunning())
+		{
+			DoNotOptimize(VHD::CHSCalculate(disk_size));
+		}
+	}
+	template <typename Header, typename Fn>
+	void Checksum(BenchmarkState& state, Fn&& update)
+	{
+		const auto header = std::make_unique<Header>();
+		memset(header.get(), 0x5A, sizeof(Header));
+		while (state.KeepRunning())
+		{
+			update(header.get());
+			DoNotOptimize(header->Checksum);
+		}
+		state.SetBytesProcessed(state.iterations_count() * sizeof(Header));
+	}
+	void VHD_ChecksumFooter(BenchmarkState& state)
+	{
+		Checksum<VHD_FOOTER>(state, [](VHD_FOOTER* header) { VHD::VHDChecksumUpdate(header); });
+	}
+	void VHD_ChecksumDynamicHeader(BenchmarkState& state)
+	{
+		Checksum<VHD_DYNAMIC_HEADER>(state, [](VHD_DYNAMIC_HEADER* header) { VHD::VHDChecksumUpdate(header); });
+	}
+	void VHDX_ChecksumHeader(BenchmarkState& state)
+	{
+		Checksum<VHDX_HEADER>(state, [](VHDX_HEADER* header) { VHDX::VHDXChecksumUpdate(header); });
+	}
+	void VHDX_ChecksumRegionTable(BenchmarkState& state)
+	{
+		Checksum<VHDX_REGION_TABLE_HEADER>(state, [](VHDX_REGION_TABLE_HEADER* header) { VHDX::VHDXChecksumUpdate(header); });
+	}
+}
+// Dynamic VHD is limited to 2040 GB, VHDX goes up to its 64 TB maximum.
+#define VHD_DISK_SIZES 1 * GB, 64 * GB, 1 * TB, VHD_MAX_DYNAMIC_DISK_SIZE
+#define VHDX_DISK_SIZES 1 * GB, 64 * GB, 1 * TB, 16 * TB, VHDX_MAX_DISK_SIZE
+BENCHMARK_WITH_ARGUMENTS(VHD_ReadHeader, VHD_DISK_SIZES);
+BENCHMARK_WITH_ARGUMENTS(VHDX_ReadHeader, VHDX_DISK_SIZES);
+BENCHMARK_WITH_ARGUMENTS(VHD_ProbeBlock, VHD_DISK_SIZES);
+BENCHMARK_WITH_ARGUMENTS(VHDX_ProbeBlock, VHDX_DISK_SIZES);
+BENCHMARK_WITH_ARGUMENTS(VHD_ScanAllocatedBlocks, VHD_DISK_SIZES);
+BENCHMARK_WITH_ARGUMENTS(VHDX_ScanAllocatedBlocks, VHDX_DISK_SIZES);
+BENCHMARK_WITH_ARGUMENTS(VHD_AllocateBlock, VHD_DISK_SIZES);
+BENCHMARK_WITH_ARGUMENTS(VHDX_AllocateBlock, VHDX_DISK_SIZES);
+// 2040 GB of 32 KB blocks and 64 TB of 1 MB blocks are both about 64M entries.
+BENCHMARK_WITH_ARGUMENTS(VHD_CollectExtentsOf, VHD_MAX_DYNAMIC_DISK_SIZE);
+BENCHMARK_WITH_ARGUMENTS(VHDX_CollectExtentsOf, VHDX_MAX_DISK_SIZE);
+BENCHMARK_WITH_ARGUMENTS(VHD_CollectExtents, VHD_MAX_DYNAMIC_DISK_SIZE);
+BENCHMARK_WITH_ARGUMENTS(VHDX_CollectExtents, VHDX_MAX_DISK_SIZE);
+BENCHMARK_WITH_ARGUMENTS(VHD_ResolveTargets, VHD_MAX_DYNAMIC_DISK_SIZE);
+BENCHMARK_WITH_ARGUMENTS(VHDX_ResolveTargets, VHDX_MAX_DISK_SIZE);
+BENCHMARK_WITH_ARGUMENTS(VHD_CHSCalculate, 1 * GB, 64 * GB, VHD_MAX_DYNAMIC_DISK_SIZE);
+BENCHMARK(VHD_ChecksumFooter);
+BENCHMARK(VHD_ChecksumDynamicHeader);
+BENCHMARK(VHDX_ChecksumHeader);
+BENCHMARK(VHDX_ChecksumRegionTable);
\ No newline at end of file
@@ -0,0 +1,149 @@
+#define NOMINMAX
+#include <windows.h>
+#include <wil/resource.h>
+#include <algorithm>
+#include <vector>
+#include "Check.h"
+#include "Journal.h"
+#include "Kernel.h"
+#include "MemoryImage.h"
+#include "Planner.h"
+#include "VDI.h"
+#include "VHD.h"
+#include "VHDX.h"
+
+namespace
+{
+	constexpr UINT64 CHECK_DISK_SIZE = 64 * 1024 * 1024;
+	constexpr UINT32 CHECK_SOURCE_BLOCK_SIZE = 1024 * 1024;
+	UINT64 GetFileSize(HANDLE file)
+	{
+		LARGE_INTEGER fsize;
+		THROW_IF_WIN32_BOOL_FALSE(GetFileSizeEx(file, &fsize));
+		return fsize.QuadPart;
+	}
+	// Guest disk contents, zero where unallocated.
+	template <typename ImageType>
+	std::vector<BYTE> ReadGuestData(HANDLE file)
+	{
+		ImageType image;
+		image.Attach(file, MEMORY_IMAGE_CLUSTER_SIZE);
+		image.ReadHeader();
+		std::vector<BYTE> data(image.GetDiskSize());
+		for (UINT32 i = 0; i < image.GetTableEntriesCount(); i++)
+		{
+			const UINT64 virtual_offset = static_cast<UINT64>(image.GetBlockSize()) * i;
+			if (const auto block_address = image.ProbeBlock(i); block_address && virtual_offset < data.size())
+			{
+				ReadFileWithOffset(file, data.data() + virtual_offset, static_cast<ULONG>(std::min<UINT64>(image.GetBlockSize(), data.size() - virtual_offset)), *block_address);
+			}
+		}
+		return data;
+	}
+	// Same steps as Conversion::Plan and CloneRuns, cloning runs until last_run and recording them in journal.
+	// Resumed conversion skips runs journal recorded. Header is written only when all runs are cloned, as interrupted conversion never reaches it.
+	template <typename DestinationImage>
+	size_t Convert(const Image& source, HANDLE destination_file, HANDLE journal_file, bool resume, size_t last_run)
+	{
+		const UINT64 resume_file_size = resume ? GetFileSize(destination_file) : 0;
+		DestinationImage destination;
+		destination.Attach(destination_file, MEMORY_IMAGE_CLUSTER_SIZE);
+		destination.RetainFileSize(resume_file_size);
+		destination.ConstructHeader(source.GetDiskSize(), 0, source.GetSectorSize(), false);
+		const auto& kernel = SelectConversionKernel(source, destination);
+		auto runs = PlanLayout(kernel.collect_extents(source, MEMORY_IMAGE_CLUSTER_SIZE), destination.GetBlockSize(), LayoutPolicy::Virtual, {});
+		kernel.resolve_targets(destination, runs);
+		const BY_HANDLE_FILE_INFORMATION source_info = {};
+		ConversionJournal journal;
+		size_t first_run = 0;
+		if (resume)
+		{
+			journal.Open(journal_file, source_info, HashPlan(destination, runs), runs.size(), resume_file_size);
+			first_run = static_cast<size_t>(journal.GetCompletedRuns());
+		}
+		else
+		{
+			journal.Create(journal_file, source_info, HashPlan(destination, runs), runs.size(), GetFileSize(destination_file));
+		}
+		ULONG _;
+		const size_t end_run = std::min(last_run, runs.size());
+		for (size_t i = first_run; i < end_run; i++)
+		{
+			DUPLICATE_EXTENTS_DATA dup_extent = {
+				.FileHandle = source.GetDataFile(),
+				.SourceFileOffset = {.QuadPart = static_cast<LONGLONG>(runs[i].source_offset) },
+				.TargetFileOffset = {.QuadPart = static_cast<LONGLONG>(runs[i].target_offset) },
+				.ByteCount = {.QuadPart = runs[i].length },
+			};
+			THROW_IF_WIN32_BOOL_FALSE(DeviceIoControl(destination_file, FSCTL_DUPLICATE_EXTENTS_TO_FILE, &dup_extent, sizeof dup_extent, nullptr, 0, &_, nullptr));
+		}
+		journal.Checkpoint(destination_file, end_run, 0);
+		if (end_run == runs.size())
+		{
+			destination.WriteHeader();
+		}
+		return runs.size();
+	}
+	// Conversion killed halfway and resumed over its partial file must equal conversion never interrupted.
+	template <typename DestinationImage>
+	void CheckResume()
+	{
+		const auto source_file = BuildImage<VHDX>(CHECK_DISK_SIZE, CHECK_SOURCE_BLOCK_SIZE, 2, true);
+		VHDX source;
+		source.Attach(source_file.get(), MEMORY_IMAGE_CLUSTER_SIZE);
+		source.ReadHeader();
+
+		const unique_memory_file uninterrupted_file(CreateMemoryFile());
+		const unique_memory_file uninterrupted_journal_file(CreateMemoryFile());
+		const size_t runs_count = Convert<DestinationImage>(source, uninterrupted_file.get(), uninterrupted_journal_file.get(), false, SIZE_MAX);
+		REQUIRE(runs_count >= 2);
+
+		const unique_memory_file resumed_file(CreateMemoryFile());
+		const unique_memory_file resumed_journal_file(CreateMemoryFile());
+		Convert<DestinationImage>(source, resumed_file.get(), resumed_journal_file.get(), false, runs_count / 2);
+		const UINT64 partial_file_size = GetFileSize(resumed_file.get());
+		Convert<DestinationImage>(source, resumed_file.get(), resumed_journal_file.get(), true, SIZE_MAX);
+		REQUIRE(GetFileSize(resumed_file.get()) >= partial_file_size);
+
+		const auto expected = ReadGuestData<VHDX>(source_file.get());
+		REQUIRE(ReadGuestData<DestinationImage>(uninterrupted_file.get()) == expected);
+		REQUIRE(ReadGuestData<DestinationImage>(resumed_file.get()) == expected);
+	}
+	// Sectors absent from VHD block bitmap are absent from runs, even within a cluster, and stay absent in VHD output.
+	void VHD_PartialClusterSectorRuns()
+	{
+		const unique_memory_file file(CreateMemoryFile());
+		{
+			VHD image;
+			image.Attach(file.get(), MEMORY_IMAGE_CLUSTER_SIZE);
+			image.ConstructHeader(CHECK_DISK_SIZE, 0, 512, false);
+			image.AllocateSectorRun(0, { 512, 1024 });
+			image.AllocateSectorRun(0, { 8192, 4096 });
+			image.WriteHeader();
+		}
+		VHD image;
+		image.Attach(file.get(), MEMORY_IMAGE_CLUSTER_SIZE);
+		image.ReadHeader();
+		std::vector<SectorRun> runs;
+		image.ProbeSectorRuns(0, runs);
+		REQUIRE(runs.size() == 2);
+		REQUIRE(runs[0].offset == 512 && runs[0].length == 1024);
+		REQUIRE(runs[1].offset == 8192 && runs[1].length == 4096);
+	}
+	void Resume_VHD()
+	{
+		CheckResume<VHD>();
+	}
+	void Resume_VHDX()
+	{
+		CheckResume<VHDX>();
+	}
+	void Resume_VDI()
+	{
+		CheckResume<VDI>();
+	}
+}
+CHECK(VHD_PartialClusterSectorRuns);
+CHECK(Resume_VHD);
+CHECK(Resume_VHDX);
+CHECK(Resume_VDI);
\ No newline at end of file
@@ -0,0 +1,181 @@
+#define NOMINMAX
+#include <windows.h>
+#include <shlwapi.h>
+#include <wil/filesystem.h>
+#include <wil/resource.h>
+#include <wil/result.h>
+#include <algorithm>
+#include <bit>
+#include <cstdio>
+#include <iterator>
+#include <memory>
+#include <vector>
+#include "ConvertImage.h"
+#include "Inspect.h"
+#include "Kernel.h"
+#include "Planner.h"
+
+static size_t ExtentHistogramBucket(UINT64 extents_count)
+{
+	_ASSERT(extents_count != 0);
+	return std::min<size_t>(std::bit_width(extents_count - 1), EXTENT_HISTOGRAM_BUCKETS - 1);
+}
+ImageReport InspectImage(PCWSTR file_name)
+{
+	const wil::unique_hfile file = wil::open_file(file_name);
+	WCHAR volume_path[MAX_PATH];
+	THROW_IF_WIN32_BOOL_FALSE(GetVolumePathNameW(file_name, volume_path, static_cast<DWORD>(std::size(volume_path))));
+	ULONG sectors_per_cluster, bytes_per_sector, free_clusters, total_clusters;
+	THROW_IF_WIN32_BOOL_FALSE(GetDiskFreeSpaceW(volume_path, &sectors_per_cluster, &bytes_per_sector, &free_clusters, &total_clusters));
+	const UINT32 cluster_size = sectors_per_cluster * bytes_per_sector;
+	LARGE_INTEGER fsize;
+	THROW_IF_WIN32_BOOL_FALSE(GetFileSizeEx(file.get(), &fsize));
+
+	const auto image = DetectImageFormatByData(file.get());
+	if (!image)
+	{
+		throw std::runtime_error("No supported image types detected.");
+	}
+	image->Attach(file.get(), cluster_size);
+	image->ReadHeader();
+	image->CheckReadable();
+	const auto extents = SelectConversionKernel(*image, *image).collect_extents(*image, cluster_size);
+	const auto runs = PlanLayout(extents, image->GetBlockSize(), LayoutPolicy::Virtual, {});
+	const auto metrics = MeasureLayout(runs, image->GetBlockSize());
+
+	ImageReport report = {
+		.image_type = image->GetImageTypeName(),
+		.fixed = image->IsFixed(),
+		.disk_size = image->GetDiskSize(),
+		.file_size = static_cast<UINT64>(fsize.QuadPart),
+		.block_size = image->GetBlockSize(),
+		.cluster_size = cluster_size,
+		.table_entries_count = image->GetTableEntriesCount(),
+		.allocated_blocks = metrics.allocated_blocks,
+		.clone_calls = metrics.clone_runs,
+	};
+	// Runs are in guest address order, so each block's runs are adjacent.
+	const auto physical_extents = ReadPhysicalExtents(image->GetDataFile(), cluster_size);
+	UINT64 block_extents_count = 0;
+	// Extent backing several runs, such as one spanning blocks, is one fragment.
+	std::vector<bool> counted_extents(physical_extents.size());
+	for (size_t i = 0; i < runs.size(); i++)
+	{
+		const auto& run = runs[i];
+		report.allocated_size += run.length;
+		auto physical = std::upper_bound(physical_extents.begin(), physical_extents.end(), run.source_offset, [](UINT64 offset, const PhysicalExtent& extent) { return offset < extent.file_offset + extent.length; });
+		for (; physical != physical_extents.end() && physical->file_offset < run.source_offset + run.length; ++physical)
+		{
+			if (physical->lcn < 0)
+			{
+				// Sparse hole, reads as zero and occupies no cluster.
+				continue;
+			}
+			const UINT64 overlap = std::min(physical->file_offset + physical->length, run.source_offset + run.length) - std::max(physical->file_offset, run.source_offset);
+			(physical->reference_count > 1 ? report.shared_size : report.exclusive_size) += overlap;
+			if (const size_t extent_index = physical - physical_extents.begin(); !counted_extents[extent_index])
+			{
+				counted_extents[extent_index] = true;
+				report.fragments++;
+			}
+			block_extents_count++;
+		}
+		if (i + 1 == runs.size() || runs[i + 1].block_index != run.block_index)
+		{
+			if (block_extents_count != 0)
+			{
+				report.extent_histogram[ExtentHistogramBucket(block_extents_count)]++;
+			}
+			block_extents_count = 0;
+		}
+	}
+	return report;
+}
+void PrintImageReport(PCWSTR file_name, const ImageReport& report)
+{
+	char buf[0x20];
+	printf(
+		"Path:              %ls\n"
+		"Image format:      %hs\n"
+		"Allocation policy: %hs\n",
+		file_name,
+		report.image_type.c_str(),
+		report.fixed ? "Fixed" : "Dynamic"
+	);
+	printf("Disk size:         %llu (%s)\n", report.disk_size, StrFormatByteSize64A(report.disk_size, buf, std::size(buf)));
+	printf("File size:         %llu (%s)\n", report.file_size, StrFormatByteSize64A(report.file_size, buf, std::size(buf)));
+	printf("Block size:        %u KB\n", report.block_size / 1024);
+	printf("Allocated blocks:  %llu / %u\n", report.allocated_blocks, report.table_entries_count);
+	printf("Allocated size:    %s\n", StrFormatByteSize64A(report.allocated_size, buf, std::size(buf)));
+	printf("Shared size:       %s\n", StrFormatByteSize64A(report.shared_size, buf, std::size(buf)));
+	printf("Exclusive size:    %s\n", StrFormatByteSize64A(report.exclusive_size, buf, std::size(buf)));
+	printf(
+		"Fragments:         %llu\n"
+		"Clone calls:       %llu\n"
+		"\n"
+		"Extents per block  Blocks\n",
+		report.fragments,
+		report.clone_calls
+	);
+	static constexpr PCSTR bucket_names[EXTENT_HISTOGRAM_BUCKETS] = { "1", "2", "3-4", "5-8", "9-16", "17+" };
+	for (size_t i = 0; i < EXTENT_HISTOGRAM_BUCKETS; i++)
+	{
+		printf("%17hs  %llu\n", bucket_names[i], report.extent_histogram[i]);
+	}
+}
+void PrintJsonString(PCWSTR string)
+{
+	putchar('"');
+	for (PCWSTR p = string; *p; p++)
+	{
+		if (*p == L'"' || *p == L'\\')
+		{
+			printf("\\%c", static_cast<char>(*p));
+		}
+		else if (*p < 0x20 || *p > 0x7E)
+		{
+			printf("\\u%04x", *p);
+		}
+		else
+		{
+			putchar(static_cast<char>(*p));
+		}
+	}
+	putchar('"');
+}
+void PrintJsonString(PCSTR string)
+{
+	const int length = MultiByteToWideChar(CP_ACP, 0, string, -1, nullptr, 0);
+	THROW_LAST_ERROR_IF(length == 0);
+	const auto wide = std::make_unique<WCHAR[]>(length);
+	THROW_LAST_ERROR_IF(MultiByteToWideChar(CP_ACP, 0, string, -1, wide.get(), length) == 0);
+	PrintJsonString(wide.get());
+}
+void PrintImageReportJson(PCWSTR file_name, const ImageReport& report)
+{
+	printf("{\"path\":");
+	PrintJsonString(file_name);
+	printf(
+		",\"format\":\"%hs\",\"fixed\":%hs,\"disk_size\":%llu,\"file_size\":%llu,\"block_size\":%u,\"cluster_size\":%u"
+		",\"table_entries\":%u,\"allocated_blocks\":%llu,\"allocated_size\":%llu,\"shared_size\":%llu,\"exclusive_size\":%llu"
+		",\"fragments\":%llu,\"clone_calls\":%llu,\"extent_histogram\":[",
+		report.image_type.c_str(),
+		report.fixed ? "true" : "false",
+		report.disk_size,
+		report.file_size,
+		report.block_size,
+		report.cluster_size,
+		report.table_entries_count,
+		report.allocated_blocks,
+		report.allocated_size,
+		report.shared_size,
+		report.exclusive_size,
+		report.fragments,
+		report.clone_calls
+	);
+	for (size_t i = 0; i < EXTENT_HISTOGRAM_BUCKETS; i++)
+	{
+		printf(i == 0 ? "%llu" : ",%llu", report.extent_histogram[i]);
+	}
+	printf("]}");
+}
\ No newline at end of file
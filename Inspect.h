@@ -0,0 +1,31 @@
+#pragma once
+#include <windows.h>
+#include <string>
+
+// Blocks are counted by physical extents backing them: 1, 2, 3-4, 5-8, 9-16 and 17 or more.
+constexpr size_t EXTENT_HISTOGRAM_BUCKETS = 6;
+struct ImageReport
+{
+	std::string image_type;
+	bool fixed;
+	UINT64 disk_size;
+	UINT64 file_size;
+	UINT32 block_size;
+	UINT32 cluster_size;
+	UINT32 table_entries_count;
+	UINT64 allocated_blocks;
+	UINT64 allocated_size;
+	// Distinct physical extents on volume backing allocated data. Histogram counts extent shared by blocks in each of them.
+	UINT64 fragments;
+	UINT64 extent_histogram[EXTENT_HISTOGRAM_BUCKETS];
+	// Allocated data whose clusters are referenced by other files or other offsets, as reported by ReFS.
+	UINT64 shared_size;
+	UINT64 exclusive_size;
+	// Clone calls to convert this image in guest address order.
+	UINT64 clone_calls;
+};
+ImageReport InspectImage(PCWSTR file_name);
+void PrintImageReport(PCWSTR file_name, const ImageReport& report);
+void PrintImageReportJson(PCWSTR file_name, const ImageReport& report);
+void PrintJsonString(PCWSTR string);
+void PrintJsonString(PCSTR string);
\ No newline at end of file
@@ -0,0 +1,116 @@
+#define NOMINMAX
+#include <windows.h>
+#include <wil/filesystem.h>
+#include <wil/resource.h>
+#include <wil/result.h>
+#include <cstring>
+#include <stdexcept>
+#include "Dedup.h"
+#include "Journal.h"
+
+static void InitializeRecord(JOURNAL_RECORD& record, const BY_HANDLE_FILE_INFORMATION& source_info, UINT64 plan_hash, UINT64 runs_count, UINT64 destination_file_size)
+{
+	record = {
+		.Signature = JOURNAL_SIGNATURE,
+		.Version = JOURNAL_VERSION,
+		.SourceVolumeSerialNumber = source_info.dwVolumeSerialNumber,
+		.SourceFileIndex = static_cast<UINT64>(source_info.nFileIndexHigh) << 32 | source_info.nFileIndexLow,
+		.SourceFileSize = static_cast<UINT64>(source_info.nFileSizeHigh) << 32 | source_info.nFileSizeLow,
+		.SourceLastWriteTime = static_cast<UINT64>(source_info.ftLastWriteTime.dwHighDateTime) << 32 | source_info.ftLastWriteTime.dwLowDateTime,
+		.PlanHash = plan_hash,
+		.RunsCount = runs_count,
+		.DestinationFileSize = destination_file_size,
+	};
+}
+static UINT64 RecordChecksum(JOURNAL_RECORD record)
+{
+	record.Checksum = 0;
+	return HashChunk(reinterpret_cast<const BYTE*>(&record), sizeof record);
+}
+void ConversionJournal::WriteRecord()
+{
+	journal_record.Sequence++;
+	journal_record.Checksum = RecordChecksum(journal_record);
+	WriteFileWithOffset(journal_file, &journal_record, sizeof journal_record, journal_record.Sequence % 2 * JOURNAL_RECORD_SIZE);
+	THROW_IF_WIN32_BOOL_FALSE(FlushFileBuffers(journal_file));
+	last_checkpoint_tick = GetTickCount64();
+}
+void ConversionJournal::Create(PCWSTR file_name, const BY_HANDLE_FILE_INFORMATION& source_info, UINT64 plan_hash, UINT64 runs_count, UINT64 destination_file_size)
+{
+	owned_file = wil::create_new_file(file_name, GENERIC_READ | GENERIC_WRITE | DELETE);
+	Create(owned_file.get(), source_info, plan_hash, runs_count, destination_file_size);
+}
+void ConversionJournal::Create(HANDLE file, const BY_HANDLE_FILE_INFORMATION& source_info, UINT64 plan_hash, UINT64 runs_count, UINT64 destination_file_size)
+{
+	journal_file = file;
+	InitializeRecord(journal_record, source_info, plan_hash, runs_count, destination_file_size);
+	WriteRecord();
+}
+void ConversionJournal::Open(PCWSTR file_name, const BY_HANDLE_FILE_INFORMATION& source_info, UINT64 plan_hash, UINT64 runs_count, UINT64 destination_file_size)
+{
+	owned_file = wil::open_file(file_name, GENERIC_READ | GENERIC_WRITE | DELETE, 0);
+	Open(owned_file.get(), source_info, plan_hash, runs_count, destination_file_size);
+}
+void ConversionJournal::Open(HANDLE file, const BY_HANDLE_FILE_INFORMATION& source_info, UINT64 plan_hash, UINT64 runs_count, UINT64 destination_file_size)
+{
+	journal_file = file;
+	LARGE_INTEGER fsize;
+	THROW_IF_WIN32_BOOL_FALSE(GetFileSizeEx(journal_file, &fsize));
+	JOURNAL_RECORD records[2] = {};
+	ReadFileWithOffset(journal_file, records, static_cast<ULONG>(std::min<LONGLONG>(fsize.QuadPart, sizeof records)), 0);
+	const bool record1_available = records[0].Signature == JOURNAL_SIGNATURE && records[0].Checksum == RecordChecksum(records[0]);
+	const bool record2_available = records[1].Signature == JOURNAL_SIGNATURE && records[1].Checksum == RecordChecksum(records[1]);
+	if (!record1_available && !record2_available)
+	{
+		throw std::runtime_error("Journal is corrupted.");
+	}
+	const JOURNAL_RECORD& record = !record2_available || (record1_available && records[0].Sequence > records[1].Sequence) ? records[0] : records[1];
+	if (record.Version != JOURNAL_VERSION)
+	{
+		throw std::runtime_error("Unsupported journal version.");
+	}
+	JOURNAL_RECORD expected;
+	InitializeRecord(expected, source_info, plan_hash, runs_count, destination_file_size);
+	if (record.SourceVolumeSerialNumber != expected.SourceVolumeSerialNumber || record.SourceFileIndex != expected.SourceFileIndex || record.SourceFileSize != expected.SourceFileSize || record.SourceLastWriteTime != expected.SourceLastWriteTime)
+	{
+		throw std::runtime_error("Source was modified or replaced after journal was recorded.");
+	}
+	if (record.PlanHash != expected.PlanHash || record.RunsCount != expected.RunsCount || record.CompletedRuns > record.RunsCount)
+	{
+		throw std::runtime_error("Conversion plan doesn't match journal. Options must be same as interrupted conversion.");
+	}
+	if (destination_file_size < record.DestinationFileSize)
+	{
+		throw std::runtime_error("Partial destination is shorter than journal recorded. Cloned data was lost.");
+	}
+	journal_record = record;
+	last_checkpoint_tick = GetTickCount64();
+}
+void ConversionJournal::Checkpoint(HANDLE destination_file, UINT64 completed_runs, UINT64 done_bytes)
+{
+	_ASSERT(completed_runs >= journal_record.CompletedRuns && completed_runs <= journal_record.RunsCount);
+	THROW_IF_WIN32_BOOL_FALSE(FlushFileBuffers(destination_file));
+	journal_record.CompletedRuns = completed_runs;
+	journal_record.DoneBytes = done_bytes;
+	WriteRecord();
+}
+void ConversionJournal::Delete()
+{
+	FILE_DISPOSITION_INFO dispos = { TRUE };
+	THROW_IF_WIN32_BOOL_FALSE(SetFileInformationByHandle(journal_file, FileDispositionInfo, &dispos, sizeof dispos));
+	journal_file = nullptr;
+	owned_file.reset();
+}
+UINT64 HashPlan(const Image& destination, const std::vector<CloneRun>& runs)
+{
+	std::vector<UINT64> plan;
+	plan.reserve(4 + runs.size() * 4);
+	UINT64 image_type = 0;
+	strncpy_s(reinterpret_cast<char*>(&image_type), sizeof image_type, destination.GetImageTypeName(), _TRUNCATE);
+	plan.insert(plan.end(), { image_type, destination.GetDiskSize(), destination.GetBlockSize(), destination.IsFixed() });
+	for (const auto& run : runs)
+	{
+		plan.insert(plan.end(), { static_cast<UINT64>(run.block_index) << 32 | run.block_offset, run.length, run.source_offset, run.target_offset });
+	}
+	return HashChunk(reinterpret_cast<const BYTE*>(plan.data()), plan.size() * sizeof(UINT64));
+}
\ No newline at end of file
@@ -0,0 +1,65 @@
+#pragma once
+#include <windows.h>
+#include <wil/resource.h>
+#include <string>
+#include "Planner.h"
+
+constexpr UINT64 JOURNAL_SIGNATURE = 0x4C4E524A58444856; // "VHDXJRNL"
+constexpr UINT32 JOURNAL_VERSION = 3;
+constexpr UINT32 JOURNAL_RECORD_SIZE = 4096;
+constexpr ULONGLONG JOURNAL_CHECKPOINT_INTERVAL = 30 * 1000;
+struct JOURNAL_RECORD
+{
+	UINT64 Signature;
+	UINT32 Version;
+	UINT32 Reserved;
+	UINT64 Sequence;
+	UINT64 Checksum;
+	UINT64 SourceVolumeSerialNumber;
+	UINT64 SourceFileIndex;
+	UINT64 SourceFileSize;
+	UINT64 SourceLastWriteTime;
+	UINT64 PlanHash;
+	UINT64 RunsCount;
+	UINT64 CompletedRuns;
+	UINT64 DoneBytes;
+	// Destination size after all blocks are allocated. Partial destination shorter than this lost cloned data.
+	UINT64 DestinationFileSize;
+	BYTE   Reserved2[3992];
+};
+static_assert(sizeof(JOURNAL_RECORD) == JOURNAL_RECORD_SIZE);
+// Two records are written alternately, so one of them is valid even if writing is torn.
+struct ConversionJournal
+{
+private:
+	// Set when journal was opened by name. Otherwise caller owns file.
+	wil::unique_hfile owned_file;
+	HANDLE journal_file = nullptr;
+	JOURNAL_RECORD journal_record;
+	ULONGLONG last_checkpoint_tick;
+	void WriteRecord();
+public:
+	void Create(PCWSTR file_name, const BY_HANDLE_FILE_INFORMATION& source_info, UINT64 plan_hash, UINT64 runs_count, UINT64 destination_file_size);
+	// Journal on empty file owned by caller, such as in-memory one of checks.
+	void Create(HANDLE file, const BY_HANDLE_FILE_INFORMATION& source_info, UINT64 plan_hash, UINT64 runs_count, UINT64 destination_file_size);
+	// Throws if journal doesn't belong to same source and plan, or partial destination was truncated since it was recorded.
+	void Open(PCWSTR file_name, const BY_HANDLE_FILE_INFORMATION& source_info, UINT64 plan_hash, UINT64 runs_count, UINT64 destination_file_size);
+	void Open(HANDLE file, const BY_HANDLE_FILE_INFORMATION& source_info, UINT64 plan_hash, UINT64 runs_count, UINT64 destination_file_size);
+	UINT64 GetCompletedRuns() const
+	{
+		return journal_record.CompletedRuns;
+	}
+	UINT64 GetDoneBytes() const
+	{
+		return journal_record.DoneBytes;
+	}
+	bool IsCheckpointDue() const
+	{
+		return GetTickCount64() - last_checkpoint_tick >= JOURNAL_CHECKPOINT_INTERVAL;
+	}
+	// Runs before completed_runs must have been cloned. Destination is flushed before they are recorded.
+	void Checkpoint(HANDLE destination_file, UINT64 completed_runs, UINT64 done_bytes);
+	void Delete();
+};
+// Identifies destination layout, so resumed conversion can verify it places blocks same as interrupted one.
+UINT64 HashPlan(const Image& destination, const std::vector<CloneRun>& runs);
\ No newline at end of file
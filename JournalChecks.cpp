@@ -0,0 +1,78 @@
+#define NOMINMAX
+#include <windows.h>
+#include <cstddef>
+#include "Check.h"
+#include "Journal.h"
+#include "MemoryImage.h"
+
+namespace
+{
+	constexpr UINT64 CHECK_PLAN_HASH = 0x5EED;
+	constexpr UINT64 CHECK_RUNS_COUNT = 100;
+	constexpr UINT64 CHECK_DESTINATION_SIZE = 64 * 1024 * 1024;
+	constexpr BY_HANDLE_FILE_INFORMATION CHECK_SOURCE_INFO = {
+		.ftLastWriteTime = { 1, 2 },
+		.dwVolumeSerialNumber = 3,
+		.nFileSizeLow = 4,
+		.nFileIndexLow = 5,
+	};
+	// Journal with checkpoints after 10 and 20 runs. Create writes sequence 1, so latest record is in second slot.
+	unique_memory_file BuildJournal()
+	{
+		unique_memory_file journal_file(CreateMemoryFile());
+		const unique_memory_file destination_file(CreateMemoryFile());
+		ConversionJournal journal;
+		journal.Create(journal_file.get(), CHECK_SOURCE_INFO, CHECK_PLAN_HASH, CHECK_RUNS_COUNT, CHECK_DESTINATION_SIZE);
+		journal.Checkpoint(destination_file.get(), 10, 1000);
+		journal.Checkpoint(destination_file.get(), 20, 2000);
+		return journal_file;
+	}
+	// Rewrites field of record in place, without updating its checksum, as torn write leaves it.
+	void TearRecord(HANDLE journal_file, UINT32 slot)
+	{
+		const UINT64 completed_runs = 30;
+		WriteFileWithOffset(journal_file, completed_runs, slot * JOURNAL_RECORD_SIZE + offsetof(JOURNAL_RECORD, CompletedRuns));
+	}
+	void Journal_Reopen()
+	{
+		const auto journal_file = BuildJournal();
+		ConversionJournal journal;
+		journal.Open(journal_file.get(), CHECK_SOURCE_INFO, CHECK_PLAN_HASH, CHECK_RUNS_COUNT, CHECK_DESTINATION_SIZE);
+		REQUIRE(journal.GetCompletedRuns() == 20);
+		REQUIRE(journal.GetDoneBytes() == 2000);
+	}
+	void Journal_TornRecord()
+	{
+		const auto journal_file = BuildJournal();
+		TearRecord(journal_file.get(), 1);
+		ConversionJournal journal;
+		journal.Open(journal_file.get(), CHECK_SOURCE_INFO, CHECK_PLAN_HASH, CHECK_RUNS_COUNT, CHECK_DESTINATION_SIZE);
+		REQUIRE(journal.GetCompletedRuns() == 10);
+		REQUIRE(journal.GetDoneBytes() == 1000);
+	}
+	void Journal_CorruptedRecords()
+	{
+		const auto journal_file = BuildJournal();
+		TearRecord(journal_file.get(), 0);
+		TearRecord(journal_file.get(), 1);
+		ConversionJournal journal;
+		REQUIRE_THROWS(journal.Open(journal_file.get(), CHECK_SOURCE_INFO, CHECK_PLAN_HASH, CHECK_RUNS_COUNT, CHECK_DESTINATION_SIZE));
+	}
+	void Journal_Mismatch()
+	{
+		const auto journal_file = BuildJournal();
+		BY_HANDLE_FILE_INFORMATION modified_source_info = CHECK_SOURCE_INFO;
+		modified_source_info.ftLastWriteTime.dwLowDateTime++;
+		ConversionJournal journal;
+		REQUIRE_THROWS(journal.Open(journal_file.get(), modified_source_info, CHECK_PLAN_HASH, CHECK_RUNS_COUNT, CHECK_DESTINATION_SIZE));
+		REQUIRE_THROWS(journal.Open(journal_file.get(), CHECK_SOURCE_INFO, CHECK_PLAN_HASH + 1, CHECK_RUNS_COUNT, CHECK_DESTINATION_SIZE));
+		REQUIRE_THROWS(journal.Open(journal_file.get(), CHECK_SOURCE_INFO, CHECK_PLAN_HASH, CHECK_RUNS_COUNT + 1, CHECK_DESTINATION_SIZE));
+		// Partial destination may have grown, but shorter one lost cloned data.
+		journal.Open(journal_file.get(), CHECK_SOURCE_INFO, CHECK_PLAN_HASH, CHECK_RUNS_COUNT, CHECK_DESTINATION_SIZE + MEMORY_IMAGE_CLUSTER_SIZE);
+		REQUIRE_THROWS(journal.Open(journal_file.get(), CHECK_SOURCE_INFO, CHECK_PLAN_HASH, CHECK_RUNS_COUNT, CHECK_DESTINATION_SIZE - MEMORY_IMAGE_CLUSTER_SIZE));
+	}
+}
+CHECK(Journal_Reopen);
+CHECK(Journal_TornRecord);
+CHECK(Journal_CorruptedRecords);
+CHECK(Journal_Mismatch);
\ No newline at end of file
@@ -0,0 +1,81 @@
+#define NOMINMAX
+#include <windows.h>
+#include <type_traits>
+#include <typeinfo>
+#include "Kernel.h"
+#include "RAW.h"
+#include "VDI.h"
+#include "VHD.h"
+#include "VHDX.h"
+#include "VMDK.h"
+
+template <typename SourceImage, typename DestinationImage>
+struct ConversionKernelOf
+{
+	static std::vector<Extent> CollectExtents(const Image& source, UINT32 cluster_size)
+	{
+		const auto& image = static_cast<const SourceImage&>(source);
+		if constexpr (std::is_same_v<SourceImage, VHD>)
+		{
+			// Disk type is branched here once, not by ProbeBlock of each block.
+			if (image.IsFixed())
+			{
+				return CollectExtentsOf(image, cluster_size, [&](UINT32 index) { return image.ProbeFixedBlock(index); }, [&](UINT32, std::vector<SectorRun>& runs) { runs.assign(1, { 0, image.GetBlockSize() }); });
+			}
+			return CollectExtentsOf(image, cluster_size, [&](UINT32 index) { return *image.ProbeDynamicBlock(index); }, [&](UINT32 index, std::vector<SectorRun>& runs) { image.ProbeDynamicSectorRuns(index, runs); });
+		}
+		else
+		{
+			return CollectExtentsOf(image, cluster_size);
+		}
+	}
+	static void ResolveTargets(Image& destination, std::vector<CloneRun>& runs)
+	{
+		auto& image = static_cast<DestinationImage&>(destination);
+		if constexpr (std::is_same_v<DestinationImage, VHD>)
+		{
+			if (image.IsFixed())
+			{
+				for (auto& run : runs)
+				{
+					run.target_offset = image.ProbeFixedBlock(run.block_index) + run.block_offset;
+				}
+				return;
+			}
+			for (auto& run : runs)
+			{
+				run.target_offset = image.AllocateDynamicSectorRun(run.block_index, { run.block_offset, run.length }) + run.block_offset;
+			}
+		}
+		else
+		{
+			for (auto& run : runs)
+			{
+				run.target_offset = image.AllocateSectorRun(run.block_index, { run.block_offset, run.length }) + run.block_offset;
+			}
+		}
+	}
+	static constexpr ConversionKernel kernel = { CollectExtents, ResolveTargets };
+};
+template <typename... Formats>
+struct ConversionKernelTable
+{
+	template <typename SourceImage>
+	static const ConversionKernel& SelectDestination(const Image& destination)
+	{
+		const ConversionKernel* kernel = &ConversionKernelOf<SourceImage, Image>::kernel;
+		(void)((typeid(destination) == typeid(Formats) && (kernel = &ConversionKernelOf<SourceImage, Formats>::kernel)) || ...);
+		return *kernel;
+	}
+	static const ConversionKernel& Select(const Image& source, const Image& destination)
+	{
+		const ConversionKernel* kernel = &ConversionKernelOf<Image, Image>::kernel;
+		(void)((typeid(source) == typeid(Formats) && (kernel = &SelectDestination<Formats>(destination))) || ...);
+		return *kernel;
+	}
+};
+const ConversionKernel& SelectConversionKernel(const Image& source, const Image& destination)
+{
+	// Formats are final, so an exact typeid match is the only way to get one.
+	return ConversionKernelTable<RAW, VHD, VHDX, VMDK, VDI>::Select(source, destination);
+}
\ No newline at end of file
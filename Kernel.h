@@ -0,0 +1,12 @@
+#pragma once
+#include "Image.h"
+#include "Planner.h"
+
+// Hot loops of a conversion, instantiated for the concrete source and destination formats
+// so per-block ProbeBlock and AllocateSectorRun calls bind statically.
+struct ConversionKernel
+{
+	std::vector<Extent>(*collect_extents)(const Image& source, UINT32 cluster_size);
+	void(*resolve_targets)(Image& destination, std::vector<CloneRun>& runs);
+};
+const ConversionKernel& SelectConversionKernel(const Image& source, const Image& destination);
\ No newline at end of file
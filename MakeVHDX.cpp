@@ -1,41 +1,236 @@
+#define NOMINMAX
 #include <windows.h>
+#include <shlwapi.h>
 #include <wil/result.h>
 #include <bit>
 #include <clocale>
 #include <cstdio>
 #include <cstdlib>
 #include <filesystem>
+#include <io.h>
+#include <optional>
+#include <vector>
 #include "ConvertImage.h"
+#include "Daemon.h"
+#include "Inspect.h"
+#include "Mount.h"
+#include "Nbd.h"
 #include <crtdbg.h>
 
 [[noreturn]]
 void usage()
 {
 	fputs(
-		"Make VHD/VHDX that shares data blocks with source.\n"
+		"Make VHD/VHDX/VMDK/VDI that shares data blocks with source.\n"
 		"\n"
-		"MakeVHDX [-fixed|-dynamic] [-b<N>] [-sparse|-nosparse] <Source> [<Destination>]\n"
+		"MakeVHDX -info[:json] <Source>...\n"
+		"MakeVHDX -mount[:cow] <Source> <Root>\n"
+		"MakeVHDX -nbd:<Port>|-nbd:unix:<Path> <Source>...\n"
+		"MakeVHDX -daemon[:<Pipe>] [-volumejobs<N>]\n"
+		"MakeVHDX -submit[:<Pipe>] [-priority<N>] <Conversion options>... <Source> [<Destination>...]\n"
+		"MakeVHDX -dedup [-fixed|-dynamic] [-b<N>|-bauto[:<W>]] [-layout:<P>] [-punch] <Source>...\n"
+		"MakeVHDX -compact [-b<N>] [-layout:<P>] [-journal|-resume] <Source>\n"
+		"MakeVHDX -stream:<Format> [-fixed|-dynamic] [-partition<N>] [-size<N>] [-b<N>|-bauto[:<W>]] [-layout:<P>] [-punch] <Source> <Output>\n"
+		"MakeVHDX [-fixed|-dynamic] [-partition<N>] [-size<N>] [-b<N>|-bauto[:<W>]] [-align<N>] [-layout:<P>] [-punch] [-sparse|-nosparse] [-copybelow<N>] [-journal|-resume|-cache:<Dir>] [<Throttle>...] <Source> [<Destination>...]\n"
 		"\n"
 		"Source       Specifies conversion source.\n"
 		"Destination  Specifies conversion destination.\n"
 		"             If not specified, will use file extension\n"
 		"             exchanged with \".vhd\" when the source is \".vhdx\", exchanged with \".vhdx\" otherwise.\n"
+		"             Multiple destinations are converted from one reading of source.\n"
 		"-fixed       Make output image is fixed file size type.\n"
 		"-dynamic     Make output image is variable file size type.\n"
 		"             If neither is specified, will be same type as source.\n"
+		"-partition   Make output image from only partition <N> of source. <N> is MBR primary partition or GPT entry number from 1.\n"
+		"-size        Specifies output image disk size by bytes. K, M, G and T suffix are accepted.\n"
+		"             Shrinking fails if source has allocated data beyond new size.\n"
 		"-b           Specifies output image block size by 1MB. It must be power of 2.\n"
 		"             Silently ignore, if output image type doesn't use blocks. (Such as fixed VHD)\n"
+		"-bauto       Select output image block size from source allocation.\n"
+		"             Weighs each clone call and block allocation as <W> KB of output size. (Default is 256)\n"
+		"-align       Specifies output image data alignment by 1KB. It must be power of 2.\n"
+		"             By default, aligned to cluster size. Never aligned less than cluster size.\n"
+		"-layout      Specifies order of output image blocks. Ignored for fixed output image.\n"
+		"             virtual     : Guest address order. (Default)\n"
+		"             source      : Source file order. Maximizes mergeable clone runs.\n"
+		"             hot:<File>  : Blocks listed in access profile <File> first, hottest first.\n"
+		"-punch       Leave zero filled clusters as holes instead of cloning them.\n"
+		"-copybelow   Copy extents smaller than <N> KB instead of cloning them, while measured clone call takes longer than copying them.\n"
+		"             Copied data is not shared with source. Extents refused by reference count limit are always copied.\n"
+		"-stream      Write <Format> (vhd, vhdx, vmdk, vdi or raw) image to <Output> sequentially.\n"
+		"             <Output> is - (standard output), tcp:<Host>:<Port>, named pipe or new file.\n"
+		"-dedup       Convert each <Source> to default destination. Identical data chunks across images are\n"
+		"             cloned from first occurrence, instead of each source.\n"
+		"-mount       Project guest disk of <Source> as <Root>\\<Source name>.raw until Ctrl+C, by Windows Projected File System.\n"
+		"             <Root> must not exist. Writes are denied, unless with :cow, written file becomes local copy.\n"
+		"             Data read is stored in projected file on <Root> volume, and consumes local disk space.\n"
+		"-nbd         Serve each <Source> read only as Network Block Device export named by its file name, until terminated.\n"
+		"             Listens on TCP <Port> of all addresses, or Unix domain socket <Path>.\n"
+		"-daemon      Run conversions submitted to named pipe <Pipe> (Default is MakeVHDX) by worker threads, until terminated.\n"
+		"             Higher priority jobs run first. At most <N> jobs run at once on each volume. (Default is 1)\n"
+		"-submit      Queue conversion to -daemon, and report its progress until completed. (Default priority is 0)\n"
+		"             Same options as conversion are accepted, except -stream.\n"
+		"-info        Report allocation, fragmentation, shared data and clone cost of each <Source> without conversion.\n"
+		"             With :json, reports are written as JSON array.\n"
+		"-compact     Rebuild dynamic VHD/VHDX without zero-ed and orphaned blocks, and replace source with it.\n"
+		"-journal     Build output image as <Destination>.partial and record progress to <Destination>.journal.\n"
+		"             It is renamed to <Destination> when completed. Interrupted conversion is kept to be resumed.\n"
+		"-resume      Continue interrupted -journal conversion. Source, destination and options must be same.\n"
+		"-cache       Keep output in <Dir> on source volume, and clone it whole when same source is converted same way again.\n"
+		"             Not used with -layout:hot. Can't be used with -journal.\n"
 		"-sparse      Make output image is sparse file.\n"
 		"-nosparse    Make output image is non-sparse file.\n"
 		"             By default, output file is also sparse only when source file is sparse.\n"
 		"\n"
+		"Throttle options, to keep latency of other workloads on same volume. All conversion modes accept them.\n"
+		"-clonerate<N>   Limits clone calls to <N> per second.\n"
+		"-metarate<N>    Limits metadata operations, such as file extension for each new block, to <N> per second.\n"
+		"-byterate<N>    Limits cloned bytes to <N> per second. K, M, G and T suffix are accepted.\n"
+		"-latency<N>     Backs off while average latency of operations exceeds <N> milliseconds.\n"
+		"-lowpriority    Issues I/O with low priority hint.\n"
+		"\n"
 		"Supported Image Types and File Extensions\n"
 		"VHDX : .vhdx\n"
 		"VHD  : .vhd\n"
+		"VMDK : .vmdk\n"
+		"VDI  : .vdi\n"
 		"RAW  : .* (Other than above)\n",
 		stderr);
 	ExitProcess(EXIT_FAILURE);
 }
+// Returns 0 if not a number with optional K, M, G or T suffix.
+UINT64 ParseByteSize(PCWSTR text)
+{
+	PWSTR suffix;
+	UINT64 size = wcstoull(text, &suffix, 0);
+	switch (towupper(*suffix))
+	{
+	case L'T':
+		size *= 1024;
+		[[fallthrough]];
+	case L'G':
+		size *= 1024;
+		[[fallthrough]];
+	case L'M':
+		size *= 1024;
+		[[fallthrough]];
+	case L'K':
+		size *= 1024;
+		suffix++;
+		break;
+	}
+	return *suffix == L'\0' ? size : 0;
+}
+std::filesystem::path DefaultDestination(PCWSTR source)
+{
+	std::filesystem::path destination = source;
+	if (_wcsicmp(destination.extension().c_str(), L".vhdx") == 0)
+	{
+		destination.replace_extension(L".vhd");
+	}
+	else
+	{
+		destination.replace_extension(L".vhdx");
+	}
+	return destination;
+}
+int ConvertBatch(const std::vector<PCWSTR>& sources, Option options)
+{
+	DedupIndex dedup_index;
+	options.dedup_index = &dedup_index;
+	int result = EXIT_SUCCESS;
+	for (const auto source : sources)
+	{
+		try
+		{
+			ConvertImage(source, DefaultDestination(source).c_str(), options);
+			puts("");
+		}
+		catch (const std::exception& e)
+		{
+			fprintf(stderr, "\x1B[91m%s\x1B[0m\n\n", e.what());
+			result = EXIT_FAILURE;
+		}
+	}
+	char buf[0x20];
+	printf("Total deduplicated: %s\n", StrFormatByteSize64A(dedup_index.GetDeduplicatedBytes(), buf, std::size(buf)));
+	return result;
+}
+int InspectBatch(const std::vector<PCWSTR>& sources, bool json)
+{
+	int result = EXIT_SUCCESS;
+	if (json)
+	{
+		putchar('[');
+	}
+	for (size_t i = 0; i < sources.size(); i++)
+	{
+		if (json && i != 0)
+		{
+			putchar(',');
+		}
+		try
+		{
+			const auto report = InspectImage(sources[i]);
+			if (json)
+			{
+				PrintImageReportJson(sources[i], report);
+			}
+			else
+			{
+				PrintImageReport(sources[i], report);
+				puts("");
+			}
+		}
+		catch (const std::exception& e)
+		{
+			if (json)
+			{
+				printf("{\"path\":");
+				PrintJsonString(sources[i]);
+				printf(",\"error\":");
+				PrintJsonString(e.what());
+				putchar('}');
+			}
+			else
+			{
+				fprintf(stderr, "%ls\n\x1B[91m%s\x1B[0m\n\n", sources[i], e.what());
+			}
+			result = EXIT_FAILURE;
+		}
+	}
+	if (json)
+	{
+		puts("]");
+	}
+	return result;
+}
+int ServeBatch(const std::vector<PCWSTR>& sources, PCWSTR address)
+{
+	try
+	{
+		ServeNbd(sources, address);
+		return EXIT_SUCCESS;
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "\x1B[91m%s\x1B[0m\n", e.what());
+		return EXIT_FAILURE;
+	}
+}
+int RunDaemonService(PCWSTR pipe_name, UINT32 volume_jobs)
+{
+	try
+	{
+		RunDaemon(pipe_name, volume_jobs);
+		return EXIT_SUCCESS;
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "\x1B[91m%s\x1B[0m\n", e.what());
+		return EXIT_FAILURE;
+	}
+}
 int wmain(int argc, PWSTR argv[])
 {
 	FAIL_FAST_IF_WIN32_BOOL_FALSE(SetDefaultDllDirectories(LOAD_LIBRARY_SEARCH_SYSTEM32));
@@ -49,7 +244,19 @@ int wmain(int argc, PWSTR argv[])
 		usage();
 	}
 	PCWSTR source = nullptr;
-	PCWSTR destination = nullptr;
+	std::vector<PCWSTR> destinations;
+	PCWSTR stream_format = nullptr;
+	bool dedup = false;
+	bool info = false;
+	bool info_json = false;
+	bool mount = false;
+	bool mount_copy_on_write = false;
+	PCWSTR nbd_address = nullptr;
+	PCWSTR daemon_pipe = nullptr;
+	PCWSTR submit_pipe = nullptr;
+	std::optional<INT32> priority;
+	UINT32 volume_jobs = 0;
+	std::vector<PCWSTR> batch_sources;
 	Option options;
 	for (int i = 1; i < argc; i++)
 	{
@@ -85,9 +292,269 @@ int wmain(int argc, PWSTR argv[])
 			}
 			options.sparse = false;
 		}
+		else if (_wcsnicmp(argv[i], L"-stream:", 8) == 0)
+		{
+			if (stream_format)
+			{
+				usage();
+			}
+			stream_format = argv[i] + 8;
+			if (_wcsicmp(stream_format, L"vhd") != 0 && _wcsicmp(stream_format, L"vhdx") != 0 && _wcsicmp(stream_format, L"vmdk") != 0 && _wcsicmp(stream_format, L"vdi") != 0 && _wcsicmp(stream_format, L"raw") != 0)
+			{
+				usage();
+			}
+		}
+		else if (_wcsicmp(argv[i], L"-info") == 0 || _wcsicmp(argv[i], L"-info:json") == 0)
+		{
+			if (info)
+			{
+				usage();
+			}
+			info = true;
+			info_json = argv[i][5] == L':';
+		}
+		else if (_wcsicmp(argv[i], L"-mount") == 0 || _wcsicmp(argv[i], L"-mount:cow") == 0)
+		{
+			if (mount)
+			{
+				usage();
+			}
+			mount = true;
+			mount_copy_on_write = argv[i][6] == L':';
+		}
+		else if (_wcsnicmp(argv[i], L"-nbd:", 5) == 0)
+		{
+			if (nbd_address || argv[i][5] == L'\0')
+			{
+				usage();
+			}
+			nbd_address = argv[i] + 5;
+		}
+		else if (_wcsicmp(argv[i], L"-daemon") == 0 || _wcsnicmp(argv[i], L"-daemon:", 8) == 0)
+		{
+			if (daemon_pipe || (argv[i][7] == L':' && argv[i][8] == L'\0'))
+			{
+				usage();
+			}
+			daemon_pipe = argv[i][7] == L':' ? argv[i] + 8 : DAEMON_DEFAULT_PIPE_NAME;
+		}
+		else if (_wcsicmp(argv[i], L"-submit") == 0 || _wcsnicmp(argv[i], L"-submit:", 8) == 0)
+		{
+			if (submit_pipe || (argv[i][7] == L':' && argv[i][8] == L'\0'))
+			{
+				usage();
+			}
+			submit_pipe = argv[i][7] == L':' ? argv[i] + 8 : DAEMON_DEFAULT_PIPE_NAME;
+		}
+		else if (_wcsnicmp(argv[i], L"-priority", 9) == 0)
+		{
+			PWSTR end;
+			if (priority || argv[i][9] == L'\0')
+			{
+				usage();
+			}
+			priority = wcstol(argv[i] + 9, &end, 0);
+			if (*end != L'\0')
+			{
+				usage();
+			}
+		}
+		else if (_wcsnicmp(argv[i], L"-copybelow", 10) == 0)
+		{
+			if (options.copy_limit || wcslen(argv[i]) < 11)
+			{
+				usage();
+			}
+			options.copy_limit = wcstoul(argv[i] + 10, nullptr, 0) * 1024;
+			if (options.copy_limit == 0)
+			{
+				usage();
+			}
+		}
+		else if (_wcsnicmp(argv[i], L"-volumejobs", 11) == 0)
+		{
+			if (volume_jobs || wcslen(argv[i]) < 12)
+			{
+				usage();
+			}
+			volume_jobs = wcstoul(argv[i] + 11, nullptr, 0);
+			if (volume_jobs == 0)
+			{
+				usage();
+			}
+		}
+		else if (_wcsicmp(argv[i], L"-dedup") == 0)
+		{
+			if (dedup)
+			{
+				usage();
+			}
+			dedup = true;
+		}
+		else if (_wcsicmp(argv[i], L"-compact") == 0)
+		{
+			if (options.compact)
+			{
+				usage();
+			}
+			options.compact = true;
+		}
+		else if (_wcsicmp(argv[i], L"-journal") == 0 || _wcsicmp(argv[i], L"-resume") == 0)
+		{
+			if (options.journal)
+			{
+				usage();
+			}
+			options.journal = true;
+			options.resume = _wcsicmp(argv[i], L"-resume") == 0;
+		}
+		else if (_wcsicmp(argv[i], L"-punch") == 0)
+		{
+			if (options.punch_zero)
+			{
+				usage();
+			}
+			options.punch_zero = true;
+		}
+		else if (_wcsnicmp(argv[i], L"-align", 6) == 0)
+		{
+			if (options.alignment || wcslen(argv[i]) < 7)
+			{
+				usage();
+			}
+			options.alignment = wcstoul(argv[i] + 6, nullptr, 0) * 1024;
+			if (!std::has_single_bit(options.alignment))
+			{
+				usage();
+			}
+		}
+		else if (_wcsnicmp(argv[i], L"-layout:", 8) == 0)
+		{
+			if (options.layout != LayoutPolicy::Virtual)
+			{
+				usage();
+			}
+			if (_wcsicmp(argv[i] + 8, L"virtual") == 0)
+			{
+				options.layout = LayoutPolicy::Virtual;
+			}
+			else if (_wcsicmp(argv[i] + 8, L"source") == 0)
+			{
+				options.layout = LayoutPolicy::Source;
+			}
+			else if (_wcsnicmp(argv[i] + 8, L"hot:", 4) == 0 && argv[i][12] != L'\0')
+			{
+				options.layout = LayoutPolicy::Hot;
+				options.access_profile = argv[i] + 12;
+			}
+			else
+			{
+				usage();
+			}
+		}
+		else if (_wcsnicmp(argv[i], L"-cache:", 7) == 0)
+		{
+			if (options.cache_directory || argv[i][7] == L'\0')
+			{
+				usage();
+			}
+			options.cache_directory = argv[i] + 7;
+		}
+		else if (_wcsnicmp(argv[i], L"-partition", 10) == 0)
+		{
+			if (options.partition || wcslen(argv[i]) < 11)
+			{
+				usage();
+			}
+			options.partition = wcstoul(argv[i] + 10, nullptr, 0);
+			if (options.partition == 0)
+			{
+				usage();
+			}
+		}
+		else if (_wcsnicmp(argv[i], L"-clonerate", 10) == 0)
+		{
+			if (options.io_budget.clone_calls_per_second || wcslen(argv[i]) < 11)
+			{
+				usage();
+			}
+			options.io_budget.clone_calls_per_second = wcstoul(argv[i] + 10, nullptr, 0);
+			if (options.io_budget.clone_calls_per_second == 0)
+			{
+				usage();
+			}
+		}
+		else if (_wcsnicmp(argv[i], L"-metarate", 9) == 0)
+		{
+			if (options.io_budget.metadata_operations_per_second || wcslen(argv[i]) < 10)
+			{
+				usage();
+			}
+			options.io_budget.metadata_operations_per_second = wcstoul(argv[i] + 9, nullptr, 0);
+			if (options.io_budget.metadata_operations_per_second == 0)
+			{
+				usage();
+			}
+		}
+		else if (_wcsnicmp(argv[i], L"-byterate", 9) == 0)
+		{
+			if (options.io_budget.bytes_per_second || wcslen(argv[i]) < 10)
+			{
+				usage();
+			}
+			options.io_budget.bytes_per_second = ParseByteSize(argv[i] + 9);
+			if (options.io_budget.bytes_per_second == 0)
+			{
+				usage();
+			}
+		}
+		else if (_wcsnicmp(argv[i], L"-latency", 8) == 0)
+		{
+			if (options.io_budget.target_latency_milliseconds || wcslen(argv[i]) < 9)
+			{
+				usage();
+			}
+			options.io_budget.target_latency_milliseconds = wcstoul(argv[i] + 8, nullptr, 0);
+			if (options.io_budget.target_latency_milliseconds == 0)
+			{
+				usage();
+			}
+		}
+		else if (_wcsicmp(argv[i], L"-lowpriority") == 0)
+		{
+			if (options.io_budget.low_priority)
+			{
+				usage();
+			}
+			options.io_budget.low_priority = true;
+		}
+		else if (_wcsnicmp(argv[i], L"-size", 5) == 0)
+		{
+			if (options.disk_size || wcslen(argv[i]) < 6)
+			{
+				usage();
+			}
+			options.disk_size = ParseByteSize(argv[i] + 5);
+			if (options.disk_size == 0)
+			{
+				usage();
+			}
+		}
+		else if (_wcsnicmp(argv[i], L"-bauto", 6) == 0)
+		{
+			if (options.block_size || options.auto_block_size || (argv[i][6] != L'\0' && argv[i][6] != L':'))
+			{
+				usage();
+			}
+			options.auto_block_size = true;
+			if (argv[i][6] == L':')
+			{
+				options.auto_block_weight = wcstoul(argv[i] + 7, nullptr, 0) * 1024;
+			}
+		}
 		else if (_wcsnicmp(argv[i], L"-b", 2) == 0)
 		{
-			if (options.block_size || wcslen(argv[i]) < 3)
+			if (options.block_size || options.auto_block_size || wcslen(argv[i]) < 3)
 			{
 				usage();
 			}
@@ -97,61 +564,139 @@ int wmain(int argc, PWSTR argv[])
 				usage();
 			}
 		}
+		else if (dedup || info || nbd_address)
+		{
+			batch_sources.push_back(argv[i]);
+		}
 		else if (source == nullptr)
 		{
 			source = argv[i];
 		}
-		else if (destination == nullptr)
+		else
 		{
-			destination = argv[i];
+			destinations.push_back(argv[i]);
 		}
-		else
+	}
+	if (daemon_pipe)
+	{
+		if (source || !batch_sources.empty() || dedup || info || mount || nbd_address || submit_pipe || priority || stream_format || options.compact || options.journal)
 		{
 			usage();
 		}
+		return RunDaemonService(daemon_pipe, volume_jobs ? volume_jobs : 1);
+	}
+	if (volume_jobs || (priority && !submit_pipe))
+	{
+		usage();
+	}
+	if (info)
+	{
+		if (batch_sources.empty() || source || dedup || mount || nbd_address || submit_pipe || stream_format || options.compact || options.journal)
+		{
+			usage();
+		}
+		return InspectBatch(batch_sources, info_json);
+	}
+	if (nbd_address)
+	{
+		if (batch_sources.empty() || source || dedup || mount || submit_pipe || stream_format || options.compact || options.journal || options.partition)
+		{
+			usage();
+		}
+		return ServeBatch(batch_sources, nbd_address);
+	}
+	if (dedup)
+	{
+		if (batch_sources.empty() || source || mount || submit_pipe || stream_format || options.compact || options.journal || options.partition || options.cache_directory)
+		{
+			usage();
+		}
+		return ConvertBatch(batch_sources, options);
 	}
 	if (source == nullptr)
 	{
 		usage();
 	}
+	if (mount && (destinations.size() != 1 || submit_pipe || stream_format || options.compact || options.journal || options.partition || options.cache_directory))
+	{
+		usage();
+	}
 	std::filesystem::path destination_buffer;
-	if (destination == nullptr)
+	if (options.compact)
 	{
+		if (!destinations.empty() || stream_format || options.fixed || options.disk_size || options.auto_block_size || options.partition || options.cache_directory)
+		{
+			usage();
+		}
+		options.punch_zero = true;
 		destination_buffer = source;
-		if (_wcsicmp(destination_buffer.extension().c_str(), L".vhdx") == 0)
+		destination_buffer += L".compact";
+		destinations.push_back(destination_buffer.c_str());
+	}
+	else if (stream_format)
+	{
+		if (destinations.size() != 1 || submit_pipe || options.journal || options.cache_directory)
 		{
-			destination_buffer.replace_extension(L".vhd");
+			usage();
 		}
-		else
+		options.stream_format = stream_format;
+		options.stream_output = destinations.front();
+		if (wcscmp(options.stream_output, L"-") == 0)
 		{
-			destination_buffer.replace_extension(L".vhdx");
+			// Keep standard output for image data, and send messages to standard error.
+			const HANDLE stdout_handle = GetStdHandle(STD_OUTPUT_HANDLE);
+			fflush(stdout);
+			_dup2(_fileno(stderr), _fileno(stdout));
+			SetStdHandle(STD_OUTPUT_HANDLE, stdout_handle);
 		}
-		destination = destination_buffer.c_str();
+	}
+	else if (destinations.empty())
+	{
+		destination_buffer = DefaultDestination(source);
+		destinations.push_back(destination_buffer.c_str());
 	}
 
 	try
 	{
-		ConvertImage(source, destination, options);
+		if (mount)
+		{
+			MountImage(source, destinations.front(), mount_copy_on_write);
+			return EXIT_SUCCESS;
+		}
+		if (submit_pipe)
+		{
+			SubmitJob(submit_pipe, priority.value_or(0), source, destinations, options);
+			puts("\nDone.");
+			return EXIT_SUCCESS;
+		}
+		ConvertImage(source, destinations, options);
 		puts("\nDone.");
 #ifdef _DEBUG
+		if (options.compact || options.stream_output)
+		{
+			return EXIT_SUCCESS;
+		}
 		// because QEMU's autodetection will mistakenly identify fixed VHD as RAW.
 		const bool s_is_vhd = (_wcsicmp(std::filesystem::path(source).extension().c_str(), L".vhd") == 0);
-		const bool d_is_vhd = (_wcsicmp(std::filesystem::path(destination).extension().c_str(), L".vhd") == 0);
 		setlocale(LC_CTYPE, ".utf8");
 		SetConsoleCP(CP_UTF8);
 		SetConsoleOutputCP(CP_UTF8);
-		wil::unique_pipe ps(_popen("Powershell.exe -Command -", "w"));
-		if (d_is_vhd)
-		{
-			fprintf(ps.get(), "$VHD = Get-VHD '%ls';", destination);
-			fprintf(ps.get(), R"(if($VHD.Alignment -EQ 1){Write-Output "$([char]27)[92m"}else{Write-Output "$([char]27)[91m";Write-Output '[BUG]'})");
-			fprintf(ps.get(), R"(Write-Output "$([char]27)[3F";)" "\n");
-			fprintf(ps.get(), "$VHD | Format-List Path,Alignment;");
-			fprintf(ps.get(), R"(Write-Output "$([char]27)[0m$([char]27)[4F";)" "\n");
-		}
-		fprintf(ps.get(), R"(Write-Output "$([char]27)[93m";)");
-		fprintf(ps.get(), R"(qemu-img.exe compare -p %s "%ls" %s "%ls";)", s_is_vhd ? "-f vpc" : "", source, d_is_vhd ? "-F vpc" : "", destination);
-		fprintf(ps.get(), R"(Write-Output "$([char]27)[2F$([char]27)[0m";)" "\n");
+		for (const auto destination : destinations)
+		{
+			const bool d_is_vhd = (_wcsicmp(std::filesystem::path(destination).extension().c_str(), L".vhd") == 0);
+			wil::unique_pipe ps(_popen("Powershell.exe -Command -", "w"));
+			if (d_is_vhd)
+			{
+				fprintf(ps.get(), "$VHD = Get-VHD '%ls';", destination);
+				fprintf(ps.get(), R"(if($VHD.Alignment -EQ 1){Write-Output "$([char]27)[92m"}else{Write-Output "$([char]27)[91m";Write-Output '[BUG]'})");
+				fprintf(ps.get(), R"(Write-Output "$([char]27)[3F";)" "\n");
+				fprintf(ps.get(), "$VHD | Format-List Path,Alignment;");
+				fprintf(ps.get(), R"(Write-Output "$([char]27)[0m$([char]27)[4F";)" "\n");
+			}
+			fprintf(ps.get(), R"(Write-Output "$([char]27)[93m";)");
+			fprintf(ps.get(), R"(qemu-img.exe compare -p %s "%ls" %s "%ls";)", s_is_vhd ? "-f vpc" : "", source, d_is_vhd ? "-F vpc" : "", destination);
+			fprintf(ps.get(), R"(Write-Output "$([char]27)[2F$([char]27)[0m";)" "\n");
+		}
 #endif
 	}
 	catch (const wil::ResultException& e)
@@ -0,0 +1,178 @@
+#define NOMINMAX
+#include <windows.h>
+#include <wil/result.h>
+#include <cstddef>
+#include <new>
+#include <string>
+#include "ConvertImage.h"
+#include "MakeVHDXApi.h"
+
+struct MAKEVHDX_CONTEXT
+{
+	Conversion conversion;
+	DWORD last_error = ERROR_SUCCESS;
+	std::string last_error_message;
+};
+static MAKEVHDX_RESULT Fail(MAKEVHDX_CONTEXT* context, MAKEVHDX_RESULT result, DWORD error, const std::exception& e) noexcept
+{
+	context->last_error = error;
+	try
+	{
+		context->last_error_message = e.what();
+	}
+	catch (const std::bad_alloc&)
+	{
+		context->last_error_message.clear();
+	}
+	return result;
+}
+template <typename Fn>
+static MAKEVHDX_RESULT Translate(MAKEVHDX_CONTEXT* context, Fn&& fn) noexcept
+{
+	try
+	{
+		fn();
+	}
+	catch (const ConversionCancelled& e)
+	{
+		return Fail(context, MAKEVHDX_CANCELLED, ERROR_CANCELLED, e);
+	}
+	catch (const wil::ResultException& e)
+	{
+		const HRESULT hr = e.GetErrorCode();
+		return Fail(context, MAKEVHDX_WIN32_ERROR, HRESULT_FACILITY(hr) == FACILITY_WIN32 ? HRESULT_CODE(hr) : hr, e);
+	}
+	catch (const std::bad_alloc& e)
+	{
+		return Fail(context, MAKEVHDX_OUT_OF_MEMORY, ERROR_NOT_ENOUGH_MEMORY, e);
+	}
+	catch (const std::invalid_argument& e)
+	{
+		return Fail(context, MAKEVHDX_INVALID_ARGUMENT, ERROR_INVALID_PARAMETER, e);
+	}
+	catch (const std::logic_error& e)
+	{
+		return Fail(context, MAKEVHDX_INVALID_STATE, ERROR_INVALID_STATE, e);
+	}
+	catch (const std::exception& e)
+	{
+		return Fail(context, MAKEVHDX_UNSUPPORTED, ERROR_NOT_SUPPORTED, e);
+	}
+	context->last_error = ERROR_SUCCESS;
+	context->last_error_message.clear();
+	return MAKEVHDX_OK;
+}
+MAKEVHDX_RESULT WINAPI MakeVhdxOpen(PCWSTR SourcePath, MAKEVHDX_CONTEXT** Context)
+{
+	if (!SourcePath || !Context)
+	{
+		return MAKEVHDX_INVALID_ARGUMENT;
+	}
+	*Context = new(std::nothrow) MAKEVHDX_CONTEXT;
+	if (!*Context)
+	{
+		return MAKEVHDX_OUT_OF_MEMORY;
+	}
+	return Translate(*Context, [&] { (*Context)->conversion.Open(SourcePath); });
+}
+MAKEVHDX_RESULT WINAPI MakeVhdxPlan(MAKEVHDX_CONTEXT* Context, PCWSTR DestinationPath, const MAKEVHDX_OPTIONS* Options)
+{
+	if (!Context || !DestinationPath || (Options && Options->Size < offsetof(MAKEVHDX_OPTIONS, Journal)))
+	{
+		return MAKEVHDX_INVALID_ARGUMENT;
+	}
+	return Translate(Context, [&]
+	{
+		Option options;
+		if (Options)
+		{
+			if (Options->Layout > MAKEVHDX_LAYOUT_HOT || (Options->Layout == MAKEVHDX_LAYOUT_HOT && !Options->AccessProfile))
+			{
+				throw std::invalid_argument("Access profile is required for hot first layout.");
+			}
+			options.disk_size = Options->DiskSize;
+			options.block_size = Options->BlockSize;
+			options.alignment = Options->Alignment;
+			options.auto_block_size = Options->AutoBlockSize;
+			if (Options->AutoBlockWeight)
+			{
+				options.auto_block_weight = Options->AutoBlockWeight;
+			}
+			options.layout = static_cast<LayoutPolicy>(Options->Layout);
+			options.access_profile = Options->AccessProfile;
+			options.punch_zero = Options->PunchZero;
+			if (Options->Fixed >= 0)
+			{
+				options.fixed = Options->Fixed != 0;
+			}
+			if (Options->Sparse >= 0)
+			{
+				options.sparse = Options->Sparse != 0;
+			}
+			if (Options->Size >= offsetof(MAKEVHDX_OPTIONS, CloneCallsPerSecond))
+			{
+				options.resume = Options->Resume;
+				options.journal = Options->Journal || Options->Resume;
+			}
+			if (Options->Size >= sizeof(MAKEVHDX_OPTIONS))
+			{
+				options.io_budget = {
+					.clone_calls_per_second = Options->CloneCallsPerSecond,
+					.metadata_operations_per_second = Options->MetadataOperationsPerSecond,
+					.bytes_per_second = Options->BytesPerSecond,
+					.target_latency_milliseconds = Options->TargetLatencyMilliseconds,
+					.low_priority = Options->LowPriority != FALSE,
+				};
+			}
+		}
+		Context->conversion.Plan(DestinationPath, options);
+	});
+}
+MAKEVHDX_RESULT WINAPI MakeVhdxExecute(MAKEVHDX_CONTEXT* Context, MAKEVHDX_PROGRESS_CALLBACK Callback, PVOID CallbackContext)
+{
+	if (!Context)
+	{
+		return MAKEVHDX_INVALID_ARGUMENT;
+	}
+	return Translate(Context, [&]
+	{
+		if (Callback)
+		{
+			Context->conversion.Execute([&](UINT64 done_bytes, UINT64 total_bytes) { Callback(CallbackContext, done_bytes, total_bytes); });
+		}
+		else
+		{
+			Context->conversion.Execute();
+		}
+	});
+}
+void WINAPI MakeVhdxCancel(MAKEVHDX_CONTEXT* Context)
+{
+	if (Context)
+	{
+		Context->conversion.Cancel();
+	}
+}
+void WINAPI MakeVhdxGetProgress(const MAKEVHDX_CONTEXT* Context, UINT64* DoneBytes, UINT64* TotalBytes)
+{
+	if (DoneBytes)
+	{
+		*DoneBytes = Context ? Context->conversion.GetDoneBytes() : 0;
+	}
+	if (TotalBytes)
+	{
+		*TotalBytes = Context ? Context->conversion.GetTotalBytes() : 0;
+	}
+}
+DWORD WINAPI MakeVhdxGetLastError(const MAKEVHDX_CONTEXT* Context)
+{
+	return Context ? Context->last_error : ERROR_INVALID_PARAMETER;
+}
+PCSTR WINAPI MakeVhdxGetLastErrorMessage(const MAKEVHDX_CONTEXT* Context)
+{
+	return Context ? Context->last_error_message.c_str() : "";
+}
+void WINAPI MakeVhdxClose(MAKEVHDX_CONTEXT* Context)
+{
+	delete Context;
+}
\ No newline at end of file
@@ -0,0 +1,71 @@
+#pragma once
+#include <windows.h>
+
+#ifdef MAKEVHDX_EXPORTS
+#define MAKEVHDX_API __declspec(dllexport)
+#else
+#define MAKEVHDX_API __declspec(dllimport)
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Stable C interface of MakeVHDXLib.dll. Each context is one conversion.
+// Contexts are independent and may be used from different threads,
+// but calls on same context must not overlap, except MakeVhdxCancel and MakeVhdxGetProgress.
+typedef struct MAKEVHDX_CONTEXT MAKEVHDX_CONTEXT;
+typedef enum MAKEVHDX_RESULT
+{
+	MAKEVHDX_OK = 0,
+	MAKEVHDX_INVALID_ARGUMENT = 1,
+	MAKEVHDX_INVALID_STATE = 2,
+	MAKEVHDX_OUT_OF_MEMORY = 3,
+	MAKEVHDX_UNSUPPORTED = 4,
+	MAKEVHDX_CANCELLED = 5,
+	MAKEVHDX_WIN32_ERROR = 6,
+} MAKEVHDX_RESULT;
+typedef enum MAKEVHDX_LAYOUT
+{
+	MAKEVHDX_LAYOUT_VIRTUAL = 0,
+	MAKEVHDX_LAYOUT_SOURCE = 1,
+	MAKEVHDX_LAYOUT_HOT = 2,
+} MAKEVHDX_LAYOUT;
+typedef struct MAKEVHDX_OPTIONS
+{
+	UINT32 Size;             // sizeof(MAKEVHDX_OPTIONS)
+	UINT64 DiskSize;         // 0: same as source
+	UINT32 BlockSize;        // 0: format default
+	UINT32 Alignment;        // 0: cluster size
+	BOOL AutoBlockSize;
+	UINT32 AutoBlockWeight;  // 0: default
+	MAKEVHDX_LAYOUT Layout;
+	PCWSTR AccessProfile;    // Required for MAKEVHDX_LAYOUT_HOT. Must be valid until MakeVhdxExecute returns.
+	BOOL PunchZero;
+	INT32 Fixed;             // -1: same as source, 0: dynamic, 1: fixed
+	INT32 Sparse;            // -1: same as source, 0: not sparse, 1: sparse
+	// Fields below are read only when Size covers them.
+	BOOL Journal;            // Build as <Destination>.partial with <Destination>.journal, and rename when completed.
+	BOOL Resume;             // Continue interrupted journaled conversion. Implies Journal.
+	UINT32 CloneCallsPerSecond;          // 0: unlimited
+	UINT32 MetadataOperationsPerSecond;  // 0: unlimited
+	UINT64 BytesPerSecond;               // 0: unlimited
+	UINT32 TargetLatencyMilliseconds;    // 0: not adaptive
+	BOOL LowPriority;
+} MAKEVHDX_OPTIONS;
+typedef void (CALLBACK* MAKEVHDX_PROGRESS_CALLBACK)(PVOID Context, UINT64 DoneBytes, UINT64 TotalBytes);
+
+// Context is returned even if opening failed, to get error. Always close it.
+MAKEVHDX_API MAKEVHDX_RESULT WINAPI MakeVhdxOpen(PCWSTR SourcePath, MAKEVHDX_CONTEXT** Context);
+MAKEVHDX_API MAKEVHDX_RESULT WINAPI MakeVhdxPlan(MAKEVHDX_CONTEXT* Context, PCWSTR DestinationPath, const MAKEVHDX_OPTIONS* Options);
+MAKEVHDX_API MAKEVHDX_RESULT WINAPI MakeVhdxExecute(MAKEVHDX_CONTEXT* Context, MAKEVHDX_PROGRESS_CALLBACK Callback, PVOID CallbackContext);
+MAKEVHDX_API void WINAPI MakeVhdxCancel(MAKEVHDX_CONTEXT* Context);
+MAKEVHDX_API void WINAPI MakeVhdxGetProgress(const MAKEVHDX_CONTEXT* Context, UINT64* DoneBytes, UINT64* TotalBytes);
+// Win32 error code and message of last failed call on this context.
+MAKEVHDX_API DWORD WINAPI MakeVhdxGetLastError(const MAKEVHDX_CONTEXT* Context);
+MAKEVHDX_API PCSTR WINAPI MakeVhdxGetLastErrorMessage(const MAKEVHDX_CONTEXT* Context);
+MAKEVHDX_API void WINAPI MakeVhdxClose(MAKEVHDX_CONTEXT* Context);
+
+#ifdef __cplusplus
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,224 @@
+#define NOMINMAX
+#include <windows.h>
+#include <winioctl.h>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include "MemoryFile.h"
+// Other handles go to the real APIs.
+#undef ReadFile
+#undef WriteFile
+#undef GetFileSizeEx
+#undef SetFileInformationByHandle
+#undef DeviceIoControl
+#undef FlushFileBuffers
+
+namespace
+{
+	struct MemoryFile
+	{
+		// Indexed by offset / MEMORY_FILE_PAGE_SIZE. Cloned pages are shared until written.
+		std::unordered_map<UINT64, std::shared_ptr<BYTE[]>> pages;
+		UINT64 size = 0;
+		UINT64 position = 0;
+	};
+	std::unordered_set<HANDLE> memory_files;
+	MemoryFile* FindMemoryFile(HANDLE file)
+	{
+		return memory_files.contains(file) ? static_cast<MemoryFile*>(file) : nullptr;
+	}
+	UINT64 GetOffset(MemoryFile& memory_file, LPOVERLAPPED overlapped)
+	{
+		return overlapped ? static_cast<UINT64>(overlapped->OffsetHigh) << 32 | overlapped->Offset : memory_file.position;
+	}
+	BYTE* GetWritablePage(MemoryFile& memory_file, UINT64 index)
+	{
+		auto& page = memory_file.pages[index];
+		if (!page)
+		{
+			page = std::make_shared<BYTE[]>(MEMORY_FILE_PAGE_SIZE);
+		}
+		else if (page.use_count() > 1)
+		{
+			auto copy = std::make_shared_for_overwrite<BYTE[]>(MEMORY_FILE_PAGE_SIZE);
+			memcpy(copy.get(), page.get(), MEMORY_FILE_PAGE_SIZE);
+			page = std::move(copy);
+		}
+		return page.get();
+	}
+	void Truncate(MemoryFile& memory_file, UINT64 size)
+	{
+		std::erase_if(memory_file.pages, [&](const auto& page) { return page.first * MEMORY_FILE_PAGE_SIZE >= size; });
+		if (const UINT32 tail = size % MEMORY_FILE_PAGE_SIZE; tail != 0 && memory_file.pages.contains(size / MEMORY_FILE_PAGE_SIZE))
+		{
+			memset(GetWritablePage(memory_file, size / MEMORY_FILE_PAGE_SIZE) + tail, 0, MEMORY_FILE_PAGE_SIZE - tail);
+		}
+		memory_file.size = size;
+	}
+}
+HANDLE CreateMemoryFile()
+{
+	const HANDLE file = new MemoryFile;
+	memory_files.insert(file);
+	return file;
+}
+void CloseMemoryFile(HANDLE file)
+{
+	if (memory_files.erase(file))
+	{
+		delete static_cast<MemoryFile*>(file);
+	}
+}
+BOOL WINAPI MemoryReadFile(HANDLE file, LPVOID buffer, DWORD size, LPDWORD read, LPOVERLAPPED overlapped)
+{
+	const auto memory_file = FindMemoryFile(file);
+	if (!memory_file)
+	{
+		return ReadFile(file, buffer, size, read, overlapped);
+	}
+	const UINT64 offset = GetOffset(*memory_file, overlapped);
+	if (overlapped && offset >= memory_file->size)
+	{
+		SetLastError(ERROR_HANDLE_EOF);
+		return FALSE;
+	}
+	const DWORD read_size = static_cast<DWORD>(std::min<UINT64>(size, memory_file->size - std::min(offset, memory_file->size)));
+	for (DWORD done = 0; done < read_size;)
+	{
+		const UINT64 index = (offset + done) / MEMORY_FILE_PAGE_SIZE;
+		const UINT32 page_offset = (offset + done) % MEMORY_FILE_PAGE_SIZE;
+		const DWORD chunk = std::min(read_size - done, MEMORY_FILE_PAGE_SIZE - page_offset);
+		if (const auto page = memory_file->pages.find(index); page != memory_file->pages.end())
+		{
+			memcpy(static_cast<BYTE*>(buffer) + done, page->second.get() + page_offset, chunk);
+		}
+		else
+		{
+			memset(static_cast<BYTE*>(buffer) + done, 0, chunk);
+		}
+		done += chunk;
+	}
+	memory_file->position = offset + read_size;
+	if (read)
+	{
+		*read = read_size;
+	}
+	return TRUE;
+}
+BOOL WINAPI MemoryWriteFile(HANDLE file, LPCVOID buffer, DWORD size, LPDWORD written, LPOVERLAPPED overlapped)
+{
+	const auto memory_file = FindMemoryFile(file);
+	if (!memory_file)
+	{
+		return WriteFile(file, buffer, size, written, overlapped);
+	}
+	const UINT64 offset = GetOffset(*memory_file, overlapped);
+	for (DWORD done = 0; done < size;)
+	{
+		const UINT32 page_offset = (offset + done) % MEMORY_FILE_PAGE_SIZE;
+		const DWORD chunk = std::min(size - done, MEMORY_FILE_PAGE_SIZE - page_offset);
+		memcpy(GetWritablePage(*memory_file, (offset + done) / MEMORY_FILE_PAGE_SIZE) + page_offset, static_cast<const BYTE*>(buffer) + done, chunk);
+		done += chunk;
+	}
+	memory_file->position = offset + size;
+	memory_file->size = std::max(memory_file->size, offset + size);
+	if (written)
+	{
+		*written = size;
+	}
+	return TRUE;
+}
+BOOL WINAPI MemoryGetFileSizeEx(HANDLE file, PLARGE_INTEGER file_size)
+{
+	const auto memory_file = FindMemoryFile(file);
+	if (!memory_file)
+	{
+		return GetFileSizeEx(file, file_size);
+	}
+	file_size->QuadPart = static_cast<LONGLONG>(memory_file->size);
+	return TRUE;
+}
+BOOL WINAPI MemorySetFileInformationByHandle(HANDLE file, FILE_INFO_BY_HANDLE_CLASS information_class, LPVOID information, DWORD size)
+{
+	const auto memory_file = FindMemoryFile(file);
+	if (!memory_file)
+	{
+		return SetFileInformationByHandle(file, information_class, information, size);
+	}
+	if (information_class == FileEndOfFileInfo && size >= sizeof(FILE_END_OF_FILE_INFO))
+	{
+		const LONGLONG end_of_file = static_cast<const FILE_END_OF_FILE_INFO*>(information)->EndOfFile.QuadPart;
+		if (end_of_file < 0)
+		{
+			SetLastError(ERROR_INVALID_PARAMETER);
+			return FALSE;
+		}
+		Truncate(*memory_file, end_of_file);
+		return TRUE;
+	}
+	// Priority hints and dispositions have no effect in memory.
+	return TRUE;
+}
+BOOL WINAPI MemoryDeviceIoControl(HANDLE file, DWORD control_code, LPVOID in_buffer, DWORD in_size, LPVOID out_buffer, DWORD out_size, LPDWORD returned, LPOVERLAPPED overlapped)
+{
+	const auto memory_file = FindMemoryFile(file);
+	if (!memory_file)
+	{
+		return DeviceIoControl(file, control_code, in_buffer, in_size, out_buffer, out_size, returned, overlapped);
+	}
+	if (returned)
+	{
+		*returned = 0;
+	}
+	if (control_code == FSCTL_SET_SPARSE)
+	{
+		return TRUE;
+	}
+	if (control_code != FSCTL_DUPLICATE_EXTENTS_TO_FILE || in_size < sizeof(DUPLICATE_EXTENTS_DATA))
+	{
+		SetLastError(ERROR_INVALID_FUNCTION);
+		return FALSE;
+	}
+	const auto& dup_extent = *static_cast<const DUPLICATE_EXTENTS_DATA*>(in_buffer);
+	const auto source_file = FindMemoryFile(dup_extent.FileHandle);
+	if (!source_file)
+	{
+		SetLastError(ERROR_NOT_SAME_DEVICE);
+		return FALSE;
+	}
+	const UINT64 source_offset = dup_extent.SourceFileOffset.QuadPart;
+	const UINT64 target_offset = dup_extent.TargetFileOffset.QuadPart;
+	const UINT64 length = dup_extent.ByteCount.QuadPart;
+	if (source_offset % MEMORY_FILE_PAGE_SIZE != 0 || target_offset % MEMORY_FILE_PAGE_SIZE != 0 || length % MEMORY_FILE_PAGE_SIZE != 0 || source_offset + length > source_file->size)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+	for (UINT64 i = 0; i < length / MEMORY_FILE_PAGE_SIZE; i++)
+	{
+		const UINT64 target_index = target_offset / MEMORY_FILE_PAGE_SIZE + i;
+		if (const auto page = source_file->pages.find(source_offset / MEMORY_FILE_PAGE_SIZE + i); page != source_file->pages.end())
+		{
+			// Copy the pointer first, as source and target may be the same map.
+			std::shared_ptr<BYTE[]> shared = page->second;
+			memory_file->pages[target_index] = std::move(shared);
+		}
+		else
+		{
+			memory_file->pages.erase(target_index);
+		}
+	}
+	memory_file->size = std::max(memory_file->size, target_offset + length);
+	return TRUE;
+}
+BOOL WINAPI MemoryFlushFileBuffers(HANDLE file)
+{
+	const auto memory_file = FindMemoryFile(file);
+	if (!memory_file)
+	{
+		return FlushFileBuffers(file);
+	}
+	return TRUE;
+}
\ No newline at end of file
@@ -0,0 +1,23 @@
+#pragma once
+// Forced include of MakeVHDXBench and MakeVHDXCheck. File APIs used by image code are routed to in-memory files, so they involve no disk.
+// Handles not made by CreateMemoryFile are passed to the real APIs. Not thread safe.
+#define NOMINMAX
+#include <windows.h>
+
+constexpr UINT32 MEMORY_FILE_PAGE_SIZE = 4096;
+// Empty file. Unwritten ranges read as zero, like a sparse file.
+HANDLE CreateMemoryFile();
+void CloseMemoryFile(HANDLE file);
+BOOL WINAPI MemoryReadFile(HANDLE file, LPVOID buffer, DWORD size, LPDWORD read, LPOVERLAPPED overlapped);
+BOOL WINAPI MemoryWriteFile(HANDLE file, LPCVOID buffer, DWORD size, LPDWORD written, LPOVERLAPPED overlapped);
+BOOL WINAPI MemoryGetFileSizeEx(HANDLE file, PLARGE_INTEGER file_size);
+BOOL WINAPI MemorySetFileInformationByHandle(HANDLE file, FILE_INFO_BY_HANDLE_CLASS information_class, LPVOID information, DWORD size);
+// FSCTL_DUPLICATE_EXTENTS_TO_FILE shares pages between memory files, as block cloning shares clusters.
+BOOL WINAPI MemoryDeviceIoControl(HANDLE file, DWORD control_code, LPVOID in_buffer, DWORD in_size, LPVOID out_buffer, DWORD out_size, LPDWORD returned, LPOVERLAPPED overlapped);
+BOOL WINAPI MemoryFlushFileBuffers(HANDLE file);
+#define ReadFile MemoryReadFile
+#define WriteFile MemoryWriteFile
+#define GetFileSizeEx MemoryGetFileSizeEx
+#define SetFileInformationByHandle MemorySetFileInformationByHandle
+#define DeviceIoControl MemoryDeviceIoControl
+#define FlushFileBuffers MemoryFlushFileBuffers
\ No newline at end of file
@@ -0,0 +1,40 @@
+#pragma once
+#include <windows.h>
+#include <wil/resource.h>
+#include <vector>
+#include "Image.h"
+#include "MemoryFile.h"
+
+// Images on in-memory files, shared by benchmarks and checks.
+constexpr UINT32 MEMORY_IMAGE_CLUSTER_SIZE = 4096;
+using unique_memory_file = wil::unique_any<HANDLE, decltype(&::CloseMemoryFile), ::CloseMemoryFile>;
+// Dynamic image with every stride-th block allocated, as written by conversion.
+// With write_data, each 8 bytes of allocated guest data hold their own guest offset. Otherwise blocks read as zero.
+template <typename ImageType>
+unique_memory_file BuildImage(UINT64 disk_size, UINT32 block_size = 0, UINT32 stride = 2, bool write_data = false)
+{
+	unique_memory_file file(CreateMemoryFile());
+	ImageType image;
+	image.Attach(file.get(), MEMORY_IMAGE_CLUSTER_SIZE);
+	image.ConstructHeader(disk_size, block_size, 512, false);
+	std::vector<UINT64> data;
+	if (write_data)
+	{
+		data.resize(image.GetBlockSize() / sizeof(UINT64));
+	}
+	for (UINT32 i = 0; i < image.GetTableEntriesCount(); i += stride)
+	{
+		const UINT64 block_address = image.AllocateBlock(i);
+		if (!write_data)
+		{
+			continue;
+		}
+		for (size_t j = 0; j < data.size(); j++)
+		{
+			data[j] = static_cast<UINT64>(i) * image.GetBlockSize() + j * sizeof(UINT64);
+		}
+		WriteFileWithOffset(file.get(), data.data(), image.GetBlockSize(), block_address);
+	}
+	image.WriteHeader();
+	return file;
+}
\ No newline at end of file
@@ -0,0 +1,249 @@
+#define NOMINMAX
+#include <windows.h>
+#include <objbase.h>
+#include <projectedfslib.h>
+#include <wil/filesystem.h>
+#include <wil/resource.h>
+#include <wil/result.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "ConvertImage.h"
+#include "Image.h"
+#include "Kernel.h"
+#include "Mount.h"
+#include "Partition.h"
+#include "Planner.h"
+#pragma comment(lib, "ole32")
+#pragma comment(lib, "ProjectedFSLib")
+
+namespace
+{
+	struct MountedImage
+	{
+		wil::unique_hfile file;
+		std::unique_ptr<Image> image;
+		// Guest address order, so a read finds its extents by binary search without touching allocation table.
+		std::vector<Extent> extents;
+		std::wstring projected_file_name;
+		PRJ_FILE_BASIC_INFO projected_file_info;
+		// Changed by each dehydration, so data of earlier content is not reused. Read by callback threads.
+		std::atomic<UINT32> content_version = 0;
+		// Written to projected file since it was last dehydrated.
+		std::atomic<UINT64> hydrated_bytes = 0;
+		PRJ_NAMESPACE_VIRTUALIZATION_CONTEXT context;
+		std::mutex enumerations_lock;
+		// Enumerations that already returned the projected file.
+		std::vector<GUID> completed_enumerations;
+	};
+	wil::unique_event mount_stop_event;
+
+	PRJ_PLACEHOLDER_INFO GetPlaceholder(const MountedImage& mounted, UINT32 content_version)
+	{
+		PRJ_PLACEHOLDER_INFO placeholder_info = { .FileBasicInfo = mounted.projected_file_info };
+		static_assert(sizeof content_version <= PRJ_PLACEHOLDER_ID_LENGTH);
+		memcpy(placeholder_info.VersionInfo.ContentID, &content_version, sizeof content_version);
+		return placeholder_info;
+	}
+	PRJ_PLACEHOLDER_INFO GetPlaceholder(const MountedImage& mounted)
+	{
+		return GetPlaceholder(mounted, mounted.content_version);
+	}
+
+	MountedImage& GetMountedImage(const PRJ_CALLBACK_DATA* callback_data)
+	{
+		return *static_cast<MountedImage*>(callback_data->InstanceContext);
+	}
+	HRESULT CALLBACK StartDirectoryEnumeration(const PRJ_CALLBACK_DATA* callback_data, const GUID* enumeration_id) noexcept
+	{
+		UNREFERENCED_PARAMETER(enumeration_id);
+		// Projected file is the only entry of root.
+		return callback_data->FilePathName[0] == L'\0' ? S_OK : HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+	}
+	HRESULT CALLBACK EndDirectoryEnumeration(const PRJ_CALLBACK_DATA* callback_data, const GUID* enumeration_id) noexcept
+	{
+		auto& mounted = GetMountedImage(callback_data);
+		const std::lock_guard lock(mounted.enumerations_lock);
+		std::erase(mounted.completed_enumerations, *enumeration_id);
+		return S_OK;
+	}
+	HRESULT CALLBACK GetDirectoryEnumeration(const PRJ_CALLBACK_DATA* callback_data, const GUID* enumeration_id, PCWSTR search_expression, PRJ_DIR_ENTRY_BUFFER_HANDLE dir_entry_buffer) noexcept
+	try
+	{
+		auto& mounted = GetMountedImage(callback_data);
+		const std::lock_guard lock(mounted.enumerations_lock);
+		if (WI_IsFlagSet(callback_data->Flags, PRJ_CB_DATA_FLAG_ENUM_RESTART_SCAN))
+		{
+			std::erase(mounted.completed_enumerations, *enumeration_id);
+		}
+		if (std::find(mounted.completed_enumerations.begin(), mounted.completed_enumerations.end(), *enumeration_id) != mounted.completed_enumerations.end())
+		{
+			return S_OK;
+		}
+		if (search_expression == nullptr || search_expression[0] == L'\0' || PrjFileNameMatch(mounted.projected_file_name.c_str(), search_expression))
+		{
+			RETURN_IF_FAILED(PrjFillDirEntryBuffer(mounted.projected_file_name.c_str(), &mounted.projected_file_info, dir_entry_buffer));
+		}
+		mounted.completed_enumerations.push_back(*enumeration_id);
+		return S_OK;
+	}
+	CATCH_RETURN();
+	HRESULT CALLBACK GetPlaceholderInfo(const PRJ_CALLBACK_DATA* callback_data) noexcept
+	{
+		const auto& mounted = GetMountedImage(callback_data);
+		if (PrjFileNameCompare(callback_data->FilePathName, mounted.projected_file_name.c_str()) != 0)
+		{
+			return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+		}
+		const PRJ_PLACEHOLDER_INFO placeholder_info = GetPlaceholder(mounted);
+		return PrjWritePlaceholderInfo(callback_data->NamespaceVirtualizationContext, callback_data->FilePathName, &placeholder_info, sizeof placeholder_info);
+	}
+	HRESULT CALLBACK GetFileData(const PRJ_CALLBACK_DATA* callback_data, UINT64 byte_offset, UINT32 length) noexcept
+	try
+	{
+		auto& mounted = GetMountedImage(callback_data);
+		const UINT64 file_size = static_cast<UINT64>(mounted.projected_file_info.FileSize);
+		// Data must be written in sector aligned units, except the last one which may end at end of file.
+		// Read ahead unit is a multiple of any sector size.
+		const UINT64 begin = byte_offset / MOUNT_READ_AHEAD_SIZE * MOUNT_READ_AHEAD_SIZE;
+		const UINT64 end = std::min(round_up(byte_offset + length, static_cast<UINT64>(MOUNT_READ_AHEAD_SIZE)), file_size);
+		const std::unique_ptr<void, decltype(&PrjFreeAlignedBuffer)> buffer(PrjAllocateAlignedBuffer(callback_data->NamespaceVirtualizationContext, MOUNT_READ_AHEAD_SIZE), PrjFreeAlignedBuffer);
+		RETURN_IF_NULL_ALLOC(buffer);
+		for (UINT64 offset = begin; offset < end;)
+		{
+			const UINT32 size = static_cast<UINT32>(std::min<UINT64>(end - offset, MOUNT_READ_AHEAD_SIZE));
+			// Unallocated ranges are zero filled without reading source.
+			ReadVirtualDisk(mounted.image->GetDataFile(), mounted.extents, offset, buffer.get(), size);
+			RETURN_IF_FAILED(PrjWriteFileData(callback_data->NamespaceVirtualizationContext, &callback_data->DataStreamId, buffer.get(), offset, size));
+			mounted.hydrated_bytes += size;
+			offset += size;
+		}
+		return S_OK;
+	}
+	CATCH_RETURN();
+	HRESULT CALLBACK Notify(const PRJ_CALLBACK_DATA* callback_data, BOOLEAN is_directory, PRJ_NOTIFICATION notification, PCWSTR destination_file_name, PRJ_NOTIFICATION_PARAMETERS* operation_parameters) noexcept
+	{
+		UNREFERENCED_PARAMETER(callback_data);
+		UNREFERENCED_PARAMETER(is_directory);
+		UNREFERENCED_PARAMETER(destination_file_name);
+		UNREFERENCED_PARAMETER(operation_parameters);
+		// Only registered without copy on write, and denies everything it is asked about.
+		switch (notification)
+		{
+		case PRJ_NOTIFICATION_PRE_DELETE:
+		case PRJ_NOTIFICATION_PRE_RENAME:
+		case PRJ_NOTIFICATION_PRE_SET_HARDLINK:
+		case PRJ_NOTIFICATION_FILE_PRE_CONVERT_TO_FULL:
+			return E_ACCESSDENIED;
+		default:
+			return S_OK;
+		}
+	}
+	BOOL WINAPI StopMount(DWORD ctrl_type) noexcept
+	{
+		UNREFERENCED_PARAMETER(ctrl_type);
+		mount_stop_event.SetEvent();
+		return TRUE;
+	}
+}
+void MountImage(PCWSTR image_file_name, PCWSTR root_path, bool copy_on_write)
+{
+	// Projected File System is optional Windows feature and its library is delay loaded.
+	if (!wil::unique_hmodule(LoadLibraryExW(L"ProjectedFSLib.dll", nullptr, LOAD_LIBRARY_SEARCH_SYSTEM32)))
+	{
+		throw std::runtime_error("Windows Projected File System feature is not enabled.");
+	}
+	MountedImage mounted;
+	mounted.file = wil::open_file(image_file_name);
+	mounted.image = DetectImageFormatByData(mounted.file.get());
+	if (!mounted.image)
+	{
+		throw std::runtime_error("No supported image types detected.");
+	}
+	// Data is only read, so it needs no alignment, and sectors absent from image are projected as zero.
+	mounted.image->Attach(mounted.file.get(), SECTOR_GRANULARITY);
+	mounted.image->ReadHeader();
+	mounted.image->CheckReadable();
+	mounted.extents = SelectConversionKernel(*mounted.image, *mounted.image).collect_extents(*mounted.image, SECTOR_GRANULARITY);
+	FILE_BASIC_INFO file_info;
+	THROW_IF_WIN32_BOOL_FALSE(GetFileInformationByHandleEx(mounted.file.get(), FileBasicInfo, &file_info, sizeof file_info));
+	mounted.projected_file_name = std::filesystem::path(image_file_name).filename().replace_extension(L".raw");
+	mounted.projected_file_info = {
+		.IsDirectory = FALSE,
+		.FileSize = static_cast<INT64>(mounted.image->GetDiskSize()),
+		.CreationTime = file_info.CreationTime,
+		.LastAccessTime = file_info.LastAccessTime,
+		.LastWriteTime = file_info.LastWriteTime,
+		.ChangeTime = file_info.ChangeTime,
+		.FileAttributes = FILE_ATTRIBUTE_ARCHIVE,
+	};
+
+	// Root must be new, so nothing left by other providers is projected over.
+	THROW_IF_WIN32_BOOL_FALSE(CreateDirectoryW(root_path, nullptr));
+	GUID instance_id;
+	THROW_IF_FAILED(CoCreateGuid(&instance_id));
+	THROW_IF_FAILED(PrjMarkDirectoryAsPlaceholder(root_path, nullptr, nullptr, &instance_id));
+	PRJ_CALLBACKS callbacks = {
+		.StartDirectoryEnumerationCallback = StartDirectoryEnumeration,
+		.EndDirectoryEnumerationCallback = EndDirectoryEnumeration,
+		.GetDirectoryEnumerationCallback = GetDirectoryEnumeration,
+		.GetPlaceholderInfoCallback = GetPlaceholderInfo,
+		.GetFileDataCallback = GetFileData,
+		.NotificationCallback = Notify,
+	};
+	PRJ_NOTIFICATION_MAPPING notification_mapping = {
+		.NotificationBitMask = PRJ_NOTIFY_PRE_DELETE | PRJ_NOTIFY_PRE_RENAME | PRJ_NOTIFY_PRE_SET_HARDLINK | PRJ_NOTIFY_FILE_PRE_CONVERT_TO_FULL,
+		.NotificationRoot = L"",
+	};
+	PRJ_STARTVIRTUALIZING_OPTIONS start_options = {};
+	if (!copy_on_write)
+	{
+		start_options.NotificationMappings = &notification_mapping;
+		start_options.NotificationMappingsCount = 1;
+	}
+	mount_stop_event.create(wil::EventOptions::ManualReset);
+	THROW_IF_FAILED(PrjStartVirtualizing(root_path, &callbacks, &mounted, &start_options, &mounted.context));
+	THROW_IF_WIN32_BOOL_FALSE(SetConsoleCtrlHandler(StopMount, TRUE));
+
+	printf(
+		"Mounted:           %ls\\%ls\n"
+		"Access:            %hs\n"
+		"\x1B[93mReads are stored in projected file on volume of <Root>. %hs\x1B[0m\n"
+		"Press Ctrl+C to unmount.\n",
+		root_path,
+		mounted.projected_file_name.c_str(),
+		copy_on_write ? "Copy on write" : "Read only",
+		copy_on_write ? "It can grow up to guest disk size." : "It is dehydrated after 4GB, once it is closed."
+	);
+	while (!mount_stop_event.wait(MOUNT_DEHYDRATE_INTERVAL))
+	{
+		if (copy_on_write || mounted.hydrated_bytes < MOUNT_HYDRATION_WINDOW)
+		{
+			continue;
+		}
+		// Turns hydrated file back to placeholder, which frees its local data. Fails while file is open, and is retried.
+		// New version is published only once file has it, so failed update leaves version of file unchanged.
+		const UINT32 content_version = mounted.content_version + 1;
+		const PRJ_PLACEHOLDER_INFO placeholder_info = GetPlaceholder(mounted, content_version);
+		PRJ_UPDATE_FAILURE_CAUSES failure_causes;
+		if (SUCCEEDED(PrjUpdateFileIfNeeded(mounted.context, mounted.projected_file_name.c_str(), &placeholder_info, sizeof placeholder_info, PRJ_UPDATE_NONE, &failure_causes)))
+		{
+			mounted.content_version = content_version;
+			mounted.hydrated_bytes = 0;
+		}
+	}
+	PrjStopVirtualizing(mounted.context);
+	SetConsoleCtrlHandler(StopMount, FALSE);
+	if (!copy_on_write)
+	{
+		// Hydrated data is only a copy of source. Modified copy on write file is left for user.
+		const std::filesystem::path projected_file_path = std::filesystem::path(root_path) / mounted.projected_file_name;
+		DeleteFileW(projected_file_path.c_str());
+		RemoveDirectoryW(root_path);
+	}
+}
\ No newline at end of file
@@ -0,0 +1,12 @@
+#pragma once
+#include <windows.h>
+
+// Projected file reads are served in aligned units of this size, so sequential readers make fewer callbacks.
+constexpr UINT32 MOUNT_READ_AHEAD_SIZE = 4 * 1024 * 1024;
+// Data read from projected file is stored in it on root volume. Read only file is dehydrated after this much, once it is closed.
+constexpr UINT64 MOUNT_HYDRATION_WINDOW = 4ULL * 1024 * 1024 * 1024;
+constexpr DWORD MOUNT_DEHYDRATE_INTERVAL = 10 * 1000;
+// Projects guest disk of image as flat file in root_path through Windows Projected File System, until Ctrl+C.
+// Writes to projected file are denied, unless copy_on_write. Source is never modified.
+// Projected File System keeps what is read as local data, so reads consume space of root volume, zero ranges included.
+void MountImage(PCWSTR image_file_name, PCWSTR root_path, bool copy_on_write);
\ No newline at end of file
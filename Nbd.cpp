@@ -0,0 +1,645 @@
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <afunix.h>
+#include <windows.h>
+#include <wil/filesystem.h>
+#include <wil/resource.h>
+#include <wil/result.h>
+#include <algorithm>
+#include <bit>
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ConvertImage.h"
+#include "Image.h"
+#include "Kernel.h"
+#include "Nbd.h"
+#include "Partition.h"
+#include "Planner.h"
+#pragma comment(lib, "ws2_32")
+
+using unique_wsacleanup_call = wil::unique_call<decltype(&::WSACleanup), ::WSACleanup, false>;
+namespace
+{
+	struct NbdExport
+	{
+		std::string name;
+		wil::unique_hfile file;
+		std::unique_ptr<Image> image;
+		// Physically contiguous blocks are already merged, so a read issues one ReadFile per extent.
+		std::vector<Extent> extents;
+		UINT64 size;
+	};
+	using NbdExports = std::vector<NbdExport>;
+	// Bounds checked reader of option data. Malformed data clears valid instead of throwing.
+	struct NbdOptionReader
+	{
+		const std::vector<BYTE>& data;
+		size_t position = 0;
+		bool valid = true;
+		const BYTE* Take(size_t size)
+		{
+			if (!valid || size > data.size() - position)
+			{
+				valid = false;
+				return nullptr;
+			}
+			position += size;
+			return data.data() + position - size;
+		}
+		UINT16 ReadUInt16()
+		{
+			UINT16 value = 0;
+			if (const auto p = Take(sizeof value))
+			{
+				memcpy(&value, p, sizeof value);
+			}
+			return std::byteswap(value);
+		}
+		UINT32 ReadUInt32()
+		{
+			UINT32 value = 0;
+			if (const auto p = Take(sizeof value))
+			{
+				memcpy(&value, p, sizeof value);
+			}
+			return std::byteswap(value);
+		}
+		std::string ReadString()
+		{
+			const UINT32 length = ReadUInt32();
+			const auto p = Take(length);
+			return p ? std::string(reinterpret_cast<const char*>(p), length) : std::string();
+		}
+		bool IsEnd() const
+		{
+			return valid && position == data.size();
+		}
+	};
+	struct NbdConnection
+	{
+	private:
+		wil::unique_socket client;
+		std::shared_ptr<const NbdExports> exports;
+		const NbdExport* selected = nullptr;
+		bool no_zeroes = false;
+		bool structured_reply = false;
+		bool base_allocation = false;
+		std::unique_ptr<BYTE[]> buffer;
+		std::vector<BYTE> reply_buffer;
+		void Send(const void* data, size_t size)
+		{
+			auto p = static_cast<const char*>(data);
+			while (size)
+			{
+				const int sent = send(client.get(), p, static_cast<int>(std::min<size_t>(size, INT_MAX)), 0);
+				THROW_LAST_ERROR_IF(sent == SOCKET_ERROR);
+				p += sent;
+				size -= sent;
+			}
+		}
+		template <typename Ty>
+		void Send(const Ty& data)
+		{
+			Send(&data, sizeof data);
+		}
+		void Receive(void* data, size_t size)
+		{
+			auto p = static_cast<char*>(data);
+			while (size)
+			{
+				const int received = recv(client.get(), p, static_cast<int>(std::min<size_t>(size, INT_MAX)), 0);
+				THROW_LAST_ERROR_IF(received == SOCKET_ERROR);
+				if (received == 0)
+				{
+					throw std::runtime_error("Client disconnected.");
+				}
+				p += received;
+				size -= received;
+			}
+		}
+		template <typename Ty>
+		void Receive(Ty& data)
+		{
+			Receive(&data, sizeof data);
+		}
+		const NbdExport* FindExport(const std::string& name) const
+		{
+			// Empty name is default export.
+			if (name.empty())
+			{
+				return &exports->front();
+			}
+			const auto it = std::find_if(exports->begin(), exports->end(), [&](const NbdExport& e) { return e.name == name; });
+			return it != exports->end() ? &*it : nullptr;
+		}
+		void SendOptionReply(UINT32 option, UINT32 type, const void* data = nullptr, UINT32 size = 0)
+		{
+			const NBD_OPTION_REPLY reply = {
+				.Magic = std::byteswap(NBD_OPTION_REPLY_MAGIC),
+				.Option = std::byteswap(option),
+				.Type = std::byteswap(type),
+				.Length = std::byteswap(size),
+			};
+			reply_buffer.assign(reinterpret_cast<const BYTE*>(&reply), reinterpret_cast<const BYTE*>(&reply) + sizeof reply);
+			reply_buffer.insert(reply_buffer.end(), static_cast<const BYTE*>(data), static_cast<const BYTE*>(data) + size);
+			Send(reply_buffer.data(), reply_buffer.size());
+		}
+		static constexpr UINT16 GetTransmissionFlags()
+		{
+			return NBD_FLAG_HAS_FLAGS | NBD_FLAG_READ_ONLY | NBD_FLAG_CAN_MULTI_CONN;
+		}
+		void SendExportInfo(UINT32 option, const NbdExport& nbd_export)
+		{
+#pragma pack(push, 1)
+			struct
+			{
+				UINT16 Type;
+				UINT64 Size;
+				UINT16 Flags;
+			} info_export = { std::byteswap(NBD_INFO_EXPORT), std::byteswap(nbd_export.size), std::byteswap(GetTransmissionFlags()) };
+			struct
+			{
+				UINT16 Type;
+				UINT32 Minimum;
+				UINT32 Preferred;
+				UINT32 Maximum;
+			} info_block_size = { std::byteswap(NBD_INFO_BLOCK_SIZE), std::byteswap(1U), std::byteswap(NBD_PREFERRED_REQUEST_SIZE), std::byteswap(NBD_MAX_REQUEST_SIZE) };
+#pragma pack(pop)
+			SendOptionReply(option, NBD_REP_INFO, &info_export, sizeof info_export);
+			SendOptionReply(option, NBD_REP_INFO, &info_block_size, sizeof info_block_size);
+			SendOptionReply(option, NBD_REP_ACK);
+		}
+		void HandleMetaContext(UINT32 option, const std::vector<BYTE>& data)
+		{
+			NbdOptionReader reader = { data };
+			const std::string export_name = reader.ReadString();
+			const UINT32 queries_count = reader.ReadUInt32();
+			std::vector<std::string> queries;
+			for (UINT32 i = 0; i < queries_count && reader.valid; i++)
+			{
+				queries.push_back(reader.ReadString());
+			}
+			if (!reader.IsEnd() || (option == NBD_OPT_SET_META_CONTEXT && !structured_reply))
+			{
+				return SendOptionReply(option, NBD_REP_ERR_INVALID);
+			}
+			if (!FindExport(export_name))
+			{
+				return SendOptionReply(option, NBD_REP_ERR_UNKNOWN);
+			}
+			// Only base:allocation is provided. Listing accepts namespace query and empty query.
+			const bool matched = std::any_of(queries.begin(), queries.end(), [&](const std::string& query) { return query == NBD_BASE_ALLOCATION || (option == NBD_OPT_LIST_META_CONTEXT && query == "base:"); })
+				|| (option == NBD_OPT_LIST_META_CONTEXT && queries.empty());
+			if (option == NBD_OPT_SET_META_CONTEXT)
+			{
+				base_allocation = matched;
+			}
+			if (matched)
+			{
+				std::vector<BYTE> context(sizeof(UINT32) + strlen(NBD_BASE_ALLOCATION));
+				const UINT32 context_id = std::byteswap(NBD_BASE_ALLOCATION_CONTEXT_ID);
+				memcpy(context.data(), &context_id, sizeof context_id);
+				memcpy(context.data() + sizeof context_id, NBD_BASE_ALLOCATION, strlen(NBD_BASE_ALLOCATION));
+				SendOptionReply(option, NBD_REP_META_CONTEXT, context.data(), static_cast<UINT32>(context.size()));
+			}
+			SendOptionReply(option, NBD_REP_ACK);
+		}
+		// Returns true when export is selected and transmission begins.
+		bool Negotiate()
+		{
+#pragma pack(push, 1)
+			const struct
+			{
+				UINT64 Magic;
+				UINT64 IHaveOpt;
+				UINT16 Flags;
+			} greeting = { std::byteswap(NBD_MAGIC), std::byteswap(NBD_IHAVEOPT), std::byteswap<UINT16>(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES) };
+#pragma pack(pop)
+			Send(greeting);
+			UINT32 client_flags;
+			Receive(client_flags);
+			client_flags = std::byteswap(client_flags);
+			if (WI_IsFlagClear(client_flags, NBD_FLAG_C_FIXED_NEWSTYLE))
+			{
+				throw std::runtime_error("Client doesn't support fixed newstyle negotiation.");
+			}
+			no_zeroes = WI_IsFlagSet(client_flags, NBD_FLAG_C_NO_ZEROES);
+			for (;;)
+			{
+				NBD_OPTION_HEADER header;
+				Receive(header);
+				const UINT32 option = std::byteswap(header.Option);
+				const UINT32 length = std::byteswap(header.Length);
+				if (std::byteswap(header.Magic) != NBD_IHAVEOPT || length > NBD_MAX_OPTION_SIZE)
+				{
+					throw std::runtime_error("Invalid NBD option.");
+				}
+				std::vector<BYTE> data(length);
+				Receive(data.data(), data.size());
+				switch (option)
+				{
+				case NBD_OPT_EXPORT_NAME:
+				{
+					// This option has no error reply, so unknown export closes connection.
+					selected = FindExport(std::string(data.begin(), data.end()));
+					if (!selected)
+					{
+						throw std::runtime_error("Client requested unknown export.");
+					}
+#pragma pack(push, 1)
+					struct
+					{
+						UINT64 Size;
+						UINT16 Flags;
+						BYTE Reserved[124];
+					} export_reply = { std::byteswap(selected->size), std::byteswap(GetTransmissionFlags()) };
+#pragma pack(pop)
+					Send(&export_reply, no_zeroes ? offsetof(decltype(export_reply), Reserved) : sizeof export_reply);
+					return true;
+				}
+				case NBD_OPT_ABORT:
+					SendOptionReply(option, NBD_REP_ACK);
+					return false;
+				case NBD_OPT_LIST:
+					if (length != 0)
+					{
+						SendOptionReply(option, NBD_REP_ERR_INVALID);
+						break;
+					}
+					for (const auto& nbd_export : *exports)
+					{
+						std::vector<BYTE> server(sizeof(UINT32) + nbd_export.name.size());
+						const UINT32 name_length = std::byteswap(static_cast<UINT32>(nbd_export.name.size()));
+						memcpy(server.data(), &name_length, sizeof name_length);
+						memcpy(server.data() + sizeof name_length, nbd_export.name.data(), nbd_export.name.size());
+						SendOptionReply(option, NBD_REP_SERVER, server.data(), static_cast<UINT32>(server.size()));
+					}
+					SendOptionReply(option, NBD_REP_ACK);
+					break;
+				case NBD_OPT_INFO:
+				case NBD_OPT_GO:
+				{
+					NbdOptionReader reader = { data };
+					const std::string export_name = reader.ReadString();
+					const UINT16 requests_count = reader.ReadUInt16();
+					reader.Take(requests_count * sizeof(UINT16));
+					if (!reader.IsEnd())
+					{
+						SendOptionReply(option, NBD_REP_ERR_INVALID);
+						break;
+					}
+					const auto nbd_export = FindExport(export_name);
+					if (!nbd_export)
+					{
+						SendOptionReply(option, NBD_REP_ERR_UNKNOWN);
+						break;
+					}
+					SendExportInfo(option, *nbd_export);
+					if (option == NBD_OPT_GO)
+					{
+						selected = nbd_export;
+						return true;
+					}
+					break;
+				}
+				case NBD_OPT_STRUCTURED_REPLY:
+					if (length != 0)
+					{
+						SendOptionReply(option, NBD_REP_ERR_INVALID);
+						break;
+					}
+					structured_reply = true;
+					SendOptionReply(option, NBD_REP_ACK);
+					break;
+				case NBD_OPT_LIST_META_CONTEXT:
+				case NBD_OPT_SET_META_CONTEXT:
+					HandleMetaContext(option, data);
+					break;
+				default:
+					SendOptionReply(option, NBD_REP_ERR_UNSUP);
+					break;
+				}
+			}
+		}
+		void SendStructuredReply(UINT64 cookie, UINT16 flags, UINT16 type, const void* payload, UINT32 size)
+		{
+			const NBD_STRUCTURED_REPLY reply = {
+				.Magic = std::byteswap(NBD_STRUCTURED_REPLY_MAGIC),
+				.Flags = std::byteswap(flags),
+				.Type = std::byteswap(type),
+				.Cookie = cookie,
+				.Length = std::byteswap(size),
+			};
+			reply_buffer.assign(reinterpret_cast<const BYTE*>(&reply), reinterpret_cast<const BYTE*>(&reply) + sizeof reply);
+			reply_buffer.insert(reply_buffer.end(), static_cast<const BYTE*>(payload), static_cast<const BYTE*>(payload) + size);
+			Send(reply_buffer.data(), reply_buffer.size());
+		}
+		void SendError(UINT64 cookie, UINT32 error)
+		{
+			if (structured_reply)
+			{
+#pragma pack(push, 1)
+				const struct
+				{
+					UINT32 Error;
+					UINT16 MessageLength;
+				} error_payload = { std::byteswap(error), 0 };
+#pragma pack(pop)
+				return SendStructuredReply(cookie, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_ERROR, &error_payload, sizeof error_payload);
+			}
+			const NBD_SIMPLE_REPLY reply = { std::byteswap(NBD_SIMPLE_REPLY_MAGIC), std::byteswap(error), cookie };
+			Send(reply);
+		}
+		bool ReadSource(void* data, UINT32 size, UINT64 source_offset)
+		{
+			try
+			{
+				ReadFileWithOffset(selected->image->GetDataFile(), data, size, source_offset);
+				return true;
+			}
+			catch (const wil::ResultException&)
+			{
+				return false;
+			}
+		}
+		void Read(UINT64 cookie, UINT64 offset, UINT32 length)
+		{
+			if (!buffer)
+			{
+				buffer = std::make_unique_for_overwrite<BYTE[]>(NBD_REPLY_HEADER_SPACE + NBD_MAX_REQUEST_SIZE);
+			}
+			BYTE* const data = buffer.get() + NBD_REPLY_HEADER_SPACE;
+			const auto& extents = selected->extents;
+			if (!structured_reply)
+			{
+				try
+				{
+					ReadVirtualDisk(selected->image->GetDataFile(), extents, offset, data, length);
+				}
+				catch (const wil::ResultException&)
+				{
+					return SendError(cookie, NBD_EIO);
+				}
+				const NBD_SIMPLE_REPLY reply = { std::byteswap(NBD_SIMPLE_REPLY_MAGIC), 0, cookie };
+				memcpy(data - sizeof reply, &reply, sizeof reply);
+				return Send(data - sizeof reply, sizeof reply + length);
+			}
+			// Holes are sent as hole chunks instead of zero data.
+			auto extent = std::upper_bound(extents.begin(), extents.end(), offset, [](UINT64 offset, const Extent& extent) { return offset < extent.virtual_offset + extent.length; });
+			for (UINT64 position = offset; position < offset + length;)
+			{
+				const bool in_extent = extent != extents.end() && extent->virtual_offset <= position;
+				const UINT64 end = in_extent ? std::min(extent->virtual_offset + extent->length, offset + length) : extent != extents.end() ? std::min(extent->virtual_offset, offset + length) : offset + length;
+				const UINT32 size = static_cast<UINT32>(end - position);
+				if (in_extent)
+				{
+					BYTE* const chunk_data = data + (position - offset);
+					if (!ReadSource(chunk_data, size, extent->source_offset + (position - extent->virtual_offset)))
+					{
+						return SendError(cookie, NBD_EIO);
+					}
+					// Header goes over the part of buffer already sent.
+					const NBD_STRUCTURED_REPLY reply = {
+						.Magic = std::byteswap(NBD_STRUCTURED_REPLY_MAGIC),
+						.Flags = 0,
+						.Type = std::byteswap(NBD_REPLY_TYPE_OFFSET_DATA),
+						.Cookie = cookie,
+						.Length = std::byteswap(static_cast<UINT32>(sizeof(UINT64) + size)),
+					};
+					const UINT64 chunk_offset = std::byteswap(position);
+					memcpy(chunk_data - sizeof chunk_offset, &chunk_offset, sizeof chunk_offset);
+					memcpy(chunk_data - sizeof chunk_offset - sizeof reply, &reply, sizeof reply);
+					Send(chunk_data - sizeof chunk_offset - sizeof reply, sizeof reply + sizeof chunk_offset + size);
+				}
+				else
+				{
+#pragma pack(push, 1)
+					const struct
+					{
+						UINT64 Offset;
+						UINT32 Length;
+					} hole = { std::byteswap(position), std::byteswap(size) };
+#pragma pack(pop)
+					SendStructuredReply(cookie, 0, NBD_REPLY_TYPE_OFFSET_HOLE, &hole, sizeof hole);
+				}
+				if (in_extent && end == extent->virtual_offset + extent->length)
+				{
+					++extent;
+				}
+				position = end;
+			}
+			SendStructuredReply(cookie, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_NONE, nullptr, 0);
+		}
+		void BlockStatus(UINT64 cookie, UINT64 offset, UINT32 length, bool request_one)
+		{
+			const auto& extents = selected->extents;
+			auto extent = std::upper_bound(extents.begin(), extents.end(), offset, [](UINT64 offset, const Extent& extent) { return offset < extent.virtual_offset + extent.length; });
+			std::vector<UINT32> status = { std::byteswap(NBD_BASE_ALLOCATION_CONTEXT_ID) };
+			for (UINT64 position = offset; position < offset + length && (status.size() - 1) / 2 < (request_one ? 1 : NBD_MAX_BLOCK_STATUS_DESCRIPTORS);)
+			{
+				UINT64 end;
+				UINT32 flags;
+				if (extent != extents.end() && extent->virtual_offset <= position)
+				{
+					// Virtually adjacent extents are one allocated descriptor, even if not physically adjacent.
+					end = extent->virtual_offset + extent->length;
+					while (++extent != extents.end() && extent->virtual_offset == end)
+					{
+						end += extent->length;
+					}
+					flags = 0;
+				}
+				else
+				{
+					end = extent != extents.end() ? extent->virtual_offset : selected->size;
+					flags = NBD_STATE_HOLE | NBD_STATE_ZERO;
+				}
+				end = std::min(end, offset + length);
+				status.push_back(std::byteswap(static_cast<UINT32>(end - position)));
+				status.push_back(std::byteswap(flags));
+				position = end;
+			}
+			SendStructuredReply(cookie, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_BLOCK_STATUS, status.data(), static_cast<UINT32>(status.size() * sizeof(UINT32)));
+		}
+		void Transmit()
+		{
+			for (;;)
+			{
+				NBD_REQUEST request;
+				Receive(request);
+				if (std::byteswap(request.Magic) != NBD_REQUEST_MAGIC)
+				{
+					throw std::runtime_error("Invalid NBD request.");
+				}
+				const UINT16 flags = std::byteswap(request.Flags);
+				const UINT16 type = std::byteswap(request.Type);
+				const UINT64 offset = std::byteswap(request.Offset);
+				const UINT32 length = std::byteswap(request.Length);
+				// Cookie is opaque to server and is echoed as received.
+				const UINT64 cookie = request.Cookie;
+				const bool in_range = offset <= selected->size && length <= selected->size - offset;
+				switch (type)
+				{
+				case NBD_CMD_READ:
+					if (!in_range || length > NBD_MAX_REQUEST_SIZE)
+					{
+						SendError(cookie, NBD_EINVAL);
+						break;
+					}
+					Read(cookie, offset, length);
+					break;
+				case NBD_CMD_WRITE:
+					// Payload must be consumed before reply.
+					if (!buffer)
+					{
+						buffer = std::make_unique_for_overwrite<BYTE[]>(NBD_REPLY_HEADER_SPACE + NBD_MAX_REQUEST_SIZE);
+					}
+					for (UINT32 remaining = length; remaining;)
+					{
+						const UINT32 size = std::min(remaining, NBD_MAX_REQUEST_SIZE);
+						Receive(buffer.get(), size);
+						remaining -= size;
+					}
+					SendError(cookie, NBD_EPERM);
+					break;
+				case NBD_CMD_TRIM:
+				case NBD_CMD_WRITE_ZEROES:
+					SendError(cookie, NBD_EPERM);
+					break;
+				case NBD_CMD_FLUSH:
+					if (structured_reply)
+					{
+						SendStructuredReply(cookie, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_NONE, nullptr, 0);
+					}
+					else
+					{
+						Send(NBD_SIMPLE_REPLY{ std::byteswap(NBD_SIMPLE_REPLY_MAGIC), 0, cookie });
+					}
+					break;
+				case NBD_CMD_DISC:
+					return;
+				case NBD_CMD_BLOCK_STATUS:
+					if (!base_allocation || !in_range || length == 0)
+					{
+						SendError(cookie, NBD_EINVAL);
+						break;
+					}
+					BlockStatus(cookie, offset, length, WI_IsFlagSet(flags, NBD_CMD_FLAG_REQ_ONE));
+					break;
+				default:
+					SendError(cookie, NBD_EINVAL);
+					break;
+				}
+			}
+		}
+	public:
+		NbdConnection(wil::unique_socket&& client_socket, std::shared_ptr<const NbdExports> nbd_exports) : client(std::move(client_socket)), exports(std::move(nbd_exports))
+		{
+		}
+		void Serve()
+		{
+			if (Negotiate())
+			{
+				Transmit();
+			}
+		}
+	};
+	wil::unique_socket Listen(PCWSTR address)
+	{
+		wil::unique_socket listener;
+		if (_wcsnicmp(address, L"unix:", 5) == 0)
+		{
+			const std::string path = std::filesystem::path(address + 5).string();
+			sockaddr_un unix_address = { .sun_family = AF_UNIX };
+			if (path.empty() || path.size() >= std::size(unix_address.sun_path))
+			{
+				throw std::invalid_argument("Unix domain socket path is too long.");
+			}
+			memcpy(unix_address.sun_path, path.c_str(), path.size());
+			listener.reset(socket(AF_UNIX, SOCK_STREAM, 0));
+			THROW_LAST_ERROR_IF(!listener);
+			THROW_LAST_ERROR_IF(bind(listener.get(), reinterpret_cast<const sockaddr*>(&unix_address), sizeof unix_address) == SOCKET_ERROR);
+		}
+		else
+		{
+			PWSTR end;
+			const ULONG port = wcstoul(address, &end, 10);
+			if (*end != L'\0' || port == 0 || port > UINT16_MAX)
+			{
+				throw std::invalid_argument("NBD address must be <Port> or unix:<Path>.");
+			}
+			// Dual stack, so IPv4 clients are accepted too.
+			listener.reset(socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP));
+			THROW_LAST_ERROR_IF(!listener);
+			const DWORD v6_only = FALSE;
+			THROW_LAST_ERROR_IF(setsockopt(listener.get(), IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<const char*>(&v6_only), sizeof v6_only) == SOCKET_ERROR);
+			sockaddr_in6 tcp_address = {
+				.sin6_family = AF_INET6,
+				.sin6_port = htons(static_cast<USHORT>(port)),
+				.sin6_addr = IN6ADDR_ANY_INIT,
+			};
+			THROW_LAST_ERROR_IF(bind(listener.get(), reinterpret_cast<const sockaddr*>(&tcp_address), sizeof tcp_address) == SOCKET_ERROR);
+		}
+		THROW_LAST_ERROR_IF(listen(listener.get(), SOMAXCONN) == SOCKET_ERROR);
+		return listener;
+	}
+}
+void ServeNbd(const std::vector<PCWSTR>& image_file_names, PCWSTR address)
+{
+	auto exports = std::make_shared<NbdExports>();
+	for (const auto image_file_name : image_file_names)
+	{
+		NbdExport nbd_export;
+		nbd_export.file = wil::open_file(image_file_name);
+		nbd_export.image = DetectImageFormatByData(nbd_export.file.get());
+		if (!nbd_export.image)
+		{
+			throw std::runtime_error("No supported image types detected.");
+		}
+		// Data is only read, so it needs no alignment, and sectors absent from image are served as holes.
+		nbd_export.image->Attach(nbd_export.file.get(), SECTOR_GRANULARITY);
+		nbd_export.image->ReadHeader();
+		nbd_export.image->CheckReadable();
+		nbd_export.extents = SelectConversionKernel(*nbd_export.image, *nbd_export.image).collect_extents(*nbd_export.image, SECTOR_GRANULARITY);
+		nbd_export.size = nbd_export.image->GetDiskSize();
+		const auto name = std::filesystem::path(image_file_name).filename().u8string();
+		nbd_export.name.assign(name.begin(), name.end());
+		if (std::any_of(exports->begin(), exports->end(), [&](const NbdExport& e) { return e.name == nbd_export.name; }))
+		{
+			throw std::invalid_argument("Export names must be unique.");
+		}
+		printf("Export:            %hs (%hs, %llu bytes)\n", nbd_export.name.c_str(), nbd_export.image->GetImageTypeName(), nbd_export.size);
+		exports->push_back(std::move(nbd_export));
+	}
+	WSADATA wsa_data;
+	THROW_IF_WIN32_ERROR(WSAStartup(MAKEWORD(2, 2), &wsa_data));
+	const unique_wsacleanup_call wsa_cleanup;
+	const wil::unique_socket listener = Listen(address);
+	printf("Listening:         %ls\n", address);
+	const std::shared_ptr<const NbdExports> shared_exports = std::move(exports);
+	for (;;)
+	{
+		wil::unique_socket client(accept(listener.get(), nullptr, nullptr));
+		THROW_LAST_ERROR_IF(!client);
+		// Replies are sent with one send() each, so Nagle only delays them.
+		const BOOL no_delay = TRUE;
+		setsockopt(client.get(), IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&no_delay), sizeof no_delay);
+		// Each connection has its own thread. Exports are shared, so a detached thread never outlives them.
+		std::thread([client = std::move(client), shared_exports]() mutable
+		{
+			try
+			{
+				NbdConnection(std::move(client), shared_exports).Serve();
+			}
+			catch (const std::exception& e)
+			{
+				fprintf(stderr, "\x1B[91m%s\x1B[0m\n", e.what());
+			}
+		}).detach();
+	}
+}
\ No newline at end of file
@@ -0,0 +1,108 @@
+#pragma once
+#include <windows.h>
+#include <vector>
+
+// Network Block Device protocol, fixed newstyle negotiation. All fields are big endian.
+constexpr UINT64 NBD_MAGIC = 0x4E42444D41474943; // "NBDMAGIC"
+constexpr UINT64 NBD_IHAVEOPT = 0x49484156454F5054; // "IHAVEOPT"
+constexpr UINT64 NBD_OPTION_REPLY_MAGIC = 0x0003E889045565A9;
+constexpr UINT32 NBD_REQUEST_MAGIC = 0x25609513;
+constexpr UINT32 NBD_SIMPLE_REPLY_MAGIC = 0x67446698;
+constexpr UINT32 NBD_STRUCTURED_REPLY_MAGIC = 0x668E33EF;
+constexpr UINT16 NBD_FLAG_FIXED_NEWSTYLE = 1U << 0;
+constexpr UINT16 NBD_FLAG_NO_ZEROES = 1U << 1;
+constexpr UINT32 NBD_FLAG_C_FIXED_NEWSTYLE = 1U << 0;
+constexpr UINT32 NBD_FLAG_C_NO_ZEROES = 1U << 1;
+constexpr UINT16 NBD_FLAG_HAS_FLAGS = 1U << 0;
+constexpr UINT16 NBD_FLAG_READ_ONLY = 1U << 1;
+constexpr UINT16 NBD_FLAG_CAN_MULTI_CONN = 1U << 8;
+constexpr UINT32 NBD_OPT_EXPORT_NAME = 1;
+constexpr UINT32 NBD_OPT_ABORT = 2;
+constexpr UINT32 NBD_OPT_LIST = 3;
+constexpr UINT32 NBD_OPT_INFO = 6;
+constexpr UINT32 NBD_OPT_GO = 7;
+constexpr UINT32 NBD_OPT_STRUCTURED_REPLY = 8;
+constexpr UINT32 NBD_OPT_LIST_META_CONTEXT = 9;
+constexpr UINT32 NBD_OPT_SET_META_CONTEXT = 10;
+constexpr UINT32 NBD_REP_ACK = 1;
+constexpr UINT32 NBD_REP_SERVER = 2;
+constexpr UINT32 NBD_REP_INFO = 3;
+constexpr UINT32 NBD_REP_META_CONTEXT = 4;
+constexpr UINT32 NBD_REP_ERR_UNSUP = 0x80000001;
+constexpr UINT32 NBD_REP_ERR_INVALID = 0x80000003;
+constexpr UINT32 NBD_REP_ERR_UNKNOWN = 0x80000006;
+constexpr UINT16 NBD_INFO_EXPORT = 0;
+constexpr UINT16 NBD_INFO_BLOCK_SIZE = 3;
+constexpr UINT16 NBD_CMD_READ = 0;
+constexpr UINT16 NBD_CMD_WRITE = 1;
+constexpr UINT16 NBD_CMD_DISC = 2;
+constexpr UINT16 NBD_CMD_FLUSH = 3;
+constexpr UINT16 NBD_CMD_TRIM = 4;
+constexpr UINT16 NBD_CMD_WRITE_ZEROES = 6;
+constexpr UINT16 NBD_CMD_BLOCK_STATUS = 7;
+constexpr UINT16 NBD_CMD_FLAG_REQ_ONE = 1U << 3;
+constexpr UINT16 NBD_REPLY_FLAG_DONE = 1U << 0;
+constexpr UINT16 NBD_REPLY_TYPE_NONE = 0;
+constexpr UINT16 NBD_REPLY_TYPE_OFFSET_DATA = 1;
+constexpr UINT16 NBD_REPLY_TYPE_OFFSET_HOLE = 2;
+constexpr UINT16 NBD_REPLY_TYPE_BLOCK_STATUS = 5;
+constexpr UINT16 NBD_REPLY_TYPE_ERROR = 0x8001;
+constexpr UINT32 NBD_STATE_HOLE = 1U << 0;
+constexpr UINT32 NBD_STATE_ZERO = 1U << 1;
+constexpr UINT32 NBD_EPERM = 1;
+constexpr UINT32 NBD_EIO = 5;
+constexpr UINT32 NBD_EINVAL = 22;
+constexpr char NBD_BASE_ALLOCATION[] = "base:allocation";
+constexpr UINT32 NBD_BASE_ALLOCATION_CONTEXT_ID = 1;
+constexpr UINT32 NBD_MAX_OPTION_SIZE = 64 * 1024;
+constexpr UINT32 NBD_MAX_REQUEST_SIZE = 32 * 1024 * 1024;
+constexpr UINT32 NBD_PREFERRED_REQUEST_SIZE = 1024 * 1024;
+constexpr UINT32 NBD_MAX_BLOCK_STATUS_DESCRIPTORS = 1024;
+#pragma pack(push, 1)
+struct NBD_OPTION_HEADER
+{
+	UINT64 Magic;
+	UINT32 Option;
+	UINT32 Length;
+};
+struct NBD_OPTION_REPLY
+{
+	UINT64 Magic;
+	UINT32 Option;
+	UINT32 Type;
+	UINT32 Length;
+};
+struct NBD_REQUEST
+{
+	UINT32 Magic;
+	UINT16 Flags;
+	UINT16 Type;
+	UINT64 Cookie;
+	UINT64 Offset;
+	UINT32 Length;
+};
+struct NBD_SIMPLE_REPLY
+{
+	UINT32 Magic;
+	UINT32 Error;
+	UINT64 Cookie;
+};
+struct NBD_STRUCTURED_REPLY
+{
+	UINT32 Magic;
+	UINT16 Flags;
+	UINT16 Type;
+	UINT64 Cookie;
+	UINT32 Length;
+};
+#pragma pack(pop)
+static_assert(sizeof(NBD_OPTION_HEADER) == 16);
+static_assert(sizeof(NBD_OPTION_REPLY) == 20);
+static_assert(sizeof(NBD_REQUEST) == 28);
+static_assert(sizeof(NBD_SIMPLE_REPLY) == 16);
+static_assert(sizeof(NBD_STRUCTURED_REPLY) == 20);
+// Room before read data for reply header and data chunk offset, so each reply is sent with one send().
+constexpr UINT32 NBD_REPLY_HEADER_SPACE = sizeof(NBD_STRUCTURED_REPLY) + sizeof(UINT64);
+// Serves images read only as exports named by file name, until process is terminated.
+// Address is TCP port, or unix:<Path> for Unix domain socket.
+void ServeNbd(const std::vector<PCWSTR>& image_file_names, PCWSTR address);
\ No newline at end of file
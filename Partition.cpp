@@ -0,0 +1,94 @@
+#define NOMINMAX
+#include <windows.h>
+#include <wil/result.h>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include "Partition.h"
+
+void ReadVirtualDisk(HANDLE data_file, const std::vector<Extent>& extents, UINT64 offset, void* buffer, UINT32 size)
+{
+	memset(buffer, 0, size);
+	auto extent = std::upper_bound(extents.begin(), extents.end(), offset, [](UINT64 offset, const Extent& extent) { return offset < extent.virtual_offset + extent.length; });
+	for (; extent != extents.end() && extent->virtual_offset < offset + size; ++extent)
+	{
+		const UINT64 begin = std::max(extent->virtual_offset, offset);
+		const UINT64 end = std::min(extent->virtual_offset + extent->length, offset + size);
+		ReadFileWithOffset(data_file, static_cast<BYTE*>(buffer) + (begin - offset), static_cast<ULONG>(end - begin), extent->source_offset + (begin - extent->virtual_offset));
+	}
+}
+PartitionRange FindPartition(HANDLE data_file, const std::vector<Extent>& extents, UINT32 sector_size, UINT64 disk_size, UINT32 partition_number)
+{
+	if (partition_number == 0)
+	{
+		throw std::invalid_argument("Partition number starts from 1.");
+	}
+	MASTER_BOOT_RECORD mbr;
+	ReadVirtualDisk(data_file, extents, 0, &mbr, sizeof mbr);
+	if (mbr.Signature != MBR_SIGNATURE)
+	{
+		throw std::runtime_error("Source has no partition table.");
+	}
+	PartitionRange partition;
+	if (std::any_of(std::begin(mbr.Partitions), std::end(mbr.Partitions), [](const MBR_PARTITION_ENTRY& entry) { return entry.Type == MBR_PARTITION_TYPE_GPT_PROTECTIVE; }))
+	{
+		const auto header_buffer = std::make_unique<BYTE[]>(sector_size);
+		ReadVirtualDisk(data_file, extents, sector_size, header_buffer.get(), sector_size);
+		GPT_HEADER header;
+		memcpy(&header, header_buffer.get(), sizeof header);
+		if (header.Signature != GPT_SIGNATURE || header.SizeOfPartitionEntry < GPT_MIN_PARTITION_ENTRY_SIZE || static_cast<UINT64>(header.NumberOfPartitionEntries) * header.SizeOfPartitionEntry > GPT_MAX_PARTITION_ENTRIES_SIZE)
+		{
+			throw std::runtime_error("GPT header is corrupted.");
+		}
+		if (partition_number > header.NumberOfPartitionEntries)
+		{
+			throw std::runtime_error("Partition doesn't exist.");
+		}
+		GPT_PARTITION_ENTRY entry;
+		ReadVirtualDisk(data_file, extents, header.PartitionEntryLBA * sector_size + static_cast<UINT64>(partition_number - 1) * header.SizeOfPartitionEntry, &entry, sizeof entry);
+		if (entry.PartitionTypeGUID == GUID{} || entry.EndingLBA < entry.StartingLBA)
+		{
+			throw std::runtime_error("Partition doesn't exist.");
+		}
+		partition = { entry.StartingLBA * sector_size, (entry.EndingLBA - entry.StartingLBA + 1) * sector_size };
+	}
+	else
+	{
+		if (partition_number > MBR_PARTITION_ENTRIES_COUNT)
+		{
+			throw std::runtime_error("Logical partitions in extended partition are not supported.");
+		}
+		const auto& entry = mbr.Partitions[partition_number - 1];
+		if (entry.Type == MBR_PARTITION_TYPE_EMPTY || entry.SectorsCount == 0)
+		{
+			throw std::runtime_error("Partition doesn't exist.");
+		}
+		partition = { static_cast<UINT64>(entry.FirstLBA) * sector_size, static_cast<UINT64>(entry.SectorsCount) * sector_size };
+	}
+	if (partition.offset + partition.length > disk_size)
+	{
+		throw std::runtime_error("Partition exceeds disk size.");
+	}
+	return partition;
+}
+std::vector<Extent> ExtractPartition(const std::vector<Extent>& extents, const PartitionRange& partition)
+{
+	std::vector<Extent> partition_extents;
+	const UINT64 partition_end = partition.offset + partition.length;
+	for (const auto& extent : extents)
+	{
+		const UINT64 begin = std::max(extent.virtual_offset, partition.offset);
+		const UINT64 end = std::min(extent.virtual_offset + extent.length, partition_end);
+		if (begin >= end)
+		{
+			continue;
+		}
+		partition_extents.push_back({
+			.virtual_offset = begin - partition.offset,
+			.source_offset = extent.source_offset + (begin - extent.virtual_offset),
+			.length = end - begin,
+		});
+	}
+	return partition_extents;
+}
\ No newline at end of file
@@ -0,0 +1,67 @@
+#pragma once
+#include "Planner.h"
+
+constexpr UINT16 MBR_SIGNATURE = 0xAA55;
+constexpr BYTE MBR_PARTITION_TYPE_EMPTY = 0x00;
+constexpr BYTE MBR_PARTITION_TYPE_GPT_PROTECTIVE = 0xEE;
+constexpr UINT32 MBR_PARTITION_ENTRIES_COUNT = 4;
+constexpr UINT64 GPT_SIGNATURE = 0x5452415020494645; // "EFI PART"
+constexpr UINT32 GPT_MIN_PARTITION_ENTRY_SIZE = 128;
+constexpr UINT32 GPT_MAX_PARTITION_ENTRIES_SIZE = 1024 * 1024;
+#pragma pack(push, 1)
+struct MBR_PARTITION_ENTRY
+{
+	BYTE   Status;
+	BYTE   FirstCHS[3];
+	BYTE   Type;
+	BYTE   LastCHS[3];
+	UINT32 FirstLBA;
+	UINT32 SectorsCount;
+};
+struct MASTER_BOOT_RECORD
+{
+	BYTE   BootCode[446];
+	MBR_PARTITION_ENTRY Partitions[MBR_PARTITION_ENTRIES_COUNT];
+	UINT16 Signature;
+};
+static_assert(sizeof(MASTER_BOOT_RECORD) == 512);
+struct GPT_HEADER
+{
+	UINT64 Signature;
+	UINT32 Revision;
+	UINT32 HeaderSize;
+	UINT32 HeaderCRC32;
+	UINT32 Reserved;
+	UINT64 MyLBA;
+	UINT64 AlternateLBA;
+	UINT64 FirstUsableLBA;
+	UINT64 LastUsableLBA;
+	GUID   DiskGUID;
+	UINT64 PartitionEntryLBA;
+	UINT32 NumberOfPartitionEntries;
+	UINT32 SizeOfPartitionEntry;
+	UINT32 PartitionEntryArrayCRC32;
+};
+static_assert(sizeof(GPT_HEADER) == 92);
+struct GPT_PARTITION_ENTRY
+{
+	GUID   PartitionTypeGUID;
+	GUID   UniquePartitionGUID;
+	UINT64 StartingLBA;
+	UINT64 EndingLBA;
+	UINT64 Attributes;
+	WCHAR  PartitionName[36];
+};
+static_assert(sizeof(GPT_PARTITION_ENTRY) == GPT_MIN_PARTITION_ENTRY_SIZE);
+#pragma pack(pop)
+struct PartitionRange
+{
+	UINT64 offset;
+	UINT64 length;
+};
+// Reads guest data through extents of source, unallocated ranges read as zero.
+void ReadVirtualDisk(HANDLE data_file, const std::vector<Extent>& extents, UINT64 offset, void* buffer, UINT32 size);
+// Partition number is MBR primary partition slot or GPT partition entry index, from 1.
+PartitionRange FindPartition(HANDLE data_file, const std::vector<Extent>& extents, UINT32 sector_size, UINT64 disk_size, UINT32 partition_number);
+// Clips extents to partition and rebases them to start of partition.
+std::vector<Extent> ExtractPartition(const std::vector<Extent>& extents, const PartitionRange& partition);
\ No newline at end of file
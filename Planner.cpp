@@ -0,0 +1,272 @@
+#define NOMINMAX
+#include <windows.h>
+#include <wil/filesystem.h>
+#include <wil/resource.h>
+#include <intrin.h>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include "Planner.h"
+
+static bool IsZeroMemory(const BYTE* buffer, size_t size)
+{
+	_ASSERT(size % 64 == 0);
+	for (size_t i = 0; i < size; i += 64)
+	{
+		const __m128i v0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buffer + i));
+		const __m128i v1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buffer + i + 16));
+		const __m128i v2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buffer + i + 32));
+		const __m128i v3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buffer + i + 48));
+		const __m128i v = _mm_or_si128(_mm_or_si128(v0, v1), _mm_or_si128(v2, v3));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xFFFF)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+std::vector<Extent> DropZeroClusters(HANDLE data_file, const std::vector<Extent>& extents, UINT32 cluster_size)
+{
+	// Clusters left uncloned stay as holes in the sparse destination, so they read as zero.
+	const auto buffer = std::make_unique<BYTE[]>(ZERO_SCAN_BUFFER_SIZE);
+	std::vector<Extent> non_zero_extents;
+	for (const auto& extent : extents)
+	{
+		// Extents of partition may end in middle of cluster.
+		_ASSERT(extent.length % 64 == 0);
+		for (UINT64 extent_offset = 0; extent_offset < extent.length;)
+		{
+			const UINT32 read_size = static_cast<UINT32>(std::min<UINT64>(extent.length - extent_offset, ZERO_SCAN_BUFFER_SIZE));
+			ReadFileWithOffset(data_file, buffer.get(), read_size, extent.source_offset + extent_offset);
+			for (UINT32 buffer_offset = 0; buffer_offset < read_size; buffer_offset += cluster_size)
+			{
+				const UINT32 piece_size = std::min(cluster_size, read_size - buffer_offset);
+				if (IsZeroMemory(buffer.get() + buffer_offset, piece_size))
+				{
+					continue;
+				}
+				const UINT64 virtual_offset = extent.virtual_offset + extent_offset + buffer_offset;
+				const UINT64 source_offset = extent.source_offset + extent_offset + buffer_offset;
+				if (!non_zero_extents.empty() && non_zero_extents.back().virtual_offset + non_zero_extents.back().length == virtual_offset && non_zero_extents.back().source_offset + non_zero_extents.back().length == source_offset)
+				{
+					non_zero_extents.back().length += piece_size;
+				}
+				else
+				{
+					non_zero_extents.push_back({
+						.virtual_offset = virtual_offset,
+						.source_offset = source_offset,
+						.length = piece_size,
+					});
+				}
+			}
+			extent_offset += read_size;
+		}
+	}
+	return non_zero_extents;
+}
+std::vector<BlockSizeEstimate> EstimateBlockSizes(const Image& destination, UINT64 disk_size, const std::vector<Extent>& extents, UINT64 call_weight)
+{
+	std::vector<BlockSizeEstimate> estimates;
+	const UINT32 maximum_block_size = std::min(destination.GetMaximumBlockSize(), MAXIMUM_AUTO_BLOCK_SIZE);
+	for (UINT32 block_size = destination.GetMinimumBlockSize(); block_size != 0 && block_size <= maximum_block_size; block_size <<= 1)
+	{
+		UINT64 allocated_blocks = 0;
+		UINT64 clone_calls = 0;
+		UINT64 last_block_index = UINT64_MAX;
+		for (const auto& extent : extents)
+		{
+			const UINT64 first_block_index = extent.virtual_offset / block_size;
+			const UINT64 end_block_index = (extent.virtual_offset + extent.length - 1) / block_size;
+			clone_calls += end_block_index - first_block_index + 1;
+			allocated_blocks += end_block_index - first_block_index + (first_block_index != last_block_index);
+			last_block_index = end_block_index;
+		}
+		const UINT64 file_size = destination.EstimateFileSize(disk_size, block_size, allocated_blocks);
+		estimates.push_back({
+			.block_size = block_size,
+			.file_size = file_size,
+			.allocated_blocks = allocated_blocks,
+			.clone_calls = clone_calls,
+			.cost = file_size + call_weight * (clone_calls + allocated_blocks),
+		});
+	}
+	return estimates;
+}
+std::vector<UINT64> ReadAccessProfile(PCWSTR file_name, UINT32 block_size, UINT32 table_entries_count)
+{
+	const auto file = wil::open_file(file_name);
+	LARGE_INTEGER fsize;
+	THROW_IF_WIN32_BOOL_FALSE(GetFileSizeEx(file.get(), &fsize));
+	THROW_WIN32_IF(ERROR_FILE_TOO_LARGE, fsize.QuadPart > MAXIMUM_ACCESS_PROFILE_SIZE);
+	std::string profile(static_cast<size_t>(fsize.QuadPart), '\0');
+	ReadFileWithOffset(file.get(), profile.data(), static_cast<ULONG>(profile.size()), 0);
+	std::vector<UINT64> block_heat(table_entries_count);
+	for (size_t line_begin = 0; line_begin < profile.size();)
+	{
+		size_t line_end = profile.find('\n', line_begin);
+		if (line_end == std::string::npos)
+		{
+			line_end = profile.size();
+		}
+		const std::string line = profile.substr(line_begin, line_end - line_begin);
+		line_begin = line_end + 1;
+		UINT64 offset;
+		UINT64 length;
+		UINT64 count = 1;
+		if (line.starts_with("#") || sscanf_s(line.c_str(), "%llu %llu %llu", &offset, &length, &count) < 2 || length == 0)
+		{
+			continue;
+		}
+		for (UINT64 block_index = offset / block_size; block_index <= (offset + length - 1) / block_size && block_index < table_entries_count; block_index++)
+		{
+			const UINT64 block_begin = std::max(offset, block_index * block_size);
+			const UINT64 block_end = std::min(offset + length, (block_index + 1) * block_size);
+			block_heat[block_index] += (block_end - block_begin) * count;
+		}
+	}
+	return block_heat;
+}
+std::vector<CloneRun> PlanLayout(const std::vector<Extent>& extents, UINT32 block_size, LayoutPolicy policy, const std::vector<UINT64>& block_heat)
+{
+	std::vector<CloneRun> runs;
+	for (const auto& extent : extents)
+	{
+		for (UINT64 extent_offset = 0; extent_offset < extent.length;)
+		{
+			const UINT64 virtual_address = extent.virtual_offset + extent_offset;
+			const UINT32 block_offset = static_cast<UINT32>(virtual_address % block_size);
+			const UINT32 length = static_cast<UINT32>(std::min<UINT64>(extent.length - extent_offset, block_size - block_offset));
+			runs.push_back({
+				.block_index = static_cast<UINT32>(virtual_address / block_size),
+				.block_offset = block_offset,
+				.length = length,
+				.source_offset = extent.source_offset + extent_offset,
+			});
+			extent_offset += length;
+		}
+	}
+	switch (policy)
+	{
+	case LayoutPolicy::Virtual:
+		break;
+	case LayoutPolicy::Source:
+		std::stable_sort(runs.begin(), runs.end(), [](const CloneRun& l, const CloneRun& r) { return l.source_offset < r.source_offset; });
+		break;
+	case LayoutPolicy::Hot:
+		std::stable_sort(runs.begin(), runs.end(), [&block_heat](const CloneRun& l, const CloneRun& r) { return block_heat[l.block_index] > block_heat[r.block_index]; });
+		break;
+	}
+	return runs;
+}
+LayoutMetrics MeasureLayout(const std::vector<CloneRun>& runs, UINT32 block_size)
+{
+	// Simulate appending each block on first touch, as dynamic images allocate.
+	std::unordered_map<UINT32, UINT64> block_slots;
+	LayoutMetrics metrics = {};
+	UINT64 next_source_offset = UINT64_MAX;
+	UINT64 next_target_offset = UINT64_MAX;
+	for (const auto& run : runs)
+	{
+		const auto [slot, _] = block_slots.try_emplace(run.block_index, block_slots.size());
+		const UINT64 target_offset = slot->second * block_size + run.block_offset;
+		if (run.source_offset != next_source_offset || target_offset != next_target_offset)
+		{
+			metrics.clone_runs++;
+		}
+		next_source_offset = run.source_offset + run.length;
+		next_target_offset = target_offset + run.length;
+	}
+	metrics.allocated_blocks = block_slots.size();
+	std::vector<std::pair<UINT32, UINT64>> virtual_order(block_slots.begin(), block_slots.end());
+	std::sort(virtual_order.begin(), virtual_order.end());
+	for (size_t i = 0; i < virtual_order.size(); i++)
+	{
+		if (i == 0 || virtual_order[i].second != virtual_order[i - 1].second + 1)
+		{
+			metrics.fragments++;
+		}
+	}
+	return metrics;
+}
+std::vector<PhysicalExtent> ReadPhysicalExtents(HANDLE file, UINT32 cluster_size)
+{
+	// Reference counts are reported only by ReFS. Other file systems fall back to plain retrieval pointers, and all data is exclusive.
+	DWORD ioctl = FSCTL_GET_RETRIEVAL_POINTERS_AND_REFCOUNT;
+	const auto buffer = std::make_unique<BYTE[]>(RETRIEVAL_POINTERS_BUFFER_SIZE);
+	std::vector<PhysicalExtent> extents;
+	STARTING_VCN_INPUT_BUFFER input = {};
+	for (;;)
+	{
+		ULONG _;
+		const bool more = !DeviceIoControl(file, ioctl, &input, sizeof input, buffer.get(), RETRIEVAL_POINTERS_BUFFER_SIZE, &_, nullptr);
+		if (more)
+		{
+			const ULONG error = GetLastError();
+			if (error == ERROR_HANDLE_EOF)
+			{
+				return extents;
+			}
+			if (ioctl == FSCTL_GET_RETRIEVAL_POINTERS_AND_REFCOUNT && extents.empty() && (error == ERROR_INVALID_FUNCTION || error == ERROR_NOT_SUPPORTED))
+			{
+				ioctl = FSCTL_GET_RETRIEVAL_POINTERS;
+				continue;
+			}
+			THROW_WIN32_IF(error, error != ERROR_MORE_DATA);
+		}
+		LONGLONG vcn;
+		if (ioctl == FSCTL_GET_RETRIEVAL_POINTERS_AND_REFCOUNT)
+		{
+			const auto pointers = reinterpret_cast<const RETRIEVAL_POINTERS_AND_REFCOUNT_BUFFER*>(buffer.get());
+			vcn = pointers->StartingVcn.QuadPart;
+			for (ULONG i = 0; i < pointers->ExtentCount; i++)
+			{
+				extents.push_back({
+					.file_offset = static_cast<UINT64>(vcn) * cluster_size,
+					.length = static_cast<UINT64>(pointers->Extents[i].NextVcn.QuadPart - vcn) * cluster_size,
+					.lcn = pointers->Extents[i].Lcn.QuadPart,
+					.reference_count = pointers->Extents[i].ReferenceCount,
+				});
+				vcn = pointers->Extents[i].NextVcn.QuadPart;
+			}
+		}
+		else
+		{
+			const auto pointers = reinterpret_cast<const RETRIEVAL_POINTERS_BUFFER*>(buffer.get());
+			vcn = pointers->StartingVcn.QuadPart;
+			for (ULONG i = 0; i < pointers->ExtentCount; i++)
+			{
+				extents.push_back({
+					.file_offset = static_cast<UINT64>(vcn) * cluster_size,
+					.length = static_cast<UINT64>(pointers->Extents[i].NextVcn.QuadPart - vcn) * cluster_size,
+					.lcn = pointers->Extents[i].Lcn.QuadPart,
+					.reference_count = 1,
+				});
+				vcn = pointers->Extents[i].NextVcn.QuadPart;
+			}
+		}
+		if (!more)
+		{
+			return extents;
+		}
+		input.StartingVcn.QuadPart = vcn;
+	}
+}
+UINT64 MarkReferenceLimitedRuns(std::vector<CloneRun>& runs, const std::vector<PhysicalExtent>& physical_extents)
+{
+	UINT64 marked_runs = 0;
+	for (auto& run : runs)
+	{
+		auto physical = std::upper_bound(physical_extents.begin(), physical_extents.end(), run.source_offset, [](UINT64 offset, const PhysicalExtent& extent) { return offset < extent.file_offset + extent.length; });
+		for (; physical != physical_extents.end() && physical->file_offset < run.source_offset + run.length; ++physical)
+		{
+			if (physical->lcn >= 0 && physical->reference_count >= CLONE_REFERENCE_LIMIT)
+			{
+				run.reference_limited = true;
+				marked_runs++;
+				break;
+			}
+		}
+	}
+	return marked_runs;
+}
\ No newline at end of file
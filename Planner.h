@@ -0,0 +1,113 @@
+#pragma once
+#include "Image.h"
+
+constexpr UINT32 MAXIMUM_AUTO_BLOCK_SIZE = 256 * 1024 * 1024;
+constexpr UINT32 MAXIMUM_ACCESS_PROFILE_SIZE = 64 * 1024 * 1024;
+constexpr LONGLONG MAXIMUM_CLONE_SIZE = 1LL << 31;
+constexpr UINT32 ZERO_SCAN_BUFFER_SIZE = 4 * 1024 * 1024;
+constexpr UINT32 COPY_BUFFER_SIZE = 1024 * 1024;
+constexpr ULONG RETRIEVAL_POINTERS_BUFFER_SIZE = 64 * 1024;
+// ReFS refuses to clone clusters referenced about 4096 times. Clusters referenced this many times are treated as at the limit.
+constexpr ULONG CLONE_REFERENCE_LIMIT = 4000;
+enum class LayoutPolicy
+{
+	Virtual,
+	Source,
+	Hot,
+};
+struct Extent
+{
+	UINT64 virtual_offset;
+	UINT64 source_offset;
+	UINT64 length;
+};
+struct BlockSizeEstimate
+{
+	UINT32 block_size;
+	UINT64 file_size;
+	UINT64 allocated_blocks;
+	UINT64 clone_calls;
+	UINT64 cost;
+};
+struct CloneRun
+{
+	UINT32 block_index;
+	UINT32 block_offset;
+	UINT32 length;
+	UINT64 source_offset;
+	UINT64 target_offset = 0;
+	HANDLE dedup_file = nullptr;
+	UINT64 dedup_offset = 0;
+	// Source clusters were at reference count limit when planned, so run is copied without trying to clone.
+	bool reference_limited = false;
+};
+// Clusters of file as reported by retrieval pointers.
+struct PhysicalExtent
+{
+	UINT64 file_offset;
+	UINT64 length;
+	LONGLONG lcn;
+	ULONG reference_count;
+};
+struct LayoutMetrics
+{
+	UINT64 allocated_blocks;
+	UINT64 fragments;
+	UINT64 clone_runs;
+};
+// probe_block(index) returns address of allocated block, probe_sector_runs(index, runs) its present runs.
+template <typename SourceImage, typename ProbeBlock, typename ProbeSectorRuns>
+std::vector<Extent> CollectExtentsOf(const SourceImage& image, UINT32 cluster_size, ProbeBlock&& probe_block, ProbeSectorRuns&& probe_sector_runs)
+{
+	const UINT64 block_size = image.GetBlockSize();
+	const UINT64 disk_end = round_up(image.GetDiskSize(), static_cast<UINT64>(cluster_size));
+	std::vector<Extent> extents;
+	std::vector<SectorRun> sector_runs;
+	std::vector<UINT64> allocated;
+	image.ScanAllocatedBlocks(allocated);
+	for (size_t word = 0; word < allocated.size(); word++)
+	{
+		for (UINT64 bits = allocated[word]; bits != 0; bits &= bits - 1)
+		{
+			const UINT32 block_index = static_cast<UINT32>(word * 64 + std::countr_zero(bits));
+			const UINT64 block_address = probe_block(block_index);
+			probe_sector_runs(block_index, sector_runs);
+			for (const auto& sector_run : sector_runs)
+			{
+				const UINT64 virtual_offset = block_size * block_index + sector_run.offset;
+				if (virtual_offset >= disk_end)
+				{
+					break;
+				}
+				const Extent extent = {
+					.virtual_offset = virtual_offset,
+					.source_offset = block_address + sector_run.offset,
+					.length = std::min<UINT64>(sector_run.length, disk_end - virtual_offset),
+				};
+				if (!extents.empty() && extents.back().virtual_offset + extents.back().length == extent.virtual_offset && extents.back().source_offset + extents.back().length == extent.source_offset)
+				{
+					extents.back().length += extent.length;
+				}
+				else
+				{
+					extents.push_back(extent);
+				}
+			}
+		}
+	}
+	return extents;
+}
+template <typename SourceImage>
+std::vector<Extent> CollectExtentsOf(const SourceImage& image, UINT32 cluster_size)
+{
+	return CollectExtentsOf(image, cluster_size, [&](UINT32 index) { return *image.ProbeBlock(index); }, [&](UINT32 index, std::vector<SectorRun>& runs) { image.ProbeSectorRuns(index, runs); });
+}
+std::vector<Extent> DropZeroClusters(HANDLE data_file, const std::vector<Extent>& extents, UINT32 cluster_size);
+std::vector<BlockSizeEstimate> EstimateBlockSizes(const Image& destination, UINT64 disk_size, const std::vector<Extent>& extents, UINT64 call_weight);
+std::vector<UINT64> ReadAccessProfile(PCWSTR file_name, UINT32 block_size, UINT32 table_entries_count);
+std::vector<CloneRun> PlanLayout(const std::vector<Extent>& extents, UINT32 block_size, LayoutPolicy policy, const std::vector<UINT64>& block_heat);
+LayoutMetrics MeasureLayout(const std::vector<CloneRun>& runs, UINT32 block_size);
+// In file offset order. Sparse holes have negative lcn.
+std::vector<PhysicalExtent> ReadPhysicalExtents(HANDLE file, UINT32 cluster_size);
+// Marks runs reading clusters at CLONE_REFERENCE_LIMIT. Returns number of marked runs.
+UINT64 MarkReferenceLimitedRuns(std::vector<CloneRun>& runs, const std::vector<PhysicalExtent>& physical_extents);
\ No newline at end of file
@@ -2,7 +2,7 @@
 #include "Image.h"
 
 constexpr UINT32 RAW_SECTOR_SIZE = 512;
-struct RAW : Image
+struct RAW final : Image
 {
 private:
 	LARGE_INTEGER raw_disk_size;
@@ -42,16 +42,20 @@ public:
 		raw_disk_size.QuadPart = disk_size;
 		raw_block_size = std::max(1U << std::min(std::countr_zero<ULONGLONG>(disk_size), 31), require_alignment);
 		FILE_END_OF_FILE_INFO eof_info = { {.QuadPart = static_cast<LONGLONG>(disk_size) } };
-		THROW_IF_WIN32_BOOL_FALSE(SetFileInformationByHandle(image_file, FileEndOfFileInfo, &eof_info, sizeof eof_info));
+		SetImageFileEnd(eof_info);
 	}
 	void WriteHeader() const
 	{
-		THROW_IF_WIN32_BOOL_FALSE(FlushFileBuffers(image_file));
+		FlushImage();
 	}
-	void CheckConvertible() const
+	void CheckReadable() const
 	{
 		THROW_WIN32_IF(ERROR_ARITHMETIC_OVERFLOW, GetDiskSize() / GetBlockSize() > UINT32_MAX);
 	}
+	void CheckConvertible() const
+	{
+		CheckReadable();
+	}
 	bool IsFixed() const
 	{
 		return true;
@@ -76,6 +80,10 @@ public:
 	{
 		return ceil_div(GetDiskSize(), GetBlockSize());
 	}
+	UINT64 EstimateFileSize(UINT64 disk_size, UINT32, UINT64) const
+	{
+		return disk_size;
+	}
 	std::optional<UINT64> ProbeBlock(UINT32 index) const
 	{
 		_ASSERT(index < GetTableEntriesCount());
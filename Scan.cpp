@@ -0,0 +1,190 @@
+#define NOMINMAX
+#include <windows.h>
+#include <immintrin.h>
+#include "Scan.h"
+
+constexpr UINT32 VHD_UNUSED_ENTRY = ~0U;
+constexpr UINT64 VHDX_STATE_MASK = 7;
+constexpr UINT64 VHDX_STATE_FULLY_PRESENT = 6;
+enum class ScanLevel
+{
+	Scalar,
+	SSE41,
+	AVX2,
+};
+static ScanLevel GetScanLevel()
+{
+	static const ScanLevel level = IsProcessorFeaturePresent(PF_AVX2_INSTRUCTIONS_AVAILABLE) ? ScanLevel::AVX2
+		: IsProcessorFeaturePresent(PF_SSE4_1_INSTRUCTIONS_AVAILABLE) ? ScanLevel::SSE41
+		: ScanLevel::Scalar;
+	return level;
+}
+static void SetBits(UINT64* bitmap, UINT64 index, UINT64 bits)
+{
+	const UINT32 shift = index % 64;
+	bitmap[index / 64] |= bits << shift;
+	if (shift != 0 && bits >> (64 - shift) != 0)
+	{
+		bitmap[index / 64 + 1] |= bits >> (64 - shift);
+	}
+}
+// Returns index of first entry left for scalar tail, or UINT32_MAX on misalignment.
+static UINT32 ScanVHDAVX2(const UINT32* table, UINT32 count, UINT32 bias, UINT32 alignment_mask, UINT64* allocated)
+{
+	const __m256i swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12, 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	const __m256i unused = _mm256_set1_epi32(-1);
+	const __m256i bias_vector = _mm256_set1_epi32(bias);
+	const __m256i mask_vector = _mm256_set1_epi32(alignment_mask);
+	UINT32 i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		const __m256i entries = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(table + i));
+		const UINT32 present = ~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(entries, unused))) & 0xFF;
+		if (present == 0)
+		{
+			continue;
+		}
+		const __m256i misalignment = _mm256_and_si256(_mm256_add_epi32(_mm256_shuffle_epi8(entries, swap), bias_vector), mask_vector);
+		const UINT32 aligned = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(misalignment, _mm256_setzero_si256())));
+		if ((present & ~aligned) != 0)
+		{
+			return UINT32_MAX;
+		}
+		if (allocated)
+		{
+			SetBits(allocated, i, present);
+		}
+	}
+	return i;
+}
+static UINT32 ScanVHDSSE41(const UINT32* table, UINT32 count, UINT32 bias, UINT32 alignment_mask, UINT64* allocated)
+{
+	const __m128i swap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	const __m128i unused = _mm_set1_epi32(-1);
+	const __m128i bias_vector = _mm_set1_epi32(bias);
+	const __m128i mask_vector = _mm_set1_epi32(alignment_mask);
+	UINT32 i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		const __m128i entries = _mm_loadu_si128(reinterpret_cast<const __m128i*>(table + i));
+		const UINT32 present = ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(entries, unused))) & 0xF;
+		if (present == 0)
+		{
+			continue;
+		}
+		const __m128i misalignment = _mm_and_si128(_mm_add_epi32(_mm_shuffle_epi8(entries, swap), bias_vector), mask_vector);
+		const UINT32 aligned = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(misalignment, _mm_setzero_si128())));
+		if ((present & ~aligned) != 0)
+		{
+			return UINT32_MAX;
+		}
+		if (allocated)
+		{
+			SetBits(allocated, i, present);
+		}
+	}
+	return i;
+}
+bool ScanVHDBlockAllocationTable(const UINT32* big_endian_table, UINT32 count, UINT32 bias, UINT32 alignment, UINT64* allocated)
+{
+	_ASSERT(std::has_single_bit(alignment));
+	const UINT32 alignment_mask = alignment - 1;
+	UINT32 i = 0;
+	switch (GetScanLevel())
+	{
+	case ScanLevel::AVX2:
+		i = ScanVHDAVX2(big_endian_table, count, bias, alignment_mask, allocated);
+		break;
+	case ScanLevel::SSE41:
+		i = ScanVHDSSE41(big_endian_table, count, bias, alignment_mask, allocated);
+		break;
+	case ScanLevel::Scalar:
+		break;
+	}
+	if (i == UINT32_MAX)
+	{
+		return false;
+	}
+	for (; i < count; i++)
+	{
+		if (big_endian_table[i] == VHD_UNUSED_ENTRY)
+		{
+			continue;
+		}
+		if (((std::byteswap(big_endian_table[i]) + bias) & alignment_mask) != 0)
+		{
+			return false;
+		}
+		if (allocated)
+		{
+			SetBits(allocated, i, 1);
+		}
+	}
+	return true;
+}
+static UINT32 ScanVHDXAVX2(const UINT64* table, UINT32 count, UINT64 first_bit, UINT64* allocated)
+{
+	const __m256i state_mask = _mm256_set1_epi64x(VHDX_STATE_MASK);
+	const __m256i fully_present = _mm256_set1_epi64x(VHDX_STATE_FULLY_PRESENT);
+	UINT32 i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		const __m256i entries0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(table + i));
+		const __m256i entries1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(table + i + 4));
+		const UINT32 present0 = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_and_si256(entries0, state_mask), fully_present)));
+		const UINT32 present1 = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_and_si256(entries1, state_mask), fully_present)));
+		if (const UINT32 present = present0 | present1 << 4; present != 0)
+		{
+			SetBits(allocated, first_bit + i, present);
+		}
+	}
+	return i;
+}
+static UINT32 ScanVHDXSSE41(const UINT64* table, UINT32 count, UINT64 first_bit, UINT64* allocated)
+{
+	const __m128i state_mask = _mm_set1_epi64x(VHDX_STATE_MASK);
+	const __m128i fully_present = _mm_set1_epi64x(VHDX_STATE_FULLY_PRESENT);
+	UINT32 i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		const __m128i entries0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(table + i));
+		const __m128i entries1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(table + i + 2));
+		const UINT32 present0 = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(_mm_and_si128(entries0, state_mask), fully_present)));
+		const UINT32 present1 = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(_mm_and_si128(entries1, state_mask), fully_present)));
+		if (const UINT32 present = present0 | present1 << 2; present != 0)
+		{
+			SetBits(allocated, first_bit + i, present);
+		}
+	}
+	return i;
+}
+void ScanVHDXBlockAllocationTable(const UINT64* table, UINT32 data_blocks_count, UINT32 chunk_ratio, UINT64* allocated)
+{
+	_ASSERT(chunk_ratio != 0);
+	const ScanLevel level = GetScanLevel();
+	// Payload entries of a chunk are contiguous, sector bitmap entry follows each chunk.
+	for (UINT64 first_block = 0; first_block < data_blocks_count; first_block += chunk_ratio)
+	{
+		const UINT64* chunk = table + first_block + first_block / chunk_ratio;
+		const UINT32 count = static_cast<UINT32>(std::min<UINT64>(chunk_ratio, data_blocks_count - first_block));
+		UINT32 i = 0;
+		switch (level)
+		{
+		case ScanLevel::AVX2:
+			i = ScanVHDXAVX2(chunk, count, first_block, allocated);
+			break;
+		case ScanLevel::SSE41:
+			i = ScanVHDXSSE41(chunk, count, first_block, allocated);
+			break;
+		case ScanLevel::Scalar:
+			break;
+		}
+		for (; i < count; i++)
+		{
+			if ((chunk[i] & VHDX_STATE_MASK) == VHDX_STATE_FULLY_PRESENT)
+			{
+				SetBits(allocated, first_block + i, 1);
+			}
+		}
+	}
+}
\ No newline at end of file
@@ -0,0 +1,11 @@
+#pragma once
+#include "Image.h"
+
+// Bulk block allocation table kernels. Dispatched once per process to AVX2, SSE4.1 or scalar code.
+
+// Marks every entry not equal to VHD unused entry (~0) in allocated, starting at bit 0.
+// Returns false when any allocated entry plus bias is not multiple of alignment. Entries, bias and alignment are in sectors.
+[[nodiscard]]
+bool ScanVHDBlockAllocationTable(const UINT32* big_endian_table, UINT32 count, UINT32 bias, UINT32 alignment, UINT64* allocated);
+// Marks every payload entry in PAYLOAD_BLOCK_FULLY_PRESENT state in allocated, skipping sector bitmap entries spaced by chunk_ratio.
+void ScanVHDXBlockAllocationTable(const UINT64* table, UINT32 data_blocks_count, UINT32 chunk_ratio, UINT64* allocated);
\ No newline at end of file
@@ -0,0 +1,137 @@
+#define NOMINMAX
+#include <windows.h>
+#include <wil/result.h>
+#include <algorithm>
+#include "Scheduler.h"
+
+IoScheduler::IoScheduler(const IoBudget& io_budget) : budget(io_budget)
+{
+	clone_calls = { static_cast<double>(budget.clone_calls_per_second), static_cast<double>(budget.clone_calls_per_second) };
+	metadata_operations = { static_cast<double>(budget.metadata_operations_per_second), static_cast<double>(budget.metadata_operations_per_second) };
+	bytes = { static_cast<double>(budget.bytes_per_second), static_cast<double>(budget.bytes_per_second) };
+	LARGE_INTEGER qpf;
+	QueryPerformanceFrequency(&qpf);
+	frequency = qpf.QuadPart;
+	last_refill = Now();
+}
+LONGLONG IoScheduler::Now()
+{
+	LARGE_INTEGER qpc;
+	QueryPerformanceCounter(&qpc);
+	return qpc.QuadPart;
+}
+double IoScheduler::Reserve(TokenBucket& bucket, double amount)
+{
+	if (bucket.rate == 0)
+	{
+		return 0;
+	}
+	// Bucket may go into debt by one large request, later requests wait for it to be repaid.
+	const double wait = bucket.tokens < 0 ? -bucket.tokens / bucket.rate : 0;
+	bucket.tokens -= amount;
+	return wait;
+}
+LONGLONG IoScheduler::Admit(IoKind kind, UINT64 size)
+{
+	double wait;
+	ULONG backoff;
+	{
+		std::lock_guard lock(scheduler_lock);
+		const LONGLONG now = Now();
+		const double elapsed = static_cast<double>(now - last_refill) / frequency;
+		last_refill = now;
+		for (auto bucket : { &clone_calls, &metadata_operations, &bytes })
+		{
+			bucket->tokens = std::min(bucket->tokens + elapsed * bucket->rate, bucket->rate);
+		}
+		wait = Reserve(bytes, static_cast<double>(size));
+		if (kind == IoKind::Clone)
+		{
+			wait = std::max(wait, Reserve(clone_calls, 1));
+		}
+		else if (kind == IoKind::Metadata)
+		{
+			wait = std::max(wait, Reserve(metadata_operations, 1));
+		}
+		backoff = backoff_milliseconds;
+	}
+	const ULONG wait_milliseconds = std::max(static_cast<ULONG>(wait * 1000), backoff);
+	if (wait_milliseconds)
+	{
+		Sleep(wait_milliseconds);
+	}
+	return Now();
+}
+void IoScheduler::Complete(LONGLONG started)
+{
+	if (budget.target_latency_milliseconds == 0)
+	{
+		return;
+	}
+	const double latency = static_cast<double>(Now() - started) * 1000 / frequency;
+	std::lock_guard lock(scheduler_lock);
+	average_latency = average_latency == 0 ? latency : average_latency * 0.875 + latency * 0.125;
+	if (average_latency > budget.target_latency_milliseconds)
+	{
+		backoff_milliseconds = std::clamp<ULONG>(backoff_milliseconds * 2, 1, MAXIMUM_BACKOFF_MILLISECONDS);
+	}
+	else
+	{
+		backoff_milliseconds /= 2;
+	}
+}
+void IoScheduler::SetPriorityHint(HANDLE file) const
+{
+	if (!budget.low_priority)
+	{
+		return;
+	}
+	FILE_IO_PRIORITY_HINT_INFO priority_hint = { IoPriorityHintLow };
+	THROW_IF_WIN32_BOOL_FALSE(SetFileInformationByHandle(file, FileIoPriorityHintInfo, &priority_hint, sizeof priority_hint));
+}
+UINT64 IoScheduler::GetMaximumCloneSize(UINT64 maximum_size, UINT32 cluster_size) const
+{
+	if (budget.bytes_per_second == 0)
+	{
+		return maximum_size;
+	}
+	return std::clamp<UINT64>(budget.bytes_per_second / cluster_size * cluster_size, cluster_size, maximum_size);
+}
+CloneCostModel::CloneCostModel(UINT64 copy_limit) : copy_limit(copy_limit)
+{
+	LARGE_INTEGER qpf;
+	QueryPerformanceFrequency(&qpf);
+	frequency = qpf.QuadPart;
+}
+LONGLONG CloneCostModel::Now()
+{
+	LARGE_INTEGER qpc;
+	QueryPerformanceCounter(&qpc);
+	return qpc.QuadPart;
+}
+UINT64 CloneCostModel::GetBreakEvenSize() const
+{
+	if (copy_limit == 0)
+	{
+		return 0;
+	}
+	if (clone_call_seconds == 0 || copy_byte_seconds == 0)
+	{
+		return std::min(DEFAULT_CLONE_CALL_COST, copy_limit);
+	}
+	return std::min(static_cast<UINT64>(clone_call_seconds / copy_byte_seconds), copy_limit);
+}
+void CloneCostModel::RecordClone(LONGLONG started)
+{
+	const double seconds = static_cast<double>(Now() - started) / frequency;
+	clone_call_seconds = clone_call_seconds == 0 ? seconds : clone_call_seconds * 0.875 + seconds * 0.125;
+}
+void CloneCostModel::RecordCopy(UINT64 size, LONGLONG started)
+{
+	if (size == 0)
+	{
+		return;
+	}
+	const double seconds = static_cast<double>(Now() - started) / frequency / size;
+	copy_byte_seconds = copy_byte_seconds == 0 ? seconds : copy_byte_seconds * 0.875 + seconds * 0.125;
+}
\ No newline at end of file
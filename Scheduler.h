@@ -0,0 +1,95 @@
+#pragma once
+#include <windows.h>
+#include <mutex>
+
+constexpr ULONG MAXIMUM_BACKOFF_MILLISECONDS = 1000;
+// Assumed cost of one clone call as bytes copied in same time, until both are measured.
+constexpr UINT64 DEFAULT_CLONE_CALL_COST = 64 * 1024;
+enum class IoKind
+{
+	Clone,
+	Copy,
+	Metadata,
+};
+// Zero is unlimited.
+struct IoBudget
+{
+	UINT32 clone_calls_per_second = 0;
+	UINT32 metadata_operations_per_second = 0;
+	UINT64 bytes_per_second = 0;
+	// Back off while measured latency of each operation is above it.
+	UINT32 target_latency_milliseconds = 0;
+	bool low_priority = false;
+};
+struct IoScheduler
+{
+private:
+	struct TokenBucket
+	{
+		double rate;
+		double tokens;
+	};
+	const IoBudget budget;
+	std::mutex scheduler_lock;
+	TokenBucket clone_calls;
+	TokenBucket metadata_operations;
+	TokenBucket bytes;
+	LONGLONG frequency;
+	LONGLONG last_refill;
+	double average_latency = 0;
+	ULONG backoff_milliseconds = 0;
+	static LONGLONG Now();
+	// Takes tokens in advance and returns time to wait, so sleeping doesn't hold the lock.
+	static double Reserve(TokenBucket& bucket, double amount);
+	LONGLONG Admit(IoKind kind, UINT64 size);
+	void Complete(LONGLONG started);
+public:
+	explicit IoScheduler(const IoBudget& io_budget);
+	IoScheduler(const IoScheduler&) = delete;
+	IoScheduler& operator=(const IoScheduler&) = delete;
+	void SetPriorityHint(HANDLE file) const;
+	// Clone requests larger than this would drain a second of byte budget at once.
+	UINT64 GetMaximumCloneSize(UINT64 maximum_size, UINT32 cluster_size) const;
+	template <typename Fn>
+	BOOL Run(IoKind kind, UINT64 size, Fn&& io)
+	{
+		const LONGLONG started = Admit(kind, size);
+		const BOOL result = io();
+		const ULONG error = GetLastError();
+		Complete(started);
+		SetLastError(error);
+		return result;
+	}
+};
+// Compares measured latency of clone calls with measured time per copied byte.
+// A clone call costs about the same regardless of its size, copying costs by bytes.
+struct CloneCostModel
+{
+private:
+	const UINT64 copy_limit;
+	LONGLONG frequency;
+	// Moving averages, zero until measured.
+	double clone_call_seconds = 0;
+	double copy_byte_seconds = 0;
+public:
+	// Extents of copy_limit bytes or more are always cloned. Zero never prefers copy.
+	explicit CloneCostModel(UINT64 copy_limit);
+	static LONGLONG Now();
+	// Size below which copying is cheaper than one clone call.
+	UINT64 GetBreakEvenSize() const;
+	bool PreferCopy(UINT64 size) const
+	{
+		return size < GetBreakEvenSize();
+	}
+	void RecordClone(LONGLONG started);
+	void RecordCopy(UINT64 size, LONGLONG started);
+};
+template <typename Fn>
+BOOL ScheduleIo(IoScheduler* scheduler, IoKind kind, UINT64 size, Fn&& io)
+{
+	if (!scheduler)
+	{
+		return io();
+	}
+	return scheduler->Run(kind, size, io);
+}
\ No newline at end of file
@@ -0,0 +1,262 @@
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <mswsock.h>
+#include <windows.h>
+#include <wil/resource.h>
+#include <wil/result.h>
+#include <algorithm>
+#include <iterator>
+#include <string>
+#include <utility>
+#include <vector>
+#include "Image.h"
+#include "Stream.h"
+#pragma comment(lib, "ws2_32")
+#pragma comment(lib, "mswsock")
+
+using unique_addrinfow = wil::unique_any<PADDRINFOW, decltype(&::FreeAddrInfoW), ::FreeAddrInfoW>;
+using unique_wsacleanup_call = wil::unique_call<decltype(&::WSACleanup), ::WSACleanup, false>;
+static const BYTE zero_buffer[STREAM_BUFFER_SIZE] = {};
+struct StreamWriter
+{
+private:
+	unique_wsacleanup_call wsa_cleanup;
+	wil::unique_socket output_socket;
+	wil::unique_hfile output_file;
+	HANDLE output_handle;
+	std::unique_ptr<BYTE[]> copy_buffer;
+	void Connect(const std::wstring& address)
+	{
+		const size_t port_separator = address.rfind(L':');
+		if (port_separator == std::wstring::npos)
+		{
+			throw std::invalid_argument("Stream address must be tcp:<Host>:<Port>.");
+		}
+		WSADATA wsa_data;
+		THROW_IF_WIN32_ERROR(WSAStartup(MAKEWORD(2, 2), &wsa_data));
+		wsa_cleanup = unique_wsacleanup_call(true);
+		const std::wstring host = address.substr(0, port_separator);
+		const std::wstring port = address.substr(port_separator + 1);
+		ADDRINFOW hints = {
+			.ai_family = AF_UNSPEC,
+			.ai_socktype = SOCK_STREAM,
+			.ai_protocol = IPPROTO_TCP,
+		};
+		unique_addrinfow address_info;
+		THROW_IF_WIN32_ERROR(GetAddrInfoW(host.c_str(), port.c_str(), &hints, address_info.put()));
+		int error = WSAHOST_NOT_FOUND;
+		for (auto ai = address_info.get(); ai; ai = ai->ai_next)
+		{
+			wil::unique_socket s(socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol));
+			if (s && connect(s.get(), ai->ai_addr, static_cast<int>(ai->ai_addrlen)) == 0)
+			{
+				output_socket = std::move(s);
+				return;
+			}
+			error = WSAGetLastError();
+		}
+		THROW_WIN32(error);
+	}
+	void Send(const BYTE* buffer, ULONG length)
+	{
+		while (length)
+		{
+			const int sent = send(output_socket.get(), reinterpret_cast<const char*>(buffer), static_cast<int>(length), 0);
+			THROW_LAST_ERROR_IF(sent == SOCKET_ERROR);
+			buffer += sent;
+			length -= sent;
+		}
+	}
+public:
+	void Write(const BYTE* buffer, ULONG length)
+	{
+		if (output_socket)
+		{
+			return Send(buffer, length);
+		}
+		while (length)
+		{
+			ULONG written;
+			THROW_IF_WIN32_BOOL_FALSE(WriteFile(output_handle, buffer, length, &written, nullptr));
+			buffer += written;
+			length -= written;
+		}
+	}
+	explicit StreamWriter(PCWSTR output_name)
+	{
+		if (wcscmp(output_name, L"-") == 0)
+		{
+			output_handle = GetStdHandle(STD_OUTPUT_HANDLE);
+			THROW_LAST_ERROR_IF(output_handle == INVALID_HANDLE_VALUE || output_handle == nullptr);
+		}
+		else if (_wcsnicmp(output_name, L"tcp:", 4) == 0)
+		{
+			Connect(output_name + 4);
+		}
+		else
+		{
+			// Named pipes and devices must exist, anything else is a new file.
+			output_file.reset(CreateFileW(output_name, GENERIC_WRITE, 0, nullptr, wcsncmp(output_name, LR"(\\.\)", 4) == 0 ? OPEN_EXISTING : CREATE_NEW, FILE_FLAG_SEQUENTIAL_SCAN, nullptr));
+			THROW_LAST_ERROR_IF(!output_file);
+			output_handle = output_file.get();
+		}
+	}
+	void WriteZero(UINT64 length)
+	{
+		while (length)
+		{
+			const ULONG write_size = static_cast<ULONG>(std::min<UINT64>(length, sizeof zero_buffer));
+			Write(zero_buffer, write_size);
+			length -= write_size;
+		}
+	}
+	void Transmit(HANDLE file, UINT64 offset, UINT64 length)
+	{
+		if (output_socket)
+		{
+			// TransmitFile reads from the current file position.
+			THROW_IF_WIN32_BOOL_FALSE(SetFilePointerEx(file, { .QuadPart = static_cast<LONGLONG>(offset) }, nullptr, FILE_BEGIN));
+			while (length)
+			{
+				const ULONG transmit_size = static_cast<ULONG>(std::min<UINT64>(length, STREAM_TRANSMIT_SIZE));
+				THROW_IF_WIN32_BOOL_FALSE(TransmitFile(output_socket.get(), file, transmit_size, 0, nullptr, nullptr, 0));
+				length -= transmit_size;
+			}
+			return;
+		}
+		if (!copy_buffer)
+		{
+			copy_buffer = std::make_unique<BYTE[]>(STREAM_BUFFER_SIZE);
+		}
+		while (length)
+		{
+			const ULONG copy_size = static_cast<ULONG>(std::min<UINT64>(length, STREAM_BUFFER_SIZE));
+			ReadFileWithOffset(file, copy_buffer.get(), copy_size, offset);
+			Write(copy_buffer.get(), copy_size);
+			offset += copy_size;
+			length -= copy_size;
+		}
+	}
+};
+StreamLayout::Segment StreamLayout::Slice(const Segment& segment, UINT64 skip, UINT64 length)
+{
+	Segment slice = segment;
+	slice.length = length;
+	if (slice.data)
+	{
+		slice.data_offset += static_cast<size_t>(skip);
+	}
+	else
+	{
+		slice.file_offset += skip;
+	}
+	return slice;
+}
+void StreamLayout::Clear(UINT64 offset, UINT64 length)
+{
+	const UINT64 clear_end = offset + length;
+	auto it = segments.lower_bound(offset);
+	if (it != segments.begin())
+	{
+		const auto previous = std::prev(it);
+		const UINT64 previous_end = previous->first + previous->second.length;
+		if (previous_end > offset)
+		{
+			if (previous_end > clear_end)
+			{
+				segments.emplace_hint(it, clear_end, Slice(previous->second, clear_end - previous->first, previous_end - clear_end));
+			}
+			previous->second.length = offset - previous->first;
+		}
+	}
+	while (it != segments.end() && it->first < clear_end)
+	{
+		const UINT64 segment_end = it->first + it->second.length;
+		if (segment_end > clear_end)
+		{
+			segments.emplace_hint(std::next(it), clear_end, Slice(it->second, clear_end - it->first, segment_end - clear_end));
+		}
+		it = segments.erase(it);
+	}
+}
+void StreamLayout::Put(UINT64 offset, Segment&& segment)
+{
+	if (segment.length == 0)
+	{
+		return;
+	}
+	Clear(offset, segment.length);
+	end_offset = std::max(end_offset, offset + segment.length);
+	segments.emplace(offset, std::move(segment));
+}
+void StreamLayout::Write(const void* data, ULONG size, UINT64 offset)
+{
+	auto bytes = std::make_shared_for_overwrite<BYTE[]>(size);
+	memcpy(bytes.get(), data, size);
+	Put(offset, { .length = size, .data = std::move(bytes) });
+}
+void StreamLayout::Duplicate(UINT64 source_offset, UINT64 target_offset, UINT64 length)
+{
+	// Duplicates share bytes of their source, so a template repeated for every block is stored once.
+	const UINT64 source_end = source_offset + length;
+	std::vector<std::pair<UINT64, Segment>> duplicates;
+	auto it = segments.upper_bound(source_offset);
+	if (it != segments.begin())
+	{
+		--it;
+	}
+	for (; it != segments.end() && it->first < source_end; ++it)
+	{
+		const UINT64 begin = std::max(it->first, source_offset);
+		const UINT64 end = std::min(it->first + it->second.length, source_end);
+		if (begin < end)
+		{
+			duplicates.emplace_back(target_offset + (begin - source_offset), Slice(it->second, begin - it->first, end - begin));
+		}
+	}
+	Clear(target_offset, length);
+	end_offset = std::max(end_offset, target_offset + length);
+	for (auto& [offset, segment] : duplicates)
+	{
+		segments.emplace(offset, std::move(segment));
+	}
+}
+void StreamLayout::SetEnd(UINT64 file_size)
+{
+	if (file_size < end_offset)
+	{
+		Clear(file_size, end_offset - file_size);
+	}
+	end_offset = file_size;
+}
+void StreamLayout::AddData(UINT64 offset, HANDLE file, UINT64 file_offset, UINT64 length)
+{
+	Put(offset, { .length = length, .file = file, .file_offset = file_offset });
+}
+void StreamLayout::Stream(PCWSTR output_name) const
+{
+	StreamWriter writer(output_name);
+	UINT64 position = 0;
+	for (auto it = segments.begin(); it != segments.end();)
+	{
+		writer.WriteZero(it->first - position);
+		Segment segment = it->second;
+		position = it->first + segment.length;
+		++it;
+		if (segment.data)
+		{
+			writer.Write(segment.data.get() + segment.data_offset, static_cast<ULONG>(segment.length));
+			continue;
+		}
+		// Contiguous ranges of file are sent with one call.
+		while (it != segments.end() && it->first == position && !it->second.data && it->second.file == segment.file && it->second.file_offset == segment.file_offset + segment.length)
+		{
+			segment.length += it->second.length;
+			position += it->second.length;
+			++it;
+		}
+		writer.Transmit(segment.file, segment.file_offset, segment.length);
+	}
+	writer.WriteZero(end_offset - position);
+}
\ No newline at end of file
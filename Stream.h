@@ -0,0 +1,49 @@
+#pragma once
+#include <windows.h>
+#include <map>
+#include <memory>
+#include <string>
+#include "Image.h"
+
+constexpr UINT32 STREAM_BUFFER_SIZE = 1024 * 1024;
+constexpr UINT32 STREAM_TRANSMIT_SIZE = 1024 * 1024 * 1024;
+// Image laid out in memory. Metadata is kept as written and data refers to ranges of source file, so image is streamed without being stored anywhere.
+struct StreamLayout : ImageSink
+{
+private:
+	struct Segment
+	{
+		UINT64 length;
+		// Written bytes, shared by segments duplicated from them. Null for range of file.
+		std::shared_ptr<const BYTE[]> data;
+		size_t data_offset;
+		HANDLE file;
+		UINT64 file_offset;
+	};
+	std::wstring file_name;
+	// Keyed by offset in image. Segments don't overlap, and gaps between them are zero.
+	std::map<UINT64, Segment> segments;
+	UINT64 end_offset = 0;
+	static Segment Slice(const Segment& segment, UINT64 skip, UINT64 length);
+	void Clear(UINT64 offset, UINT64 length);
+	void Put(UINT64 offset, Segment&& segment);
+public:
+	explicit StreamLayout(std::wstring image_file_name) : file_name(std::move(image_file_name))
+	{
+	}
+	void Write(const void* data, ULONG size, UINT64 offset);
+	void Duplicate(UINT64 source_offset, UINT64 target_offset, UINT64 length);
+	void SetEnd(UINT64 file_size);
+	UINT64 GetEnd() const
+	{
+		return end_offset;
+	}
+	PCWSTR GetFileName() const
+	{
+		return file_name.c_str();
+	}
+	// Range of image is data of file, read only when streamed.
+	void AddData(UINT64 offset, HANDLE file, UINT64 file_offset, UINT64 length);
+	// Writes image in file order to stdout "-", "tcp:<Host>:<Port>", existing named pipe or device, or new file.
+	void Stream(PCWSTR output_name) const;
+};
\ No newline at end of file
@@ -0,0 +1,150 @@
+#include "VDI.h"
+
+void VDI::ReadHeader()
+{
+	ReadFileWithOffset(image_file, &vdi_header, VDI_HEADER_LOCATION);
+	THROW_WIN32_IF(ERROR_VHD_DRIVE_FOOTER_MISSING, vdi_header.Signature != VDI_SIGNATURE);
+	THROW_WIN32_IF(ERROR_VHD_FORMAT_UNSUPPORTED_VERSION, vdi_header.Version != VDI_VERSION);
+	THROW_WIN32_IF(ERROR_VHD_FORMAT_UNKNOWN, vdi_header.ImageType < VDI_TYPE_DYNAMIC || vdi_header.ImageType > VDI_TYPE_DIFFERENCE);
+	THROW_WIN32_IF(ERROR_VHD_INVALID_BLOCK_SIZE, vdi_header.BlockSize < VDI_SECTOR_SIZE || !std::has_single_bit(vdi_header.BlockSize));
+	THROW_WIN32_IF(ERROR_VHD_INVALID_SIZE, vdi_header.SectorSize != VDI_SECTOR_SIZE || vdi_header.DiskSize == 0 || vdi_header.DiskSize % VDI_SECTOR_SIZE != 0);
+	THROW_WIN32_IF(ERROR_VHD_SPARSE_HEADER_CORRUPT, vdi_header.BlocksInImage > VDI_MAX_BLOCKS_COUNT || vdi_header.BlocksInImage < ceil_div(vdi_header.DiskSize, vdi_header.BlockSize));
+	THROW_WIN32_IF(ERROR_VHD_SPARSE_HEADER_CORRUPT, vdi_header.OffsetBlocks < sizeof vdi_header || vdi_header.OffsetData < vdi_header.OffsetBlocks + static_cast<UINT64>(vdi_header.BlocksInImage) * sizeof(UINT32));
+	vdi_block_map = std::make_unique_for_overwrite<UINT32[]>(vdi_header.BlocksInImage);
+	ReadFileWithOffset(image_file, vdi_block_map.get(), vdi_header.BlocksInImage * sizeof(UINT32), vdi_header.OffsetBlocks);
+	vdi_blocks_allocated = vdi_header.BlocksAllocated;
+}
+void VDI::ConstructHeader(UINT64 disk_size, UINT32 block_size, UINT32 sector_size, bool fixed)
+{
+	if (disk_size < MINIMUM_DISK_SIZE)
+	{
+		throw std::invalid_argument("VDI disk size is less than 3MB.");
+	}
+	if (sector_size != VDI_SECTOR_SIZE)
+	{
+		throw std::invalid_argument("Unsuported VDI sector size.");
+	}
+	if (disk_size % VDI_SECTOR_SIZE != 0)
+	{
+		throw std::invalid_argument("VDI disk size is not multiple of sector.");
+	}
+	if (block_size == 0)
+	{
+		block_size = VDI_DEFAULT_BLOCK_SIZE;
+	}
+	THROW_WIN32_IF(ERROR_VHD_INVALID_BLOCK_SIZE, block_size < VDI_SECTOR_SIZE || !std::has_single_bit(block_size));
+	if (block_size < require_alignment)
+	{
+		throw std::invalid_argument("VDI block size is smaller than required alignment.");
+	}
+	THROW_WIN32_IF(ERROR_ARITHMETIC_OVERFLOW, disk_size / block_size >= VDI_MAX_BLOCKS_COUNT);
+	const UINT32 blocks_count = ceil_div(disk_size, block_size);
+	const UINT64 block_map_write_size = round_up(static_cast<UINT64>(blocks_count) * sizeof(UINT32), VDI_SECTOR_SIZE);
+	const UINT64 data_offset = round_up(VDI_BLOCK_MAP_LOCATION + block_map_write_size, require_alignment);
+	THROW_WIN32_IF(ERROR_ARITHMETIC_OVERFLOW, data_offset > UINT32_MAX);
+	memset(&vdi_header, 0, sizeof vdi_header);
+	memcpy(vdi_header.Text, VDI_TEXT, sizeof VDI_TEXT - 1);
+	vdi_header.Signature = VDI_SIGNATURE;
+	vdi_header.Version = VDI_VERSION;
+	vdi_header.HeaderSize = VDI_HEADER_SIZE;
+	vdi_header.ImageType = fixed ? VDI_TYPE_FIXED : VDI_TYPE_DYNAMIC;
+	vdi_header.OffsetBlocks = VDI_BLOCK_MAP_LOCATION;
+	vdi_header.OffsetData = static_cast<UINT32>(data_offset);
+	vdi_header.SectorSize = VDI_SECTOR_SIZE;
+	vdi_header.DiskSize = disk_size;
+	vdi_header.BlockSize = block_size;
+	vdi_header.BlocksInImage = blocks_count;
+	THROW_IF_FAILED(CoCreateGuid(&vdi_header.UuidImage));
+	THROW_IF_FAILED(CoCreateGuid(&vdi_header.UuidLastSnap));
+	vdi_block_map_write_size = static_cast<UINT32>(block_map_write_size);
+	vdi_block_map = std::make_unique_for_overwrite<UINT32[]>(vdi_block_map_write_size / sizeof(UINT32));
+	std::fill_n(vdi_block_map.get(), vdi_block_map_write_size / sizeof(UINT32), VDI_UNALLOCATED_BLOCK);
+	vdi_blocks_allocated = 0;
+	if (fixed)
+	{
+		for (; vdi_blocks_allocated < blocks_count; vdi_blocks_allocated++)
+		{
+			vdi_block_map[vdi_blocks_allocated] = vdi_blocks_allocated;
+		}
+	}
+	FILE_END_OF_FILE_INFO eof_info = { {.QuadPart = static_cast<LONGLONG>(data_offset + static_cast<UINT64>(block_size) * vdi_blocks_allocated) } };
+	SetImageFileEnd(eof_info);
+}
+void VDI::WriteHeader() const
+{
+	VDI_HEADER vdi_header_write = vdi_header;
+	vdi_header_write.BlocksAllocated = vdi_blocks_allocated;
+	MetadataCommit commit;
+	commit.Add(vdi_header_write, VDI_HEADER_LOCATION);
+	commit.Add(vdi_block_map.get(), vdi_block_map_write_size, VDI_BLOCK_MAP_LOCATION);
+	WriteImage(commit);
+	_ASSERT(GetImageFileSize() % require_alignment == 0);
+	FlushImage();
+}
+void VDI::RenewIdentity()
+{
+	THROW_IF_FAILED(CoCreateGuid(&vdi_header.UuidImage));
+	THROW_IF_FAILED(CoCreateGuid(&vdi_header.UuidLastSnap));
+	WriteFileWithOffset(image_file, vdi_header, VDI_HEADER_LOCATION);
+	THROW_IF_WIN32_BOOL_FALSE(FlushFileBuffers(image_file));
+}
+void VDI::CheckReadable() const
+{
+	if (vdi_header.ImageType == VDI_TYPE_DIFFERENCE || vdi_header.ImageType == VDI_TYPE_UNDO)
+	{
+		throw std::runtime_error("Differencing VDI is not supported.");
+	}
+}
+void VDI::CheckConvertible() const
+{
+	CheckReadable();
+	if (vdi_header.BlockSize < require_alignment)
+	{
+		throw std::runtime_error("VDI block size is smaller than required alignment.");
+	}
+	// Extra data before each block shifts every block after first off alignment.
+	if (vdi_header.BlockExtra != 0)
+	{
+		throw std::runtime_error("VDI blocks with extra data are not supported.");
+	}
+	if (vdi_header.OffsetData % require_alignment != 0)
+	{
+		throw std::runtime_error("VDI data blocks is not aligned.");
+	}
+}
+UINT64 VDI::EstimateFileSize(UINT64 disk_size, UINT32 block_size, UINT64 allocated_blocks) const
+{
+	const UINT64 block_map_write_size = round_up((disk_size + block_size - 1) / block_size * sizeof(UINT32), VDI_SECTOR_SIZE);
+	return round_up(VDI_BLOCK_MAP_LOCATION + block_map_write_size, require_alignment) + allocated_blocks * block_size;
+}
+UINT64 VDI::AllocateBlock(UINT32 index)
+{
+	if (const auto offset = ProbeBlock(index))
+	{
+		return *offset;
+	}
+	_ASSERT(vdi_header.BlockExtra == 0);
+	THROW_WIN32_IF(ERROR_ARITHMETIC_OVERFLOW, vdi_blocks_allocated >= VDI_MAX_BLOCKS_COUNT);
+	const UINT64 block_address = vdi_header.OffsetData + static_cast<UINT64>(vdi_header.BlockSize) * vdi_blocks_allocated;
+	FILE_END_OF_FILE_INFO eof_info = { {.QuadPart = static_cast<LONGLONG>(block_address + vdi_header.BlockSize) } };
+	SetImageFileEnd(eof_info);
+	vdi_block_map[index] = vdi_blocks_allocated++;
+	_ASSERT(block_address % require_alignment == 0);
+	return block_address;
+}
+std::unique_ptr<Image> VDI::DetectImageFormatByData(HANDLE file)
+{
+	LARGE_INTEGER fsize;
+	THROW_IF_WIN32_BOOL_FALSE(GetFileSizeEx(file, &fsize));
+	if (std::cmp_less(fsize.QuadPart, sizeof(VDI_HEADER)))
+	{
+		return nullptr;
+	}
+	decltype(VDI_HEADER::Signature) vdi_sig;
+	ReadFileWithOffset(file, &vdi_sig, offsetof(VDI_HEADER, Signature));
+	if (vdi_sig == VDI_SIGNATURE)
+	{
+		return std::unique_ptr<Image>(new VDI);
+	}
+	return nullptr;
+}
\ No newline at end of file
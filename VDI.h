@@ -0,0 +1,110 @@
+#pragma once
+#include "Image.h"
+
+constexpr char VDI_TEXT[] = "<<< Oracle VM VirtualBox Disk Image >>>\n";
+constexpr UINT32 VDI_SIGNATURE = 0xBEDA107F;
+constexpr UINT32 VDI_VERSION = 0x00010001;
+constexpr UINT32 VDI_HEADER_SIZE = 0x180;
+constexpr UINT32 VDI_UNALLOCATED_BLOCK = ~0U;
+constexpr UINT32 VDI_ZERO_BLOCK = ~1U;
+constexpr UINT32 VDI_MAX_BLOCKS_COUNT = VDI_ZERO_BLOCK;
+constexpr UINT32 VDI_SECTOR_SIZE = 512;
+constexpr UINT32 VDI_DEFAULT_BLOCK_SIZE = 1024 * 1024;
+constexpr UINT64 VDI_HEADER_LOCATION = 0;
+constexpr UINT32 VDI_BLOCK_MAP_LOCATION = 512;
+constexpr UINT32 VDI_SECTOR_ALIGNED_ENTRIES = VDI_SECTOR_SIZE / sizeof(UINT32);
+enum VDIType : UINT32
+{
+	VDI_TYPE_DYNAMIC = 1,
+	VDI_TYPE_FIXED = 2,
+	VDI_TYPE_UNDO = 3,
+	VDI_TYPE_DIFFERENCE = 4,
+};
+struct VDI_HEADER
+{
+	char   Text[64];
+	UINT32 Signature;
+	UINT32 Version;
+	UINT32 HeaderSize;
+	UINT32 ImageType;
+	UINT32 ImageFlags;
+	char   Description[256];
+	UINT32 OffsetBlocks;
+	UINT32 OffsetData;
+	UINT32 Cylinders;
+	UINT32 Heads;
+	UINT32 Sectors;
+	UINT32 SectorSize;
+	UINT32 Unused1;
+	UINT64 DiskSize;
+	UINT32 BlockSize;
+	UINT32 BlockExtra;
+	UINT32 BlocksInImage;
+	UINT32 BlocksAllocated;
+	GUID   UuidImage;
+	GUID   UuidLastSnap;
+	GUID   UuidLink;
+	GUID   UuidParent;
+	UINT64 Unused2[7];
+};
+static_assert(sizeof(VDI_HEADER) == 512);
+static_assert(offsetof(VDI_HEADER, DiskSize) == 368);
+struct VDI final : Image
+{
+private:
+	VDI_HEADER vdi_header;
+	std::unique_ptr<UINT32[]> vdi_block_map;
+	UINT32 vdi_block_map_write_size;
+	UINT32 vdi_blocks_allocated;
+public:
+	void ReadHeader();
+	void ConstructHeader(UINT64 disk_size, UINT32 block_size, UINT32 sector_size, bool fixed);
+	void WriteHeader() const;
+	void CheckReadable() const;
+	void CheckConvertible() const;
+	void RenewIdentity();
+	bool IsFixed() const
+	{
+		return vdi_header.ImageType == VDI_TYPE_FIXED;
+	}
+	PCSTR GetImageTypeName() const
+	{
+		return "VDI";
+	}
+	UINT64 GetDiskSize() const
+	{
+		return vdi_header.DiskSize;
+	}
+	UINT32 GetSectorSize() const
+	{
+		return VDI_SECTOR_SIZE;
+	}
+	UINT32 GetBlockSize() const
+	{
+		return vdi_header.BlockSize;
+	}
+	UINT32 GetTableEntriesCount() const
+	{
+		return vdi_header.BlocksInImage;
+	}
+	UINT32 GetMinimumBlockSize() const
+	{
+		return std::max(require_alignment, VDI_SECTOR_SIZE);
+	}
+	UINT32 GetMaximumBlockSize() const
+	{
+		return 1U << 31;
+	}
+	UINT64 EstimateFileSize(UINT64 disk_size, UINT32 block_size, UINT64 allocated_blocks) const;
+	std::optional<UINT64> ProbeBlock(UINT32 index) const
+	{
+		_ASSERT(index < GetTableEntriesCount());
+		if (const UINT32 block_number = vdi_block_map[index]; block_number < VDI_MAX_BLOCKS_COUNT)
+		{
+			return vdi_header.OffsetData + vdi_header.BlockExtra + static_cast<UINT64>(vdi_header.BlockSize + vdi_header.BlockExtra) * block_number;
+		}
+		return std::nullopt;
+	}
+	UINT64 AllocateBlock(UINT32 index);
+	static std::unique_ptr<Image> DetectImageFormatByData(HANDLE file);
+};
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "VHD.h"
+#include "Scan.h"
 
 void VHD::ReadHeader()
 {
@@ -35,6 +36,7 @@ void VHD::ReadHeader()
 	vhd_block_size = std::byteswap(vhd_dyn_header.BlockSize);
 	THROW_WIN32_IF(ERROR_VHD_INVALID_BLOCK_SIZE, vhd_block_size < VHD_SECTOR_SIZE || !std::has_single_bit(vhd_block_size));
 	vhd_bitmap_actual_size = round_up(vhd_block_size / (VHD_SECTOR_SIZE * CHAR_BIT), VHD_SECTOR_SIZE);
+	vhd_sector_bitmap = std::make_unique_for_overwrite<BYTE[]>(vhd_bitmap_actual_size);
 	vhd_table_entries_count = std::byteswap(vhd_dyn_header.MaxTableEntries);
 	vhd_block_allocation_table = std::make_unique_for_overwrite<VHD_BAT_ENTRY[]>(vhd_table_entries_count);
 	ReadFileWithOffset(image_file, vhd_block_allocation_table.get(), vhd_table_entries_count * sizeof(VHD_BAT_ENTRY), std::byteswap(vhd_dyn_header.TableOffset));
@@ -82,7 +84,7 @@ void VHD::ConstructHeader(UINT64 disk_size, UINT32 block_size, UINT32 sector_siz
 		THROW_IF_FAILED(CoCreateGuid(&vhd_footer.UniqueId));
 		VHDChecksumUpdate(&vhd_footer);
 		FILE_END_OF_FILE_INFO eof_info = { {.QuadPart = static_cast<LONGLONG>(disk_size + sizeof vhd_footer) } };
-		THROW_IF_WIN32_BOOL_FALSE(SetFileInformationByHandle(image_file, FileEndOfFileInfo, &eof_info, sizeof eof_info));
+		SetImageFileEnd(eof_info);
 		return;
 	}
 	if (disk_size > VHD_MAX_DYNAMIC_DISK_SIZE)
@@ -99,6 +101,7 @@ void VHD::ConstructHeader(UINT64 disk_size, UINT32 block_size, UINT32 sector_siz
 	vhd_block_allocation_table = std::make_unique<VHD_BAT_ENTRY[]>(vhd_table_sector_aligned_count);
 	vhd_next_free_address = round_up(VHD_BLOCK_ALLOC_TABLE_LOCATION + vhd_table_sector_aligned_count * sizeof(VHD_BAT_ENTRY), require_alignment);
 	vhd_template_bitmap_address = 0;
+	vhd_partial_bitmaps.clear();
 	memset(&vhd_footer, 0, sizeof vhd_footer);
 	vhd_footer.Cookie = VHD_COOKIE;
 	vhd_footer.Features = VHD_FEATURE_RESERVED_MUST_ALWAYS_ON;
@@ -124,28 +127,31 @@ void VHD::WriteHeader() const
 {
 	if (vhd_footer.DiskType == VHDType::Fixed)
 	{
-		WriteFileWithOffset(image_file, vhd_footer, vhd_disk_size);
-		THROW_IF_WIN32_BOOL_FALSE(FlushFileBuffers(image_file));
+		WriteImage(vhd_footer, vhd_disk_size);
+		FlushImage();
 		return;
 	}
 	if (vhd_footer.DiskType == VHDType::Dynamic)
 	{
-		WriteFileWithOffset(image_file, vhd_footer, VHD_HEADER_LOCATION);
-		WriteFileWithOffset(image_file, vhd_dyn_header, VHD_DYNAMIC_HEADER_LOCATION);
-		WriteFileWithOffset(image_file, vhd_block_allocation_table.get(), vhd_table_sector_aligned_count * sizeof(VHD_BAT_ENTRY), VHD_BLOCK_ALLOC_TABLE_LOCATION);
-		WriteFileWithOffset(image_file, vhd_footer, vhd_next_free_address + require_alignment - sizeof vhd_footer);
-#ifdef _DEBUG
-		LARGE_INTEGER fsize;
-		_ASSERT(GetFileSizeEx(image_file, &fsize));
-		_ASSERT(fsize.QuadPart % require_alignment == 0);
-#endif
-		THROW_IF_WIN32_BOOL_FALSE(FlushFileBuffers(image_file));
+		MetadataCommit commit;
+		commit.Add(vhd_footer, VHD_HEADER_LOCATION);
+		commit.Add(vhd_dyn_header, VHD_DYNAMIC_HEADER_LOCATION);
+		commit.Add(vhd_block_allocation_table.get(), vhd_table_sector_aligned_count * sizeof(VHD_BAT_ENTRY), VHD_BLOCK_ALLOC_TABLE_LOCATION);
+		for (const auto& [index, partial_bitmap] : vhd_partial_bitmaps)
+		{
+			commit.Add(partial_bitmap.get(), vhd_bitmap_actual_size, static_cast<UINT64>(vhd_block_allocation_table[index]) * VHD_SECTOR_SIZE);
+		}
+		WriteImage(commit);
+		// Trailing footer is the one readers trust, so it goes last.
+		WriteImage(vhd_footer, vhd_next_free_address + require_alignment - sizeof vhd_footer);
+		_ASSERT(GetImageFileSize() % require_alignment == 0);
+		FlushImage();
 		return;
 	}
 	_CrtDbgBreak();
 	THROW_WIN32(ERROR_CALL_NOT_IMPLEMENTED);
 }
-void VHD::CheckConvertible() const
+void VHD::CheckReadable() const
 {
 	if (IsFixed())
 	{
@@ -156,68 +162,184 @@ void VHD::CheckConvertible() const
 	{
 		throw std::runtime_error("Differencing VHD is not supported.");
 	}
+}
+void VHD::CheckConvertible() const
+{
+	CheckReadable();
+	if (IsFixed())
+	{
+		return;
+	}
 	if (vhd_block_size < require_alignment)
 	{
 		throw std::runtime_error("VHD block size is smaller than required alignment.");
 	}
-	for (UINT32 i = 0; i < vhd_table_entries_count; i++)
+	if (!ScanVHDBlockAllocationTable(reinterpret_cast<const UINT32*>(vhd_block_allocation_table.get()), vhd_table_entries_count, vhd_bitmap_actual_size / VHD_SECTOR_SIZE, std::max(require_alignment / VHD_SECTOR_SIZE, 1U), nullptr))
 	{
-		if (vhd_block_allocation_table[i] != VHD_UNUSED_BAT_ENTRY)
+		throw std::runtime_error("VHD data blocks is not aligned.");
+	}
+}
+void VHD::CopyIdentity(const Image& source)
+{
+	// Children refer parent by UniqueId and time stamp.
+	const auto& source_vhd = dynamic_cast<const VHD&>(source);
+	vhd_footer.UniqueId = source_vhd.vhd_footer.UniqueId;
+	vhd_footer.TimeStamp = source_vhd.vhd_footer.TimeStamp;
+	VHDChecksumUpdate(&vhd_footer);
+}
+void VHD::RenewIdentity()
+{
+	THROW_IF_FAILED(CoCreateGuid(&vhd_footer.UniqueId));
+	VHDChecksumUpdate(&vhd_footer);
+	if (vhd_footer.DiskType != VHDType::Fixed)
+	{
+		WriteFileWithOffset(image_file, vhd_footer, VHD_HEADER_LOCATION);
+	}
+	LARGE_INTEGER fsize;
+	THROW_IF_WIN32_BOOL_FALSE(GetFileSizeEx(image_file, &fsize));
+	WriteFileWithOffset(image_file, vhd_footer, round_up(fsize.QuadPart - VHD_FOOTER_OFFSET, VHD_FOOTER_ALIGN));
+	THROW_IF_WIN32_BOOL_FALSE(FlushFileBuffers(image_file));
+}
+UINT64 VHD::EstimateFileSize(UINT64 disk_size, UINT32 block_size, UINT64 allocated_blocks) const
+{
+	const UINT64 table_size = round_up((disk_size + block_size - 1) / block_size * sizeof(VHD_BAT_ENTRY), VHD_SECTOR_SIZE);
+	const UINT64 bitmap_aligned_size = round_up(round_up(block_size / (VHD_SECTOR_SIZE * CHAR_BIT), VHD_SECTOR_SIZE), require_alignment);
+	return round_up(VHD_BLOCK_ALLOC_TABLE_LOCATION + table_size, require_alignment) + allocated_blocks * (bitmap_aligned_size + block_size) + require_alignment;
+}
+void VHD::ProbeSectorRuns(UINT32 index, std::vector<SectorRun>& runs) const
+{
+	if (vhd_footer.DiskType != VHDType::Dynamic)
+	{
+		runs.clear();
+		if (ProbeBlock(index))
 		{
-			if ((vhd_block_allocation_table[i] * VHD_SECTOR_SIZE + vhd_bitmap_actual_size) % require_alignment != 0)
-			{
-				throw std::runtime_error("VHD data blocks is not aligned.");
-			}
+			runs.push_back({ 0, vhd_block_size });
 		}
+		return;
 	}
+	ProbeDynamicSectorRuns(index, runs);
 }
-std::optional<UINT64> VHD::ProbeBlock(UINT32 index) const
+void VHD::ProbeDynamicSectorRuns(UINT32 index, std::vector<SectorRun>& runs) const
 {
-	_ASSERT(index < GetTableEntriesCount());
-	if (vhd_footer.DiskType == VHDType::Fixed)
+	runs.clear();
+	const auto block_address = ProbeDynamicBlock(index);
+	if (!block_address)
 	{
-		return static_cast<UINT64>(GetBlockSize()) * index;
+		return;
 	}
-	if (vhd_footer.DiskType == VHDType::Dynamic)
+	ReadFileWithOffset(image_file, vhd_sector_bitmap.get(), vhd_bitmap_actual_size, *block_address - vhd_bitmap_actual_size);
+	// Runs are exact even within a cluster. Absent sectors read as zero in guest, whatever the file holds there.
+	const UINT32 sectors_count = vhd_block_size / VHD_SECTOR_SIZE;
+	for (UINT32 sector = 0; sector < sectors_count; sector++)
 	{
-		if (UINT64 block_address = vhd_block_allocation_table[index]; block_address != VHD_UNUSED_BAT_ENTRY)
+		if (!(vhd_sector_bitmap[sector / CHAR_BIT] & (0x80 >> (sector % CHAR_BIT))))
+		{
+			continue;
+		}
+		const UINT32 run_offset = sector * VHD_SECTOR_SIZE;
+		if (!runs.empty() && runs.back().offset + runs.back().length == run_offset)
+		{
+			runs.back().length += VHD_SECTOR_SIZE;
+		}
+		else
 		{
-			return block_address * VHD_SECTOR_SIZE + vhd_bitmap_actual_size;
+			runs.push_back({ run_offset, VHD_SECTOR_SIZE });
 		}
-		return std::nullopt;
 	}
-	_CrtDbgBreak();
-	THROW_WIN32(ERROR_CALL_NOT_IMPLEMENTED);
 }
 UINT64 VHD::AllocateBlock(UINT32 index)
 {
-	if (const auto offset = ProbeBlock(index))
+	if (vhd_footer.DiskType != VHDType::Dynamic)
 	{
+		return *ProbeBlock(index);
+	}
+	return AllocateDynamicBlock(index);
+}
+UINT64 VHD::AllocateDynamicBlock(UINT32 index)
+{
+	if (const auto offset = ProbeDynamicBlock(index))
+	{
+		if (const auto partial_bitmap = vhd_partial_bitmaps.find(index); partial_bitmap != vhd_partial_bitmaps.end())
+		{
+			vhd_partial_bitmaps.erase(partial_bitmap);
+			WriteFullBitmap(*offset - vhd_bitmap_aligned_size);
+		}
 		return *offset;
 	}
+	const UINT64 bitmap_address = AppendBlock(index);
+	WriteFullBitmap(bitmap_address);
+	return bitmap_address + vhd_bitmap_aligned_size;
+}
+void VHD::ScanAllocatedBlocks(std::vector<UINT64>& allocated) const
+{
+	if (vhd_footer.DiskType != VHDType::Dynamic)
+	{
+		return Image::ScanAllocatedBlocks(allocated);
+	}
+	allocated.assign((vhd_table_entries_count + 63ULL) / 64, 0);
+	[[maybe_unused]] const bool aligned = ScanVHDBlockAllocationTable(reinterpret_cast<const UINT32*>(vhd_block_allocation_table.get()), vhd_table_entries_count, 0, 1, allocated.data());
+	_ASSERT(aligned);
+}
+UINT64 VHD::AllocateSectorRun(UINT32 index, SectorRun run)
+{
+	if (vhd_footer.DiskType != VHDType::Dynamic)
+	{
+		return AllocateBlock(index);
+	}
+	return AllocateDynamicSectorRun(index, run);
+}
+UINT64 VHD::AllocateDynamicSectorRun(UINT32 index, SectorRun run)
+{
+	if (run.offset == 0 && run.length >= vhd_block_size)
+	{
+		return AllocateDynamicBlock(index);
+	}
+	_ASSERT(run.offset % VHD_SECTOR_SIZE == 0 && run.length % VHD_SECTOR_SIZE == 0);
+	_ASSERT(run.offset + run.length <= vhd_block_size);
+	auto block_address = ProbeDynamicBlock(index);
+	if (!block_address)
+	{
+		block_address = AppendBlock(index) + vhd_bitmap_aligned_size;
+		vhd_partial_bitmaps.emplace(index, std::make_unique<BYTE[]>(vhd_bitmap_actual_size));
+	}
+	const auto partial_bitmap = vhd_partial_bitmaps.find(index);
+	if (partial_bitmap == vhd_partial_bitmaps.end())
+	{
+		return *block_address;
+	}
+	for (UINT32 sector = run.offset / VHD_SECTOR_SIZE; sector < (run.offset + run.length) / VHD_SECTOR_SIZE; sector++)
+	{
+		partial_bitmap->second[sector / CHAR_BIT] |= 0x80 >> (sector % CHAR_BIT);
+	}
+	const UINT32 sectors_count = vhd_block_size / VHD_SECTOR_SIZE;
+	if (std::all_of(partial_bitmap->second.get(), partial_bitmap->second.get() + sectors_count / CHAR_BIT, [](BYTE bits) { return bits == 0xFF; }))
+	{
+		vhd_partial_bitmaps.erase(partial_bitmap);
+		WriteFullBitmap(*block_address - vhd_bitmap_aligned_size);
+	}
+	return *block_address;
+}
+UINT64 VHD::AppendBlock(UINT32 index)
+{
 	FILE_END_OF_FILE_INFO eof_info = { {.QuadPart = static_cast<LONGLONG>(vhd_next_free_address) + vhd_bitmap_aligned_size + vhd_block_size } };
 	_ASSERT(std::cmp_greater(eof_info.EndOfFile.QuadPart, VHD_BLOCK_ALLOC_TABLE_LOCATION));
 	THROW_WIN32_IF(ERROR_ARITHMETIC_OVERFLOW, eof_info.EndOfFile.QuadPart > static_cast<LONGLONG>(UINT32_MAX) * VHD_SECTOR_SIZE);
-	THROW_IF_WIN32_BOOL_FALSE(SetFileInformationByHandle(image_file, FileEndOfFileInfo, &eof_info, sizeof eof_info));
-	ULONG _;
-	DUPLICATE_EXTENTS_DATA dup_extent = {
-		.FileHandle = image_file,
-		.SourceFileOffset = {.QuadPart = static_cast<LONGLONG>(vhd_template_bitmap_address) },
-		.TargetFileOffset = {.QuadPart = static_cast<LONGLONG>(vhd_next_free_address) },
-		.ByteCount = {.QuadPart = require_alignment }
-	};
-	if (vhd_template_bitmap_address == 0 || !DeviceIoControl(image_file, FSCTL_DUPLICATE_EXTENTS_TO_FILE, &dup_extent, sizeof dup_extent, nullptr, 0, &_, nullptr))
+	SetImageFileEnd(eof_info);
+	vhd_block_allocation_table[index] = static_cast<UINT32>((vhd_next_free_address + vhd_bitmap_padding_size) / VHD_SECTOR_SIZE);
+	vhd_next_free_address += vhd_bitmap_aligned_size + vhd_block_size;
+	_ASSERT(vhd_next_free_address % require_alignment == 0);
+	return vhd_next_free_address - vhd_block_size - vhd_bitmap_aligned_size;
+}
+void VHD::WriteFullBitmap(UINT64 bitmap_address)
+{
+	if (vhd_template_bitmap_address == 0 || !ScheduleIo(io_scheduler, IoKind::Metadata, 0, [&] { return DuplicateImageRange(vhd_template_bitmap_address, bitmap_address, vhd_bitmap_aligned_size); }))
 	{
 		_ASSERT(vhd_template_bitmap_address == 0 || GetLastError() == ERROR_BLOCK_TOO_MANY_REFERENCES);
-		vhd_template_bitmap_address = vhd_next_free_address;
+		vhd_template_bitmap_address = bitmap_address;
 		const auto vhd_bitmap_buffer = std::make_unique<std::byte[]>(vhd_bitmap_aligned_size); // 0 fill to expect compression by the SSD.
 		memset(vhd_bitmap_buffer.get() + vhd_bitmap_padding_size, 0xFF, vhd_bitmap_actual_size);
-		WriteFileWithOffset(image_file, vhd_bitmap_buffer.get(), vhd_bitmap_aligned_size, vhd_next_free_address);
+		WriteImage(vhd_bitmap_buffer.get(), vhd_bitmap_aligned_size, bitmap_address);
 	}
-	vhd_block_allocation_table[index] = static_cast<UINT32>((vhd_next_free_address + vhd_bitmap_padding_size) / VHD_SECTOR_SIZE);
-	vhd_next_free_address += vhd_bitmap_aligned_size + vhd_block_size;
-	_ASSERT(vhd_next_free_address % require_alignment == 0);
-	return vhd_next_free_address - vhd_block_size;
 }
 std::unique_ptr<Image> VHD::DetectImageFormatByData(HANDLE file)
 {
@@ -235,21 +357,6 @@ std::unique_ptr<Image> VHD::DetectImageFormatByData(HANDLE file)
 	}
 	return nullptr;
 }
-UINT32 VHD::VHDChecksumUpdate(auto* header)
-{
-	header->Checksum = 0;
-	UINT32 checksum = 0;
-	for (UINT32 counter = 0; counter < sizeof(*header); counter++)
-	{
-		checksum += reinterpret_cast<PBYTE>(header)[counter];
-	}
-	return header->Checksum = std::byteswap(~checksum);
-}
-bool VHD::VHDChecksumValidate(auto* header)
-{
-	const UINT32 checksum = header->Checksum;
-	return VHDChecksumUpdate(header) == checksum;
-}
 UINT32 VHD::CHSCalculate(UINT64 disk_size)
 {
 	const int totalSectors = static_cast<int>(std::min(disk_size / VHD_SECTOR_SIZE, 65535ULL * 16 * 255));
@@ -1,5 +1,6 @@
 #pragma once
 #include "Image.h"
+#include <map>
 
 constexpr UINT32 VHD_UNUSED_BAT_ENTRY = ~0U;
 struct VHD_BAT_ENTRY
@@ -78,12 +79,14 @@ constexpr UINT64 VHD_DYNAMIC_HEADER_LOCATION = sizeof(VHD_FOOTER);
 constexpr UINT64 VHD_BLOCK_ALLOC_TABLE_LOCATION = VHD_DYNAMIC_HEADER_LOCATION + sizeof(VHD_DYNAMIC_HEADER);
 constexpr UINT32 VHD_DEFAULT_BLOCK_SIZE = 2 * 1024 * 1024;
 constexpr UINT32 VHD_SECTOR_ALIGNED_BYTES = VHD_SECTOR_SIZE / sizeof(VHD_BAT_ENTRY);
-struct VHD : Image
+struct VHD final : Image
 {
 private:
 	VHD_FOOTER vhd_footer;
 	VHD_DYNAMIC_HEADER vhd_dyn_header;
 	std::unique_ptr<VHD_BAT_ENTRY[]> vhd_block_allocation_table;
+	std::unique_ptr<BYTE[]> vhd_sector_bitmap;
+	std::map<UINT32, std::unique_ptr<BYTE[]>> vhd_partial_bitmaps;
 	UINT64 vhd_next_free_address;
 	UINT64 vhd_template_bitmap_address;
 	UINT64 vhd_disk_size;
@@ -93,14 +96,19 @@ private:
 	UINT32 vhd_bitmap_aligned_size;
 	UINT32 vhd_table_entries_count;
 	UINT32 vhd_table_sector_aligned_count;
+	UINT64 AppendBlock(UINT32 index);
+	void WriteFullBitmap(UINT64 bitmap_address);
+public:
 	static UINT32 VHDChecksumUpdate(auto* header);
 	static bool VHDChecksumValidate(auto* header);
 	static UINT32 CHSCalculate(UINT64 disk_size);
-public:
 	void ReadHeader();
 	void ConstructHeader(UINT64 disk_size, UINT32 block_size, UINT32 sector_size, bool is_fixed);
 	void WriteHeader() const;
+	void CheckReadable() const;
 	void CheckConvertible() const;
+	void CopyIdentity(const Image& source);
+	void RenewIdentity();
 	bool IsFixed() const
 	{
 		return vhd_footer.DiskType == VHDType::Fixed;
@@ -125,7 +133,64 @@ public:
 	{
 		return vhd_table_entries_count;
 	}
-	std::optional<UINT64> ProbeBlock(UINT32 index) const;
+	UINT32 GetMinimumBlockSize() const
+	{
+		return std::max(require_alignment, VHD_SECTOR_SIZE);
+	}
+	UINT32 GetMaximumBlockSize() const
+	{
+		return 1U << 31;
+	}
+	UINT64 EstimateFileSize(UINT64 disk_size, UINT32 block_size, UINT64 allocated_blocks) const;
+	std::optional<UINT64> ProbeBlock(UINT32 index) const
+	{
+		if (vhd_footer.DiskType == VHDType::Fixed)
+		{
+			return ProbeFixedBlock(index);
+		}
+		if (vhd_footer.DiskType == VHDType::Dynamic)
+		{
+			return ProbeDynamicBlock(index);
+		}
+		_CrtDbgBreak();
+		THROW_WIN32(ERROR_CALL_NOT_IMPLEMENTED);
+	}
+	// Disk type specific parts, for conversion kernels which check disk type once instead of for each block.
+	UINT64 ProbeFixedBlock(UINT32 index) const
+	{
+		_ASSERT(IsFixed() && index < GetTableEntriesCount());
+		return static_cast<UINT64>(vhd_block_size) * index;
+	}
+	std::optional<UINT64> ProbeDynamicBlock(UINT32 index) const
+	{
+		_ASSERT(vhd_footer.DiskType == VHDType::Dynamic && index < GetTableEntriesCount());
+		if (UINT64 block_address = vhd_block_allocation_table[index]; block_address != VHD_UNUSED_BAT_ENTRY)
+		{
+			return block_address * VHD_SECTOR_SIZE + vhd_bitmap_actual_size;
+		}
+		return std::nullopt;
+	}
+	void ProbeDynamicSectorRuns(UINT32 index, std::vector<SectorRun>& runs) const;
+	UINT64 AllocateDynamicBlock(UINT32 index);
+	UINT64 AllocateDynamicSectorRun(UINT32 index, SectorRun run);
 	UINT64 AllocateBlock(UINT32 index);
+	void ScanAllocatedBlocks(std::vector<UINT64>& allocated) const;
+	void ProbeSectorRuns(UINT32 index, std::vector<SectorRun>& runs) const;
+	UINT64 AllocateSectorRun(UINT32 index, SectorRun run);
 	static std::unique_ptr<Image> DetectImageFormatByData(HANDLE file);
-};
\ No newline at end of file
+};
+UINT32 VHD::VHDChecksumUpdate(auto* header)
+{
+	header->Checksum = 0;
+	UINT32 checksum = 0;
+	for (UINT32 counter = 0; counter < sizeof(*header); counter++)
+	{
+		checksum += reinterpret_cast<PBYTE>(header)[counter];
+	}
+	return header->Checksum = std::byteswap(~checksum);
+}
+bool VHD::VHDChecksumValidate(auto* header)
+{
+	const UINT32 checksum = header->Checksum;
+	return VHDChecksumUpdate(header) == checksum;
+}
\ No newline at end of file
@@ -2,6 +2,7 @@
 #include <windows.h>
 #include <initguid.h>
 #include "VHDX.h"
+#include "Scan.h"
 #pragma comment(lib, "ntdll")
 
 consteval bool ValidateIndexNeverExceeds32bits()
@@ -109,7 +110,8 @@ void VHDX::ReadHeader()
 				}
 				else if (vhdx_metadata_table_header.MetadataTableEntries[j].ItemId == VirtualDiskID)
 				{
-					__noop;
+					vhdx_virtual_disk_id_offset = FileOffset + Offset;
+					ReadFileWithOffset(image_file, &vhdx_metadata_packed.VirtualDiskId, vhdx_virtual_disk_id_offset);
 				}
 				else if (vhdx_metadata_table_header.MetadataTableEntries[j].IsRequired)
 				{
@@ -208,6 +210,7 @@ void VHDX::ConstructHeader(UINT64 disk_size, UINT32 block_size, UINT32 sector_si
 	vhdx_metadata_packed.LogicalSectorSize = sector_size;
 	vhdx_metadata_packed.PhysicalSectorSize = VHDX_PHYSICAL_SECTOR_SIZE;
 	THROW_IF_FAILED(CoCreateGuid(&vhdx_metadata_packed.VirtualDiskId));
+	vhdx_virtual_disk_id_offset = VHDX_METADATA_LOCATION + VHDX_METADATA_START_OFFSET + offsetof(VHDX_METADATA_PACKED, VirtualDiskId);
 	vhdx_chuck_ratio = CalculateChuckRatio(vhdx_metadata_packed.LogicalSectorSize, vhdx_metadata_packed.VhdxFileParameters.BlockSize);
 	vhdx_data_blocks_count = ceil_div(vhdx_metadata_packed.VirtualDiskSize, vhdx_metadata_packed.VhdxFileParameters.BlockSize);
 	const UINT32 vhdx_table_entries_count = vhdx_data_blocks_count + (vhdx_data_blocks_count - 1) / vhdx_chuck_ratio;
@@ -247,26 +250,31 @@ void VHDX::ConstructHeader(UINT64 disk_size, UINT32 block_size, UINT32 sector_si
 		}
 	}
 	FILE_END_OF_FILE_INFO eof_info = { {.QuadPart = static_cast<LONGLONG>(vhdx_next_free_address) } };
-	THROW_IF_WIN32_BOOL_FALSE(SetFileInformationByHandle(image_file, FileEndOfFileInfo, &eof_info, sizeof eof_info));
+	SetImageFileEnd(eof_info);
 }
 void VHDX::WriteHeader() const
 {
-	WriteFileWithOffset(image_file, vhdx_file_indentifier, VHDX_FILE_IDENTIFIER_LOCATION);
-	WriteFileWithOffset(image_file, vhdx_header, VHDX_HEADER1_LOCATION);
-	WriteFileWithOffset(image_file, vhdx_header, VHDX_HEADER2_LOCATION);
-	WriteFileWithOffset(image_file, vhdx_region_table_header, VHDX_REGION_TABLE_HEADER1_OFFSET);
-	WriteFileWithOffset(image_file, vhdx_region_table_header, VHDX_REGION_TABLE_HEADER2_OFFSET);
-	WriteFileWithOffset(image_file, vhdx_metadata_table_header, VHDX_METADATA_LOCATION);
-	WriteFileWithOffset(image_file, vhdx_metadata_packed, VHDX_METADATA_LOCATION + VHDX_METADATA_START_OFFSET);
-	WriteFileWithOffset(image_file, vhdx_block_allocation_table.get(), vhdx_table_write_size, VHDX_BAT_LOCATION);
-#ifdef _DEBUG
-	LARGE_INTEGER fsize;
-	_ASSERT(GetFileSizeEx(image_file, &fsize));
-	_ASSERT(fsize.QuadPart % VHDX_MINIMUM_ALIGNMENT == 0);
-#endif
-	THROW_IF_WIN32_BOOL_FALSE(FlushFileBuffers(image_file));
+	MetadataCommit commit;
+	commit.Add(vhdx_file_indentifier, VHDX_FILE_IDENTIFIER_LOCATION);
+	commit.Add(vhdx_region_table_header, VHDX_REGION_TABLE_HEADER1_OFFSET);
+	commit.Add(vhdx_region_table_header, VHDX_REGION_TABLE_HEADER2_OFFSET);
+	commit.Add(vhdx_metadata_table_header, VHDX_METADATA_LOCATION);
+	commit.Add(vhdx_metadata_packed, VHDX_METADATA_LOCATION + VHDX_METADATA_START_OFFSET);
+	commit.Add(vhdx_block_allocation_table.get(), vhdx_table_write_size, VHDX_BAT_LOCATION);
+	WriteImage(commit);
+	FlushImage();
+	// Headers go after everything they describe is durable. Header 1 gets the higher sequence number, so a torn write leaves the other one current.
+	VHDX_HEADER header = vhdx_header;
+	header.SequenceNumber++;
+	VHDXChecksumUpdate(&header);
+	WriteImage(header, VHDX_HEADER2_LOCATION);
+	header.SequenceNumber++;
+	VHDXChecksumUpdate(&header);
+	WriteImage(header, VHDX_HEADER1_LOCATION);
+	_ASSERT(GetImageFileSize() % VHDX_MINIMUM_ALIGNMENT == 0);
+	FlushImage();
 }
-void VHDX::CheckConvertible() const
+void VHDX::CheckReadable() const
 {
 	if (vhdx_header.LogGuid != GUID_NULL)
 	{
@@ -276,17 +284,34 @@ void VHDX::CheckConvertible() const
 	{
 		throw std::runtime_error("Differencing VHDX is not supported.");
 	}
+}
+void VHDX::CheckConvertible() const
+{
+	CheckReadable();
 	THROW_WIN32_IF(ERROR_CALL_NOT_IMPLEMENTED, require_alignment > VHDX_MINIMUM_ALIGNMENT);
 }
-std::optional<UINT64> VHDX::ProbeBlock(UINT32 index) const
+void VHDX::CopyIdentity(const Image& source)
 {
-	_ASSERT(index < GetTableEntriesCount());
-	index += index / vhdx_chuck_ratio;
-	if (vhdx_block_allocation_table[index].State == VHDXBlockState::PAYLOAD_BLOCK_FULLY_PRESENT)
-	{
-		return vhdx_block_allocation_table[index].FileOffsetMB * VHDX_BAT_UNIT;
-	}
-	return std::nullopt;
+	// Children refer parent by DataWriteGuid, which changes only when guest data does.
+	const auto& source_vhdx = dynamic_cast<const VHDX&>(source);
+	vhdx_header.FileWriteGuid = source_vhdx.vhdx_header.FileWriteGuid;
+	vhdx_header.DataWriteGuid = source_vhdx.vhdx_header.DataWriteGuid;
+	VHDXChecksumUpdate(&vhdx_header);
+	vhdx_metadata_packed.VirtualDiskId = source_vhdx.vhdx_metadata_packed.VirtualDiskId;
+}
+void VHDX::RenewIdentity()
+{
+	// Metadata region has no checksum, so only the item is rewritten.
+	THROW_WIN32_IF(ERROR_VHD_METADATA_READ_FAILURE, vhdx_virtual_disk_id_offset == 0);
+	THROW_IF_FAILED(CoCreateGuid(&vhdx_metadata_packed.VirtualDiskId));
+	WriteFileWithOffset(image_file, vhdx_metadata_packed.VirtualDiskId, vhdx_virtual_disk_id_offset);
+	THROW_IF_WIN32_BOOL_FALSE(FlushFileBuffers(image_file));
+}
+UINT64 VHDX::EstimateFileSize(UINT64 disk_size, UINT32 block_size, UINT64 allocated_blocks) const
+{
+	const UINT64 data_blocks_count = (disk_size + block_size - 1) / block_size;
+	const UINT64 table_entries_count = data_blocks_count + (data_blocks_count - 1) / CalculateChuckRatio(512, block_size);
+	return VHDX_BAT_LOCATION + round_up(table_entries_count * sizeof(VHDX_BAT_ENTRY), VHDX_MINIMUM_ALIGNMENT) + allocated_blocks * block_size;
 }
 UINT64 VHDX::AllocateBlock(UINT32 index)
 {
@@ -298,12 +323,17 @@ UINT64 VHDX::AllocateBlock(UINT32 index)
 	FILE_END_OF_FILE_INFO eof_info = { {.QuadPart = static_cast<LONGLONG>(vhdx_next_free_address + vhdx_metadata_packed.VhdxFileParameters.BlockSize) } };
 	_ASSERT(eof_info.EndOfFile.QuadPart % VHDX_MINIMUM_ALIGNMENT == 0);
 	_ASSERT(std::cmp_greater_equal(eof_info.EndOfFile.QuadPart, VHDX_BAT_LOCATION + VHDX_MINIMUM_ALIGNMENT));
-	THROW_IF_WIN32_BOOL_FALSE(SetFileInformationByHandle(image_file, FileEndOfFileInfo, &eof_info, sizeof eof_info));
+	SetImageFileEnd(eof_info);
 	vhdx_block_allocation_table[index].FileOffsetMB = vhdx_next_free_address / VHDX_BAT_UNIT;
 	vhdx_block_allocation_table[index].State = PAYLOAD_BLOCK_FULLY_PRESENT;
 	vhdx_next_free_address += vhdx_metadata_packed.VhdxFileParameters.BlockSize;
 	return vhdx_next_free_address - vhdx_metadata_packed.VhdxFileParameters.BlockSize;
 }
+void VHDX::ScanAllocatedBlocks(std::vector<UINT64>& allocated) const
+{
+	allocated.assign((vhdx_data_blocks_count + 63ULL) / 64, 0);
+	ScanVHDXBlockAllocationTable(reinterpret_cast<const UINT64*>(vhdx_block_allocation_table.get()), vhdx_data_blocks_count, vhdx_chuck_ratio, allocated.data());
+}
 std::unique_ptr<Image> VHDX::DetectImageFormatByData(HANDLE file)
 {
 	LARGE_INTEGER fsize;
@@ -320,19 +350,6 @@ std::unique_ptr<Image> VHDX::DetectImageFormatByData(HANDLE file)
 	}
 	return nullptr;
 }
-template <typename Ty>
-bool VHDX::VHDXChecksumValidate(Ty* header)
-{
-	UINT32 checksum = header->Checksum;
-	header->Checksum = 0;
-	return RtlCrc32(header, sizeof(Ty), 0) == checksum;
-}
-template <typename Ty>
-void VHDX::VHDXChecksumUpdate(Ty* header)
-{
-	header->Checksum = 0;
-	header->Checksum = RtlCrc32(header, sizeof(Ty), 0);
-}
 UINT32 VHDX::CalculateChuckRatio(UINT32 sector_size, UINT32 block_size)
 {
 	return static_cast<UINT32>(VHDX_NUMBER_OF_SECTORS_PER_SECTOR_BITMAP_BLOCK * sector_size / block_size);
@@ -123,7 +123,7 @@ struct VHDX_FILE_PARAMETERS
 	UINT32 Reserved : 30;
 };
 static_assert(sizeof(VHDX_FILE_PARAMETERS) == 8);
-struct VHDX : Image
+struct VHDX final : Image
 {
 private:
 	VHDX_FILE_IDENTIFIER vhdx_file_indentifier;
@@ -142,19 +142,23 @@ private:
 	static_assert(sizeof(VHDX_METADATA_PACKED) == 4096);
 	std::unique_ptr<VHDX_BAT_ENTRY[]> vhdx_block_allocation_table;
 	UINT64 vhdx_next_free_address;
+	UINT64 vhdx_virtual_disk_id_offset = 0;
 	UINT32 vhdx_chuck_ratio;
 	UINT32 vhdx_data_blocks_count;
 	UINT32 vhdx_table_write_size;
+	static UINT32 CalculateChuckRatio(UINT32 sector_size, UINT32 block_size);
+public:
 	template <typename Ty>
 	static bool VHDXChecksumValidate(Ty* header);
 	template <typename Ty>
 	static void VHDXChecksumUpdate(Ty* header);
-	static UINT32 CalculateChuckRatio(UINT32 sector_size, UINT32 block_size);
-public:
 	void ReadHeader();
 	void ConstructHeader(UINT64 disk_size, UINT32 block_size, UINT32 sector_size, bool fixed);
 	void WriteHeader() const;
+	void CheckReadable() const;
 	void CheckConvertible() const;
+	void CopyIdentity(const Image& source);
+	void RenewIdentity();
 	bool IsFixed() const
 	{
 		return vhdx_metadata_packed.VhdxFileParameters.LeaveBlocksAllocated;
@@ -179,7 +183,39 @@ public:
 	{
 		return vhdx_data_blocks_count;
 	}
-	std::optional<UINT64> ProbeBlock(UINT32 index) const;
+	UINT32 GetMinimumBlockSize() const
+	{
+		return VHDX_MIN_BLOCK_SIZE;
+	}
+	UINT32 GetMaximumBlockSize() const
+	{
+		return VHDX_MAX_BLOCK_SIZE;
+	}
+	UINT64 EstimateFileSize(UINT64 disk_size, UINT32 block_size, UINT64 allocated_blocks) const;
+	std::optional<UINT64> ProbeBlock(UINT32 index) const
+	{
+		_ASSERT(index < GetTableEntriesCount());
+		index += index / vhdx_chuck_ratio;
+		if (vhdx_block_allocation_table[index].State == VHDXBlockState::PAYLOAD_BLOCK_FULLY_PRESENT)
+		{
+			return vhdx_block_allocation_table[index].FileOffsetMB * VHDX_BAT_UNIT;
+		}
+		return std::nullopt;
+	}
 	UINT64 AllocateBlock(UINT32 index);
+	void ScanAllocatedBlocks(std::vector<UINT64>& allocated) const;
 	static std::unique_ptr<Image> DetectImageFormatByData(HANDLE file);
-};
\ No newline at end of file
+};
+template <typename Ty>
+bool VHDX::VHDXChecksumValidate(Ty* header)
+{
+	UINT32 checksum = header->Checksum;
+	header->Checksum = 0;
+	return RtlCrc32(header, sizeof(Ty), 0) == checksum;
+}
+template <typename Ty>
+void VHDX::VHDXChecksumUpdate(Ty* header)
+{
+	header->Checksum = 0;
+	header->Checksum = RtlCrc32(header, sizeof(Ty), 0);
+}
\ No newline at end of file
@@ -0,0 +1,378 @@
+#define NOMINMAX
+#include <windows.h>
+#include <wil/filesystem.h>
+#include <filesystem>
+#include <format>
+#include <string_view>
+#include "VMDK.h"
+
+static std::filesystem::path GetSiblingFilePath(HANDLE file, std::string_view utf8_file_name)
+{
+	const DWORD length = GetFinalPathNameByHandleW(file, nullptr, 0, FILE_NAME_NORMALIZED);
+	THROW_LAST_ERROR_IF(length == 0);
+	std::wstring path(length, L'\0');
+	THROW_LAST_ERROR_IF(GetFinalPathNameByHandleW(file, path.data(), length, FILE_NAME_NORMALIZED) == 0);
+	path.resize(wcslen(path.c_str()));
+	return std::filesystem::path(path).replace_filename(std::u8string_view(reinterpret_cast<const char8_t*>(utf8_file_name.data()), utf8_file_name.size()));
+}
+static std::string ToUTF8(std::wstring_view file_name)
+{
+	const int length = WideCharToMultiByte(CP_UTF8, WC_ERR_INVALID_CHARS, file_name.data(), static_cast<int>(file_name.size()), nullptr, 0, nullptr, nullptr);
+	THROW_LAST_ERROR_IF(length == 0);
+	std::string utf8_file_name(length, '\0');
+	THROW_LAST_ERROR_IF(WideCharToMultiByte(CP_UTF8, WC_ERR_INVALID_CHARS, file_name.data(), static_cast<int>(file_name.size()), utf8_file_name.data(), length, nullptr, nullptr) == 0);
+	return utf8_file_name;
+}
+static std::string GetFileNameUTF8(HANDLE file)
+{
+	constexpr ULONG name_info_size = sizeof(FILE_NAME_INFO) + UNICODE_STRING_MAX_BYTES;
+	const auto name_info_buffer = std::make_unique_for_overwrite<std::byte[]>(name_info_size);
+	const auto name_info = reinterpret_cast<FILE_NAME_INFO*>(name_info_buffer.get());
+	THROW_IF_WIN32_BOOL_FALSE(GetFileInformationByHandleEx(file, FileNameInfo, name_info, name_info_size));
+	std::wstring_view file_name(name_info->FileName, name_info->FileNameLength / sizeof(WCHAR));
+	file_name.remove_prefix(file_name.find_last_of(L'\\') + 1);
+	return ToUTF8(file_name);
+}
+
+void VMDK::ReadHeader()
+{
+	vmdk_extent_file.reset();
+	vmdk_data_file = image_file;
+	vmdk_extent_offset = 0;
+	vmdk_is_flat = false;
+	vmdk_is_fixed = false;
+	ReadFileWithOffset(image_file, &vmdk_header.MagicNumber, VMDK_HEADER_LOCATION);
+	if (vmdk_header.MagicNumber == VMDK_SPARSE_MAGIC)
+	{
+		ReadSparseExtent(image_file);
+		return;
+	}
+	ReadDescriptor();
+}
+void VMDK::ReadDescriptor()
+{
+	LARGE_INTEGER fsize;
+	THROW_IF_WIN32_BOOL_FALSE(GetFileSizeEx(image_file, &fsize));
+	THROW_WIN32_IF(ERROR_VHD_INVALID_FILE_SIZE, fsize.QuadPart > VMDK_DESCRIPTOR_MAX_SIZE);
+	vmdk_descriptor.resize(static_cast<size_t>(fsize.QuadPart));
+	ReadFileWithOffset(image_file, vmdk_descriptor.data(), static_cast<ULONG>(vmdk_descriptor.size()), 0);
+	THROW_WIN32_IF(ERROR_VHD_DRIVE_FOOTER_MISSING, !vmdk_descriptor.starts_with(VMDK_DESCRIPTOR_SIGNATURE));
+	UINT32 extents_count = 0;
+	char extent_type[16] = {};
+	char extent_file_name[1024] = {};
+	UINT64 extent_sectors = 0;
+	UINT64 extent_offset_sectors = 0;
+	for (size_t line_begin = 0; line_begin < vmdk_descriptor.size();)
+	{
+		size_t line_end = vmdk_descriptor.find('\n', line_begin);
+		if (line_end == std::string::npos)
+		{
+			line_end = vmdk_descriptor.size();
+		}
+		const std::string line = vmdk_descriptor.substr(line_begin, line_end - line_begin);
+		line_begin = line_end + 1;
+		if (line.starts_with("parentFileNameHint"))
+		{
+			throw std::runtime_error("Differencing VMDK is not supported.");
+		}
+		if (!line.starts_with("RW ") && !line.starts_with("RDONLY ") && !line.starts_with("NOACCESS "))
+		{
+			continue;
+		}
+		char access[16];
+		UINT64 sectors;
+		UINT64 offset_sectors = 0;
+		const int fields = sscanf_s(
+			line.c_str(),
+			"%15s %llu %15s \"%1023[^\"]\" %llu",
+			access, static_cast<unsigned>(std::size(access)),
+			&sectors,
+			extent_type, static_cast<unsigned>(std::size(extent_type)),
+			extent_file_name, static_cast<unsigned>(std::size(extent_file_name)),
+			&offset_sectors
+		);
+		THROW_WIN32_IF(ERROR_VHD_SPARSE_HEADER_CORRUPT, fields < 4);
+		if (++extents_count > 1)
+		{
+			throw std::runtime_error("Multiple extents VMDK is not supported.");
+		}
+		extent_sectors = sectors;
+		extent_offset_sectors = offset_sectors;
+	}
+	THROW_WIN32_IF(ERROR_VHD_FORMAT_UNKNOWN, extents_count == 0);
+	vmdk_extent_file = wil::open_file(GetSiblingFilePath(image_file, extent_file_name).c_str());
+	if (_stricmp(extent_type, "SPARSE") == 0)
+	{
+		ReadSparseExtent(vmdk_extent_file.get());
+		THROW_WIN32_IF(ERROR_VHD_INVALID_SIZE, vmdk_disk_size != extent_sectors * VMDK_SECTOR_SIZE);
+		return;
+	}
+	if (_stricmp(extent_type, "FLAT") != 0 && _stricmp(extent_type, "VMFS") != 0)
+	{
+		throw std::runtime_error("Unsupported VMDK extent type.");
+	}
+	vmdk_data_file = vmdk_extent_file.get();
+	vmdk_is_flat = true;
+	vmdk_is_fixed = true;
+	vmdk_disk_size = extent_sectors * VMDK_SECTOR_SIZE;
+	vmdk_extent_offset = extent_offset_sectors * VMDK_SECTOR_SIZE;
+	THROW_WIN32_IF(ERROR_VHD_INVALID_SIZE, vmdk_disk_size == 0 || extent_sectors > UINT64_MAX / VMDK_SECTOR_SIZE);
+	LARGE_INTEGER extent_size;
+	THROW_IF_WIN32_BOOL_FALSE(GetFileSizeEx(vmdk_data_file, &extent_size));
+	THROW_WIN32_IF(ERROR_VHD_INVALID_FILE_SIZE, std::cmp_less(extent_size.QuadPart, vmdk_extent_offset + vmdk_disk_size));
+	vmdk_block_size = std::max(1U << std::min(std::countr_zero(vmdk_disk_size), 31), require_alignment);
+	vmdk_table_entries_count = ceil_div(vmdk_disk_size, vmdk_block_size);
+}
+void VMDK::ReadSparseExtent(HANDLE file)
+{
+	vmdk_data_file = file;
+	ReadFileWithOffset(file, &vmdk_header, VMDK_HEADER_LOCATION);
+	THROW_WIN32_IF(ERROR_VHD_DRIVE_FOOTER_MISSING, vmdk_header.MagicNumber != VMDK_SPARSE_MAGIC);
+	THROW_WIN32_IF(ERROR_VHD_FORMAT_UNSUPPORTED_VERSION, vmdk_header.Version == 0 || vmdk_header.Version > VMDK_MAX_VERSION);
+	if (WI_IsAnyFlagSet(vmdk_header.Flags, VMDK_FLAG_COMPRESSED_GRAINS | VMDK_FLAG_HAS_MARKERS) || vmdk_header.GdOffset == VMDK_GD_AT_END)
+	{
+		throw std::runtime_error("Stream optimized VMDK is not supported.");
+	}
+	THROW_WIN32_IF(ERROR_VHD_SPARSE_HEADER_CORRUPT, vmdk_header.NumGTEsPerGT != VMDK_NUM_GTES_PER_GT || vmdk_header.GdOffset == 0);
+	THROW_WIN32_IF(ERROR_VHD_INVALID_BLOCK_SIZE, vmdk_header.GrainSize == 0 || vmdk_header.GrainSize > VMDK_MAX_GRAIN_SIZE / VMDK_SECTOR_SIZE || !std::has_single_bit(vmdk_header.GrainSize));
+	THROW_WIN32_IF(ERROR_VHD_INVALID_SIZE, vmdk_header.Capacity == 0 || vmdk_header.Capacity / vmdk_header.GrainSize >= UINT32_MAX - VMDK_NUM_GTES_PER_GT);
+	vmdk_disk_size = vmdk_header.Capacity * VMDK_SECTOR_SIZE;
+	vmdk_block_size = static_cast<UINT32>(vmdk_header.GrainSize * VMDK_SECTOR_SIZE);
+	vmdk_table_entries_count = ceil_div(vmdk_header.Capacity, vmdk_header.GrainSize);
+	vmdk_grain_tables_count = ceil_div(vmdk_table_entries_count, VMDK_NUM_GTES_PER_GT);
+	const auto grain_directory = std::make_unique_for_overwrite<UINT32[]>(vmdk_grain_tables_count);
+	ReadFileWithOffset(file, grain_directory.get(), vmdk_grain_tables_count * sizeof(UINT32), vmdk_header.GdOffset * VMDK_SECTOR_SIZE);
+	vmdk_grain_table = std::make_unique<UINT32[]>(static_cast<size_t>(vmdk_grain_tables_count) * VMDK_NUM_GTES_PER_GT);
+	// Grain tables are usually laid out back to back, so read each contiguous run at once.
+	constexpr UINT32 max_tables_per_read = 16 * 1024;
+	for (UINT32 i = 0; i < vmdk_grain_tables_count;)
+	{
+		if (grain_directory[i] == 0)
+		{
+			i++;
+			continue;
+		}
+		UINT32 j = i + 1;
+		while (j < vmdk_grain_tables_count && j - i < max_tables_per_read && grain_directory[j] == grain_directory[j - 1] + VMDK_GRAIN_TABLE_SECTORS)
+		{
+			j++;
+		}
+		ReadFileWithOffset(file, &vmdk_grain_table[static_cast<size_t>(i) * VMDK_NUM_GTES_PER_GT], (j - i) * VMDK_NUM_GTES_PER_GT * sizeof(UINT32), static_cast<UINT64>(grain_directory[i]) * VMDK_SECTOR_SIZE);
+		i = j;
+	}
+}
+void VMDK::ConstructHeader(UINT64 disk_size, UINT32 block_size, UINT32 sector_size, bool fixed)
+{
+	if (disk_size < MINIMUM_DISK_SIZE)
+	{
+		throw std::invalid_argument("VMDK disk size is less than 3MB.");
+	}
+	if (disk_size > VMDK_MAX_DISK_SIZE)
+	{
+		throw std::invalid_argument("Exceeded maximum sparse VMDK disk size.");
+	}
+	if (sector_size != VMDK_SECTOR_SIZE)
+	{
+		throw std::invalid_argument("Unsuported VMDK sector size.");
+	}
+	if (disk_size % VMDK_SECTOR_SIZE != 0)
+	{
+		throw std::invalid_argument("VMDK disk size is not multiple of sector.");
+	}
+	if (block_size == 0)
+	{
+		block_size = VMDK_DEFAULT_GRAIN_SIZE;
+	}
+	THROW_WIN32_IF(ERROR_VHD_INVALID_BLOCK_SIZE, block_size < VMDK_MIN_GRAIN_SIZE || block_size > VMDK_MAX_GRAIN_SIZE || !std::has_single_bit(block_size));
+	if (block_size < require_alignment)
+	{
+		throw std::invalid_argument("VMDK grain size is smaller than required alignment.");
+	}
+	vmdk_extent_file.reset();
+	vmdk_data_file = image_file;
+	vmdk_extent_offset = 0;
+	vmdk_is_flat = false;
+	vmdk_is_fixed = fixed;
+	vmdk_disk_size = disk_size;
+	vmdk_block_size = block_size;
+	vmdk_table_entries_count = ceil_div(disk_size, block_size);
+	vmdk_grain_tables_count = ceil_div(vmdk_table_entries_count, VMDK_NUM_GTES_PER_GT);
+	const UINT64 directory_sectors = ceil_div(vmdk_grain_tables_count * sizeof(UINT32), VMDK_SECTOR_SIZE);
+	const UINT64 tables_sectors = static_cast<UINT64>(vmdk_grain_tables_count) * VMDK_GRAIN_TABLE_SECTORS;
+	memset(&vmdk_header, 0, sizeof vmdk_header);
+	vmdk_header.MagicNumber = VMDK_SPARSE_MAGIC;
+	vmdk_header.Version = VMDK_VERSION;
+	vmdk_header.Flags = VMDK_FLAG_VALID_NEW_LINE_DETECTION | VMDK_FLAG_USE_REDUNDANT_GRAIN_TABLE;
+	vmdk_header.Capacity = disk_size / VMDK_SECTOR_SIZE;
+	vmdk_header.GrainSize = block_size / VMDK_SECTOR_SIZE;
+	vmdk_header.DescriptorOffset = VMDK_DESCRIPTOR_SECTOR;
+	vmdk_header.DescriptorSize = VMDK_DESCRIPTOR_SECTORS;
+	vmdk_header.NumGTEsPerGT = VMDK_NUM_GTES_PER_GT;
+	vmdk_header.RgdOffset = VMDK_DESCRIPTOR_SECTOR + VMDK_DESCRIPTOR_SECTORS;
+	vmdk_header.GdOffset = vmdk_header.RgdOffset + directory_sectors + tables_sectors;
+	vmdk_header.OverHead = round_up((vmdk_header.GdOffset + directory_sectors + tables_sectors) * VMDK_SECTOR_SIZE, require_alignment) / VMDK_SECTOR_SIZE;
+	vmdk_header.SingleEndLineChar = '\n';
+	vmdk_header.NonEndLineChar = ' ';
+	vmdk_header.DoubleEndLineChar1 = '\r';
+	vmdk_header.DoubleEndLineChar2 = '\n';
+	vmdk_grain_table = std::make_unique<UINT32[]>(static_cast<size_t>(vmdk_grain_tables_count) * VMDK_NUM_GTES_PER_GT);
+	vmdk_next_free_address = vmdk_header.OverHead * VMDK_SECTOR_SIZE;
+	if (fixed)
+	{
+		for (UINT32 i = 0; i < vmdk_table_entries_count; i++)
+		{
+			vmdk_grain_table[i] = static_cast<UINT32>(vmdk_next_free_address / VMDK_SECTOR_SIZE);
+			vmdk_next_free_address += vmdk_block_size;
+		}
+	}
+	THROW_WIN32_IF(ERROR_ARITHMETIC_OVERFLOW, vmdk_next_free_address > static_cast<UINT64>(UINT32_MAX) * VMDK_SECTOR_SIZE);
+	vmdk_descriptor = BuildDescriptor();
+	THROW_WIN32_IF(ERROR_INSUFFICIENT_BUFFER, vmdk_descriptor.size() > VMDK_DESCRIPTOR_SECTORS * VMDK_SECTOR_SIZE);
+	FILE_END_OF_FILE_INFO eof_info = { {.QuadPart = static_cast<LONGLONG>(vmdk_next_free_address) } };
+	SetImageFileEnd(eof_info);
+}
+std::string VMDK::BuildDescriptor() const
+{
+	GUID content_id;
+	THROW_IF_FAILED(CoCreateGuid(&content_id));
+	const UINT64 cylinders = std::min(vmdk_header.Capacity / (16 * 63), 16383ULL);
+	return std::format(
+		"{}\n"
+		"version=1\n"
+		"CID={:08x}\n"
+		"parentCID=ffffffff\n"
+		"createType=\"monolithicSparse\"\n"
+		"\n"
+		"# Extent description\n"
+		"RW {} SPARSE \"{}\"\n"
+		"\n"
+		"# The Disk Data Base\n"
+		"#DDB\n"
+		"\n"
+		"ddb.virtualHWVersion = \"4\"\n"
+		"ddb.geometry.cylinders = \"{}\"\n"
+		"ddb.geometry.heads = \"16\"\n"
+		"ddb.geometry.sectors = \"63\"\n"
+		"ddb.adapterType = \"ide\"\n",
+		VMDK_DESCRIPTOR_SIGNATURE,
+		static_cast<UINT32>(content_id.Data1),
+		vmdk_header.Capacity,
+		image_sink ? ToUTF8(image_sink->GetFileName()) : GetFileNameUTF8(image_file),
+		cylinders
+	);
+}
+void VMDK::WriteHeader() const
+{
+	if (vmdk_is_flat || vmdk_data_file != image_file)
+	{
+		_CrtDbgBreak();
+		THROW_WIN32(ERROR_CALL_NOT_IMPLEMENTED);
+	}
+	MetadataCommit commit;
+	commit.Add(vmdk_header, VMDK_HEADER_LOCATION);
+	constexpr UINT32 descriptor_buffer_size = VMDK_DESCRIPTOR_SECTORS * VMDK_SECTOR_SIZE;
+	const auto descriptor_buffer = std::make_unique<char[]>(descriptor_buffer_size);
+	memcpy(descriptor_buffer.get(), vmdk_descriptor.data(), vmdk_descriptor.size());
+	commit.Add(descriptor_buffer.get(), descriptor_buffer_size, VMDK_DESCRIPTOR_SECTOR * VMDK_SECTOR_SIZE);
+	const UINT32 directory_size = round_up(vmdk_grain_tables_count * static_cast<UINT32>(sizeof(UINT32)), VMDK_SECTOR_SIZE);
+	const UINT32 tables_size = vmdk_grain_tables_count * VMDK_GRAIN_TABLE_SECTORS * VMDK_SECTOR_SIZE;
+	const UINT64 directory_offsets[] = { vmdk_header.RgdOffset, vmdk_header.GdOffset };
+	std::unique_ptr<UINT32[]> grain_directories[std::size(directory_offsets)];
+	for (size_t d = 0; d < std::size(directory_offsets); d++)
+	{
+		const UINT64 tables_offset = directory_offsets[d] + directory_size / VMDK_SECTOR_SIZE;
+		grain_directories[d] = std::make_unique<UINT32[]>(directory_size / sizeof(UINT32));
+		for (UINT32 i = 0; i < vmdk_grain_tables_count; i++)
+		{
+			grain_directories[d][i] = static_cast<UINT32>(tables_offset + static_cast<UINT64>(i) * VMDK_GRAIN_TABLE_SECTORS);
+		}
+		commit.Add(grain_directories[d].get(), directory_size, directory_offsets[d] * VMDK_SECTOR_SIZE);
+		commit.Add(vmdk_grain_table.get(), tables_size, tables_offset * VMDK_SECTOR_SIZE);
+	}
+	WriteImage(commit);
+	_ASSERT(GetImageFileSize() % require_alignment == 0);
+	FlushImage();
+}
+void VMDK::RenewIdentity()
+{
+	if (vmdk_is_flat || vmdk_data_file != image_file)
+	{
+		_CrtDbgBreak();
+		THROW_WIN32(ERROR_CALL_NOT_IMPLEMENTED);
+	}
+	// Descriptor also names the file itself as extent, so it is built again for this file.
+	vmdk_descriptor = BuildDescriptor();
+	const UINT32 descriptor_buffer_size = static_cast<UINT32>(vmdk_header.DescriptorSize * VMDK_SECTOR_SIZE);
+	THROW_WIN32_IF(ERROR_INSUFFICIENT_BUFFER, vmdk_descriptor.size() > descriptor_buffer_size || descriptor_buffer_size > VMDK_DESCRIPTOR_MAX_SIZE);
+	const auto descriptor_buffer = std::make_unique<char[]>(descriptor_buffer_size);
+	memcpy(descriptor_buffer.get(), vmdk_descriptor.data(), vmdk_descriptor.size());
+	WriteFileWithOffset(image_file, descriptor_buffer.get(), descriptor_buffer_size, vmdk_header.DescriptorOffset * VMDK_SECTOR_SIZE);
+	THROW_IF_WIN32_BOOL_FALSE(FlushFileBuffers(image_file));
+}
+void VMDK::CheckReadable() const
+{
+	if (vmdk_is_flat)
+	{
+		THROW_WIN32_IF(ERROR_ARITHMETIC_OVERFLOW, GetDiskSize() / GetBlockSize() > UINT32_MAX);
+	}
+}
+void VMDK::CheckConvertible() const
+{
+	CheckReadable();
+	if (vmdk_is_flat)
+	{
+		if (vmdk_extent_offset % require_alignment != 0)
+		{
+			throw std::runtime_error("VMDK flat extent is not aligned.");
+		}
+		return;
+	}
+	if (vmdk_block_size < require_alignment)
+	{
+		throw std::runtime_error("VMDK grain size is smaller than required alignment.");
+	}
+	for (UINT32 i = 0; i < vmdk_table_entries_count; i++)
+	{
+		if (const auto grain_address = ProbeBlock(i); grain_address && *grain_address % require_alignment != 0)
+		{
+			throw std::runtime_error("VMDK grains is not aligned.");
+		}
+	}
+}
+UINT64 VMDK::EstimateFileSize(UINT64 disk_size, UINT32 block_size, UINT64 allocated_blocks) const
+{
+	const UINT64 grain_tables_count = ((disk_size + block_size - 1) / block_size + VMDK_NUM_GTES_PER_GT - 1) / VMDK_NUM_GTES_PER_GT;
+	const UINT64 directory_sectors = (grain_tables_count * sizeof(UINT32) + VMDK_SECTOR_SIZE - 1) / VMDK_SECTOR_SIZE;
+	const UINT64 metadata_sectors = VMDK_DESCRIPTOR_SECTOR + VMDK_DESCRIPTOR_SECTORS + 2 * (directory_sectors + grain_tables_count * VMDK_GRAIN_TABLE_SECTORS);
+	return round_up(metadata_sectors * VMDK_SECTOR_SIZE, require_alignment) + allocated_blocks * block_size;
+}
+UINT64 VMDK::AllocateBlock(UINT32 index)
+{
+	if (const auto offset = ProbeBlock(index))
+	{
+		return *offset;
+	}
+	FILE_END_OF_FILE_INFO eof_info = { {.QuadPart = static_cast<LONGLONG>(vmdk_next_free_address + vmdk_block_size) } };
+	THROW_WIN32_IF(ERROR_ARITHMETIC_OVERFLOW, eof_info.EndOfFile.QuadPart > static_cast<LONGLONG>(UINT32_MAX) * VMDK_SECTOR_SIZE);
+	SetImageFileEnd(eof_info);
+	vmdk_grain_table[index] = static_cast<UINT32>(vmdk_next_free_address / VMDK_SECTOR_SIZE);
+	vmdk_next_free_address += vmdk_block_size;
+	_ASSERT(vmdk_next_free_address % require_alignment == 0);
+	return vmdk_next_free_address - vmdk_block_size;
+}
+std::unique_ptr<Image> VMDK::DetectImageFormatByData(HANDLE file)
+{
+	LARGE_INTEGER fsize;
+	THROW_IF_WIN32_BOOL_FALSE(GetFileSizeEx(file, &fsize));
+	char signature[std::size(VMDK_DESCRIPTOR_SIGNATURE) - 1];
+	if (std::cmp_less(fsize.QuadPart, sizeof signature))
+	{
+		return nullptr;
+	}
+	ReadFileWithOffset(file, &signature, VMDK_HEADER_LOCATION);
+	if (memcmp(signature, &VMDK_SPARSE_MAGIC, sizeof VMDK_SPARSE_MAGIC) == 0 || memcmp(signature, VMDK_DESCRIPTOR_SIGNATURE, sizeof signature) == 0)
+	{
+		return std::unique_ptr<Image>(new VMDK);
+	}
+	return nullptr;
+}
\ No newline at end of file
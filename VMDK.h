@@ -0,0 +1,132 @@
+#pragma once
+#include "Image.h"
+#include <wil/resource.h>
+#include <string>
+
+constexpr UINT32 VMDK_SPARSE_MAGIC = 0x564D444B;
+constexpr UINT32 VMDK_VERSION = 1;
+constexpr UINT32 VMDK_MAX_VERSION = 3;
+constexpr UINT32 VMDK_FLAG_VALID_NEW_LINE_DETECTION = 1U << 0;
+constexpr UINT32 VMDK_FLAG_USE_REDUNDANT_GRAIN_TABLE = 1U << 1;
+constexpr UINT32 VMDK_FLAG_ZEROED_GRAIN_GTE = 1U << 2;
+constexpr UINT32 VMDK_FLAG_COMPRESSED_GRAINS = 1U << 16;
+constexpr UINT32 VMDK_FLAG_HAS_MARKERS = 1U << 17;
+constexpr UINT64 VMDK_GD_AT_END = ~0ULL;
+constexpr UINT32 VMDK_SECTOR_SIZE = 512;
+constexpr UINT32 VMDK_NUM_GTES_PER_GT = 512;
+constexpr UINT32 VMDK_GRAIN_TABLE_SECTORS = VMDK_NUM_GTES_PER_GT * sizeof(UINT32) / VMDK_SECTOR_SIZE;
+constexpr UINT32 VMDK_UNUSED_GRAIN_ENTRY = 0;
+constexpr UINT32 VMDK_ZERO_GRAIN_ENTRY = 1;
+constexpr UINT32 VMDK_MIN_GRAIN_SIZE = 4 * 1024;
+constexpr UINT32 VMDK_MAX_GRAIN_SIZE = 1024 * 1024 * 1024;
+constexpr UINT32 VMDK_DEFAULT_GRAIN_SIZE = 64 * 1024;
+constexpr UINT64 VMDK_MAX_DISK_SIZE = static_cast<UINT64>(UINT32_MAX) * VMDK_SECTOR_SIZE;
+constexpr UINT64 VMDK_HEADER_LOCATION = 0;
+constexpr UINT64 VMDK_DESCRIPTOR_SECTOR = 1;
+constexpr UINT64 VMDK_DESCRIPTOR_SECTORS = 20;
+constexpr UINT32 VMDK_DESCRIPTOR_MAX_SIZE = 64 * 1024;
+constexpr char VMDK_DESCRIPTOR_SIGNATURE[] = "# Disk DescriptorFile";
+#pragma pack(push, 1)
+struct VMDK_SPARSE_EXTENT_HEADER
+{
+	UINT32 MagicNumber;
+	UINT32 Version;
+	UINT32 Flags;
+	UINT64 Capacity;
+	UINT64 GrainSize;
+	UINT64 DescriptorOffset;
+	UINT64 DescriptorSize;
+	UINT32 NumGTEsPerGT;
+	UINT64 RgdOffset;
+	UINT64 GdOffset;
+	UINT64 OverHead;
+	UINT8  UncleanShutdown;
+	char   SingleEndLineChar;
+	char   NonEndLineChar;
+	char   DoubleEndLineChar1;
+	char   DoubleEndLineChar2;
+	UINT16 CompressAlgorithm;
+	UINT8  Pad[433];
+};
+#pragma pack(pop)
+static_assert(sizeof(VMDK_SPARSE_EXTENT_HEADER) == 512);
+struct VMDK final : Image
+{
+private:
+	VMDK_SPARSE_EXTENT_HEADER vmdk_header;
+	std::string vmdk_descriptor;
+	std::unique_ptr<UINT32[]> vmdk_grain_table;
+	wil::unique_hfile vmdk_extent_file;
+	HANDLE vmdk_data_file;
+	UINT64 vmdk_disk_size;
+	UINT64 vmdk_extent_offset;
+	UINT64 vmdk_next_free_address;
+	UINT32 vmdk_block_size;
+	UINT32 vmdk_table_entries_count;
+	UINT32 vmdk_grain_tables_count;
+	bool vmdk_is_flat;
+	bool vmdk_is_fixed;
+	void ReadDescriptor();
+	void ReadSparseExtent(HANDLE file);
+	std::string BuildDescriptor() const;
+public:
+	void ReadHeader();
+	void ConstructHeader(UINT64 disk_size, UINT32 block_size, UINT32 sector_size, bool fixed);
+	void WriteHeader() const;
+	void CheckReadable() const;
+	void CheckConvertible() const;
+	void RenewIdentity();
+	bool IsFixed() const
+	{
+		return vmdk_is_fixed;
+	}
+	PCSTR GetImageTypeName() const
+	{
+		return "VMDK";
+	}
+	UINT64 GetDiskSize() const
+	{
+		return vmdk_disk_size;
+	}
+	UINT32 GetSectorSize() const
+	{
+		return VMDK_SECTOR_SIZE;
+	}
+	UINT32 GetBlockSize() const
+	{
+		return vmdk_block_size;
+	}
+	UINT32 GetTableEntriesCount() const
+	{
+		return vmdk_table_entries_count;
+	}
+	HANDLE GetDataFile() const
+	{
+		return vmdk_data_file;
+	}
+	UINT32 GetMinimumBlockSize() const
+	{
+		return std::max(require_alignment, VMDK_MIN_GRAIN_SIZE);
+	}
+	UINT32 GetMaximumBlockSize() const
+	{
+		return VMDK_MAX_GRAIN_SIZE;
+	}
+	UINT64 EstimateFileSize(UINT64 disk_size, UINT32 block_size, UINT64 allocated_blocks) const;
+	std::optional<UINT64> ProbeBlock(UINT32 index) const
+	{
+		_ASSERT(index < GetTableEntriesCount());
+		if (vmdk_is_flat)
+		{
+			return vmdk_extent_offset + static_cast<UINT64>(GetBlockSize()) * index;
+		}
+		const UINT32 grain_entry = vmdk_grain_table[index];
+		if (grain_entry == VMDK_UNUSED_GRAIN_ENTRY || (grain_entry == VMDK_ZERO_GRAIN_ENTRY && WI_IsFlagSet(vmdk_header.Flags, VMDK_FLAG_ZEROED_GRAIN_GTE)))
+		{
+			return std::nullopt;
+		}
+		return static_cast<UINT64>(grain_entry) * VMDK_SECTOR_SIZE;
+	}
+	UINT64 AllocateBlock(UINT32 index);
+	static std::unique_ptr<Image> DetectImageFormatByData(HANDLE file);
+};
\ No newline at end of file